@@ -0,0 +1,524 @@
+/*
+ * Copyright 2015 Open Connectome Project (http://openconnecto.me)
+ *
+ * This file is part of FlashR.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+
+#include "fmr_fuse.h"
+
+using namespace fm;
+
+namespace fmr
+{
+
+/*
+ * The number of elements we process in a block. The intermediate buffers
+ * of a block should fit in the L1 cache.
+ */
+static const size_t FUSE_BLOCK_SIZE = 512;
+/*
+ * The maximal number of operators we fuse. The intermediate matrices
+ * may also be used somewhere else, in which case their operators are
+ * computed more than once, so we don't want the expression to grow forever.
+ */
+static const size_t MAX_FUSE_OPS = 8;
+/*
+ * The maximal number of nodes in a fused expression. An expression is
+ * a tree, so it has at most one more leaf than binary operators.
+ */
+static const size_t MAX_FUSE_NODES = MAX_FUSE_OPS * 2 + 1;
+/*
+ * The maximal size of an element in the intermediate buffers.
+ */
+static const size_t MAX_ENTRY_SIZE = 8;
+
+static bool fuse_ops = true;
+
+void set_fuse_ops(bool fuse)
+{
+	fuse_ops = fuse;
+}
+
+namespace
+{
+
+/*
+ * A node of a fused expression. A leaf reads one of the (at most two)
+ * input matrices. Otherwise, it applies a unary operator to a node or
+ * a binary operator to two nodes. A node only refers to the nodes before
+ * it, so the nodes are evaluated in order and the last one is the output.
+ */
+struct expr_node
+{
+	int input;
+	int left;
+	int right;
+	bulk_uoperate::const_ptr uop;
+	bulk_operate::const_ptr bop;
+
+	static expr_node leaf(int input) {
+		expr_node node;
+		node.input = input;
+		node.left = -1;
+		node.right = -1;
+		return node;
+	}
+
+	bool is_leaf() const {
+		return uop == NULL && bop == NULL;
+	}
+
+	const scalar_type &get_output_type(
+			const std::vector<const scalar_type *> &in_types) const {
+		if (uop)
+			return uop->get_output_type();
+		else if (bop)
+			return bop->get_output_type();
+		else
+			return *in_types[input];
+	}
+
+	size_t get_num_ops() const {
+		return is_leaf() ? 0 : 1;
+	}
+};
+
+typedef std::vector<expr_node> expr_prog;
+
+std::string get_prog_name(const expr_prog &prog, size_t idx)
+{
+	const expr_node &node = prog[idx];
+	if (node.uop)
+		return node.uop->get_name() + "(" + get_prog_name(prog, node.left)
+			+ ")";
+	else if (node.bop)
+		return node.bop->get_name() + "(" + get_prog_name(prog, node.left)
+			+ ", " + get_prog_name(prog, node.right) + ")";
+	else
+		return node.input == 0 ? "x" : "y";
+}
+
+/*
+ * The intermediate buffers of a thread, with a buffer of FUSE_BLOCK_SIZE
+ * elements for each node. They're allocated the first time the thread
+ * runs a fused operator and reused afterwards.
+ */
+thread_local std::vector<char> fuse_bufs;
+
+/*
+ * Evaluate an expression on a block of elements. A leaf points to its
+ * input directly, and the last node writes to the output directly.
+ */
+void run_prog(const expr_prog &prog, size_t num_eles, const char *ins[2],
+		void *out)
+{
+	const size_t buf_size = FUSE_BLOCK_SIZE * MAX_ENTRY_SIZE;
+	assert(prog.size() <= MAX_FUSE_NODES);
+	if (fuse_bufs.size() < MAX_FUSE_NODES * buf_size)
+		fuse_bufs.resize(MAX_FUSE_NODES * buf_size);
+	const void *res[MAX_FUSE_NODES];
+	for (size_t i = 0; i < prog.size(); i++) {
+		const expr_node &node = prog[i];
+		void *curr_out = i == prog.size() - 1 ? out : &fuse_bufs[i * buf_size];
+		if (node.uop)
+			node.uop->runA(num_eles, res[node.left], curr_out);
+		else if (node.bop)
+			node.bop->runAA(num_eles, res[node.left], res[node.right],
+					curr_out);
+		else
+			curr_out = const_cast<char *>(ins[node.input]);
+		res[i] = curr_out;
+	}
+}
+
+/*
+ * This runs an expression of one input matrix one block at a time.
+ */
+class fused_uoperate: public bulk_uoperate
+{
+	expr_prog prog;
+	const scalar_type &in_type;
+	const scalar_type &out_type;
+public:
+	fused_uoperate(const expr_prog &prog, const scalar_type &in_type,
+			const scalar_type &out_type): in_type(in_type), out_type(out_type) {
+		assert(prog.size() > 1);
+		this->prog = prog;
+	}
+
+	virtual void runA(size_t num_eles, const void *in_arr,
+			void *out_arr) const {
+		const char *in = (const char *) in_arr;
+		char *out = (char *) out_arr;
+		for (size_t i = 0; i < num_eles; i += FUSE_BLOCK_SIZE) {
+			size_t len = std::min(FUSE_BLOCK_SIZE, num_eles - i);
+			const char *ins[2] = {in + i * in_type.get_size(), NULL};
+			run_prog(prog, len, ins, out + i * out_type.get_size());
+		}
+	}
+	virtual const scalar_type &get_input_type() const {
+		return in_type;
+	}
+	virtual const scalar_type &get_output_type() const {
+		return out_type;
+	}
+	virtual std::string get_name() const {
+		return "fused(" + get_prog_name(prog, prog.size() - 1) + ")";
+	}
+};
+
+/*
+ * This runs an expression of two input matrices one block at a time.
+ */
+class fused_operate: public bulk_operate
+{
+	expr_prog prog;
+	const scalar_type &left_type;
+	const scalar_type &right_type;
+	const scalar_type &out_type;
+
+	/*
+	 * An element input is repeated in a block.
+	 */
+	void run(size_t num_eles, const char *left, bool left_arr,
+			const char *right, bool right_arr, char *out) const {
+		char left_buf[FUSE_BLOCK_SIZE * MAX_ENTRY_SIZE];
+		char right_buf[FUSE_BLOCK_SIZE * MAX_ENTRY_SIZE];
+		size_t left_size = left_type.get_size();
+		size_t right_size = right_type.get_size();
+		if (!left_arr)
+			for (size_t i = 0; i < FUSE_BLOCK_SIZE; i++)
+				memcpy(left_buf + i * left_size, left, left_size);
+		if (!right_arr)
+			for (size_t i = 0; i < FUSE_BLOCK_SIZE; i++)
+				memcpy(right_buf + i * right_size, right, right_size);
+		for (size_t i = 0; i < num_eles; i += FUSE_BLOCK_SIZE) {
+			size_t len = std::min(FUSE_BLOCK_SIZE, num_eles - i);
+			const char *ins[2] = {
+				left_arr ? left + i * left_size : left_buf,
+				right_arr ? right + i * right_size : right_buf};
+			run_prog(prog, len, ins, out + i * out_type.get_size());
+		}
+	}
+public:
+	fused_operate(const expr_prog &prog, const scalar_type &left_type,
+			const scalar_type &right_type,
+			const scalar_type &out_type): left_type(left_type),
+			right_type(right_type), out_type(out_type) {
+		assert(prog.size() > 1);
+		this->prog = prog;
+	}
+
+	virtual void runAA(size_t num_eles, const void *left_arr,
+			const void *right_arr, void *output_arr) const {
+		run(num_eles, (const char *) left_arr, true,
+				(const char *) right_arr, true, (char *) output_arr);
+	}
+	virtual void runAE(size_t num_eles, const void *left_arr,
+			const void *right, void *output_arr) const {
+		run(num_eles, (const char *) left_arr, true, (const char *) right,
+				false, (char *) output_arr);
+	}
+	virtual void runEA(size_t num_eles, const void *left,
+			const void *right_arr, void *output_arr) const {
+		run(num_eles, (const char *) left, false, (const char *) right_arr,
+				true, (char *) output_arr);
+	}
+	// A fused operator is only used for element-wise operations.
+	virtual void runAgg(size_t num_eles, const void *in, void *output) const {
+		throw unsupported_exception();
+	}
+	virtual void runCum(size_t num_eles, const void *left_arr,
+			const void *prev, void *output) const {
+		throw unsupported_exception();
+	}
+
+	virtual const scalar_type &get_left_type() const {
+		return left_type;
+	}
+	virtual const scalar_type &get_right_type() const {
+		return right_type;
+	}
+	virtual const scalar_type &get_output_type() const {
+		return out_type;
+	}
+	virtual std::string get_name() const {
+		return "fused(" + get_prog_name(prog, prog.size() - 1) + ")";
+	}
+};
+
+/*
+ * How a virtual matrix was computed from its inputs. We only keep weak
+ * references to the stores of the inputs. The store of a virtual matrix
+ * refers to the stores of its inputs, so they're alive as long as the
+ * matrix is virtual.
+ */
+struct elem_expr
+{
+	std::vector<std::weak_ptr<const detail::matrix_store> > ins;
+	expr_prog prog;
+};
+
+/*
+ * The stores of the inputs of an expression.
+ */
+struct expr_inputs
+{
+	std::vector<detail::matrix_store::const_ptr> stores;
+	std::vector<const scalar_type *> types;
+
+	bool lock(const elem_expr &expr) {
+		for (size_t i = 0; i < expr.ins.size(); i++) {
+			detail::matrix_store::const_ptr store = expr.ins[i].lock();
+			if (store == NULL)
+				return false;
+			stores.push_back(store);
+			types.push_back(&store->get_type());
+		}
+		return true;
+	}
+
+	/*
+	 * Get the index of the input in the expression. It returns -1 if
+	 * the expression can't have more inputs.
+	 */
+	int add(detail::matrix_store::const_ptr store) {
+		for (size_t i = 0; i < stores.size(); i++)
+			if (stores[i] == store)
+				return i;
+		if (stores.size() == 2)
+			return -1;
+		stores.push_back(store);
+		types.push_back(&store->get_type());
+		return stores.size() - 1;
+	}
+};
+
+}
+
+/*
+ * The expressions are indexed by the ownership of their output matrices
+ * instead of their addresses, so a new matrix allocated at the address of
+ * a destroyed one never finds the expression of the destroyed matrix.
+ */
+typedef std::weak_ptr<const dense_matrix> expr_key;
+static std::map<expr_key, elem_expr, std::owner_less<expr_key> > exprs;
+/*
+ * The number of expressions after we removed the expressions of
+ * the destroyed matrices last time.
+ */
+static size_t num_purged_exprs = 0;
+static const size_t MIN_PURGE_EXPRS = 64;
+
+static void add_expr(dense_matrix::ptr out, const expr_inputs &ins,
+		const expr_prog &prog)
+{
+	// The expressions of destroyed matrices are never used again. We remove
+	// them when the number of expressions doubles, so adding expressions
+	// takes amortized constant time.
+	if (exprs.size() >= std::max(num_purged_exprs * 2, MIN_PURGE_EXPRS)) {
+		for (auto it = exprs.begin(); it != exprs.end();) {
+			if (it->first.expired())
+				it = exprs.erase(it);
+			else
+				it++;
+		}
+		num_purged_exprs = exprs.size();
+	}
+
+	elem_expr expr;
+	for (size_t i = 0; i < ins.stores.size(); i++)
+		expr.ins.push_back(ins.stores[i]);
+	expr.prog = prog;
+	exprs[expr_key(out)] = expr;
+}
+
+/*
+ * Find the expression that computed the matrix and lock its inputs.
+ * We only fuse the operators of a virtual matrix. Otherwise, we would
+ * compute the materialized data again.
+ */
+static const elem_expr *find_expr(dense_matrix::ptr m, expr_inputs &ins)
+{
+	if (!m->is_virtual())
+		return NULL;
+	auto it = exprs.find(expr_key(m));
+	if (it == exprs.end())
+		return NULL;
+	if (!ins.lock(it->second)) {
+		exprs.erase(it);
+		return NULL;
+	}
+	return &it->second;
+}
+
+/*
+ * Append the expression of a matrix to a program. A matrix without
+ * an expression is a leaf. It returns the index of the last node of
+ * the matrix, or -1 if it can't be fused.
+ */
+static int append_expr(dense_matrix::ptr m, expr_inputs &ins, expr_prog &prog)
+{
+	expr_inputs m_ins;
+	const elem_expr *expr = find_expr(m, m_ins);
+	if (expr == NULL) {
+		int input = ins.add(m->get_raw_store());
+		if (input < 0)
+			return -1;
+		prog.push_back(expr_node::leaf(input));
+		return prog.size() - 1;
+	}
+
+	std::vector<int> input_map(m_ins.stores.size());
+	for (size_t i = 0; i < m_ins.stores.size(); i++) {
+		input_map[i] = ins.add(m_ins.stores[i]);
+		if (input_map[i] < 0)
+			return -1;
+	}
+	int offset = prog.size();
+	for (size_t i = 0; i < expr->prog.size(); i++) {
+		expr_node node = expr->prog[i];
+		if (node.is_leaf())
+			node.input = input_map[node.input];
+		if (node.left >= 0)
+			node.left += offset;
+		if (node.right >= 0)
+			node.right += offset;
+		prog.push_back(node);
+	}
+	return prog.size() - 1;
+}
+
+/*
+ * Test if we can add an operator to a program. The results of all nodes
+ * except the leaves are kept in the intermediate buffers.
+ */
+static bool can_fuse(const expr_inputs &ins, const expr_prog &prog,
+		size_t out_entry_size)
+{
+	if (out_entry_size > MAX_ENTRY_SIZE)
+		return false;
+	size_t num_ops = 0;
+	for (size_t i = 0; i < prog.size(); i++) {
+		num_ops += prog[i].get_num_ops();
+		if (!prog[i].is_leaf()
+				&& prog[i].get_output_type(ins.types).get_size()
+				> MAX_ENTRY_SIZE)
+			return false;
+	}
+	return num_ops < MAX_FUSE_OPS;
+}
+
+/*
+ * Apply a fused expression to its inputs.
+ */
+static dense_matrix::ptr apply_expr(const expr_inputs &ins,
+		const expr_prog &prog)
+{
+	const scalar_type &out_type = prog.back().get_output_type(ins.types);
+	dense_matrix::ptr left = dense_matrix::create(ins.stores[0]);
+	if (ins.stores.size() == 1)
+		return left->sapply(bulk_uoperate::const_ptr(new fused_uoperate(
+						prog, *ins.types[0], out_type)));
+	dense_matrix::ptr right = dense_matrix::create(ins.stores[1]);
+	return left->mapply2(*right, bulk_operate::const_ptr(new fused_operate(
+					prog, *ins.types[0], *ins.types[1], out_type)));
+}
+
+dense_matrix::ptr fuse_sapply(dense_matrix::ptr m, bulk_uoperate::const_ptr op)
+{
+	if (!fuse_ops)
+		return m->sapply(op);
+
+	expr_inputs ins;
+	expr_prog prog;
+	int in_node = append_expr(m, ins, prog);
+	dense_matrix::ptr out;
+	if (in_node >= 0 && prog.size() > 1
+			&& can_fuse(ins, prog, op->output_entry_size())
+			&& prog[in_node].get_output_type(ins.types)
+			== op->get_input_type()) {
+		expr_node node = expr_node::leaf(-1);
+		node.left = in_node;
+		node.uop = op;
+		prog.push_back(node);
+		out = apply_expr(ins, prog);
+	}
+	else {
+		// The operator starts a new expression.
+		ins = expr_inputs();
+		prog.clear();
+		ins.add(m->get_raw_store());
+		prog.push_back(expr_node::leaf(0));
+		expr_node node = expr_node::leaf(-1);
+		node.left = 0;
+		node.uop = op;
+		prog.push_back(node);
+		out = m->sapply(op);
+	}
+	if (out)
+		add_expr(out, ins, prog);
+	return out;
+}
+
+dense_matrix::ptr fuse_mapply2(dense_matrix::ptr m1, dense_matrix::ptr m2,
+		bulk_operate::const_ptr op)
+{
+	if (!fuse_ops)
+		return m1->mapply2(*m2, op);
+
+	// A binary operator is fused with the expressions of its inputs if
+	// the whole expression reads at most two matrices, e.g., x * x + y * y.
+	expr_inputs ins;
+	expr_prog prog;
+	int left = append_expr(m1, ins, prog);
+	int right = left >= 0 ? append_expr(m2, ins, prog) : -1;
+	dense_matrix::ptr out;
+	if (right >= 0 && prog.size() > 2
+			&& can_fuse(ins, prog, op->output_entry_size())
+			&& prog[left].get_output_type(ins.types) == op->get_left_type()
+			&& prog[right].get_output_type(ins.types)
+			== op->get_right_type()) {
+		expr_node node = expr_node::leaf(-1);
+		node.left = left;
+		node.right = right;
+		node.bop = op;
+		prog.push_back(node);
+		out = apply_expr(ins, prog);
+	}
+	else {
+		ins = expr_inputs();
+		prog.clear();
+		prog.push_back(expr_node::leaf(ins.add(m1->get_raw_store())));
+		prog.push_back(expr_node::leaf(ins.add(m2->get_raw_store())));
+		expr_node node = expr_node::leaf(-1);
+		node.left = 0;
+		node.right = 1;
+		node.bop = op;
+		prog.push_back(node);
+		out = m1->mapply2(*m2, op);
+	}
+	if (out)
+		add_expr(out, ins, prog);
+	return out;
+}
+
+}
@@ -0,0 +1,64 @@
+#ifndef __FMR_FUSE_H__
+#define __FMR_FUSE_H__
+
+/*
+ * Copyright 2015 Open Connectome Project (http://openconnecto.me)
+ *
+ * This file is part of FlashR.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bulk_operate.h"
+#include "dense_matrix.h"
+
+/*
+ * This file fuses chains of element-wise operations.
+ *
+ * Each element-wise operation on a virtual matrix otherwise becomes
+ * a separate operator in FlashMatrix, which writes a full intermediate
+ * buffer for every portion. Instead, we remember how a virtual matrix was
+ * computed from its inputs. When another element-wise operation is applied
+ * to it, we apply a single fused operator to the original inputs.
+ * The fused operator runs all operators on a small block of elements
+ * at a time, so the intermediate results stay in the L1 cache.
+ *
+ * A fused operator is a unary or binary operator in FlashMatrix, so we
+ * only fuse expressions that read at most two matrices, e.g.,
+ * sqrt(x * x + y * y).
+ */
+
+namespace fmr
+{
+
+/*
+ * Apply a unary element-wise operator on a matrix. This has the same
+ * semantics as dense_matrix::sapply.
+ */
+fm::dense_matrix::ptr fuse_sapply(fm::dense_matrix::ptr m,
+		fm::bulk_uoperate::const_ptr op);
+/*
+ * Apply a binary element-wise operator on two matrices of the same shape.
+ * This has the same semantics as dense_matrix::mapply2.
+ */
+fm::dense_matrix::ptr fuse_mapply2(fm::dense_matrix::ptr m1,
+		fm::dense_matrix::ptr m2, fm::bulk_operate::const_ptr op);
+
+/*
+ * Enable or disable fusion. It's enabled by default.
+ */
+void set_fuse_ops(bool fuse);
+
+}
+
+#endif
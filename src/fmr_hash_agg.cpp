@@ -0,0 +1,805 @@
+/*
+ * Copyright 2015 Open Connectome Project (http://openconnecto.me)
+ *
+ * This file is part of FlashR.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "local_matrix_store.h"
+#include "mem_worker_thread.h"
+
+#include "fmr_hash_agg.h"
+#include "fmr_parallel.h"
+
+using namespace fm;
+
+namespace fmr
+{
+
+/*
+ * The maximal number of entries in a hash table of a thread, so that
+ * the table fits in the L2 cache.
+ */
+static const size_t CACHE_TABLE_SIZE = 1 << 14;
+/*
+ * The number of elements we sample to estimate the number of unique values.
+ */
+static const size_t NUM_SAMPLES = 1 << 16;
+/*
+ * The maximal number of partitions. The partition of an element is stored
+ * in 16 bits.
+ */
+static const size_t MAX_NUM_PARTS = 1 << 14;
+/*
+ * The number of copies of a value we aggregate at a time.
+ */
+static const size_t AGG_BUF_SIZE = 4096;
+/*
+ * We count integer values with an array of counters in each thread if
+ * their range is smaller than this, so the counters fit in the L2 cache.
+ */
+static const size_t MAX_DENSE_RANGE = 1 << 15;
+/*
+ * The maximal number of entries in the hash table of a thread when we
+ * count a vector portion by portion. If the vector has more unique values,
+ * sorting works better.
+ */
+static const size_t MAX_PORTION_TABLE_SIZE = 1 << 20;
+
+/*
+ * Map a value to an unsigned integer with the same order, so that we hash
+ * and compare all types in the same way.
+ */
+template<class T>
+struct ordered_key
+{
+};
+
+template<>
+struct ordered_key<int>
+{
+	static uint64_t to_key(int v) {
+		return ((uint32_t) v) ^ 0x80000000U;
+	}
+	static int from_key(uint64_t k) {
+		return (int) (uint32_t) (k ^ 0x80000000U);
+	}
+};
+
+template<>
+struct ordered_key<double>
+{
+	static uint64_t to_key(double v) {
+		// -0 and 0 are the same value.
+		if (v == 0)
+			v = 0;
+		uint64_t bits;
+		memcpy(&bits, &v, sizeof(bits));
+		return (bits >> 63) ? ~bits : bits | (1ULL << 63);
+	}
+	static double from_key(uint64_t k) {
+		uint64_t bits = (k >> 63) ? k & ~(1ULL << 63) : ~k;
+		double v;
+		memcpy(&v, &bits, sizeof(v));
+		return v;
+	}
+};
+
+/*
+ * A unique value and the number of its copies.
+ */
+typedef std::pair<uint64_t, size_t> group_t;
+
+/*
+ * A hash table with open addressing that counts the copies of each key.
+ */
+class count_table
+{
+	struct entry {
+		uint64_t key;
+		// An entry is empty if the count is 0.
+		size_t count;
+	};
+	std::vector<entry> entries;
+	size_t num_keys;
+	size_t max_size;
+	int shift;
+
+	size_t get_slot(uint64_t key) const {
+		return (key * 0x9E3779B97F4A7C15ULL) >> shift;
+	}
+	bool grow();
+public:
+	/*
+	 * The table can't have more than `max_size' entries.
+	 */
+	count_table(size_t init_size, size_t max_size) {
+		int log_size = 4;
+		while ((1UL << log_size) < init_size)
+			log_size++;
+		entries.resize(1UL << log_size);
+		shift = 64 - log_size;
+		num_keys = 0;
+		this->max_size = max_size;
+	}
+
+	/*
+	 * Add `count' copies of a key. It returns false if the table needs
+	 * to grow beyond its maximal size.
+	 */
+	bool add(uint64_t key, size_t count) {
+		size_t mask = entries.size() - 1;
+		for (size_t i = get_slot(key); ; i = (i + 1) & mask) {
+			entry &e = entries[i];
+			if (e.count == 0) {
+				// We keep the load factor under 0.5.
+				if ((num_keys + 1) * 2 > entries.size())
+					return grow() && add(key, count);
+				e.key = key;
+				e.count = count;
+				num_keys++;
+				return true;
+			}
+			if (e.key == key) {
+				e.count += count;
+				return true;
+			}
+		}
+	}
+
+	void get_groups(std::vector<group_t> &groups) const {
+		for (size_t i = 0; i < entries.size(); i++)
+			if (entries[i].count > 0)
+				groups.push_back(group_t(entries[i].key, entries[i].count));
+	}
+};
+
+bool count_table::grow()
+{
+	if (entries.size() * 2 > max_size)
+		return false;
+	std::vector<entry> old;
+	old.swap(entries);
+	entries.resize(old.size() * 2);
+	shift--;
+	num_keys = 0;
+	for (size_t i = 0; i < old.size(); i++)
+		if (old[i].count > 0)
+			add(old[i].key, old[i].count);
+	return true;
+}
+
+/*
+ * Estimate the number of unique values in an array from a sample of
+ * the array. The sorted keys of the sample are returned in `sample'.
+ */
+template<class T>
+static size_t estimate_num_uniq(const T *arr, size_t len,
+		std::vector<uint64_t> &sample)
+{
+	size_t num_samples = std::min(len, NUM_SAMPLES);
+	sample.resize(num_samples);
+	for (size_t i = 0; i < num_samples; i++)
+		sample[i] = ordered_key<T>::to_key(arr[i * len / num_samples]);
+	std::sort(sample.begin(), sample.end());
+
+	size_t num_uniq = 0;
+	size_t num_once = 0;
+	size_t num_twice = 0;
+	for (size_t i = 0; i < num_samples; ) {
+		size_t j = i + 1;
+		while (j < num_samples && sample[j] == sample[i])
+			j++;
+		num_uniq++;
+		if (j - i == 1)
+			num_once++;
+		else if (j - i == 2)
+			num_twice++;
+		i = j;
+	}
+	if (num_samples == len)
+		return num_uniq;
+	// This is the Chao1 estimator. It guesses the number of values we
+	// haven't seen from the values we have seen once and twice.
+	double est = num_uniq + (double) num_once * (num_once - 1)
+		/ (2 * (num_twice + 1));
+	return std::min((double) len, est);
+}
+
+/*
+ * This finds the partition of a key, i.e., the number of splitters that are
+ * smaller than or equal to the key. A binary search over the splitters is
+ * slow because its branches are unpredictable, so we divide the range of
+ * the keys into buckets and store the partitions that each bucket covers.
+ * Most buckets are covered by a single partition.
+ */
+class range_partitioner
+{
+	static const size_t NUM_BUCKETS = 1 << 16;
+	std::vector<uint64_t> splitters;
+	uint64_t min_key;
+	uint64_t max_key;
+	int shift;
+	// The partition of the first key of each bucket.
+	std::vector<uint32_t> first_parts;
+
+	size_t search(uint64_t key) const {
+		return std::upper_bound(splitters.begin(), splitters.end(), key)
+			- splitters.begin();
+	}
+public:
+	range_partitioner(const std::vector<uint64_t> &splitters,
+			uint64_t min_key, uint64_t max_key) {
+		this->splitters = splitters;
+		this->min_key = min_key;
+		this->max_key = max_key;
+		uint64_t range = max_key - min_key;
+		shift = 0;
+		while ((range >> shift) >= NUM_BUCKETS)
+			shift++;
+		first_parts.resize(NUM_BUCKETS + 1);
+		for (size_t b = 0; b <= NUM_BUCKETS; b++)
+			first_parts[b] = b > (range >> shift) ? splitters.size()
+				: search(min_key + (((uint64_t) b) << shift));
+	}
+
+	size_t get_num_parts() const {
+		return splitters.size() + 1;
+	}
+
+	size_t get_part(uint64_t key) const {
+		// All splitters are between the minimal and the maximal key.
+		if (key < min_key)
+			return 0;
+		if (key > max_key)
+			return splitters.size();
+		size_t b = (key - min_key) >> shift;
+		size_t lo = first_parts[b];
+		size_t hi = first_parts[b + 1];
+		if (lo == hi)
+			return lo;
+		return std::upper_bound(splitters.begin() + lo,
+				splitters.begin() + hi, key) - splitters.begin();
+	}
+};
+
+/*
+ * Each thread counts its part of the array in a small hash table and we
+ * merge the tables. It returns false if a table outgrows the cache.
+ */
+template<class T>
+static bool count_local(const T *arr, size_t len, size_t num_tasks,
+		std::vector<group_t> &groups)
+{
+	std::vector<count_table> tables(num_tasks,
+			count_table(CACHE_TABLE_SIZE / 16, CACHE_TABLE_SIZE));
+	std::vector<char> overflow(num_tasks);
+	parallel_for(num_tasks, [&](size_t i) {
+			size_t end = len * (i + 1) / num_tasks;
+			for (size_t j = len * i / num_tasks; j < end; j++) {
+				if (!tables[i].add(ordered_key<T>::to_key(arr[j]), 1)) {
+					overflow[i] = true;
+					return;
+				}
+			}
+		});
+	for (size_t i = 0; i < num_tasks; i++)
+		if (overflow[i])
+			return false;
+
+	count_table merged(CACHE_TABLE_SIZE, SIZE_MAX);
+	std::vector<group_t> local_groups;
+	for (size_t i = 0; i < num_tasks; i++) {
+		local_groups.clear();
+		tables[i].get_groups(local_groups);
+		for (size_t j = 0; j < local_groups.size(); j++)
+			merged.add(local_groups[j].first, local_groups[j].second);
+	}
+	merged.get_groups(groups);
+	std::sort(groups.begin(), groups.end());
+	return true;
+}
+
+/*
+ * Partition the array by value ranges and count each partition in its own
+ * hash table. The ranges are chosen from the sample, so the partitions have
+ * about the same number of elements, and the groups of the partitions are
+ * in order.
+ */
+template<class T>
+static void count_partitioned(const T *arr, size_t len, size_t num_tasks,
+		const std::vector<uint64_t> &sample, size_t num_uniq,
+		std::vector<std::vector<group_t> > &part_groups)
+{
+	size_t num_parts = std::min(MAX_NUM_PARTS, std::max(num_tasks * 4,
+				num_uniq / (CACHE_TABLE_SIZE / 2)));
+	std::vector<uint64_t> splitters;
+	for (size_t p = 1; p < num_parts; p++)
+		splitters.push_back(sample[p * sample.size() / num_parts]);
+	splitters.erase(std::unique(splitters.begin(), splitters.end()),
+			splitters.end());
+	range_partitioner partitioner(splitters, sample.front(), sample.back());
+	num_parts = partitioner.get_num_parts();
+
+	// Find the partition of each element and count the elements of each
+	// partition in each part of the array, so that we can scatter
+	// the elements to a contiguous array.
+	std::vector<uint16_t> part_ids(len);
+	std::vector<std::vector<size_t> > offs(num_tasks,
+			std::vector<size_t>(num_parts));
+	parallel_for(num_tasks, [&](size_t i) {
+			std::vector<size_t> &cnts = offs[i];
+			size_t end = len * (i + 1) / num_tasks;
+			for (size_t j = len * i / num_tasks; j < end; j++) {
+				uint64_t key = ordered_key<T>::to_key(arr[j]);
+				size_t p = partitioner.get_part(key);
+				part_ids[j] = p;
+				cnts[p]++;
+			}
+		});
+	std::vector<size_t> part_starts(num_parts + 1);
+	size_t off = 0;
+	for (size_t p = 0; p < num_parts; p++) {
+		part_starts[p] = off;
+		for (size_t i = 0; i < num_tasks; i++) {
+			size_t cnt = offs[i][p];
+			offs[i][p] = off;
+			off += cnt;
+		}
+	}
+	part_starts[num_parts] = off;
+
+	std::vector<T> parted(len);
+	parallel_for(num_tasks, [&](size_t i) {
+			std::vector<size_t> &pos = offs[i];
+			size_t end = len * (i + 1) / num_tasks;
+			for (size_t j = len * i / num_tasks; j < end; j++)
+				parted[pos[part_ids[j]]++] = arr[j];
+		});
+
+	part_groups.resize(num_parts);
+	parallel_for(num_parts, [&](size_t p) {
+			size_t part_len = part_starts[p + 1] - part_starts[p];
+			count_table table(std::min(part_len, CACHE_TABLE_SIZE), SIZE_MAX);
+			for (size_t j = part_starts[p]; j < part_starts[p + 1]; j++)
+				table.add(ordered_key<T>::to_key(parted[j]), 1);
+			table.get_groups(part_groups[p]);
+			std::sort(part_groups[p].begin(), part_groups[p].end());
+		});
+}
+
+/*
+ * Whether a value is an integer that we can count with an array of
+ * counters. NAs are counted separately, so they aren't in the range.
+ */
+static inline bool get_dense_key(int v, int64_t &key)
+{
+	key = v;
+	return true;
+}
+
+static inline bool get_dense_key(double v, int64_t &key)
+{
+	// This fails on NaN and Inf.
+	if (v - v != 0 || floor(v) != v || fabs(v) > (double) INT64_MAX / 4)
+		return false;
+	key = v;
+	return true;
+}
+
+static inline bool is_dense_na(int v)
+{
+	// NA_INTEGER
+	return v == INT_MIN;
+}
+
+static inline bool is_dense_na(double v)
+{
+	return false;
+}
+
+/*
+ * If the values are integers in a small range, each thread counts
+ * the values in its part of the array with an array of counters, and we
+ * sum up the counters. It returns false if the values can't be counted
+ * this way.
+ */
+template<class T>
+static bool count_dense(const T *arr, size_t len, size_t num_tasks,
+		std::vector<group_t> &groups)
+{
+	std::vector<int64_t> mins(num_tasks, INT64_MAX);
+	std::vector<int64_t> maxs(num_tasks, INT64_MIN);
+	std::vector<char> fails(num_tasks);
+	parallel_for(num_tasks, [&](size_t i) {
+			size_t end = len * (i + 1) / num_tasks;
+			int64_t min = INT64_MAX;
+			int64_t max = INT64_MIN;
+			for (size_t j = len * i / num_tasks; j < end; j++) {
+				int64_t key;
+				if (is_dense_na(arr[j]))
+					continue;
+				if (!get_dense_key(arr[j], key)) {
+					fails[i] = true;
+					return;
+				}
+				min = std::min(min, key);
+				max = std::max(max, key);
+			}
+			mins[i] = min;
+			maxs[i] = max;
+		});
+	for (size_t i = 0; i < num_tasks; i++)
+		if (fails[i])
+			return false;
+	int64_t min = *std::min_element(mins.begin(), mins.end());
+	int64_t max = *std::max_element(maxs.begin(), maxs.end());
+	size_t range = min > max ? 0 : max - min + 1;
+	if (range > MAX_DENSE_RANGE)
+		return false;
+
+	std::vector<std::vector<size_t> > cnts(num_tasks);
+	parallel_for(num_tasks, [&](size_t i) {
+			// The last counter is for NAs.
+			std::vector<size_t> &local = cnts[i];
+			local.resize(range + 1);
+			size_t end = len * (i + 1) / num_tasks;
+			for (size_t j = len * i / num_tasks; j < end; j++) {
+				int64_t key = 0;
+				if (is_dense_na(arr[j]))
+					local[range]++;
+				else {
+					get_dense_key(arr[j], key);
+					local[key - min]++;
+				}
+			}
+		});
+	for (size_t i = 1; i < num_tasks; i++)
+		for (size_t k = 0; k <= range; k++)
+			cnts[0][k] += cnts[i][k];
+	// Only integers have NAs here. NA_INTEGER is the smallest integer, so
+	// it's the first group.
+	if (cnts[0][range] > 0)
+		groups.push_back(group_t(ordered_key<T>::to_key((T) INT_MIN),
+					cnts[0][range]));
+	for (size_t k = 0; k < range; k++)
+		if (cnts[0][k] > 0)
+			groups.push_back(group_t(ordered_key<T>::to_key(min + (int64_t) k),
+						cnts[0][k]));
+	return true;
+}
+
+/*
+ * This counts a vector that isn't in contiguous memory, e.g., a virtual
+ * vector or a vector on NUMA nodes or disks. Each thread counts
+ * the portions it processes in its own hash table, so the vector is read
+ * once portion by portion and isn't materialized.
+ */
+template<class T>
+class count_portion_op: public detail::portion_mapply_op
+{
+	std::shared_ptr<std::vector<count_table> > tables;
+	// Whether the table of a thread has outgrown its maximal size.
+	std::shared_ptr<std::vector<char> > overflows;
+
+	count_portion_op(std::shared_ptr<std::vector<count_table> > tables,
+			std::shared_ptr<std::vector<char> > overflows)
+		: detail::portion_mapply_op(0, 0, get_scalar_type<T>()) {
+		this->tables = tables;
+		this->overflows = overflows;
+	}
+public:
+	count_portion_op(): detail::portion_mapply_op(0, 0,
+			get_scalar_type<T>()) {
+		size_t num_threads = detail::mem_thread_pool::get_global_num_threads();
+		tables = std::shared_ptr<std::vector<count_table> >(
+				new std::vector<count_table>(num_threads,
+					count_table(CACHE_TABLE_SIZE / 16, MAX_PORTION_TABLE_SIZE)));
+		overflows = std::shared_ptr<std::vector<char> >(
+				new std::vector<char>(num_threads));
+	}
+
+	virtual detail::portion_mapply_op::const_ptr transpose() const {
+		// We count the elements in any order.
+		return detail::portion_mapply_op::const_ptr(new count_portion_op<T>(
+					tables, overflows));
+	}
+
+	virtual void run(
+			const std::vector<detail::local_matrix_store::const_ptr> &ins) const {
+		const detail::local_matrix_store &in = *ins[0];
+		int thread_id = detail::mem_thread_pool::get_curr_thread_id();
+		if ((*overflows)[thread_id])
+			return;
+		count_table &table = (*tables)[thread_id];
+		const T *arr = reinterpret_cast<const T *>(in.get_raw_arr());
+		size_t len = in.get_num_rows() * in.get_num_cols();
+		if (arr) {
+			for (size_t i = 0; i < len; i++)
+				if (!table.add(ordered_key<T>::to_key(arr[i]), 1)) {
+					(*overflows)[thread_id] = true;
+					return;
+				}
+			return;
+		}
+		for (size_t i = 0; i < in.get_num_rows(); i++)
+			for (size_t j = 0; j < in.get_num_cols(); j++) {
+				T val = *reinterpret_cast<const T *>(in.get(i, j));
+				if (!table.add(ordered_key<T>::to_key(val), 1)) {
+					(*overflows)[thread_id] = true;
+					return;
+				}
+			}
+	}
+
+	/*
+	 * Merge the tables of all threads. It returns false if a table has
+	 * outgrown its maximal size.
+	 */
+	bool get_groups(std::vector<group_t> &groups) const {
+		for (size_t i = 0; i < overflows->size(); i++)
+			if ((*overflows)[i])
+				return false;
+		count_table merged(CACHE_TABLE_SIZE, SIZE_MAX);
+		std::vector<group_t> local_groups;
+		for (size_t i = 0; i < tables->size(); i++) {
+			local_groups.clear();
+			(*tables)[i].get_groups(local_groups);
+			for (size_t j = 0; j < local_groups.size(); j++)
+				merged.add(local_groups[j].first, local_groups[j].second);
+		}
+		merged.get_groups(groups);
+		std::sort(groups.begin(), groups.end());
+		return true;
+	}
+
+	virtual std::string to_string(
+			const std::vector<detail::matrix_store::const_ptr> &mats) const {
+		return std::string("hash_count(") + mats[0]->get_name() + ")";
+	}
+
+	virtual bool is_agg() const {
+		return false;
+	}
+};
+
+template<class T>
+static bool count_portions(col_vec::ptr vec,
+		std::vector<std::vector<group_t> > &part_groups)
+{
+	std::shared_ptr<count_portion_op<T> > op(new count_portion_op<T>());
+	std::vector<detail::matrix_store::const_ptr> stores(1,
+			vec->get_raw_store());
+	detail::__mapply_portion(stores, op, matrix_layout_t::L_COL);
+	part_groups.resize(1);
+	return op->get_groups(part_groups[0]);
+}
+
+/*
+ * The contiguous array of a vector in memory, or NULL if the vector is
+ * virtual, on disks or on NUMA nodes.
+ */
+static const char *get_mem_arr(col_vec::ptr vec)
+{
+	detail::mem_matrix_store::const_ptr store
+		= std::dynamic_pointer_cast<const detail::mem_matrix_store>(
+				vec->get_raw_store());
+	return store ? store->get_raw_arr() : NULL;
+}
+
+/*
+ * Write the unique values and their counts of all partitions to
+ * the output vectors.
+ */
+template<class T>
+static void write_counts(const std::vector<std::vector<group_t> > &part_groups,
+		dense_matrix::ptr &vals, dense_matrix::ptr &cnts)
+{
+	std::vector<size_t> offs(part_groups.size() + 1);
+	for (size_t p = 0; p < part_groups.size(); p++)
+		offs[p + 1] = offs[p] + part_groups[p].size();
+	size_t num_groups = offs.back();
+
+	detail::mem_matrix_store::ptr val_store = detail::mem_matrix_store::create(
+			num_groups, 1, matrix_layout_t::L_COL, get_scalar_type<T>(), -1);
+	detail::mem_matrix_store::ptr cnt_store = detail::mem_matrix_store::create(
+			num_groups, 1, matrix_layout_t::L_COL, get_scalar_type<double>(),
+			-1);
+	T *val_arr = reinterpret_cast<T *>(val_store->get_raw_arr());
+	double *cnt_arr = reinterpret_cast<double *>(cnt_store->get_raw_arr());
+	for (size_t p = 0; p < part_groups.size(); p++) {
+		const std::vector<group_t> &groups = part_groups[p];
+		for (size_t k = 0; k < groups.size(); k++) {
+			val_arr[offs[p] + k] = ordered_key<T>::from_key(groups[k].first);
+			cnt_arr[offs[p] + k] = groups[k].second;
+		}
+	}
+	vals = dense_matrix::create(val_store);
+	cnts = dense_matrix::create(cnt_store);
+}
+
+template<class T>
+static void hash_count(const T *arr, size_t len, dense_matrix::ptr &vals,
+		dense_matrix::ptr &cnts)
+{
+	size_t num_tasks = len < AGG_BUF_SIZE ? 1 : get_num_tasks();
+	std::vector<std::vector<group_t> > part_groups(1);
+	if (count_dense(arr, len, num_tasks, part_groups[0])) {
+		write_counts<T>(part_groups, vals, cnts);
+		return;
+	}
+
+	std::vector<uint64_t> sample;
+	size_t num_uniq = estimate_num_uniq(arr, len, sample);
+	bool counted = false;
+	part_groups[0].clear();
+	if (num_uniq < CACHE_TABLE_SIZE / 2)
+		counted = count_local(arr, len, num_tasks, part_groups[0]);
+	if (!counted) {
+		part_groups.clear();
+		count_partitioned(arr, len, num_tasks, sample, num_uniq, part_groups);
+	}
+	write_counts<T>(part_groups, vals, cnts);
+}
+
+/*
+ * Aggregate `count' copies of `val'. The copies are aggregated
+ * AGG_BUF_SIZE at a time and the results are combined, so the operator
+ * must have a combine operator.
+ */
+template<class T>
+static void agg_copies(const agg_operate &op, T val, size_t count,
+		std::vector<T> &buf, char *tmp, char *out)
+{
+	size_t num = std::min(count, AGG_BUF_SIZE);
+	buf.assign(num, val);
+	op.get_agg().runAgg(num, buf.data(), out);
+	for (size_t done = num; done < count; done += num) {
+		size_t n = std::min(num, count - done);
+		op.get_agg().runAgg(n, buf.data(), tmp);
+		op.get_combine().runAA(1, out, tmp, out);
+	}
+}
+
+/*
+ * Write the unique values and their aggregation results of all partitions
+ * to the output vectors.
+ */
+template<class T>
+static void write_groups(const agg_operate &op,
+		const std::vector<std::vector<group_t> > &part_groups,
+		dense_matrix::ptr &vals, dense_matrix::ptr &aggs)
+{
+	std::vector<size_t> offs(part_groups.size() + 1);
+	for (size_t p = 0; p < part_groups.size(); p++)
+		offs[p + 1] = offs[p] + part_groups[p].size();
+	size_t num_groups = offs.back();
+
+	detail::mem_matrix_store::ptr val_store = detail::mem_matrix_store::create(
+			num_groups, 1, matrix_layout_t::L_COL, get_scalar_type<T>(), -1);
+	detail::mem_matrix_store::ptr agg_store = detail::mem_matrix_store::create(
+			num_groups, 1, matrix_layout_t::L_COL, op.get_output_type(), -1);
+	T *val_arr = reinterpret_cast<T *>(val_store->get_raw_arr());
+	char *agg_arr = agg_store->get_raw_arr();
+	size_t out_size = op.get_output_type().get_size();
+	parallel_for(part_groups.size(), [&](size_t p) {
+			std::vector<T> buf;
+			std::vector<char> tmp(out_size);
+			const std::vector<group_t> &groups = part_groups[p];
+			for (size_t k = 0; k < groups.size(); k++) {
+				size_t idx = offs[p] + k;
+				T val = ordered_key<T>::from_key(groups[k].first);
+				val_arr[idx] = val;
+				agg_copies(op, val, groups[k].second, buf, tmp.data(),
+						agg_arr + idx * out_size);
+			}
+		});
+	vals = dense_matrix::create(val_store);
+	aggs = dense_matrix::create(agg_store);
+}
+
+template<class T>
+static bool hash_sgroupby(const T *arr, size_t len, const agg_operate &op,
+		dense_matrix::ptr &vals, dense_matrix::ptr &aggs)
+{
+	std::vector<uint64_t> sample;
+	size_t num_uniq = estimate_num_uniq(arr, len, sample);
+	// If almost all values are unique, grouping doesn't reduce the data
+	// and sorting works better.
+	if (num_uniq > len / 2)
+		return false;
+
+	size_t num_tasks = get_num_tasks();
+	std::vector<std::vector<group_t> > part_groups;
+	bool counted = false;
+	if (num_uniq < CACHE_TABLE_SIZE / 2) {
+		part_groups.resize(1);
+		counted = count_local(arr, len, num_tasks, part_groups[0]);
+	}
+	// The hash tables outgrow the cache, so we partition the array first.
+	if (!counted) {
+		part_groups.clear();
+		count_partitioned(arr, len, num_tasks, sample, num_uniq, part_groups);
+	}
+	write_groups<T>(op, part_groups, vals, aggs);
+	return true;
+}
+
+bool hash_sgroupby(col_vec::ptr vec, agg_operate::const_ptr op,
+		dense_matrix::ptr &vals, dense_matrix::ptr &aggs)
+{
+	size_t len = vec->get_length();
+	bool is_int = vec->get_type() == get_scalar_type<int>();
+	bool is_double = vec->get_type() == get_scalar_type<double>();
+	if (len == 0 || !(is_int || is_double))
+		return false;
+	// We can't aggregate the copies of a value in parts without a combine
+	// operator. The sort-based groupby runs the operator on each group.
+	if (!op->has_combine())
+		return false;
+
+	const char *arr = get_mem_arr(vec);
+	if (arr && is_int)
+		return hash_sgroupby(reinterpret_cast<const int *>(arr), len, *op,
+				vals, aggs);
+	else if (arr)
+		return hash_sgroupby(reinterpret_cast<const double *>(arr), len, *op,
+				vals, aggs);
+
+	std::vector<std::vector<group_t> > part_groups;
+	if (is_int && count_portions<int>(vec, part_groups))
+		write_groups<int>(*op, part_groups, vals, aggs);
+	else if (is_double && count_portions<double>(vec, part_groups))
+		write_groups<double>(*op, part_groups, vals, aggs);
+	else
+		return false;
+	return true;
+}
+
+bool hash_count(col_vec::ptr vec, dense_matrix::ptr &vals,
+		dense_matrix::ptr &cnts)
+{
+	size_t len = vec->get_length();
+	bool is_int = vec->get_type() == get_scalar_type<int>();
+	bool is_double = vec->get_type() == get_scalar_type<double>();
+	if (len == 0 || !(is_int || is_double))
+		return false;
+
+	const char *arr = get_mem_arr(vec);
+	if (arr && is_int)
+		hash_count(reinterpret_cast<const int *>(arr), len, vals, cnts);
+	else if (arr)
+		hash_count(reinterpret_cast<const double *>(arr), len, vals, cnts);
+	else {
+		std::vector<std::vector<group_t> > part_groups;
+		if (is_int && count_portions<int>(vec, part_groups))
+			write_counts<int>(part_groups, vals, cnts);
+		else if (is_double && count_portions<double>(vec, part_groups))
+			write_counts<double>(part_groups, vals, cnts);
+		else
+			return false;
+	}
+	return true;
+}
+
+}
@@ -0,0 +1,72 @@
+#ifndef __FMR_HASH_AGG_H__
+#define __FMR_HASH_AGG_H__
+
+/*
+ * Copyright 2015 Open Connectome Project (http://openconnecto.me)
+ *
+ * This file is part of FlashR.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bulk_operate.h"
+#include "dense_matrix.h"
+
+/*
+ * This file groups the elements of a vector by their values with hash
+ * tables instead of sorting the vector.
+ *
+ * The elements in a group all have the same value, so we only need to
+ * count the elements of each unique value and we run the aggregation
+ * operator on the copies of the value in the end.
+ *
+ * We estimate the number of unique values from a sample of the vector.
+ * If there are few of them, each thread counts its part of the vector in
+ * a small hash table that fits in the CPU cache, and we merge the tables
+ * in the end. Otherwise, we partition the vector by value ranges first,
+ * so that each partition is counted by a single thread without merging.
+ * If almost all values are unique, sorting works better.
+ *
+ * A vector that isn't in contiguous memory, e.g., a virtual vector or
+ * a vector on NUMA nodes or disks, isn't materialized. Each thread counts
+ * the portions it reads in its own hash table, and we merge the tables.
+ */
+
+namespace fmr
+{
+
+/*
+ * Group the elements of a vector by value. It outputs the unique values
+ * sorted in ascending order and the aggregation result of each value,
+ * which is the same as fm::col_vec::groupby with sorting.
+ * It returns false if the sort-based groupby should be used instead, e.g.,
+ * if there are too many unique values or the aggregation operator doesn't
+ * have a combine operator to aggregate the copies of a value in parts.
+ */
+bool hash_sgroupby(fm::col_vec::ptr vec, fm::agg_operate::const_ptr op,
+		fm::dense_matrix::ptr &vals, fm::dense_matrix::ptr &aggs);
+
+/*
+ * Count the copies of each value in a vector. It outputs the unique values
+ * sorted in ascending order and their counts as doubles. If the values are
+ * integers in a small range, we count them with arrays of counters instead
+ * of hash tables. Doubles are equal only if they have the same value.
+ * It returns false if the type of the vector isn't supported or a vector
+ * that isn't in contiguous memory has too many unique values.
+ */
+bool hash_count(fm::col_vec::ptr vec, fm::dense_matrix::ptr &vals,
+		fm::dense_matrix::ptr &cnts);
+
+}
+
+#endif
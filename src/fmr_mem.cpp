@@ -0,0 +1,339 @@
+/*
+ * Copyright 2015 Open Connectome Project (http://openconnecto.me)
+ *
+ * This file is part of FlashR.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "dense_matrix.h"
+#include "mem_matrix_store.h"
+#include "EM_dense_matrix.h"
+
+#include "fmr_mem.h"
+
+using namespace fm;
+
+namespace fmr
+{
+
+namespace
+{
+
+struct obj_rec
+{
+	std::weak_ptr<dense_matrix> mat;
+	obj_mem_info info;
+	// Whether the data of the matrix has been counted.
+	bool counted;
+	// The data ID of the matrix, which may be shared with other matrices.
+	// A virtual matrix doesn't have data.
+	bool has_data;
+	size_t data_id;
+};
+
+struct data_rec
+{
+	mem_store_t store;
+	size_t bytes;
+	size_t num_refs;
+};
+
+class mem_tracker
+{
+	std::mutex lock;
+	std::unordered_map<const void *, obj_rec> objs;
+	std::unordered_map<size_t, data_rec> datas;
+	// The same R object may be borrowed by multiple matrices.
+	std::unordered_multiset<const void *> R_datas;
+	size_t curr_bytes[NUM_MEM_STORES];
+	size_t peak_bytes[NUM_MEM_STORES];
+	size_t curr_total;
+	size_t peak_total;
+
+	void get_mem_info(const dense_matrix &mat, obj_rec &rec) const;
+	void add_data(const obj_rec &rec);
+	void remove_data(const obj_rec &rec);
+	void refresh();
+public:
+	mem_tracker() {
+		memset(curr_bytes, 0, sizeof(curr_bytes));
+		memset(peak_bytes, 0, sizeof(peak_bytes));
+		curr_total = 0;
+		peak_total = 0;
+	}
+
+	void track(const void *ref, dense_matrix::ptr mat);
+	void untrack(const void *ref);
+	void track_R(const void *data);
+	void untrack_R(const void *data);
+	void update();
+	std::vector<obj_mem_info> get_obj_info();
+	mem_usage get_usage();
+};
+
+}
+
+static bool is_in_mem_store(mem_store_t store)
+{
+	return store == MEM_SMP || store == MEM_NUMA;
+}
+
+void mem_tracker::get_mem_info(const dense_matrix &mat, obj_rec &rec) const
+{
+	obj_mem_info &info = rec.info;
+	detail::matrix_store::const_ptr store = mat.get_raw_store();
+	info.nrow = mat.get_num_rows();
+	info.ncol = mat.get_num_cols();
+	info.materialized = !mat.is_virtual();
+	info.bytes = info.nrow * info.ncol * mat.get_entry_size();
+	rec.has_data = false;
+	rec.data_id = 0;
+	if (mat.is_virtual()) {
+		info.store = MEM_VIRTUAL;
+		info.bytes = 0;
+		return;
+	}
+
+	// The transpose of a matrix shares the data ID of the matrix.
+	if (!mat.is_in_mem()) {
+		info.store = MEM_EM;
+		detail::EM_matrix_store::const_ptr em_store
+			= std::dynamic_pointer_cast<const detail::EM_matrix_store>(store);
+		if (em_store) {
+			rec.has_data = true;
+			rec.data_id = em_store->get_data_id();
+		}
+		return;
+	}
+
+	info.store = mat.get_data().get_num_nodes() > 0 ? MEM_NUMA : MEM_SMP;
+	detail::mem_matrix_store::const_ptr mem_store
+		= std::dynamic_pointer_cast<const detail::mem_matrix_store>(store);
+	if (mem_store == NULL)
+		return;
+	rec.has_data = true;
+	rec.data_id = mem_store->get_data_id();
+	if (info.store == MEM_SMP && mem_store->get_raw_arr()
+			&& R_datas.find(mem_store->get_raw_arr()) != R_datas.end())
+		info.store = MEM_R;
+}
+
+void mem_tracker::add_data(const obj_rec &rec)
+{
+	if (!rec.has_data)
+		return;
+	auto it = datas.find(rec.data_id);
+	if (it != datas.end()) {
+		it->second.num_refs++;
+		return;
+	}
+
+	data_rec data;
+	data.store = rec.info.store;
+	data.bytes = rec.info.bytes;
+	data.num_refs = 1;
+	datas.insert(std::pair<size_t, data_rec>(rec.data_id, data));
+	curr_bytes[data.store] += data.bytes;
+	peak_bytes[data.store] = std::max(peak_bytes[data.store],
+			curr_bytes[data.store]);
+	if (is_in_mem_store(data.store)) {
+		curr_total += data.bytes;
+		peak_total = std::max(peak_total, curr_total);
+	}
+}
+
+void mem_tracker::remove_data(const obj_rec &rec)
+{
+	if (!rec.has_data)
+		return;
+	auto it = datas.find(rec.data_id);
+	if (it == datas.end())
+		return;
+	if (--it->second.num_refs > 0)
+		return;
+
+	curr_bytes[it->second.store] -= it->second.bytes;
+	if (is_in_mem_store(it->second.store))
+		curr_total -= it->second.bytes;
+	datas.erase(it);
+}
+
+/*
+ * This counts the data of the matrices tracked since the last refresh.
+ * Materializing a matrix replaces its store, so we also move the matrix to
+ * its new data.
+ */
+void mem_tracker::refresh()
+{
+	for (auto it = objs.begin(); it != objs.end(); it++) {
+		dense_matrix::ptr mat = it->second.mat.lock();
+		if (mat == NULL)
+			continue;
+		obj_rec rec;
+		rec.mat = it->second.mat;
+		rec.counted = true;
+		get_mem_info(*mat, rec);
+		if (it->second.counted && rec.has_data == it->second.has_data
+				&& rec.data_id == it->second.data_id
+				&& rec.info.store == it->second.info.store)
+			continue;
+		// We add the new data first, so the peak includes both if
+		// the old data isn't shared.
+		add_data(rec);
+		remove_data(it->second);
+		it->second = rec;
+	}
+}
+
+void mem_tracker::track(const void *ref, dense_matrix::ptr mat)
+{
+	if (mat == NULL)
+		return;
+
+	// We count the data of the matrix when the usage is requested or
+	// a matrix is materialized, so creating an object doesn't cost more
+	// as the number of live objects grows.
+	obj_rec rec;
+	rec.mat = mat;
+	rec.counted = false;
+	rec.has_data = false;
+	rec.data_id = 0;
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = objs.find(ref);
+	if (it != objs.end()) {
+		remove_data(it->second);
+		it->second = rec;
+	}
+	else
+		objs.insert(std::pair<const void *, obj_rec>(ref, rec));
+}
+
+void mem_tracker::untrack(const void *ref)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = objs.find(ref);
+	if (it == objs.end())
+		return;
+	remove_data(it->second);
+	objs.erase(it);
+}
+
+void mem_tracker::track_R(const void *data)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	R_datas.insert(data);
+}
+
+void mem_tracker::untrack_R(const void *data)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = R_datas.find(data);
+	if (it != R_datas.end())
+		R_datas.erase(it);
+}
+
+void mem_tracker::update()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	refresh();
+}
+
+std::vector<obj_mem_info> mem_tracker::get_obj_info()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	refresh();
+	std::vector<obj_mem_info> infos;
+	for (auto it = objs.begin(); it != objs.end(); it++) {
+		dense_matrix::ptr mat = it->second.mat.lock();
+		if (mat == NULL || !it->second.counted)
+			continue;
+		infos.push_back(it->second.info);
+		infos.back().name = mat->get_raw_store()->get_name();
+	}
+	return infos;
+}
+
+mem_usage mem_tracker::get_usage()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	refresh();
+	mem_usage usage;
+	memset(usage.num_objs, 0, sizeof(usage.num_objs));
+	for (auto it = objs.begin(); it != objs.end(); it++)
+		if (it->second.counted)
+			usage.num_objs[it->second.info.store]++;
+	memcpy(usage.curr_bytes, curr_bytes, sizeof(curr_bytes));
+	memcpy(usage.peak_bytes, peak_bytes, sizeof(peak_bytes));
+	usage.curr_total = curr_total;
+	usage.peak_total = peak_total;
+	return usage;
+}
+
+static mem_tracker tracker;
+
+const char *get_mem_store_name(mem_store_t store)
+{
+	switch (store) {
+		case MEM_SMP: return "SMP";
+		case MEM_NUMA: return "NUMA";
+		case MEM_EM: return "EM";
+		case MEM_R: return "R";
+		case MEM_VIRTUAL: return "virtual";
+		default: return "unknown";
+	}
+}
+
+void track_obj(const void *ref, dense_matrix::ptr mat)
+{
+	tracker.track(ref, mat);
+}
+
+void untrack_obj(const void *ref)
+{
+	tracker.untrack(ref);
+}
+
+void track_R_data(const void *data)
+{
+	tracker.track_R(data);
+}
+
+void untrack_R_data(const void *data)
+{
+	tracker.untrack_R(data);
+}
+
+void update_mem_usage()
+{
+	tracker.update();
+}
+
+std::vector<obj_mem_info> get_obj_mem_info()
+{
+	return tracker.get_obj_info();
+}
+
+mem_usage get_mem_usage()
+{
+	return tracker.get_usage();
+}
+
+}
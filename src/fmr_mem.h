@@ -0,0 +1,123 @@
+#ifndef __FMR_MEM_H__
+#define __FMR_MEM_H__
+
+/*
+ * Copyright 2015 Open Connectome Project (http://openconnecto.me)
+ *
+ * This file is part of FlashR.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace fm
+{
+	class dense_matrix;
+	class sparse_matrix;
+}
+
+/*
+ * This file tracks the memory used by the dense matrices that R objects
+ * refer to. An R object refers to a matrix with an object_ref, which
+ * tracks the matrix when it's created and stops tracking it when R garbage
+ * collects the object. R objects may share the data of a matrix, e.g.,
+ * a matrix and its transpose, so the data is identified by the data ID of
+ * its store and counted once. A matrix that borrows the memory of an R
+ * object is counted separately because R already owns the memory.
+ *
+ * Tracking a matrix only records a weak reference to it. The data of the
+ * tracked matrices is counted when the usage is requested and when FlashR
+ * materializes a matrix, so the peaks don't include the temporary matrices
+ * that FlashMatrix creates inside an operation or the objects that are
+ * freed before their data is counted.
+ */
+
+namespace fmr
+{
+
+enum mem_store_t
+{
+	MEM_SMP,
+	MEM_NUMA,
+	MEM_EM,
+	MEM_R,
+	MEM_VIRTUAL,
+	NUM_MEM_STORES,
+};
+
+const char *get_mem_store_name(mem_store_t store);
+
+/*
+ * The memory of a live matrix. The bytes of a matrix on disks are stored
+ * on disks instead of in memory. The bytes of a matrix in R are owned by
+ * R. A virtual matrix doesn't have data until it's materialized.
+ */
+struct obj_mem_info
+{
+	mem_store_t store;
+	size_t nrow;
+	size_t ncol;
+	size_t bytes;
+	bool materialized;
+	std::string name;
+};
+
+/*
+ * The number of live matrices in each type of store and the current and
+ * peak bytes of the data they use. The totals only count the data in
+ * memory.
+ */
+struct mem_usage
+{
+	size_t num_objs[NUM_MEM_STORES];
+	size_t curr_bytes[NUM_MEM_STORES];
+	size_t peak_bytes[NUM_MEM_STORES];
+	size_t curr_total;
+	size_t peak_total;
+};
+
+void track_obj(const void *ref, std::shared_ptr<fm::dense_matrix> mat);
+void untrack_obj(const void *ref);
+
+/*
+ * We don't track sparse matrices.
+ */
+static inline void track_obj(const void *,
+		std::shared_ptr<fm::sparse_matrix>)
+{
+}
+
+/*
+ * The memory borrowed from an R object.
+ */
+void track_R_data(const void *data);
+void untrack_R_data(const void *data);
+
+/*
+ * This counts the data of the matrices tracked since the last update and
+ * updates the memory of the matrices materialized after they're tracked.
+ * It should be called after materializing a matrix.
+ */
+void update_mem_usage();
+
+std::vector<obj_mem_info> get_obj_mem_info();
+mem_usage get_mem_usage();
+
+}
+
+#endif
@@ -0,0 +1,287 @@
+/*
+ * Copyright 2015 Open Connectome Project (http://openconnecto.me)
+ *
+ * This file is part of FlashR.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+
+#include "fmr_simd.h"
+#include "fmr_na.h"
+
+namespace fmr
+{
+
+namespace
+{
+
+typedef bool (*NA_scan_t)(const char *arr, size_t num_eles);
+
+bool scan_int(const char *arr, size_t num_eles)
+{
+	return simd::contain_na(reinterpret_cast<const int *>(arr), num_eles);
+}
+
+bool scan_double(const char *arr, size_t num_eles)
+{
+	return simd::contain_nan(reinterpret_cast<const double *>(arr), num_eles);
+}
+
+/*
+ * A flag is -1 if we don't know it yet, 0 if the chunk doesn't have NA
+ * and 1 if it has NA.
+ */
+enum
+{
+	FLAG_UNKNOWN = -1,
+	FLAG_NO_NA = 0,
+	FLAG_NA = 1,
+};
+
+struct NA_arr
+{
+	std::weak_ptr<const void> owner;
+	const char *start;
+	const char *end;
+	size_t entry_size;
+	NA_scan_t scan;
+	std::shared_ptr<std::atomic<signed char> > flags;
+};
+
+/*
+ * Small ranges are cheaper to scan than to look up.
+ */
+const size_t MIN_LOOKUP_LEN = 64;
+/*
+ * We don't remove the expired arrays until there are this many arrays.
+ */
+const size_t MIN_PURGE_SIZE = 64;
+/*
+ * The number of arrays that a thread remembers from its last lookups.
+ * A binary operator reads two arrays.
+ */
+const size_t NUM_LOCAL_ARRS = 4;
+
+/*
+ * A thread first looks up the arrays it found last time, so most lookups
+ * don't touch the lock and the map shared by all threads. An array can't
+ * be replaced while its owner is alive, so an entry stays valid as long
+ * as its owner. The entry holds its own reference to the flags, so they
+ * stay alive after the array is removed from the map.
+ */
+struct local_NA_arrs
+{
+	NA_arr arrs[NUM_LOCAL_ARRS];
+	size_t next;
+
+	local_NA_arrs() {
+		for (size_t i = 0; i < NUM_LOCAL_ARRS; i++)
+			arrs[i].start = arrs[i].end = NULL;
+		next = 0;
+	}
+};
+
+thread_local local_NA_arrs local_arrs;
+
+class NA_cache
+{
+	pthread_rwlock_t lock;
+	// The registered arrays, indexed by their start addresses.
+	std::map<const char *, NA_arr> arrs;
+	// The number of arrays after we removed the expired ones last time.
+	size_t num_purged;
+public:
+	NA_cache() {
+		pthread_rwlock_init(&lock, NULL);
+		num_purged = 0;
+	}
+	~NA_cache() {
+		pthread_rwlock_destroy(&lock);
+	}
+
+	void add(std::shared_ptr<const void> owner, const char *arr,
+			size_t num_eles, size_t entry_size, NA_scan_t scan, bool scan_now);
+	const NA_arr *find(const char *arr);
+	int lookup(const char *arr, size_t num_eles, size_t entry_size,
+			NA_scan_t scan);
+};
+
+void NA_cache::add(std::shared_ptr<const void> owner, const char *arr,
+		size_t num_eles, size_t entry_size, NA_scan_t scan, bool scan_now)
+{
+	if (owner == NULL || num_eles == 0)
+		return;
+
+	size_t num_chunks = (num_eles + NA_CHUNK_LEN - 1) / NA_CHUNK_LEN;
+	std::shared_ptr<std::atomic<signed char> > flags(
+			new std::atomic<signed char>[num_chunks],
+			std::default_delete<std::atomic<signed char>[]>());
+	for (size_t i = 0; i < num_chunks; i++) {
+		signed char flag = FLAG_UNKNOWN;
+		if (scan_now) {
+			size_t len = std::min(NA_CHUNK_LEN, num_eles - i * NA_CHUNK_LEN);
+			flag = scan(arr + i * NA_CHUNK_LEN * entry_size, len)
+				? FLAG_NA : FLAG_NO_NA;
+		}
+		flags.get()[i].store(flag, std::memory_order_relaxed);
+	}
+
+	NA_arr rec;
+	rec.owner = owner;
+	rec.start = arr;
+	rec.end = arr + num_eles * entry_size;
+	rec.entry_size = entry_size;
+	rec.scan = scan;
+	rec.flags = flags;
+
+	pthread_rwlock_wrlock(&lock);
+	// The arrays whose owners are gone may have been freed. Their entries
+	// are ignored by lookups, so we only remove them when the number of
+	// arrays doubles. Otherwise, registering many arrays takes quadratic
+	// time.
+	if (arrs.size() >= std::max(num_purged * 2, MIN_PURGE_SIZE)) {
+		for (auto it = arrs.begin(); it != arrs.end();) {
+			if (it->second.owner.expired())
+				it = arrs.erase(it);
+			else
+				it++;
+		}
+		num_purged = arrs.size();
+	}
+	arrs[arr] = rec;
+	pthread_rwlock_unlock(&lock);
+}
+
+/*
+ * Find the registered array that may contain the address. It returns
+ * the copy of the array that the thread remembers, so the array is only
+ * copied the first time the thread looks it up.
+ */
+const NA_arr *NA_cache::find(const char *arr)
+{
+	for (size_t i = 0; i < NUM_LOCAL_ARRS; i++) {
+		const NA_arr &local = local_arrs.arrs[i];
+		if (local.start <= arr && arr < local.end && !local.owner.expired())
+			return &local;
+	}
+
+	NA_arr &local = local_arrs.arrs[local_arrs.next];
+	bool found = false;
+	pthread_rwlock_rdlock(&lock);
+	auto it = arrs.upper_bound(arr);
+	if (it != arrs.begin()) {
+		it--;
+		if (arr < it->second.end) {
+			local = it->second;
+			found = true;
+		}
+	}
+	pthread_rwlock_unlock(&lock);
+	if (!found)
+		return NULL;
+	local_arrs.next = (local_arrs.next + 1) % NUM_LOCAL_ARRS;
+	return &local;
+}
+
+/*
+ * It returns the NA flag of the range or FLAG_UNKNOWN if the range isn't
+ * in a registered array.
+ */
+int NA_cache::lookup(const char *arr, size_t num_eles, size_t entry_size,
+		NA_scan_t scan)
+{
+	const NA_arr *rec = find(arr);
+	if (rec == NULL)
+		return FLAG_UNKNOWN;
+	const char *start = rec->start;
+	if (arr + num_eles * entry_size > rec->end
+			|| rec->entry_size != entry_size || rec->scan != scan
+			|| (arr - start) % entry_size != 0)
+		return FLAG_UNKNOWN;
+	// The operator reads the data of the range, so the owner can only be
+	// gone if the array was freed and its memory was reused.
+	if (rec->owner.expired())
+		return FLAG_UNKNOWN;
+
+	size_t num_arr_eles = (rec->end - start) / entry_size;
+	size_t off = (arr - start) / entry_size;
+	size_t first = off / NA_CHUNK_LEN;
+	size_t last = (off + num_eles - 1) / NA_CHUNK_LEN;
+	for (size_t i = first; i <= last; i++) {
+		std::atomic<signed char> &flag = rec->flags.get()[i];
+		signed char val = flag.load(std::memory_order_relaxed);
+		if (val == FLAG_UNKNOWN) {
+			size_t len = std::min(NA_CHUNK_LEN,
+					num_arr_eles - i * NA_CHUNK_LEN);
+			val = scan(start + i * NA_CHUNK_LEN * entry_size, len)
+				? FLAG_NA : FLAG_NO_NA;
+			flag.store(val, std::memory_order_relaxed);
+		}
+		if (val == FLAG_NA)
+			return FLAG_NA;
+	}
+	return FLAG_NO_NA;
+}
+
+NA_cache cache;
+
+bool has_NA(const char *arr, size_t num_eles, size_t entry_size,
+		NA_scan_t scan)
+{
+	if (num_eles == 0)
+		return false;
+	if (num_eles < MIN_LOOKUP_LEN)
+		return scan(arr, num_eles);
+
+	int flag = cache.lookup(arr, num_eles, entry_size, scan);
+	if (flag == FLAG_UNKNOWN)
+		return scan(arr, num_eles);
+	else
+		return flag == FLAG_NA;
+}
+
+}
+
+void register_NA_arr(std::shared_ptr<const void> owner, const int *arr,
+		size_t num_eles, bool scan)
+{
+	cache.add(owner, reinterpret_cast<const char *>(arr), num_eles,
+			sizeof(int), scan_int, scan);
+}
+
+void register_NA_arr(std::shared_ptr<const void> owner, const double *arr,
+		size_t num_eles, bool scan)
+{
+	cache.add(owner, reinterpret_cast<const char *>(arr), num_eles,
+			sizeof(double), scan_double, scan);
+}
+
+bool has_NA(const int *arr, size_t num_eles)
+{
+	return has_NA(reinterpret_cast<const char *>(arr), num_eles, sizeof(int),
+			scan_int);
+}
+
+bool has_NA(const double *arr, size_t num_eles)
+{
+	return has_NA(reinterpret_cast<const char *>(arr), num_eles,
+			sizeof(double), scan_double);
+}
+
+}
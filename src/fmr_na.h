@@ -0,0 +1,64 @@
+#ifndef __FMR_NA_H__
+#define __FMR_NA_H__
+
+/*
+ * Copyright 2015 Open Connectome Project (http://openconnecto.me)
+ *
+ * This file is part of FlashR.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+
+#include <memory>
+
+/*
+ * This file caches whether the chunks of an array contain NA, so the
+ * NA-adaptive operators don't scan the same data for NA every time they
+ * run on it. An array is registered together with the object that owns its
+ * memory, and its flags are ignored once the owner is destroyed, so a new
+ * array allocated at the same address never sees stale flags. The flag of
+ * a chunk is computed when the array is registered or the first time an
+ * operator looks it up. For doubles, NaN is treated as NA.
+ */
+
+namespace fmr
+{
+
+/*
+ * The number of elements covered by an NA flag.
+ */
+const size_t NA_CHUNK_LEN = 4096;
+
+/*
+ * Register an array whose data doesn't change while its owner is alive.
+ * If `scan' is true, the flags of all chunks are computed now. Otherwise,
+ * they are computed when they're looked up.
+ */
+void register_NA_arr(std::shared_ptr<const void> owner, const int *arr,
+		size_t num_eles, bool scan);
+void register_NA_arr(std::shared_ptr<const void> owner, const double *arr,
+		size_t num_eles, bool scan);
+
+/*
+ * Test if a range of elements may contain NA. If the range is in a
+ * registered array, the answer comes from the flags of the chunks that
+ * overlap with the range. Otherwise, the range is scanned.
+ */
+bool has_NA(const int *arr, size_t num_eles);
+bool has_NA(const double *arr, size_t num_eles);
+
+}
+
+#endif
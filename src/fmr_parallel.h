@@ -0,0 +1,92 @@
+#ifndef __FMR_PARALLEL_H__
+#define __FMR_PARALLEL_H__
+
+/*
+ * Copyright 2015 Open Connectome Project (http://openconnecto.me)
+ *
+ * This file is part of FlashR.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <vector>
+
+#include "mem_worker_thread.h"
+
+/*
+ * This runs FlashR's own parallel loops over in-memory arrays in
+ * the FlashMatrix threads.
+ */
+
+namespace fmr
+{
+
+template<class Func>
+class func_task: public fm::detail::thread_task
+{
+	Func func;
+	size_t idx;
+public:
+	func_task(Func func, size_t idx): func(func) {
+		this->idx = idx;
+	}
+
+	virtual void run() {
+		func(idx);
+	}
+};
+
+/*
+ * Run `func' on every index in [0, num_tasks) in the FlashMatrix threads.
+ * The threads delete the tasks after running them.
+ */
+template<class Func>
+void parallel_for(size_t num_tasks, Func func)
+{
+	fm::detail::mem_thread_pool::ptr threads
+		= fm::detail::mem_thread_pool::get_global_mem_threads();
+	size_t num_nodes = threads->get_num_nodes();
+	for (size_t i = 0; i < num_tasks; i++)
+		threads->process_task(i % num_nodes, new func_task<Func>(func, i));
+	threads->wait4complete();
+}
+
+/*
+ * Run `func' on every index in [0, node_ids.size()). Index `i' runs in
+ * a thread on the NUMA node `node_ids[i]', e.g., the node that stores
+ * the data of the task.
+ */
+template<class Func>
+void parallel_for(const std::vector<int> &node_ids, Func func)
+{
+	fm::detail::mem_thread_pool::ptr threads
+		= fm::detail::mem_thread_pool::get_global_mem_threads();
+	size_t num_nodes = threads->get_num_nodes();
+	for (size_t i = 0; i < node_ids.size(); i++) {
+		int node_id = node_ids[i] < 0 ? i % num_nodes : node_ids[i] % num_nodes;
+		threads->process_task(node_id, new func_task<Func>(func, i));
+	}
+	threads->wait4complete();
+}
+
+/*
+ * The number of tasks we split a loop into, one for each thread.
+ */
+static inline size_t get_num_tasks()
+{
+	return fm::detail::mem_thread_pool::get_global_num_threads();
+}
+
+}
+
+#endif
@@ -0,0 +1,396 @@
+/*
+ * Copyright 2015 Open Connectome Project (http://openconnecto.me)
+ *
+ * This file is part of FlashR.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <Rcpp.h>
+
+#include "local_matrix_store.h"
+#include "mem_matrix_store.h"
+
+#include "fmr_quantile.h"
+
+using namespace fm;
+
+namespace fmr
+{
+
+/*
+ * A sketch keeps all values until it has this many values, so
+ * the quantiles of a small input are exact.
+ */
+static const size_t EXACT_LEN = 4096;
+/*
+ * The minimal capacity of a level.
+ */
+static const size_t MIN_LEVEL_CAP = 8;
+
+class kll_sketch
+{
+	// The capacity of the top level. The capacity of a level decreases by
+	// 2/3 for each level below it.
+	size_t k;
+	size_t num_vals;
+	size_t num_nas;
+	// The capacity of level 0.
+	size_t cap0;
+	std::vector<std::vector<double> > levels;
+	uint64_t rand_state;
+
+	size_t get_capacity(size_t level) const;
+	void compact(size_t level);
+	void compress();
+public:
+	typedef std::shared_ptr<kll_sketch> ptr;
+
+	kll_sketch(size_t k, uint64_t seed) {
+		this->k = k;
+		num_vals = 0;
+		num_nas = 0;
+		cap0 = std::max(k, EXACT_LEN);
+		levels.resize(1);
+		// xorshift doesn't work with 0.
+		rand_state = seed * 2 + 1;
+	}
+
+	void add(double v) {
+		levels[0].push_back(v);
+		num_vals++;
+		if (levels[0].size() > cap0)
+			compress();
+	}
+	void add_na() {
+		num_nas++;
+	}
+	size_t get_num_nas() const {
+		return num_nas;
+	}
+
+	void merge(const kll_sketch &sketch);
+	void get_quantiles(const std::vector<double> &probs, double *out) const;
+};
+
+size_t kll_sketch::get_capacity(size_t level) const
+{
+	size_t depth = levels.size() - 1 - level;
+	if (depth == 0)
+		return k;
+	double cap = k * pow(2.0 / 3.0, depth);
+	return std::max(MIN_LEVEL_CAP, (size_t) ceil(cap));
+}
+
+/*
+ * Move every other value in a level to the next level. We choose the odd
+ * or the even values randomly, so the ranks are unbiased. If a level has
+ * an odd number of values, the smallest one stays in the level.
+ */
+void kll_sketch::compact(size_t level)
+{
+	if (level + 1 == levels.size())
+		levels.emplace_back();
+	std::vector<double> &vals = levels[level];
+	std::vector<double> &next = levels[level + 1];
+	std::sort(vals.begin(), vals.end());
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 7;
+	rand_state ^= rand_state << 17;
+	size_t num_left = vals.size() % 2;
+	for (size_t i = num_left + (rand_state & 1); i < vals.size(); i += 2)
+		next.push_back(vals[i]);
+	vals.resize(num_left);
+}
+
+void kll_sketch::compress()
+{
+	for (size_t i = 0; i < levels.size(); i++) {
+		size_t cap = get_capacity(i);
+		// Level 0 keeps all values before the first compaction.
+		if (levels.size() == 1)
+			cap = cap0;
+		if (levels[i].size() > cap)
+			compact(i);
+	}
+	cap0 = get_capacity(0);
+}
+
+void kll_sketch::merge(const kll_sketch &sketch)
+{
+	if (levels.size() < sketch.levels.size())
+		levels.resize(sketch.levels.size());
+	for (size_t i = 0; i < sketch.levels.size(); i++)
+		levels[i].insert(levels[i].end(), sketch.levels[i].begin(),
+				sketch.levels[i].end());
+	num_vals += sketch.num_vals;
+	num_nas += sketch.num_nas;
+	if (levels.size() == 1)
+		cap0 = std::max(k, EXACT_LEN);
+	if (levels.size() > 1 || levels[0].size() > cap0)
+		compress();
+}
+
+/*
+ * A value in level h stands for 2^h values, so we find a quantile in
+ * the sorted values with their weights. If the sketch has all values,
+ * all weights are 1 and the quantiles are exact.
+ */
+void kll_sketch::get_quantiles(const std::vector<double> &probs,
+		double *out) const
+{
+	std::vector<std::pair<double, size_t> > vals;
+	for (size_t i = 0; i < levels.size(); i++)
+		for (size_t j = 0; j < levels[i].size(); j++)
+			vals.push_back(std::pair<double, size_t>(levels[i][j],
+						((size_t) 1) << i));
+	std::sort(vals.begin(), vals.end());
+	// The first location that each value stands for.
+	std::vector<size_t> locs(vals.size());
+	size_t loc = 0;
+	for (size_t i = 0; i < vals.size(); i++) {
+		locs[i] = loc;
+		loc += vals[i].second;
+	}
+
+	for (size_t i = 0; i < probs.size(); i++) {
+		if (vals.empty()) {
+			out[i] = NA_REAL;
+			continue;
+		}
+		// This is how R's quantile interpolates with type 7.
+		double idx = (loc - 1) * probs[i];
+		size_t lo = floor(idx);
+		size_t hi = std::min(lo + 1, loc - 1);
+		size_t lo_pos = std::upper_bound(locs.begin(), locs.end(), lo)
+			- locs.begin() - 1;
+		size_t hi_pos = std::upper_bound(locs.begin(), locs.end(), hi)
+			- locs.begin() - 1;
+		double h = idx - lo;
+		double lo_val = vals[lo_pos].first;
+		double hi_val = vals[hi_pos].first;
+		out[i] = lo_val;
+		if (h > 0 && hi_val != lo_val)
+			out[i] = (1 - h) * lo_val + h * hi_val;
+	}
+}
+
+static inline bool is_na(int v)
+{
+	return v == NA_INTEGER;
+}
+
+static inline bool is_na(double v)
+{
+	// NaN is also missing in R's quantile.
+	return isnan(v);
+}
+
+template<class T>
+static inline void add_val(kll_sketch &sketch, T v)
+{
+	if (is_na(v))
+		sketch.add_na();
+	else
+		sketch.add(v);
+}
+
+/*
+ * Add the values of each column of a portion to the sketch of the column.
+ */
+template<class T>
+static void add_portion(const detail::local_matrix_store &in,
+		const std::vector<kll_sketch::ptr> &sketches)
+{
+	size_t nrow = in.get_num_rows();
+	size_t ncol = in.get_num_cols();
+	if (in.store_layout() == matrix_layout_t::L_ROW) {
+		const detail::local_row_matrix_store &row_in
+			= dynamic_cast<const detail::local_row_matrix_store &>(in);
+		for (size_t i = 0; i < nrow; i++) {
+			const T *row = reinterpret_cast<const T *>(row_in.get_row(i));
+			for (size_t j = 0; j < ncol; j++)
+				add_val(*sketches[j], row[j]);
+		}
+	}
+	else {
+		const detail::local_col_matrix_store &col_in
+			= dynamic_cast<const detail::local_col_matrix_store &>(in);
+		for (size_t j = 0; j < ncol; j++) {
+			const T *col = reinterpret_cast<const T *>(col_in.get_col(j));
+			kll_sketch &sketch = *sketches[j];
+			for (size_t i = 0; i < nrow; i++)
+				add_val(sketch, col[i]);
+		}
+	}
+}
+
+/*
+ * This sketches the columns of a matrix in a single scan.
+ *
+ * If a portion has all rows of its columns, which is the case for a wide
+ * matrix, we get the quantiles of the columns from the portion directly.
+ * Otherwise, each thread sketches the columns in the portions it
+ * processes and we merge the sketches of the threads in the end.
+ */
+class quantile_portion_op: public detail::portion_mapply_op
+{
+	std::vector<double> probs;
+	size_t k;
+	bool na_rm;
+	size_t global_nrow;
+	detail::mem_matrix_store::ptr res;
+	// The sketches of the columns in each thread.
+	std::vector<std::vector<kll_sketch::ptr> > sketches;
+public:
+	quantile_portion_op(const std::vector<double> &probs, size_t k,
+			bool na_rm, size_t global_nrow,
+			detail::mem_matrix_store::ptr res): detail::portion_mapply_op(0, 0,
+				get_scalar_type<double>()) {
+		this->probs = probs;
+		this->k = k;
+		this->na_rm = na_rm;
+		this->global_nrow = global_nrow;
+		this->res = res;
+		sketches.resize(detail::mem_thread_pool::get_global_num_threads());
+	}
+
+	virtual detail::portion_mapply_op::const_ptr transpose() const {
+		fprintf(stderr, "quantile doesn't support transpose\n");
+		return detail::portion_mapply_op::const_ptr();
+	}
+
+	virtual void run(
+			const std::vector<detail::local_matrix_store::const_ptr> &ins) const;
+
+	/*
+	 * Merge the sketches of the threads and get the quantiles.
+	 */
+	void merge() const;
+
+	void get_quantiles(const kll_sketch &sketch, size_t col) const {
+		double *out = reinterpret_cast<double *>(res->get(0, col));
+		if (sketch.get_num_nas() > 0 && !na_rm) {
+			for (size_t i = 0; i < probs.size(); i++)
+				out[i] = NA_REAL;
+		}
+		else
+			sketch.get_quantiles(probs, out);
+	}
+
+	virtual std::string to_string(
+			const std::vector<detail::matrix_store::const_ptr> &mats) const {
+		return std::string("quantile(") + mats[0]->get_name() + ")";
+	}
+
+	virtual bool is_agg() const {
+		return false;
+	}
+};
+
+void quantile_portion_op::run(
+		const std::vector<detail::local_matrix_store::const_ptr> &ins) const
+{
+	const detail::local_matrix_store &in = *ins[0];
+	size_t ncol = in.get_num_cols();
+	size_t start_col = in.get_global_start_col();
+	bool all_rows = in.get_num_rows() == global_nrow;
+	int thread_id = detail::mem_thread_pool::get_curr_thread_id();
+	std::vector<kll_sketch::ptr> &local
+		= const_cast<quantile_portion_op *>(this)->sketches[thread_id];
+	if (!all_rows && local.empty())
+		local.resize(res->get_num_cols());
+
+	std::vector<kll_sketch::ptr> portion_sketches(ncol);
+	for (size_t j = 0; j < ncol; j++) {
+		if (all_rows)
+			portion_sketches[j] = kll_sketch::ptr(new kll_sketch(k,
+						start_col + j));
+		else {
+			if (local[start_col + j] == NULL)
+				local[start_col + j] = kll_sketch::ptr(new kll_sketch(k,
+							(start_col + j) * sketches.size() + thread_id));
+			portion_sketches[j] = local[start_col + j];
+		}
+	}
+	if (in.get_type() == get_scalar_type<double>())
+		add_portion<double>(in, portion_sketches);
+	else
+		add_portion<int>(in, portion_sketches);
+	if (all_rows) {
+		for (size_t j = 0; j < ncol; j++)
+			get_quantiles(*portion_sketches[j], start_col + j);
+	}
+}
+
+void quantile_portion_op::merge() const
+{
+	size_t ncol = res->get_num_cols();
+	for (size_t j = 0; j < ncol; j++) {
+		kll_sketch::ptr merged;
+		for (size_t i = 0; i < sketches.size(); i++) {
+			if (sketches[i].empty() || sketches[i][j] == NULL)
+				continue;
+			if (merged == NULL)
+				merged = sketches[i][j];
+			else
+				merged->merge(*sketches[i][j]);
+		}
+		if (merged)
+			get_quantiles(*merged, j);
+	}
+}
+
+/*
+ * The normalized rank error of a KLL sketch with the capacity k is about
+ * 2.296 / k^0.9723 with 99% confidence, as measured by Apache DataSketches.
+ */
+static size_t get_sketch_capacity(double eps)
+{
+	if (eps <= 0)
+		return SIZE_MAX;
+	double k = ceil(pow(2.296 / eps, 1 / 0.9723));
+	// A sketch this large keeps all values of any input we can handle.
+	if (k > 1e15)
+		return SIZE_MAX;
+	return std::max(MIN_LEVEL_CAP, (size_t) k);
+}
+
+dense_matrix::ptr sketch_col_quantiles(dense_matrix::ptr mat,
+		const std::vector<double> &probs, double eps, bool na_rm)
+{
+	if (mat->get_type() != get_scalar_type<double>()
+			&& mat->get_type() != get_scalar_type<int>())
+		return dense_matrix::ptr();
+
+	detail::mem_matrix_store::ptr res = detail::mem_matrix_store::create(
+			probs.size(), mat->get_num_cols(), matrix_layout_t::L_COL,
+			get_scalar_type<double>(), -1);
+	std::shared_ptr<quantile_portion_op> op(new quantile_portion_op(probs,
+				get_sketch_capacity(eps), na_rm, mat->get_num_rows(), res));
+	std::vector<detail::matrix_store::const_ptr> stores(1,
+			mat->get_raw_store());
+	detail::__mapply_portion(stores, op, matrix_layout_t::L_COL);
+	op->merge();
+	return dense_matrix::create(res);
+}
+
+}
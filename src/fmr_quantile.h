@@ -0,0 +1,56 @@
+#ifndef __FMR_QUANTILE_H__
+#define __FMR_QUANTILE_H__
+
+/*
+ * Copyright 2015 Open Connectome Project (http://openconnecto.me)
+ *
+ * This file is part of FlashR.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <vector>
+
+#include "dense_matrix.h"
+
+/*
+ * This file computes quantiles of the columns of a matrix in a single pass
+ * with KLL sketches (Karnin, Lang and Liberty, "Optimal Quantile
+ * Approximation in Streams", FOCS 2016).
+ *
+ * A sketch keeps a sample of the values in levels. A value in level h
+ * stands for 2^h values. When a level is full, we sort it and move every
+ * other value to the next level. Sketches are mergeable, so each thread
+ * sketches the portions it processes and we merge the sketches of
+ * the threads in the end. A sketch keeps all values of a small input, so
+ * its quantiles are exact.
+ */
+
+namespace fmr
+{
+
+/*
+ * Compute the quantiles of each column of a matrix as R's quantile with
+ * type 7. The output is a matrix with a column of quantiles for each
+ * column. `eps' is the error of the ranks of the quantiles relative to
+ * the number of values. If `eps' is 0, the quantiles are exact, but
+ * the sketches keep all values in memory. A column with NAs gets NAs
+ * unless `na_rm' is true. It returns NULL if the type of the matrix isn't
+ * supported.
+ */
+fm::dense_matrix::ptr sketch_col_quantiles(fm::dense_matrix::ptr mat,
+		const std::vector<double> &probs, double eps, bool na_rm);
+
+}
+
+#endif
@@ -0,0 +1,605 @@
+/*
+ * Copyright 2015 Open Connectome Project (http://openconnecto.me)
+ *
+ * This file is part of FlashR.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <Rcpp.h>
+
+#include "local_matrix_store.h"
+
+#include "fmr_scan.h"
+
+using namespace fm;
+
+namespace fmr
+{
+
+/*
+ * A scan tells how to summarize a part of a column, how to combine
+ * the value carried from the parts before a part with the summary of
+ * the part, and how to scan a part from the value carried into it.
+ */
+
+/*
+ * The operations of the scans on doubles. Sums and products are
+ * accumulated in long double as R does.
+ */
+struct fp_add
+{
+	typedef long double acc_t;
+	static acc_t init() {
+		return 0;
+	}
+	static acc_t run(acc_t a, acc_t b) {
+		return a + b;
+	}
+};
+
+struct fp_mul
+{
+	typedef long double acc_t;
+	static acc_t init() {
+		return 1;
+	}
+	static acc_t run(acc_t a, acc_t b) {
+		return a * b;
+	}
+};
+
+struct fp_max
+{
+	typedef double acc_t;
+	static acc_t init() {
+		return -INFINITY;
+	}
+	static acc_t run(acc_t a, acc_t b) {
+		// This propagates NA and NaN as R does.
+		if (isnan(a) || isnan(b))
+			return a + b;
+		return a > b ? a : b;
+	}
+};
+
+struct fp_min
+{
+	typedef double acc_t;
+	static acc_t init() {
+		return INFINITY;
+	}
+	static acc_t run(acc_t a, acc_t b) {
+		if (isnan(a) || isnan(b))
+			return a + b;
+		return a < b ? a : b;
+	}
+};
+
+/*
+ * NA and NaN in doubles propagate in the arithmetic, so the summary of
+ * a part is the result of the operation on the part.
+ */
+template<class Op>
+struct fp_scan
+{
+	typedef double val_t;
+	typedef typename Op::acc_t carry_t;
+	typedef typename Op::acc_t summary_t;
+
+	static carry_t init() {
+		return Op::init();
+	}
+	static summary_t summarize(const double *in, size_t len) {
+		summary_t sum = Op::init();
+		for (size_t i = 0; i < len; i++)
+			sum = Op::run(sum, in[i]);
+		return sum;
+	}
+	static carry_t combine(carry_t carry, summary_t sum) {
+		return Op::run(carry, sum);
+	}
+	static void scan(const double *in, size_t len, carry_t carry,
+			double *out) {
+		for (size_t i = 0; i < len; i++) {
+			carry = Op::run(carry, in[i]);
+			out[i] = carry;
+		}
+	}
+};
+
+static inline bool in_int_range(int64_t v)
+{
+	// INT_MIN is NA_INTEGER.
+	return v <= INT_MAX && v > INT_MIN;
+}
+
+/*
+ * The cumulative sum of integers is NA from the first NA or the first sum
+ * that overflows. The summary of a part keeps the range of the sums of
+ * its prefixes, so we know if the part overflows with the value carried
+ * into it.
+ */
+struct int_sum_scan
+{
+	typedef int val_t;
+	struct carry_t
+	{
+		int64_t sum;
+		bool na;
+	};
+	struct summary_t
+	{
+		int64_t sum;
+		int64_t min;
+		int64_t max;
+		bool na;
+	};
+
+	static carry_t init() {
+		carry_t carry = {0, false};
+		return carry;
+	}
+	static summary_t summarize(const int *in, size_t len) {
+		summary_t sum = {0, 0, 0, false};
+		for (size_t i = 0; i < len; i++) {
+			if (in[i] == NA_INTEGER) {
+				sum.na = true;
+				break;
+			}
+			sum.sum += in[i];
+			sum.min = std::min(sum.min, sum.sum);
+			sum.max = std::max(sum.max, sum.sum);
+		}
+		return sum;
+	}
+	static carry_t combine(carry_t carry, const summary_t &sum) {
+		if (carry.na || sum.na || !in_int_range(carry.sum + sum.min)
+				|| !in_int_range(carry.sum + sum.max))
+			carry.na = true;
+		else
+			carry.sum += sum.sum;
+		return carry;
+	}
+	static void scan(const int *in, size_t len, carry_t carry, int *out) {
+		size_t i = 0;
+		if (!carry.na) {
+			int64_t sum = carry.sum;
+			for (; i < len; i++) {
+				if (in[i] == NA_INTEGER)
+					break;
+				sum += in[i];
+				if (!in_int_range(sum))
+					break;
+				out[i] = sum;
+			}
+		}
+		for (; i < len; i++)
+			out[i] = NA_INTEGER;
+	}
+};
+
+struct int_max
+{
+	static int init() {
+		return INT_MIN;
+	}
+	static int run(int a, int b) {
+		return std::max(a, b);
+	}
+};
+
+struct int_min
+{
+	static int init() {
+		return INT_MAX;
+	}
+	static int run(int a, int b) {
+		return std::min(a, b);
+	}
+};
+
+/*
+ * The cumulative maximum or minimum of integers is NA from the first NA.
+ */
+template<class Op>
+struct int_extreme_scan
+{
+	typedef int val_t;
+	struct carry_t
+	{
+		int val;
+		bool na;
+	};
+	typedef carry_t summary_t;
+
+	static carry_t init() {
+		carry_t carry = {Op::init(), false};
+		return carry;
+	}
+	static summary_t summarize(const int *in, size_t len) {
+		summary_t sum = init();
+		for (size_t i = 0; i < len; i++) {
+			if (in[i] == NA_INTEGER) {
+				sum.na = true;
+				break;
+			}
+			sum.val = Op::run(sum.val, in[i]);
+		}
+		return sum;
+	}
+	static carry_t combine(carry_t carry, const summary_t &sum) {
+		carry.na = carry.na || sum.na;
+		carry.val = Op::run(carry.val, sum.val);
+		return carry;
+	}
+	static void scan(const int *in, size_t len, carry_t carry, int *out) {
+		size_t i = 0;
+		if (!carry.na) {
+			for (; i < len && in[i] != NA_INTEGER; i++) {
+				carry.val = Op::run(carry.val, in[i]);
+				out[i] = carry.val;
+			}
+		}
+		for (; i < len; i++)
+			out[i] = NA_INTEGER;
+	}
+};
+
+/*
+ * Get column `j' of a portion of the matrix being scanned. The input of
+ * a transposed operator is the transpose of the matrix, so a column of
+ * the matrix is a row of the input. The column is copied to `buf' if it
+ * isn't stored contiguously.
+ */
+template<class T>
+static const T *get_scan_col(const detail::local_matrix_store &in,
+		bool transposed, size_t j, std::vector<T> &buf)
+{
+	if (!transposed && in.store_layout() == matrix_layout_t::L_COL)
+		return reinterpret_cast<const T *>(
+				dynamic_cast<const detail::local_col_matrix_store &>(
+					in).get_col(j));
+	if (transposed && in.store_layout() == matrix_layout_t::L_ROW)
+		return reinterpret_cast<const T *>(
+				dynamic_cast<const detail::local_row_matrix_store &>(
+					in).get_row(j));
+
+	size_t len = transposed ? in.get_num_cols() : in.get_num_rows();
+	buf.resize(len);
+	for (size_t i = 0; i < len; i++)
+		buf[i] = *reinterpret_cast<const T *>(
+				transposed ? in.get(j, i) : in.get(i, j));
+	return buf.data();
+}
+
+/*
+ * The position and the size of a portion in the matrix being scanned.
+ */
+struct scan_portion
+{
+	off_t start_row;
+	off_t start_col;
+	size_t num_rows;
+	size_t num_cols;
+
+	scan_portion(const detail::local_matrix_store &in, bool transposed) {
+		start_row = transposed ? in.get_global_start_col()
+			: in.get_global_start_row();
+		start_col = transposed ? in.get_global_start_row()
+			: in.get_global_start_col();
+		num_rows = transposed ? in.get_num_cols() : in.get_num_rows();
+		num_cols = transposed ? in.get_num_rows() : in.get_num_cols();
+	}
+};
+
+/*
+ * The values carried into the portions of the first pass. The portions
+ * start at the rows in `starts' and `carries[k]' has the values carried
+ * into all columns at the row `starts[k]'.
+ */
+template<class Scan>
+struct scan_carries
+{
+	std::vector<off_t> starts;
+	std::vector<std::vector<typename Scan::carry_t> > carries;
+
+	scan_carries(size_t ncol) {
+		starts.push_back(0);
+		carries.push_back(std::vector<typename Scan::carry_t>(ncol,
+					Scan::init()));
+	}
+
+	scan_carries() {
+	}
+};
+
+/*
+ * This summarizes the columns of each portion in the first pass.
+ */
+template<class Scan>
+class scan_summary_op: public detail::portion_mapply_op
+{
+	typedef typename Scan::val_t val_t;
+	typedef typename Scan::summary_t summary_t;
+	struct part_summary
+	{
+		off_t start_row;
+		off_t start_col;
+		std::vector<summary_t> sums;
+
+		bool operator<(const part_summary &sum) const {
+			if (start_row != sum.start_row)
+				return start_row < sum.start_row;
+			return start_col < sum.start_col;
+		}
+	};
+	size_t global_ncol;
+	bool transposed;
+	// The summaries of the portions processed by each thread.
+	std::shared_ptr<std::vector<std::vector<part_summary> > > summaries;
+
+	scan_summary_op(size_t global_ncol, bool transposed,
+			std::shared_ptr<std::vector<std::vector<part_summary> > > summaries
+			): detail::portion_mapply_op(0, 0, get_scalar_type<val_t>()) {
+		this->global_ncol = global_ncol;
+		this->transposed = transposed;
+		this->summaries = summaries;
+	}
+public:
+	scan_summary_op(size_t global_ncol): detail::portion_mapply_op(0, 0,
+				get_scalar_type<val_t>()) {
+		this->global_ncol = global_ncol;
+		this->transposed = false;
+		summaries = std::shared_ptr<std::vector<std::vector<part_summary> > >(
+				new std::vector<std::vector<part_summary> >(
+					detail::mem_thread_pool::get_global_num_threads()));
+	}
+
+	virtual detail::portion_mapply_op::const_ptr transpose() const {
+		return detail::portion_mapply_op::const_ptr(new scan_summary_op(
+					global_ncol, !transposed, summaries));
+	}
+
+	virtual void run(
+			const std::vector<detail::local_matrix_store::const_ptr> &ins) const {
+		scan_portion portion(*ins[0], transposed);
+		part_summary part;
+		part.start_row = portion.start_row;
+		part.start_col = portion.start_col;
+		part.sums.resize(portion.num_cols);
+		std::vector<val_t> buf;
+		for (size_t j = 0; j < portion.num_cols; j++)
+			part.sums[j] = Scan::summarize(get_scan_col(*ins[0], transposed, j,
+						buf), portion.num_rows);
+		int thread_id = detail::mem_thread_pool::get_curr_thread_id();
+		(*summaries)[thread_id].push_back(part);
+	}
+
+	/*
+	 * Combine the summaries of the portions in order.
+	 */
+	std::shared_ptr<const scan_carries<Scan> > get_carries() const;
+
+	virtual std::string to_string(
+			const std::vector<detail::matrix_store::const_ptr> &mats) const {
+		return std::string("scan_summary(") + mats[0]->get_name() + ")";
+	}
+
+	virtual bool is_agg() const {
+		return false;
+	}
+};
+
+template<class Scan>
+std::shared_ptr<const scan_carries<Scan> > scan_summary_op<Scan>::get_carries(
+		) const
+{
+	std::vector<part_summary> parts;
+	for (size_t i = 0; i < summaries->size(); i++)
+		parts.insert(parts.end(), (*summaries)[i].begin(),
+				(*summaries)[i].end());
+	std::sort(parts.begin(), parts.end());
+
+	std::shared_ptr<scan_carries<Scan> > carries(new scan_carries<Scan>());
+	std::vector<typename Scan::carry_t> running(global_ncol, Scan::init());
+	for (size_t i = 0; i < parts.size(); i++) {
+		const part_summary &part = parts[i];
+		if (carries->starts.empty()
+				|| carries->starts.back() != part.start_row) {
+			carries->starts.push_back(part.start_row);
+			carries->carries.push_back(running);
+		}
+		std::vector<typename Scan::carry_t> &carry = carries->carries.back();
+		for (size_t j = 0; j < part.sums.size(); j++) {
+			carry[part.start_col + j] = running[part.start_col + j];
+			running[part.start_col + j] = Scan::combine(
+					running[part.start_col + j], part.sums[j]);
+		}
+	}
+	return carries;
+}
+
+/*
+ * This scans each portion from the values carried into it in the second
+ * pass. A portion may not start at a portion of the first pass, e.g., when
+ * we get a subset of the rows of the result, so we summarize the rows
+ * between the start of the portion of the first pass and the portion.
+ */
+template<class Scan>
+class scan_portion_op: public detail::portion_mapply_op
+{
+	typedef typename Scan::val_t val_t;
+	typedef typename Scan::carry_t carry_t;
+	// The matrix being scanned in col-major order.
+	detail::matrix_store::const_ptr in_store;
+	std::shared_ptr<const scan_carries<Scan> > carries;
+	bool transposed;
+
+	bool get_carries(const scan_portion &portion,
+			std::vector<carry_t> &res) const;
+public:
+	scan_portion_op(size_t out_num_rows, size_t out_num_cols,
+			detail::matrix_store::const_ptr in_store,
+			std::shared_ptr<const scan_carries<Scan> > carries,
+			bool transposed): detail::portion_mapply_op(out_num_rows,
+				out_num_cols, get_scalar_type<val_t>()) {
+		this->in_store = in_store;
+		this->carries = carries;
+		this->transposed = transposed;
+	}
+
+	virtual detail::portion_mapply_op::const_ptr transpose() const {
+		return detail::portion_mapply_op::const_ptr(new scan_portion_op(
+					get_out_num_cols(), get_out_num_rows(), in_store, carries,
+					!transposed));
+	}
+
+	virtual void run(
+			const std::vector<detail::local_matrix_store::const_ptr> &ins,
+			detail::local_matrix_store &out) const;
+
+	virtual std::string to_string(
+			const std::vector<detail::matrix_store::const_ptr> &mats) const {
+		return std::string("scan(") + mats[0]->get_name() + ")";
+	}
+};
+
+template<class Scan>
+bool scan_portion_op<Scan>::get_carries(const scan_portion &portion,
+		std::vector<carry_t> &res) const
+{
+	size_t k = std::upper_bound(carries->starts.begin(),
+			carries->starts.end(), portion.start_row)
+		- carries->starts.begin() - 1;
+	off_t part_start = carries->starts[k];
+	res.assign(carries->carries[k].begin() + portion.start_col,
+			carries->carries[k].begin() + portion.start_col + portion.num_cols);
+	if (portion.start_row == part_start)
+		return true;
+
+	detail::local_matrix_store::const_ptr prefix = in_store->get_portion(
+			part_start, portion.start_col, portion.start_row - part_start,
+			portion.num_cols);
+	if (prefix == NULL) {
+		fprintf(stderr, "can't get the rows before a portion to scan\n");
+		return false;
+	}
+	std::vector<val_t> buf;
+	for (size_t j = 0; j < portion.num_cols; j++)
+		res[j] = Scan::combine(res[j], Scan::summarize(
+					get_scan_col(*prefix, false, j, buf),
+					prefix->get_num_rows()));
+	return true;
+}
+
+template<class Scan>
+void scan_portion_op<Scan>::run(
+		const std::vector<detail::local_matrix_store::const_ptr> &ins,
+		detail::local_matrix_store &out) const
+{
+	scan_portion portion(*ins[0], transposed);
+	std::vector<carry_t> carry;
+	if (!get_carries(portion, carry))
+		return;
+
+	// A column of the matrix is a column of the output if the output is
+	// col-major, or a row of the output if it's row-major and transposed.
+	val_t *res = reinterpret_cast<val_t *>(out.get_raw_arr());
+	bool out_col_major = out.store_layout() == matrix_layout_t::L_COL;
+	bool contig = out_col_major != transposed;
+	std::vector<val_t> in_buf;
+	std::vector<val_t> out_buf(contig ? 0 : portion.num_rows);
+	for (size_t j = 0; j < portion.num_cols; j++) {
+		const val_t *in_col = get_scan_col(*ins[0], transposed, j, in_buf);
+		val_t *out_col = contig ? res + j * portion.num_rows : out_buf.data();
+		Scan::scan(in_col, portion.num_rows, carry[j], out_col);
+		if (contig)
+			continue;
+		// Element i of column j is at (i, j) in the output, or (j, i) if
+		// the output is transposed.
+		for (size_t i = 0; i < portion.num_rows; i++) {
+			size_t row = transposed ? j : i;
+			size_t col = transposed ? i : j;
+			if (out_col_major)
+				res[row + col * out.get_num_rows()] = out_buf[i];
+			else
+				res[row * out.get_num_cols() + col] = out_buf[i];
+		}
+	}
+}
+
+template<class Scan>
+static dense_matrix::ptr scan_cols(dense_matrix::ptr mat)
+{
+	if (mat->store_layout() != matrix_layout_t::L_COL)
+		mat = mat->conv2(matrix_layout_t::L_COL);
+	std::vector<detail::matrix_store::const_ptr> stores(1,
+			mat->get_raw_store());
+	std::shared_ptr<const scan_carries<Scan> > carries(
+			new scan_carries<Scan>(mat->get_num_cols()));
+	// A wide matrix or a small matrix has all rows in a portion.
+	if (mat->get_data().get_portion_size().first < mat->get_num_rows()) {
+		std::shared_ptr<scan_summary_op<Scan> > op(
+				new scan_summary_op<Scan>(mat->get_num_cols()));
+		detail::__mapply_portion(stores, op, matrix_layout_t::L_COL);
+		carries = op->get_carries();
+	}
+	detail::portion_mapply_op::const_ptr op(new scan_portion_op<Scan>(
+				mat->get_num_rows(), mat->get_num_cols(), stores[0], carries,
+				false));
+	detail::matrix_store::ptr res = detail::__mapply_portion_virtual(stores,
+			op, matrix_layout_t::L_COL);
+	if (res == NULL)
+		return dense_matrix::ptr();
+	return dense_matrix::create(res);
+}
+
+dense_matrix::ptr scan_cols(dense_matrix::ptr mat, scan_op_t op)
+{
+	if (mat->get_type() == get_scalar_type<double>()) {
+		switch (op) {
+			case SCAN_SUM:
+				return scan_cols<fp_scan<fp_add> >(mat);
+			case SCAN_PROD:
+				return scan_cols<fp_scan<fp_mul> >(mat);
+			case SCAN_MAX:
+				return scan_cols<fp_scan<fp_max> >(mat);
+			case SCAN_MIN:
+				return scan_cols<fp_scan<fp_min> >(mat);
+		}
+	}
+	else if (mat->get_type() == get_scalar_type<int>()) {
+		switch (op) {
+			case SCAN_SUM:
+				return scan_cols<int_sum_scan>(mat);
+			case SCAN_MAX:
+				return scan_cols<int_extreme_scan<int_max> >(mat);
+			case SCAN_MIN:
+				return scan_cols<int_extreme_scan<int_min> >(mat);
+			default:
+				break;
+		}
+	}
+	return dense_matrix::ptr();
+}
+
+}
@@ -0,0 +1,59 @@
+#ifndef __FMR_SCAN_H__
+#define __FMR_SCAN_H__
+
+/*
+ * Copyright 2015 Open Connectome Project (http://openconnecto.me)
+ *
+ * This file is part of FlashR.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "dense_matrix.h"
+
+/*
+ * This file computes cumulative sums, products, maxima and minima of
+ * the columns of a matrix in parallel.
+ *
+ * A portion of a tall matrix has only some of the rows, so the scan of
+ * a portion depends on the portions before it. We scan a matrix in two
+ * passes. The first pass summarizes each portion, e.g., gets the sums of
+ * its columns. We combine the summaries of the portions in order to get
+ * the values carried into each portion. The second pass scans each portion
+ * from the values carried into it. The second pass is lazily evaluated,
+ * so it works on matrices in memory and on disks.
+ */
+
+namespace fmr
+{
+
+enum scan_op_t
+{
+	SCAN_SUM,
+	SCAN_PROD,
+	SCAN_MAX,
+	SCAN_MIN,
+};
+
+/*
+ * Scan the columns of a matrix as R's cumsum, cumprod, cummax and cummin.
+ * An NA in integers makes the rest of the column NA, so does an integer
+ * overflow in a sum. NA and NaN in doubles propagate as in R. The products
+ * of integers should be computed on doubles, as R does. It returns NULL if
+ * the type of the matrix isn't supported.
+ */
+fm::dense_matrix::ptr scan_cols(fm::dense_matrix::ptr mat, scan_op_t op);
+
+}
+
+#endif
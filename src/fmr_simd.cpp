@@ -0,0 +1,2580 @@
+/*
+ * Copyright 2015 Open Connectome Project (http://openconnecto.me)
+ *
+ * This file is part of FlashR.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include "fmr_simd.h"
+
+/*
+ * We compile the kernels for a specific instruction set with the target
+ * pragma, so the package itself doesn't need to be compiled with -mavx2.
+ * Other compilers only get the scalar path.
+ */
+#if defined(__GNUC__) && !defined(__clang__) && !defined(__INTEL_COMPILER) \
+	&& (defined(__x86_64__) || defined(__i386__))
+#define FMR_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace fmr
+{
+
+namespace simd
+{
+
+/*
+ * The environment variable FLASHR_SIMD can lower the instruction set
+ * (scalar, avx2 or avx512). It's mainly used for testing and benchmarking.
+ */
+static isa_t detect_isa()
+{
+	isa_t isa = ISA_SCALAR;
+#ifdef FMR_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		isa = ISA_AVX512;
+	else if (__builtin_cpu_supports("avx2"))
+		isa = ISA_AVX2;
+#endif
+	const char *env = getenv("FLASHR_SIMD");
+	if (env == NULL)
+		return isa;
+	if (strcmp(env, "scalar") == 0)
+		return ISA_SCALAR;
+	else if (strcmp(env, "avx2") == 0 && isa >= ISA_AVX2)
+		return ISA_AVX2;
+	return isa;
+}
+
+isa_t get_isa()
+{
+	static isa_t isa = detect_isa();
+	return isa;
+}
+
+const char *get_isa_name(isa_t isa)
+{
+	switch (isa) {
+		case ISA_AVX512: return "avx512";
+		case ISA_AVX2: return "avx2";
+		default: return "scalar";
+	}
+}
+
+/*
+ * R's NA values. We can't include R headers here, so we define them
+ * the same way as R does.
+ */
+static const int NA_INT = INT_MIN;
+static const uint64_t NA_REAL_BITS = 0x7FF00000000007A2ULL;
+static const uint64_t NA_REAL_PAYLOAD = 1954;
+
+static inline double get_na_real()
+{
+	double v;
+	memcpy(&v, &NA_REAL_BITS, sizeof(v));
+	return v;
+}
+
+static inline bool is_na_real(double v)
+{
+	uint64_t bits;
+	memcpy(&bits, &v, sizeof(v));
+	return std::isnan(v) && (bits & 0xFFFFFFFFULL) == NA_REAL_PAYLOAD;
+}
+
+/*
+ * Integer arithmetic outputs NA if the result overflows as R does.
+ * NA itself is out of the range of R integers.
+ */
+static inline int int_result(int64_t res)
+{
+	return res > INT_MAX || res < -INT_MAX ? NA_INT : (int) res;
+}
+
+/*
+ * The scalar version of the operators. They are used to compute
+ * the elements at the end of an array that don't fill a register.
+ */
+template<na_bop_t op>
+struct scalar_op
+{
+};
+
+template<>
+struct scalar_op<NA_ADD>
+{
+	static int run(int e1, int e2) {
+		return int_result((int64_t) e1 + e2);
+	}
+	static double run(double e1, double e2) {
+		return e1 + e2;
+	}
+};
+
+template<>
+struct scalar_op<NA_SUB>
+{
+	static int run(int e1, int e2) {
+		return int_result((int64_t) e1 - e2);
+	}
+	static double run(double e1, double e2) {
+		return e1 - e2;
+	}
+};
+
+template<>
+struct scalar_op<NA_MUL>
+{
+	static int run(int e1, int e2) {
+		return int_result((int64_t) e1 * e2);
+	}
+	static double run(double e1, double e2) {
+		return e1 * e2;
+	}
+};
+
+template<>
+struct scalar_op<NA_DIV>
+{
+	static double run(double e1, double e2) {
+		return e1 / e2;
+	}
+};
+
+template<>
+struct scalar_op<NA_EQ>
+{
+	template<class T>
+	static int run(T e1, T e2) {
+		return e1 == e2;
+	}
+};
+
+template<>
+struct scalar_op<NA_NEQ>
+{
+	template<class T>
+	static int run(T e1, T e2) {
+		return e1 != e2;
+	}
+};
+
+template<>
+struct scalar_op<NA_GT>
+{
+	template<class T>
+	static int run(T e1, T e2) {
+		return e1 > e2;
+	}
+};
+
+template<>
+struct scalar_op<NA_GE>
+{
+	template<class T>
+	static int run(T e1, T e2) {
+		return e1 >= e2;
+	}
+};
+
+template<>
+struct scalar_op<NA_LT>
+{
+	template<class T>
+	static int run(T e1, T e2) {
+		return e1 < e2;
+	}
+};
+
+template<>
+struct scalar_op<NA_LE>
+{
+	template<class T>
+	static int run(T e1, T e2) {
+		return e1 <= e2;
+	}
+};
+
+/*
+ * The operand at `idx'. It's always the first element if the operand
+ * is a single element.
+ */
+template<operand_t type, bool is_left, class T>
+static inline T get_operand(const T *arr, size_t idx)
+{
+	if ((type == EA && is_left) || (type == AE && !is_left))
+		return arr[0];
+	else
+		return arr[idx];
+}
+
+template<na_bop_t op>
+static inline int scalar_int_arith(int e1, int e2)
+{
+	return e1 == NA_INT || e2 == NA_INT ? NA_INT : scalar_op<op>::run(e1, e2);
+}
+
+template<na_bop_t op>
+static inline double scalar_int_div(int e1, int e2)
+{
+	return e1 == NA_INT || e2 == NA_INT ? get_na_real()
+		: scalar_op<op>::run((double) e1, (double) e2);
+}
+
+template<na_bop_t op>
+static inline double scalar_real_arith(double e1, double e2)
+{
+	return is_na_real(e1) || is_na_real(e2) ? get_na_real()
+		: scalar_op<op>::run(e1, e2);
+}
+
+/*
+ * Comparison on doubles returns NA if any of the operands is NaN.
+ */
+template<na_bop_t op>
+static inline int scalar_real_cmp(double e1, double e2)
+{
+	return std::isnan(e1) || std::isnan(e2) ? NA_INT
+		: scalar_op<op>::run(e1, e2);
+}
+
+template<na_bop_t op, operand_t type>
+static void scalar_int_arith(size_t num_eles, size_t start, const int *left,
+		const int *right, int *out)
+{
+	for (size_t i = start; i < num_eles; i++)
+		out[i] = scalar_int_arith<op>(get_operand<type, true>(left, i),
+				get_operand<type, false>(right, i));
+}
+
+template<na_bop_t op, operand_t type>
+static void scalar_int_div(size_t num_eles, size_t start, const int *left,
+		const int *right, double *out)
+{
+	for (size_t i = start; i < num_eles; i++)
+		out[i] = scalar_int_div<op>(get_operand<type, true>(left, i),
+				get_operand<type, false>(right, i));
+}
+
+template<na_bop_t op, operand_t type>
+static void scalar_real_arith(size_t num_eles, size_t start,
+		const double *left, const double *right, double *out)
+{
+	for (size_t i = start; i < num_eles; i++)
+		out[i] = scalar_real_arith<op>(get_operand<type, true>(left, i),
+				get_operand<type, false>(right, i));
+}
+
+template<na_bop_t op, operand_t type>
+static void scalar_real_cmp(size_t num_eles, size_t start,
+		const double *left, const double *right, int *out)
+{
+	for (size_t i = start; i < num_eles; i++)
+		out[i] = scalar_real_cmp<op>(get_operand<type, true>(left, i),
+				get_operand<type, false>(right, i));
+}
+
+/*
+ * The kernels for each instruction set. `int_kernel' computes integer
+ * arithmetic and comparison, `int_div_kernel' computes integer division,
+ * `real_kernel' computes double arithmetic and `real_cmp_kernel' computes
+ * double comparison.
+ */
+template<isa_t isa, na_bop_t op, operand_t type>
+struct int_kernel
+{
+};
+
+template<isa_t isa, na_bop_t op, operand_t type>
+struct int_div_kernel
+{
+};
+
+template<isa_t isa, na_bop_t op, operand_t type>
+struct real_kernel
+{
+};
+
+template<isa_t isa, na_bop_t op, operand_t type>
+struct real_cmp_kernel
+{
+};
+
+/*
+ * The scalar version of the unary math functions.
+ */
+template<na_uop_t op>
+static inline double scalar_math(double v);
+
+template<>
+inline double scalar_math<NA_SQRT>(double v)
+{
+	return std::sqrt(v);
+}
+
+template<>
+inline double scalar_math<NA_LOG>(double v)
+{
+	return std::log(v);
+}
+
+template<>
+inline double scalar_math<NA_LOG2>(double v)
+{
+	return std::log2(v);
+}
+
+template<>
+inline double scalar_math<NA_LOG10>(double v)
+{
+	return std::log10(v);
+}
+
+template<>
+inline double scalar_math<NA_LOG1P>(double v)
+{
+	return std::log1p(v);
+}
+
+template<>
+inline double scalar_math<NA_EXP>(double v)
+{
+	return std::exp(v);
+}
+
+template<na_uop_t op>
+static void scalar_real_urun(size_t num_eles, size_t start, const double *in,
+		double *out)
+{
+	for (size_t i = start; i < num_eles; i++) {
+		if (is_na_real(in[i]))
+			out[i] = get_na_real();
+		else if (std::isnan(in[i]))
+			out[i] = in[i];
+		else
+			out[i] = scalar_math<op>(in[i]);
+	}
+}
+
+/*
+ * `real_ukernel' computes a unary math function on doubles.
+ */
+template<isa_t isa, na_uop_t op>
+struct real_ukernel
+{
+};
+
+/*
+ * An integer input is converted to doubles in the output array first,
+ * and then we compute the math function in place.
+ */
+template<isa_t isa, na_uop_t op>
+struct int_ukernel
+{
+	static void run(size_t num_eles, const int *in, double *out) {
+		const double na = get_na_real();
+		for (size_t i = 0; i < num_eles; i++)
+			out[i] = in[i] == NA_INT ? na : in[i];
+		real_ukernel<isa, op>::run(num_eles, out, out);
+	}
+};
+
+/*
+ * The scalar version of type casts.
+ */
+static inline double scalar_int2real(int v)
+{
+	return v == NA_INT ? get_na_real() : v;
+}
+
+static inline int scalar_real2int(double v)
+{
+	if (std::isnan(v) || v >= 2147483648.0 || v <= -2147483648.0)
+		return NA_INT;
+	else
+		return (int) v;
+}
+
+static inline int scalar_real2logical(double v)
+{
+	return std::isnan(v) ? NA_INT : v != 0;
+}
+
+static inline int scalar_int2logical(int v)
+{
+	return v == NA_INT ? NA_INT : v != 0;
+}
+
+template<class InType, class OutType, OutType (*cast)(InType)>
+static void scalar_cast(size_t num_eles, size_t start, const InType *in,
+		OutType *out)
+{
+	for (size_t i = start; i < num_eles; i++)
+		out[i] = cast(in[i]);
+}
+
+/*
+ * The scalar version of which.min and which.max.
+ */
+static inline bool is_missing(int v)
+{
+	return v == NA_INT;
+}
+
+static inline bool is_missing(double v)
+{
+	return std::isnan(v);
+}
+
+template<bool is_max, class T>
+static inline bool is_better(T v, T best)
+{
+	return is_max ? v > best : v < best;
+}
+
+/*
+ * Search the elements in [start, end). `best_idx' is -1 if we haven't
+ * found any element that isn't NA.
+ */
+template<bool is_max, class T>
+static void scalar_which(const T *arr, size_t start, size_t end, T &best,
+		ssize_t &best_idx)
+{
+	for (size_t i = start; i < end; i++) {
+		if (!is_missing(arr[i])
+				&& (best_idx < 0 || is_better<is_max>(arr[i], best))) {
+			best = arr[i];
+			best_idx = i;
+		}
+	}
+}
+
+/*
+ * Merge the results of SIMD lanes. Each lane has found its first best
+ * element, so we choose the smallest index among the lanes with the best
+ * value.
+ */
+template<bool is_max, class T, class IdxType>
+static void merge_lanes(const T *vals, const IdxType *idxs, size_t num_lanes,
+		T &best, ssize_t &best_idx)
+{
+	for (size_t k = 0; k < num_lanes; k++) {
+		ssize_t idx = idxs[k];
+		if (is_better<is_max>(vals[k], best)
+				|| (vals[k] == best && idx < best_idx)) {
+			best = vals[k];
+			best_idx = idx;
+		}
+	}
+}
+
+template<bool is_max, class T>
+static void scalar_row_which(const T *mat, size_t start_row, size_t nrow,
+		size_t ncol, bool row_major, int *out)
+{
+	for (size_t i = start_row; i < nrow; i++) {
+		T best = 0;
+		ssize_t best_idx = -1;
+		for (size_t j = 0; j < ncol; j++) {
+			T v = row_major ? mat[i * ncol + j] : mat[i + j * nrow];
+			if (!is_missing(v)
+					&& (best_idx < 0 || is_better<is_max>(v, best))) {
+				best = v;
+				best_idx = j;
+			}
+		}
+		out[i] = best_idx < 0 ? NA_INT : best_idx + 1;
+	}
+}
+
+/*
+ * The scalar version of the nearest-center search.
+ */
+static inline double get_ele(const double *data, size_t nrow, size_t ncol,
+		bool row_major, size_t i, size_t j)
+{
+	return row_major ? data[i * ncol + j] : data[i + j * nrow];
+}
+
+/*
+ * Merge the nearest centers found by SIMD lanes of a row, search the rest
+ * of the centers from `start_center' and write the result of the row.
+ * An index in `idxs' is negative if the lane hasn't found a center.
+ */
+static void scalar_nearest_finish(const double *data, size_t nrow,
+		size_t ncol, bool row_major, size_t i, const double *centers,
+		size_t num_centers, size_t start_center, const double *bests,
+		const double *idxs, size_t num_lanes, int *idx, double *dist)
+{
+	double best = 0;
+	ssize_t best_idx = -1;
+	for (size_t k = 0; k < num_lanes; k++) {
+		if (idxs[k] < 0)
+			continue;
+		if (best_idx < 0 || bests[k] < best
+				|| (bests[k] == best && idxs[k] < best_idx)) {
+			best = bests[k];
+			best_idx = idxs[k];
+		}
+	}
+	for (size_t c = start_center; c < num_centers; c++) {
+		double sum = 0;
+		for (size_t j = 0; j < ncol; j++) {
+			double diff = get_ele(data, nrow, ncol, row_major, i, j)
+				- centers[c + j * num_centers];
+			sum += diff * diff;
+		}
+		if (!std::isnan(sum) && (best_idx < 0 || sum < best)) {
+			best = sum;
+			best_idx = c;
+		}
+	}
+	idx[i] = best_idx < 0 ? NA_INT : best_idx + 1;
+	if (dist)
+		dist[i] = best_idx < 0 ? get_na_real() : best;
+}
+
+/*
+ * We transpose a matrix in tiles. A tile of 32x32 doubles or 64x64 integers
+ * and the part of the output it's copied to both fit in L1 cache.
+ */
+template<class T>
+struct transpose_tile_len
+{
+	static const size_t value = 256 / sizeof(T);
+};
+
+/*
+ * Transpose a tile of a row-major block to a column-major block.
+ */
+template<class T>
+static void scalar_transpose_tile(const T *in, size_t nrow, size_t ncol,
+		size_t in_ld, T *out, size_t out_ld)
+{
+	for (size_t j = 0; j < ncol; j++)
+		for (size_t i = 0; i < nrow; i++)
+			out[i + j * out_ld] = in[i * in_ld + j];
+}
+
+#ifdef FMR_X86_SIMD
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+namespace avx2
+{
+
+/*
+ * Integer operations. A comparison returns a mask where a true lane
+ * has all bits set.
+ */
+template<na_bop_t op>
+struct vop
+{
+};
+
+template<>
+struct vop<NA_ADD>
+{
+	static __m256i run(__m256i e1, __m256i e2) {
+		return _mm256_add_epi32(e1, e2);
+	}
+	static __m256d run(__m256d e1, __m256d e2) {
+		return _mm256_add_pd(e1, e2);
+	}
+};
+
+template<>
+struct vop<NA_SUB>
+{
+	static __m256i run(__m256i e1, __m256i e2) {
+		return _mm256_sub_epi32(e1, e2);
+	}
+	static __m256d run(__m256d e1, __m256d e2) {
+		return _mm256_sub_pd(e1, e2);
+	}
+};
+
+template<>
+struct vop<NA_MUL>
+{
+	static __m256i run(__m256i e1, __m256i e2) {
+		return _mm256_mullo_epi32(e1, e2);
+	}
+	static __m256d run(__m256d e1, __m256d e2) {
+		return _mm256_mul_pd(e1, e2);
+	}
+};
+
+template<>
+struct vop<NA_DIV>
+{
+	static __m256d run(__m256d e1, __m256d e2) {
+		return _mm256_div_pd(e1, e2);
+	}
+};
+
+template<>
+struct vop<NA_EQ>
+{
+	static __m256i run(__m256i e1, __m256i e2) {
+		return _mm256_cmpeq_epi32(e1, e2);
+	}
+	static __m256d run(__m256d e1, __m256d e2) {
+		return _mm256_cmp_pd(e1, e2, _CMP_EQ_OQ);
+	}
+};
+
+template<>
+struct vop<NA_NEQ>
+{
+	static __m256i run(__m256i e1, __m256i e2) {
+		return _mm256_xor_si256(_mm256_cmpeq_epi32(e1, e2),
+				_mm256_set1_epi32(-1));
+	}
+	static __m256d run(__m256d e1, __m256d e2) {
+		return _mm256_cmp_pd(e1, e2, _CMP_NEQ_OQ);
+	}
+};
+
+template<>
+struct vop<NA_GT>
+{
+	static __m256i run(__m256i e1, __m256i e2) {
+		return _mm256_cmpgt_epi32(e1, e2);
+	}
+	static __m256d run(__m256d e1, __m256d e2) {
+		return _mm256_cmp_pd(e1, e2, _CMP_GT_OQ);
+	}
+};
+
+template<>
+struct vop<NA_GE>
+{
+	static __m256i run(__m256i e1, __m256i e2) {
+		return _mm256_xor_si256(_mm256_cmpgt_epi32(e2, e1),
+				_mm256_set1_epi32(-1));
+	}
+	static __m256d run(__m256d e1, __m256d e2) {
+		return _mm256_cmp_pd(e1, e2, _CMP_GE_OQ);
+	}
+};
+
+template<>
+struct vop<NA_LT>
+{
+	static __m256i run(__m256i e1, __m256i e2) {
+		return _mm256_cmpgt_epi32(e2, e1);
+	}
+	static __m256d run(__m256d e1, __m256d e2) {
+		return _mm256_cmp_pd(e1, e2, _CMP_LT_OQ);
+	}
+};
+
+template<>
+struct vop<NA_LE>
+{
+	static __m256i run(__m256i e1, __m256i e2) {
+		return _mm256_xor_si256(_mm256_cmpgt_epi32(e1, e2),
+				_mm256_set1_epi32(-1));
+	}
+	static __m256d run(__m256d e1, __m256d e2) {
+		return _mm256_cmp_pd(e1, e2, _CMP_LE_OQ);
+	}
+};
+
+static inline bool is_cmp(na_bop_t op)
+{
+	return op >= NA_EQ;
+}
+
+/*
+ * The lanes where integer arithmetic overflows. Addition overflows if
+ * the result has a different sign from both operands, and subtraction
+ * overflows if the operands have different signs and the result has
+ * a different sign from the first operand. We detect the overflow of
+ * multiplication in doubles, which are exact in the range of integers.
+ */
+template<na_bop_t op>
+static inline __m256i overflow(__m256i, __m256i, __m256i)
+{
+	return _mm256_setzero_si256();
+}
+
+template<>
+inline __m256i overflow<NA_ADD>(__m256i e1, __m256i e2, __m256i res)
+{
+	__m256i v = _mm256_and_si256(_mm256_xor_si256(e1, res),
+			_mm256_xor_si256(e2, res));
+	return _mm256_srai_epi32(v, 31);
+}
+
+template<>
+inline __m256i overflow<NA_SUB>(__m256i e1, __m256i e2, __m256i res)
+{
+	__m256i v = _mm256_and_si256(_mm256_xor_si256(e1, e2),
+			_mm256_xor_si256(e1, res));
+	return _mm256_srai_epi32(v, 31);
+}
+
+static inline __m128i mul_overflow4(__m128i e1, __m128i e2)
+{
+	const __m256d max = _mm256_set1_pd(INT_MAX);
+	__m256d prod = _mm256_mul_pd(_mm256_cvtepi32_pd(e1),
+			_mm256_cvtepi32_pd(e2));
+	__m256d abs = _mm256_andnot_pd(_mm256_set1_pd(-0.0), prod);
+	__m256i mask = _mm256_castpd_si256(_mm256_cmp_pd(abs, max, _CMP_GT_OQ));
+	// Pack the lower 32 bits of each 64-bit lane.
+	mask = _mm256_permutevar8x32_epi32(mask,
+			_mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7));
+	return _mm256_castsi256_si128(mask);
+}
+
+template<>
+inline __m256i overflow<NA_MUL>(__m256i e1, __m256i e2, __m256i)
+{
+	__m128i lo = mul_overflow4(_mm256_castsi256_si128(e1),
+			_mm256_castsi256_si128(e2));
+	__m128i hi = mul_overflow4(_mm256_extracti128_si256(e1, 1),
+			_mm256_extracti128_si256(e2, 1));
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+
+template<operand_t type, bool is_left>
+static inline __m256i load_int(const int *arr, size_t idx, __m256i single)
+{
+	if ((type == EA && is_left) || (type == AE && !is_left))
+		return single;
+	else
+		return _mm256_loadu_si256((const __m256i *) (arr + idx));
+}
+
+template<operand_t type, bool is_left>
+static inline __m128i load_int4(const int *arr, size_t idx, __m128i single)
+{
+	if ((type == EA && is_left) || (type == AE && !is_left))
+		return single;
+	else
+		return _mm_loadu_si128((const __m128i *) (arr + idx));
+}
+
+template<operand_t type, bool is_left>
+static inline __m256d load_real(const double *arr, size_t idx, __m256d single)
+{
+	if ((type == EA && is_left) || (type == AE && !is_left))
+		return single;
+	else
+		return _mm256_loadu_pd(arr + idx);
+}
+
+/*
+ * Set the lanes that contain R's NA to all ones.
+ */
+static inline __m256d is_na(__m256d v)
+{
+	__m256d nan = _mm256_cmp_pd(v, v, _CMP_UNORD_Q);
+	__m256i low = _mm256_and_si256(_mm256_castpd_si256(v),
+			_mm256_set1_epi64x(0xFFFFFFFFLL));
+	__m256i payload = _mm256_cmpeq_epi64(low,
+			_mm256_set1_epi64x(NA_REAL_PAYLOAD));
+	return _mm256_and_pd(nan, _mm256_castsi256_pd(payload));
+}
+
+/*
+ * Pack the lower 32 bits of each 64-bit lane into a 128-bit register.
+ */
+static inline __m128i pack_mask(__m256d mask)
+{
+	__m256i v = _mm256_permutevar8x32_epi32(_mm256_castpd_si256(mask),
+			_mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7));
+	return _mm256_castsi256_si128(v);
+}
+
+template<na_bop_t op, operand_t type>
+static void int_run(size_t num_eles, const int *left, const int *right,
+		int *out)
+{
+	if (num_eles == 0)
+		return;
+	const __m256i na = _mm256_set1_epi32(NA_INT);
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256i single_left = _mm256_set1_epi32(left[0]);
+	const __m256i single_right = _mm256_set1_epi32(right[0]);
+	size_t i = 0;
+	for (; i + 8 <= num_eles; i += 8) {
+		__m256i e1 = load_int<type, true>(left, i, single_left);
+		__m256i e2 = load_int<type, false>(right, i, single_right);
+		__m256i na_mask = _mm256_or_si256(_mm256_cmpeq_epi32(e1, na),
+				_mm256_cmpeq_epi32(e2, na));
+		__m256i res = vop<op>::run(e1, e2);
+		// Comparison outputs logicals.
+		if (is_cmp(op))
+			res = _mm256_and_si256(res, one);
+		else
+			na_mask = _mm256_or_si256(na_mask, overflow<op>(e1, e2, res));
+		res = _mm256_blendv_epi8(res, na, na_mask);
+		_mm256_storeu_si256((__m256i *) (out + i), res);
+	}
+	scalar_int_arith<op, type>(num_eles, i, left, right, out);
+}
+
+template<na_bop_t op, operand_t type>
+static void int_div_run(size_t num_eles, const int *left, const int *right,
+		double *out)
+{
+	if (num_eles == 0)
+		return;
+	const __m128i na = _mm_set1_epi32(NA_INT);
+	const __m256d na_real = _mm256_set1_pd(get_na_real());
+	const __m128i single_left = _mm_set1_epi32(left[0]);
+	const __m128i single_right = _mm_set1_epi32(right[0]);
+	size_t i = 0;
+	for (; i + 4 <= num_eles; i += 4) {
+		__m128i e1 = load_int4<type, true>(left, i, single_left);
+		__m128i e2 = load_int4<type, false>(right, i, single_right);
+		__m128i na_mask = _mm_or_si128(_mm_cmpeq_epi32(e1, na),
+				_mm_cmpeq_epi32(e2, na));
+		__m256d res = vop<op>::run(_mm256_cvtepi32_pd(e1),
+				_mm256_cvtepi32_pd(e2));
+		res = _mm256_blendv_pd(res, na_real,
+				_mm256_castsi256_pd(_mm256_cvtepi32_epi64(na_mask)));
+		_mm256_storeu_pd(out + i, res);
+	}
+	scalar_int_div<op, type>(num_eles, i, left, right, out);
+}
+
+template<na_bop_t op, operand_t type>
+static void real_run(size_t num_eles, const double *left,
+		const double *right, double *out)
+{
+	if (num_eles == 0)
+		return;
+	const __m256d na_real = _mm256_set1_pd(get_na_real());
+	const __m256d single_left = _mm256_set1_pd(left[0]);
+	const __m256d single_right = _mm256_set1_pd(right[0]);
+	size_t i = 0;
+	for (; i + 4 <= num_eles; i += 4) {
+		__m256d e1 = load_real<type, true>(left, i, single_left);
+		__m256d e2 = load_real<type, false>(right, i, single_right);
+		__m256d res = vop<op>::run(e1, e2);
+		res = _mm256_blendv_pd(res, na_real,
+				_mm256_or_pd(is_na(e1), is_na(e2)));
+		_mm256_storeu_pd(out + i, res);
+	}
+	scalar_real_arith<op, type>(num_eles, i, left, right, out);
+}
+
+template<na_bop_t op, operand_t type>
+static void real_cmp_run(size_t num_eles, const double *left,
+		const double *right, int *out)
+{
+	if (num_eles == 0)
+		return;
+	const __m128i na = _mm_set1_epi32(NA_INT);
+	const __m128i one = _mm_set1_epi32(1);
+	const __m256d single_left = _mm256_set1_pd(left[0]);
+	const __m256d single_right = _mm256_set1_pd(right[0]);
+	size_t i = 0;
+	for (; i + 4 <= num_eles; i += 4) {
+		__m256d e1 = load_real<type, true>(left, i, single_left);
+		__m256d e2 = load_real<type, false>(right, i, single_right);
+		__m128i res = _mm_and_si128(pack_mask(vop<op>::run(e1, e2)), one);
+		__m128i nan = pack_mask(_mm256_cmp_pd(e1, e2, _CMP_UNORD_Q));
+		res = _mm_blendv_epi8(res, na, nan);
+		_mm_storeu_si128((__m128i *) (out + i), res);
+	}
+	scalar_real_cmp<op, type>(num_eles, i, left, right, out);
+}
+
+/*
+ * We test NA in blocks so that we can stop early once we find one.
+ */
+static bool contain_na(const int *arr, size_t num_eles)
+{
+	const __m256i na = _mm256_set1_epi32(NA_INT);
+	size_t i = 0;
+	for (; i + 32 <= num_eles; i += 32) {
+		const __m256i *p = (const __m256i *) (arr + i);
+		__m256i m = _mm256_or_si256(
+				_mm256_or_si256(_mm256_cmpeq_epi32(_mm256_loadu_si256(p), na),
+					_mm256_cmpeq_epi32(_mm256_loadu_si256(p + 1), na)),
+				_mm256_or_si256(_mm256_cmpeq_epi32(_mm256_loadu_si256(p + 2), na),
+					_mm256_cmpeq_epi32(_mm256_loadu_si256(p + 3), na)));
+		if (!_mm256_testz_si256(m, m))
+			return true;
+	}
+	for (; i < num_eles; i++)
+		if (arr[i] == NA_INT)
+			return true;
+	return false;
+}
+
+static bool contain_nan(const double *arr, size_t num_eles)
+{
+	size_t i = 0;
+	for (; i + 16 <= num_eles; i += 16) {
+		__m256d v1 = _mm256_loadu_pd(arr + i);
+		__m256d v2 = _mm256_loadu_pd(arr + i + 4);
+		__m256d v3 = _mm256_loadu_pd(arr + i + 8);
+		__m256d v4 = _mm256_loadu_pd(arr + i + 12);
+		__m256d m = _mm256_or_pd(
+				_mm256_or_pd(_mm256_cmp_pd(v1, v1, _CMP_UNORD_Q),
+					_mm256_cmp_pd(v2, v2, _CMP_UNORD_Q)),
+				_mm256_or_pd(_mm256_cmp_pd(v3, v3, _CMP_UNORD_Q),
+					_mm256_cmp_pd(v4, v4, _CMP_UNORD_Q)));
+		if (_mm256_movemask_pd(m))
+			return true;
+	}
+	for (; i < num_eles; i++)
+		if (std::isnan(arr[i]))
+			return true;
+	return false;
+}
+
+/*
+ * cvttpd2dq outputs INT_MIN for NaN and the values out of the integer
+ * range. It is NA_INTEGER, so the conversion follows R's rules.
+ */
+static void cast_real2int(size_t num_eles, const double *in, int *out)
+{
+	size_t i = 0;
+	for (; i + 4 <= num_eles; i += 4)
+		_mm_storeu_si128((__m128i *) (out + i),
+				_mm256_cvttpd_epi32(_mm256_loadu_pd(in + i)));
+	scalar_cast<double, int, scalar_real2int>(num_eles, i, in, out);
+}
+
+static void cast_int2real(size_t num_eles, const int *in, double *out)
+{
+	const __m128i na = _mm_set1_epi32(NA_INT);
+	const __m256d na_real = _mm256_set1_pd(get_na_real());
+	size_t i = 0;
+	for (; i + 4 <= num_eles; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (in + i));
+		__m256d na_mask = _mm256_castsi256_pd(
+				_mm256_cvtepi32_epi64(_mm_cmpeq_epi32(v, na)));
+		_mm256_storeu_pd(out + i, _mm256_blendv_pd(_mm256_cvtepi32_pd(v),
+					na_real, na_mask));
+	}
+	scalar_cast<int, double, scalar_int2real>(num_eles, i, in, out);
+}
+
+static void cast_real2logical(size_t num_eles, const double *in, int *out)
+{
+	const __m128i na = _mm_set1_epi32(NA_INT);
+	const __m128i one = _mm_set1_epi32(1);
+	const __m256d zero = _mm256_setzero_pd();
+	size_t i = 0;
+	for (; i + 4 <= num_eles; i += 4) {
+		__m256d v = _mm256_loadu_pd(in + i);
+		__m128i res = _mm_and_si128(pack_mask(_mm256_cmp_pd(v, zero,
+						_CMP_NEQ_OQ)), one);
+		res = _mm_blendv_epi8(res, na,
+				pack_mask(_mm256_cmp_pd(v, v, _CMP_UNORD_Q)));
+		_mm_storeu_si128((__m128i *) (out + i), res);
+	}
+	scalar_cast<double, int, scalar_real2logical>(num_eles, i, in, out);
+}
+
+static void cast_int2logical(size_t num_eles, const int *in, int *out)
+{
+	const __m256i na = _mm256_set1_epi32(NA_INT);
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256i zero = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + 8 <= num_eles; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (in + i));
+		__m256i res = _mm256_andnot_si256(_mm256_cmpeq_epi32(v, zero), one);
+		// NA stays NA.
+		res = _mm256_blendv_epi8(res, v, _mm256_cmpeq_epi32(v, na));
+		_mm256_storeu_si256((__m256i *) (out + i), res);
+	}
+	scalar_cast<int, int, scalar_int2logical>(num_eles, i, in, out);
+}
+
+/*
+ * which.min and which.max. Each lane starts with the best element found
+ * so far, which isn't NA. NaN is never better than any value in ordered
+ * comparison, so it's ignored automatically. The indices are kept in
+ * doubles, which are exact for any array size.
+ */
+template<bool is_max>
+static void which_run(const double *arr, size_t start, size_t end,
+		double &best, ssize_t &best_idx)
+{
+	__m256d vbest = _mm256_set1_pd(best);
+	__m256d vidx = _mm256_set1_pd(best_idx);
+	__m256d idx = _mm256_add_pd(_mm256_set1_pd(start),
+			_mm256_setr_pd(0, 1, 2, 3));
+	const __m256d step = _mm256_set1_pd(4);
+	size_t i = start;
+	for (; i + 4 <= end; i += 4) {
+		__m256d v = _mm256_loadu_pd(arr + i);
+		__m256d m = _mm256_cmp_pd(v, vbest, is_max ? _CMP_GT_OQ : _CMP_LT_OQ);
+		vbest = _mm256_blendv_pd(vbest, v, m);
+		vidx = _mm256_blendv_pd(vidx, idx, m);
+		idx = _mm256_add_pd(idx, step);
+	}
+	double vals[4], idxs[4];
+	_mm256_storeu_pd(vals, vbest);
+	_mm256_storeu_pd(idxs, vidx);
+	merge_lanes<is_max>(vals, idxs, 4, best, best_idx);
+	scalar_which<is_max>(arr, i, end, best, best_idx);
+}
+
+/*
+ * NA is the smallest integer, so we have to exclude it for which.min.
+ * The indices are kept in 32-bit integers, so the caller has to make sure
+ * the array is smaller than 2^31.
+ */
+template<bool is_max>
+static void which_run(const int *arr, size_t start, size_t end, int &best,
+		ssize_t &best_idx)
+{
+	const __m256i na = _mm256_set1_epi32(NA_INT);
+	__m256i vbest = _mm256_set1_epi32(best);
+	__m256i vidx = _mm256_set1_epi32(best_idx);
+	__m256i idx = _mm256_add_epi32(_mm256_set1_epi32(start),
+			_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+	const __m256i step = _mm256_set1_epi32(8);
+	size_t i = start;
+	for (; i + 8 <= end; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (arr + i));
+		__m256i m;
+		if (is_max)
+			m = _mm256_cmpgt_epi32(v, vbest);
+		else
+			m = _mm256_andnot_si256(_mm256_cmpeq_epi32(v, na),
+					_mm256_cmpgt_epi32(vbest, v));
+		vbest = _mm256_blendv_epi8(vbest, v, m);
+		vidx = _mm256_blendv_epi8(vidx, idx, m);
+		idx = _mm256_add_epi32(idx, step);
+	}
+	int vals[8], idxs[8];
+	_mm256_storeu_si256((__m256i *) vals, vbest);
+	_mm256_storeu_si256((__m256i *) idxs, vidx);
+	merge_lanes<is_max>(vals, idxs, 8, best, best_idx);
+	scalar_which<is_max>(arr, i, end, best, best_idx);
+}
+
+/*
+ * which.min and which.max of 4 rows at a time. A lane's best value is NaN
+ * until it finds a value, and so is its index, which becomes NA_INTEGER
+ * after conversion.
+ */
+template<bool is_max, bool row_major>
+static void row_which_run(const double *mat, size_t nrow, size_t ncol,
+		int *out)
+{
+	const __m128i stride = _mm_setr_epi32(0, ncol, ncol * 2, ncol * 3);
+	const __m256d nan = _mm256_set1_pd(NAN);
+	// The source of the unmasked gather is undefined, which GCC 12 warns
+	// about, so we gather all lanes into zeros instead.
+	const __m256d all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+	size_t i = 0;
+	for (; i + 4 <= nrow; i += 4) {
+		__m256d vbest = nan;
+		__m256d vidx = nan;
+		for (size_t j = 0; j < ncol; j++) {
+			__m256d v;
+			if (row_major)
+				v = _mm256_mask_i32gather_pd(_mm256_setzero_pd(),
+						mat + i * ncol + j, stride, all, 8);
+			else
+				v = _mm256_loadu_pd(mat + i + j * nrow);
+			__m256d m = _mm256_or_pd(
+					_mm256_cmp_pd(v, vbest, is_max ? _CMP_GT_OQ : _CMP_LT_OQ),
+					_mm256_and_pd(_mm256_cmp_pd(vbest, vbest, _CMP_UNORD_Q),
+						_mm256_cmp_pd(v, v, _CMP_ORD_Q)));
+			vbest = _mm256_blendv_pd(vbest, v, m);
+			vidx = _mm256_blendv_pd(vidx, _mm256_set1_pd(j + 1), m);
+		}
+		_mm_storeu_si128((__m128i *) (out + i), _mm256_cvttpd_epi32(vidx));
+	}
+	scalar_row_which<is_max>(mat, i, nrow, ncol, row_major, out);
+}
+
+template<bool is_max, bool row_major>
+static void row_which_run(const int *mat, size_t nrow, size_t ncol, int *out)
+{
+	const __m256i stride = _mm256_mullo_epi32(_mm256_set1_epi32(ncol),
+			_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+	const __m256i na = _mm256_set1_epi32(NA_INT);
+	size_t i = 0;
+	for (; i + 8 <= nrow; i += 8) {
+		__m256i vbest = na;
+		__m256i vidx = na;
+		for (size_t j = 0; j < ncol; j++) {
+			__m256i v;
+			if (row_major)
+				v = _mm256_i32gather_epi32(mat + i * ncol + j, stride, 4);
+			else
+				v = _mm256_loadu_si256((const __m256i *) (mat + i + j * nrow));
+			// NA is smaller than any integer.
+			__m256i m;
+			if (is_max)
+				m = _mm256_cmpgt_epi32(v, vbest);
+			else
+				m = _mm256_andnot_si256(_mm256_cmpeq_epi32(v, na),
+						_mm256_or_si256(_mm256_cmpeq_epi32(vbest, na),
+							_mm256_cmpgt_epi32(vbest, v)));
+			vbest = _mm256_blendv_epi8(vbest, v, m);
+			vidx = _mm256_blendv_epi8(vidx, _mm256_set1_epi32(j + 1), m);
+		}
+		_mm256_storeu_si256((__m256i *) (out + i), vidx);
+	}
+	scalar_row_which<is_max>(mat, i, nrow, ncol, row_major, out);
+}
+
+/*
+ * The basic operations used by the vectorized math functions.
+ * A mask has all bits set in its true lanes.
+ */
+typedef __m256d vdouble;
+typedef __m256d vmask;
+static const size_t VLEN = 4;
+
+static inline vdouble vload(const double *p)
+{
+	return _mm256_loadu_pd(p);
+}
+
+static inline void vstore(double *p, vdouble v)
+{
+	_mm256_storeu_pd(p, v);
+}
+
+static inline vdouble vset(double v)
+{
+	return _mm256_set1_pd(v);
+}
+
+static inline vdouble vadd(vdouble a, vdouble b)
+{
+	return _mm256_add_pd(a, b);
+}
+
+static inline vdouble vsub(vdouble a, vdouble b)
+{
+	return _mm256_sub_pd(a, b);
+}
+
+static inline vdouble vmul(vdouble a, vdouble b)
+{
+	return _mm256_mul_pd(a, b);
+}
+
+static inline vdouble vdiv(vdouble a, vdouble b)
+{
+	return _mm256_div_pd(a, b);
+}
+
+static inline vdouble vsqrt(vdouble a)
+{
+	return _mm256_sqrt_pd(a);
+}
+
+static inline vdouble vmin(vdouble a, vdouble b)
+{
+	return _mm256_min_pd(a, b);
+}
+
+static inline vdouble vmax(vdouble a, vdouble b)
+{
+	return _mm256_max_pd(a, b);
+}
+
+static inline vdouble vround(vdouble a)
+{
+	return _mm256_round_pd(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+}
+
+static inline vdouble vfloor(vdouble a)
+{
+	return _mm256_floor_pd(a);
+}
+
+static inline vmask veq(vdouble a, vdouble b)
+{
+	return _mm256_cmp_pd(a, b, _CMP_EQ_OQ);
+}
+
+static inline vmask vlt(vdouble a, vdouble b)
+{
+	return _mm256_cmp_pd(a, b, _CMP_LT_OQ);
+}
+
+static inline vmask vgt(vdouble a, vdouble b)
+{
+	return _mm256_cmp_pd(a, b, _CMP_GT_OQ);
+}
+
+static inline vmask visnan(vdouble a)
+{
+	return _mm256_cmp_pd(a, a, _CMP_UNORD_Q);
+}
+
+static inline vmask vis_na(vdouble a)
+{
+	return is_na(a);
+}
+
+static inline vdouble vselect(vmask m, vdouble a, vdouble b)
+{
+	return _mm256_blendv_pd(b, a, m);
+}
+
+static inline vmask vor(vmask a, vmask b)
+{
+	return _mm256_or_pd(a, b);
+}
+
+static inline vmask vand(vmask a, vmask b)
+{
+	return _mm256_and_pd(a, b);
+}
+
+/*
+ * The unbiased exponent of a positive and normal number. We convert
+ * the exponent to double by putting it in the mantissa of 2^52.
+ */
+static inline vdouble vget_exp(vdouble a)
+{
+	__m256i e = _mm256_srli_epi64(_mm256_castpd_si256(a), 52);
+	__m256d d = _mm256_castsi256_pd(_mm256_or_si256(e,
+				_mm256_set1_epi64x(0x4330000000000000LL)));
+	return _mm256_sub_pd(d, _mm256_set1_pd(4503599627370496.0 + 1023));
+}
+
+/*
+ * The mantissa of a number in [1, 2).
+ */
+static inline vdouble vget_mant(vdouble a)
+{
+	__m256i m = _mm256_and_si256(_mm256_castpd_si256(a),
+			_mm256_set1_epi64x(0x000FFFFFFFFFFFFFLL));
+	return _mm256_castsi256_pd(_mm256_or_si256(m,
+				_mm256_set1_epi64x(0x3FF0000000000000LL)));
+}
+
+/*
+ * 2^k for an integer k in the normal range.
+ */
+static inline vdouble vpow2(vdouble k)
+{
+	__m256d biased = _mm256_add_pd(k, _mm256_set1_pd(4503599627370496.0 + 1023));
+	return _mm256_castsi256_pd(_mm256_slli_epi64(
+				_mm256_castpd_si256(biased), 52));
+}
+
+/*
+ * Transpose a 4x4 block of doubles or an 8x8 block of integers.
+ */
+static inline void transpose_block(const double *in, size_t in_ld,
+		double *out, size_t out_ld)
+{
+	__m256d r0 = _mm256_loadu_pd(in);
+	__m256d r1 = _mm256_loadu_pd(in + in_ld);
+	__m256d r2 = _mm256_loadu_pd(in + in_ld * 2);
+	__m256d r3 = _mm256_loadu_pd(in + in_ld * 3);
+	__m256d t0 = _mm256_unpacklo_pd(r0, r1);
+	__m256d t1 = _mm256_unpackhi_pd(r0, r1);
+	__m256d t2 = _mm256_unpacklo_pd(r2, r3);
+	__m256d t3 = _mm256_unpackhi_pd(r2, r3);
+	_mm256_store_pd(out, _mm256_permute2f128_pd(t0, t2, 0x20));
+	_mm256_store_pd(out + out_ld, _mm256_permute2f128_pd(t1, t3, 0x20));
+	_mm256_store_pd(out + out_ld * 2, _mm256_permute2f128_pd(t0, t2, 0x31));
+	_mm256_store_pd(out + out_ld * 3, _mm256_permute2f128_pd(t1, t3, 0x31));
+}
+
+static inline void transpose_block(const int *in, size_t in_ld, int *out,
+		size_t out_ld)
+{
+	__m256i r[8], t[8], u[8];
+	for (int k = 0; k < 8; k++)
+		r[k] = _mm256_loadu_si256((const __m256i *) (in + k * in_ld));
+	for (int k = 0; k < 8; k += 2) {
+		t[k] = _mm256_unpacklo_epi32(r[k], r[k + 1]);
+		t[k + 1] = _mm256_unpackhi_epi32(r[k], r[k + 1]);
+	}
+	for (int k = 0; k < 8; k += 4) {
+		u[k] = _mm256_unpacklo_epi64(t[k], t[k + 2]);
+		u[k + 1] = _mm256_unpackhi_epi64(t[k], t[k + 2]);
+		u[k + 2] = _mm256_unpacklo_epi64(t[k + 1], t[k + 3]);
+		u[k + 3] = _mm256_unpackhi_epi64(t[k + 1], t[k + 3]);
+	}
+	// u[0..3] have the columns 0-3 of the first four rows in the low
+	// 128 bits and the columns 4-7 in the high 128 bits.
+	for (int k = 0; k < 4; k++) {
+		_mm256_store_si256((__m256i *) (out + k * out_ld),
+				_mm256_permute2x128_si256(u[k], u[k + 4], 0x20));
+		_mm256_store_si256((__m256i *) (out + (k + 4) * out_ld),
+				_mm256_permute2x128_si256(u[k], u[k + 4], 0x31));
+	}
+}
+
+/*
+ * Transpose a full tile. We transpose it to a buffer in L1 cache first and
+ * then copy the buffer to the output, so each column of the output is
+ * written sequentially. Writing the blocks to the output directly
+ * interleaves the writes to many partial cache lines, which is slower than
+ * scalar code once the output doesn't fit in cache.
+ */
+template<class T>
+static void transpose_tile(const T *in, size_t in_ld, T *out, size_t out_ld)
+{
+	// The number of elements in a vector and the size of a block.
+	const size_t vec_len = 32 / sizeof(T);
+	const size_t tile_len = transpose_tile_len<T>::value;
+	T buf[tile_len * tile_len] __attribute__((aligned(32)));
+	for (size_t i = 0; i < tile_len; i += vec_len)
+		for (size_t j = 0; j < tile_len; j += vec_len)
+			transpose_block(in + i * in_ld + j, in_ld,
+					buf + i + j * tile_len, tile_len);
+	for (size_t j = 0; j < tile_len; j++) {
+		const T *src = buf + j * tile_len;
+		T *dst = out + j * out_ld;
+		for (size_t i = 0; i < tile_len; i += vec_len)
+			_mm256_storeu_si256((__m256i *) (dst + i),
+					_mm256_load_si256((const __m256i *) (src + i)));
+	}
+}
+
+#include "fmr_simd_math.h"
+#include "fmr_simd_dist.h"
+
+}
+
+template<na_uop_t op>
+struct real_ukernel<ISA_AVX2, op>
+{
+	static void run(size_t num_eles, const double *in, double *out) {
+		avx2::real_urun<op>(num_eles, in, out);
+	}
+};
+
+template<na_bop_t op, operand_t type>
+struct int_kernel<ISA_AVX2, op, type>
+{
+	static void run(size_t num_eles, const int *left, const int *right,
+			int *out) {
+		avx2::int_run<op, type>(num_eles, left, right, out);
+	}
+};
+
+template<na_bop_t op, operand_t type>
+struct int_div_kernel<ISA_AVX2, op, type>
+{
+	static void run(size_t num_eles, const int *left, const int *right,
+			double *out) {
+		avx2::int_div_run<op, type>(num_eles, left, right, out);
+	}
+};
+
+template<na_bop_t op, operand_t type>
+struct real_kernel<ISA_AVX2, op, type>
+{
+	static void run(size_t num_eles, const double *left, const double *right,
+			double *out) {
+		avx2::real_run<op, type>(num_eles, left, right, out);
+	}
+};
+
+template<na_bop_t op, operand_t type>
+struct real_cmp_kernel<ISA_AVX2, op, type>
+{
+	static void run(size_t num_eles, const double *left, const double *right,
+			int *out) {
+		avx2::real_cmp_run<op, type>(num_eles, left, right, out);
+	}
+};
+
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2,avx512f")
+
+namespace avx512
+{
+
+/*
+ * GCC 12 warns that the undefined source vector of the unmasked forms of
+ * some AVX-512 intrinsics may be used uninitialized. We use the zero-masked
+ * forms with all lanes selected instead, which compile to the same
+ * instructions.
+ */
+static inline __m512d cvt_int2real(__m256i v)
+{
+	return _mm512_maskz_cvtepi32_pd(0xFF, v);
+}
+
+static inline __m256i cvt_real2int(__m512d v)
+{
+	return _mm512_maskz_cvttpd_epi32(0xFF, v);
+}
+
+static inline __m256i lo_half(__m512i v)
+{
+	return _mm512_maskz_extracti64x4_epi64(0xFF, v, 0);
+}
+
+static inline __m256i hi_half(__m512i v)
+{
+	return _mm512_maskz_extracti64x4_epi64(0xFF, v, 1);
+}
+
+template<na_bop_t op>
+struct vop
+{
+};
+
+template<>
+struct vop<NA_ADD>
+{
+	static __m512i run(__m512i e1, __m512i e2) {
+		return _mm512_add_epi32(e1, e2);
+	}
+	static __m512d run(__m512d e1, __m512d e2) {
+		return _mm512_add_pd(e1, e2);
+	}
+};
+
+template<>
+struct vop<NA_SUB>
+{
+	static __m512i run(__m512i e1, __m512i e2) {
+		return _mm512_sub_epi32(e1, e2);
+	}
+	static __m512d run(__m512d e1, __m512d e2) {
+		return _mm512_sub_pd(e1, e2);
+	}
+};
+
+template<>
+struct vop<NA_MUL>
+{
+	static __m512i run(__m512i e1, __m512i e2) {
+		return _mm512_mullo_epi32(e1, e2);
+	}
+	static __m512d run(__m512d e1, __m512d e2) {
+		return _mm512_mul_pd(e1, e2);
+	}
+};
+
+template<>
+struct vop<NA_DIV>
+{
+	static __m512d run(__m512d e1, __m512d e2) {
+		return _mm512_div_pd(e1, e2);
+	}
+};
+
+/*
+ * Comparison returns a bitmask instead.
+ */
+template<na_bop_t op>
+struct vcmp
+{
+};
+
+template<>
+struct vcmp<NA_EQ>
+{
+	static __mmask16 run(__m512i e1, __m512i e2) {
+		return _mm512_cmp_epi32_mask(e1, e2, _MM_CMPINT_EQ);
+	}
+	static __mmask8 run(__m512d e1, __m512d e2) {
+		return _mm512_cmp_pd_mask(e1, e2, _CMP_EQ_OQ);
+	}
+};
+
+template<>
+struct vcmp<NA_NEQ>
+{
+	static __mmask16 run(__m512i e1, __m512i e2) {
+		return _mm512_cmp_epi32_mask(e1, e2, _MM_CMPINT_NE);
+	}
+	static __mmask8 run(__m512d e1, __m512d e2) {
+		return _mm512_cmp_pd_mask(e1, e2, _CMP_NEQ_OQ);
+	}
+};
+
+template<>
+struct vcmp<NA_GT>
+{
+	static __mmask16 run(__m512i e1, __m512i e2) {
+		return _mm512_cmp_epi32_mask(e1, e2, _MM_CMPINT_NLE);
+	}
+	static __mmask8 run(__m512d e1, __m512d e2) {
+		return _mm512_cmp_pd_mask(e1, e2, _CMP_GT_OQ);
+	}
+};
+
+template<>
+struct vcmp<NA_GE>
+{
+	static __mmask16 run(__m512i e1, __m512i e2) {
+		return _mm512_cmp_epi32_mask(e1, e2, _MM_CMPINT_NLT);
+	}
+	static __mmask8 run(__m512d e1, __m512d e2) {
+		return _mm512_cmp_pd_mask(e1, e2, _CMP_GE_OQ);
+	}
+};
+
+template<>
+struct vcmp<NA_LT>
+{
+	static __mmask16 run(__m512i e1, __m512i e2) {
+		return _mm512_cmp_epi32_mask(e1, e2, _MM_CMPINT_LT);
+	}
+	static __mmask8 run(__m512d e1, __m512d e2) {
+		return _mm512_cmp_pd_mask(e1, e2, _CMP_LT_OQ);
+	}
+};
+
+template<>
+struct vcmp<NA_LE>
+{
+	static __mmask16 run(__m512i e1, __m512i e2) {
+		return _mm512_cmp_epi32_mask(e1, e2, _MM_CMPINT_LE);
+	}
+	static __mmask8 run(__m512d e1, __m512d e2) {
+		return _mm512_cmp_pd_mask(e1, e2, _CMP_LE_OQ);
+	}
+};
+
+template<operand_t type, bool is_left>
+static inline __m512i load_int(const int *arr, size_t idx, __m512i single)
+{
+	if ((type == EA && is_left) || (type == AE && !is_left))
+		return single;
+	else
+		return _mm512_loadu_si512(arr + idx);
+}
+
+template<operand_t type, bool is_left>
+static inline __m256i load_int8(const int *arr, size_t idx, __m256i single)
+{
+	if ((type == EA && is_left) || (type == AE && !is_left))
+		return single;
+	else
+		return _mm256_loadu_si256((const __m256i *) (arr + idx));
+}
+
+template<operand_t type, bool is_left>
+static inline __m512d load_real(const double *arr, size_t idx, __m512d single)
+{
+	if ((type == EA && is_left) || (type == AE && !is_left))
+		return single;
+	else
+		return _mm512_loadu_pd(arr + idx);
+}
+
+static inline __mmask8 is_na(__m512d v)
+{
+	__mmask8 nan = _mm512_cmp_pd_mask(v, v, _CMP_UNORD_Q);
+	__m512i low = _mm512_and_si512(_mm512_castpd_si512(v),
+			_mm512_set1_epi64(0xFFFFFFFFLL));
+	return _mm512_mask_cmpeq_epi64_mask(nan, low,
+			_mm512_set1_epi64(NA_REAL_PAYLOAD));
+}
+
+/*
+ * The lanes where integer arithmetic overflows. See the AVX2 version.
+ */
+template<na_bop_t op>
+static inline __mmask16 overflow(__m512i, __m512i, __m512i)
+{
+	return 0;
+}
+
+template<>
+inline __mmask16 overflow<NA_ADD>(__m512i e1, __m512i e2, __m512i res)
+{
+	__m512i v = _mm512_and_si512(_mm512_xor_si512(e1, res),
+			_mm512_xor_si512(e2, res));
+	return _mm512_cmplt_epi32_mask(v, _mm512_setzero_si512());
+}
+
+template<>
+inline __mmask16 overflow<NA_SUB>(__m512i e1, __m512i e2, __m512i res)
+{
+	__m512i v = _mm512_and_si512(_mm512_xor_si512(e1, e2),
+			_mm512_xor_si512(e1, res));
+	return _mm512_cmplt_epi32_mask(v, _mm512_setzero_si512());
+}
+
+static inline __mmask8 mul_overflow8(__m256i e1, __m256i e2)
+{
+	__m512d prod = _mm512_mul_pd(cvt_int2real(e1), cvt_int2real(e2));
+	return _mm512_cmp_pd_mask(_mm512_abs_pd(prod), _mm512_set1_pd(INT_MAX),
+			_CMP_GT_OQ);
+}
+
+template<>
+inline __mmask16 overflow<NA_MUL>(__m512i e1, __m512i e2, __m512i)
+{
+	__mmask8 lo = mul_overflow8(lo_half(e1), lo_half(e2));
+	__mmask8 hi = mul_overflow8(hi_half(e1), hi_half(e2));
+	return (__mmask16) lo | ((__mmask16) hi << 8);
+}
+
+template<na_bop_t op, operand_t type>
+static void int_arith_run(size_t num_eles, const int *left, const int *right,
+		int *out)
+{
+	if (num_eles == 0)
+		return;
+	const __m512i na = _mm512_set1_epi32(NA_INT);
+	const __m512i single_left = _mm512_set1_epi32(left[0]);
+	const __m512i single_right = _mm512_set1_epi32(right[0]);
+	size_t i = 0;
+	for (; i + 16 <= num_eles; i += 16) {
+		__m512i e1 = load_int<type, true>(left, i, single_left);
+		__m512i e2 = load_int<type, false>(right, i, single_right);
+		__mmask16 na_mask = _mm512_cmpeq_epi32_mask(e1, na)
+			| _mm512_cmpeq_epi32_mask(e2, na);
+		__m512i res = vop<op>::run(e1, e2);
+		na_mask |= overflow<op>(e1, e2, res);
+		res = _mm512_mask_mov_epi32(res, na_mask, na);
+		_mm512_storeu_si512(out + i, res);
+	}
+	scalar_int_arith<op, type>(num_eles, i, left, right, out);
+}
+
+template<na_bop_t op, operand_t type>
+static void int_cmp_run(size_t num_eles, const int *left, const int *right,
+		int *out)
+{
+	if (num_eles == 0)
+		return;
+	const __m512i na = _mm512_set1_epi32(NA_INT);
+	const __m512i one = _mm512_set1_epi32(1);
+	const __m512i single_left = _mm512_set1_epi32(left[0]);
+	const __m512i single_right = _mm512_set1_epi32(right[0]);
+	size_t i = 0;
+	for (; i + 16 <= num_eles; i += 16) {
+		__m512i e1 = load_int<type, true>(left, i, single_left);
+		__m512i e2 = load_int<type, false>(right, i, single_right);
+		__mmask16 na_mask = _mm512_cmpeq_epi32_mask(e1, na)
+			| _mm512_cmpeq_epi32_mask(e2, na);
+		__m512i res = _mm512_maskz_mov_epi32(vcmp<op>::run(e1, e2), one);
+		res = _mm512_mask_mov_epi32(res, na_mask, na);
+		_mm512_storeu_si512(out + i, res);
+	}
+	scalar_int_arith<op, type>(num_eles, i, left, right, out);
+}
+
+template<na_bop_t op, operand_t type>
+static void int_div_run(size_t num_eles, const int *left, const int *right,
+		double *out)
+{
+	if (num_eles == 0)
+		return;
+	const __m256i na = _mm256_set1_epi32(NA_INT);
+	const __m512d na_real = _mm512_set1_pd(get_na_real());
+	const __m256i single_left = _mm256_set1_epi32(left[0]);
+	const __m256i single_right = _mm256_set1_epi32(right[0]);
+	size_t i = 0;
+	for (; i + 8 <= num_eles; i += 8) {
+		__m256i e1 = load_int8<type, true>(left, i, single_left);
+		__m256i e2 = load_int8<type, false>(right, i, single_right);
+		__m256i na_vec = _mm256_or_si256(_mm256_cmpeq_epi32(e1, na),
+				_mm256_cmpeq_epi32(e2, na));
+		__mmask8 na_mask = _mm256_movemask_ps(_mm256_castsi256_ps(na_vec));
+		__m512d res = vop<op>::run(cvt_int2real(e1), cvt_int2real(e2));
+		res = _mm512_mask_mov_pd(res, na_mask, na_real);
+		_mm512_storeu_pd(out + i, res);
+	}
+	scalar_int_div<op, type>(num_eles, i, left, right, out);
+}
+
+template<na_bop_t op, operand_t type>
+static void real_run(size_t num_eles, const double *left,
+		const double *right, double *out)
+{
+	if (num_eles == 0)
+		return;
+	const __m512d na_real = _mm512_set1_pd(get_na_real());
+	const __m512d single_left = _mm512_set1_pd(left[0]);
+	const __m512d single_right = _mm512_set1_pd(right[0]);
+	size_t i = 0;
+	for (; i + 8 <= num_eles; i += 8) {
+		__m512d e1 = load_real<type, true>(left, i, single_left);
+		__m512d e2 = load_real<type, false>(right, i, single_right);
+		__m512d res = vop<op>::run(e1, e2);
+		res = _mm512_mask_mov_pd(res, is_na(e1) | is_na(e2), na_real);
+		_mm512_storeu_pd(out + i, res);
+	}
+	scalar_real_arith<op, type>(num_eles, i, left, right, out);
+}
+
+template<na_bop_t op, operand_t type>
+static void real_cmp_run(size_t num_eles, const double *left,
+		const double *right, int *out)
+{
+	if (num_eles == 0)
+		return;
+	const __m512i na = _mm512_set1_epi32(NA_INT);
+	const __m512i one = _mm512_set1_epi32(1);
+	const __m512d single_left = _mm512_set1_pd(left[0]);
+	const __m512d single_right = _mm512_set1_pd(right[0]);
+	size_t i = 0;
+	for (; i + 8 <= num_eles; i += 8) {
+		__m512d e1 = load_real<type, true>(left, i, single_left);
+		__m512d e2 = load_real<type, false>(right, i, single_right);
+		__mmask8 nan = _mm512_cmp_pd_mask(e1, e2, _CMP_UNORD_Q);
+		// Only the lower 8 lanes are used.
+		__m512i res = _mm512_maskz_mov_epi32(vcmp<op>::run(e1, e2), one);
+		res = _mm512_mask_mov_epi32(res, nan, na);
+		_mm256_storeu_si256((__m256i *) (out + i), lo_half(res));
+	}
+	scalar_real_cmp<op, type>(num_eles, i, left, right, out);
+}
+
+static bool contain_na(const int *arr, size_t num_eles)
+{
+	const __m512i na = _mm512_set1_epi32(NA_INT);
+	size_t i = 0;
+	for (; i + 64 <= num_eles; i += 64) {
+		__mmask16 m = _mm512_cmpeq_epi32_mask(_mm512_loadu_si512(arr + i), na)
+			| _mm512_cmpeq_epi32_mask(_mm512_loadu_si512(arr + i + 16), na)
+			| _mm512_cmpeq_epi32_mask(_mm512_loadu_si512(arr + i + 32), na)
+			| _mm512_cmpeq_epi32_mask(_mm512_loadu_si512(arr + i + 48), na);
+		if (m)
+			return true;
+	}
+	for (; i < num_eles; i++)
+		if (arr[i] == NA_INT)
+			return true;
+	return false;
+}
+
+static bool contain_nan(const double *arr, size_t num_eles)
+{
+	size_t i = 0;
+	for (; i + 32 <= num_eles; i += 32) {
+		__m512d v1 = _mm512_loadu_pd(arr + i);
+		__m512d v2 = _mm512_loadu_pd(arr + i + 8);
+		__m512d v3 = _mm512_loadu_pd(arr + i + 16);
+		__m512d v4 = _mm512_loadu_pd(arr + i + 24);
+		__mmask8 m = _mm512_cmp_pd_mask(v1, v1, _CMP_UNORD_Q)
+			| _mm512_cmp_pd_mask(v2, v2, _CMP_UNORD_Q)
+			| _mm512_cmp_pd_mask(v3, v3, _CMP_UNORD_Q)
+			| _mm512_cmp_pd_mask(v4, v4, _CMP_UNORD_Q);
+		if (m)
+			return true;
+	}
+	for (; i < num_eles; i++)
+		if (std::isnan(arr[i]))
+			return true;
+	return false;
+}
+
+/*
+ * vcvttpd2dq outputs INT_MIN for NaN and the values out of the integer
+ * range. It is NA_INTEGER, so the conversion follows R's rules.
+ */
+static void cast_real2int(size_t num_eles, const double *in, int *out)
+{
+	size_t i = 0;
+	for (; i + 8 <= num_eles; i += 8)
+		_mm256_storeu_si256((__m256i *) (out + i),
+				cvt_real2int(_mm512_loadu_pd(in + i)));
+	scalar_cast<double, int, scalar_real2int>(num_eles, i, in, out);
+}
+
+/*
+ * Only INT_MIN is converted to -2^31, so we find NA after the conversion.
+ * Comparing 32-bit integers in a 256-bit register requires AVX512VL.
+ */
+static void cast_int2real(size_t num_eles, const int *in, double *out)
+{
+	const __m512d na_int = _mm512_set1_pd(NA_INT);
+	const __m512d na_real = _mm512_set1_pd(get_na_real());
+	size_t i = 0;
+	for (; i + 8 <= num_eles; i += 8) {
+		__m512d v = cvt_int2real(_mm256_loadu_si256(
+					(const __m256i *) (in + i)));
+		__mmask8 na_mask = _mm512_cmp_pd_mask(v, na_int, _CMP_EQ_OQ);
+		_mm512_storeu_pd(out + i, _mm512_mask_blend_pd(na_mask, v, na_real));
+	}
+	scalar_cast<int, double, scalar_int2real>(num_eles, i, in, out);
+}
+
+static void cast_real2logical(size_t num_eles, const double *in, int *out)
+{
+	const __m512i na = _mm512_set1_epi32(NA_INT);
+	const __m512i one = _mm512_set1_epi32(1);
+	const __m512d zero = _mm512_setzero_pd();
+	size_t i = 0;
+	for (; i + 16 <= num_eles; i += 16) {
+		__m512d v1 = _mm512_loadu_pd(in + i);
+		__m512d v2 = _mm512_loadu_pd(in + i + 8);
+		__mmask16 nz = _mm512_cmp_pd_mask(v1, zero, _CMP_NEQ_OQ)
+			| (_mm512_cmp_pd_mask(v2, zero, _CMP_NEQ_OQ) << 8);
+		__mmask16 nan = _mm512_cmp_pd_mask(v1, v1, _CMP_UNORD_Q)
+			| (_mm512_cmp_pd_mask(v2, v2, _CMP_UNORD_Q) << 8);
+		__m512i res = _mm512_maskz_mov_epi32(nz, one);
+		_mm512_storeu_si512(out + i, _mm512_mask_mov_epi32(res, nan, na));
+	}
+	scalar_cast<double, int, scalar_real2logical>(num_eles, i, in, out);
+}
+
+static void cast_int2logical(size_t num_eles, const int *in, int *out)
+{
+	const __m512i na = _mm512_set1_epi32(NA_INT);
+	const __m512i one = _mm512_set1_epi32(1);
+	const __m512i zero = _mm512_setzero_si512();
+	size_t i = 0;
+	for (; i + 16 <= num_eles; i += 16) {
+		__m512i v = _mm512_loadu_si512(in + i);
+		__m512i res = _mm512_maskz_mov_epi32(
+				_mm512_cmpneq_epi32_mask(v, zero), one);
+		// NA stays NA.
+		_mm512_storeu_si512(out + i, _mm512_mask_mov_epi32(res,
+					_mm512_cmpeq_epi32_mask(v, na), v));
+	}
+	scalar_cast<int, int, scalar_int2logical>(num_eles, i, in, out);
+}
+
+/*
+ * which.min and which.max. See the AVX2 version for details.
+ */
+template<bool is_max>
+static void which_run(const double *arr, size_t start, size_t end,
+		double &best, ssize_t &best_idx)
+{
+	__m512d vbest = _mm512_set1_pd(best);
+	__m512d vidx = _mm512_set1_pd(best_idx);
+	__m512d idx = _mm512_add_pd(_mm512_set1_pd(start),
+			_mm512_setr_pd(0, 1, 2, 3, 4, 5, 6, 7));
+	const __m512d step = _mm512_set1_pd(8);
+	size_t i = start;
+	for (; i + 8 <= end; i += 8) {
+		__m512d v = _mm512_loadu_pd(arr + i);
+		__mmask8 m = _mm512_cmp_pd_mask(v, vbest,
+				is_max ? _CMP_GT_OQ : _CMP_LT_OQ);
+		vbest = _mm512_mask_blend_pd(m, vbest, v);
+		vidx = _mm512_mask_blend_pd(m, vidx, idx);
+		idx = _mm512_add_pd(idx, step);
+	}
+	double vals[8], idxs[8];
+	_mm512_storeu_pd(vals, vbest);
+	_mm512_storeu_pd(idxs, vidx);
+	merge_lanes<is_max>(vals, idxs, 8, best, best_idx);
+	scalar_which<is_max>(arr, i, end, best, best_idx);
+}
+
+template<bool is_max>
+static void which_run(const int *arr, size_t start, size_t end, int &best,
+		ssize_t &best_idx)
+{
+	const __m512i na = _mm512_set1_epi32(NA_INT);
+	__m512i vbest = _mm512_set1_epi32(best);
+	__m512i vidx = _mm512_set1_epi32(best_idx);
+	__m512i idx = _mm512_add_epi32(_mm512_set1_epi32(start),
+			_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13,
+				14, 15));
+	const __m512i step = _mm512_set1_epi32(16);
+	size_t i = start;
+	for (; i + 16 <= end; i += 16) {
+		__m512i v = _mm512_loadu_si512(arr + i);
+		__mmask16 m;
+		if (is_max)
+			m = _mm512_cmpgt_epi32_mask(v, vbest);
+		else
+			m = _mm512_mask_cmplt_epi32_mask(_mm512_cmpneq_epi32_mask(v, na),
+					v, vbest);
+		vbest = _mm512_mask_mov_epi32(vbest, m, v);
+		vidx = _mm512_mask_mov_epi32(vidx, m, idx);
+		idx = _mm512_add_epi32(idx, step);
+	}
+	int vals[16], idxs[16];
+	_mm512_storeu_si512(vals, vbest);
+	_mm512_storeu_si512(idxs, vidx);
+	merge_lanes<is_max>(vals, idxs, 16, best, best_idx);
+	scalar_which<is_max>(arr, i, end, best, best_idx);
+}
+
+template<bool is_max, bool row_major>
+static void row_which_run(const double *mat, size_t nrow, size_t ncol,
+		int *out)
+{
+	const __m256i stride = _mm256_mullo_epi32(_mm256_set1_epi32(ncol),
+			_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+	const __m512d nan = _mm512_set1_pd(NAN);
+	size_t i = 0;
+	for (; i + 8 <= nrow; i += 8) {
+		__m512d vbest = nan;
+		__m512d vidx = nan;
+		for (size_t j = 0; j < ncol; j++) {
+			__m512d v;
+			if (row_major)
+				v = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), 0xFF,
+						stride, mat + i * ncol + j, 8);
+			else
+				v = _mm512_loadu_pd(mat + i + j * nrow);
+			__mmask8 m = _mm512_cmp_pd_mask(v, vbest,
+					is_max ? _CMP_GT_OQ : _CMP_LT_OQ)
+				| _mm512_mask_cmp_pd_mask(
+						_mm512_cmp_pd_mask(vbest, vbest, _CMP_UNORD_Q),
+						v, v, _CMP_ORD_Q);
+			vbest = _mm512_mask_blend_pd(m, vbest, v);
+			vidx = _mm512_mask_blend_pd(m, vidx, _mm512_set1_pd(j + 1));
+		}
+		_mm256_storeu_si256((__m256i *) (out + i), cvt_real2int(vidx));
+	}
+	scalar_row_which<is_max>(mat, i, nrow, ncol, row_major, out);
+}
+
+template<bool is_max, bool row_major>
+static void row_which_run(const int *mat, size_t nrow, size_t ncol, int *out)
+{
+	const __m512i stride = _mm512_mullo_epi32(_mm512_set1_epi32(ncol),
+			_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13,
+				14, 15));
+	const __m512i na = _mm512_set1_epi32(NA_INT);
+	size_t i = 0;
+	for (; i + 16 <= nrow; i += 16) {
+		__m512i vbest = na;
+		__m512i vidx = na;
+		for (size_t j = 0; j < ncol; j++) {
+			__m512i v;
+			if (row_major)
+				v = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(),
+						0xFFFF, stride, mat + i * ncol + j, 4);
+			else
+				v = _mm512_loadu_si512(mat + i + j * nrow);
+			__mmask16 m;
+			if (is_max)
+				m = _mm512_cmpgt_epi32_mask(v, vbest);
+			else
+				m = _mm512_cmpneq_epi32_mask(v, na)
+					& (_mm512_cmpeq_epi32_mask(vbest, na)
+							| _mm512_cmplt_epi32_mask(v, vbest));
+			vbest = _mm512_mask_mov_epi32(vbest, m, v);
+			vidx = _mm512_mask_mov_epi32(vidx, m, _mm512_set1_epi32(j + 1));
+		}
+		_mm512_storeu_si512(out + i, vidx);
+	}
+	scalar_row_which<is_max>(mat, i, nrow, ncol, row_major, out);
+}
+
+/*
+ * The basic operations used by the vectorized math functions.
+ */
+typedef __m512d vdouble;
+typedef __mmask8 vmask;
+static const size_t VLEN = 8;
+
+static inline vdouble vload(const double *p)
+{
+	return _mm512_loadu_pd(p);
+}
+
+static inline void vstore(double *p, vdouble v)
+{
+	_mm512_storeu_pd(p, v);
+}
+
+static inline vdouble vset(double v)
+{
+	return _mm512_set1_pd(v);
+}
+
+static inline vdouble vadd(vdouble a, vdouble b)
+{
+	return _mm512_add_pd(a, b);
+}
+
+static inline vdouble vsub(vdouble a, vdouble b)
+{
+	return _mm512_sub_pd(a, b);
+}
+
+static inline vdouble vmul(vdouble a, vdouble b)
+{
+	return _mm512_mul_pd(a, b);
+}
+
+static inline vdouble vdiv(vdouble a, vdouble b)
+{
+	return _mm512_div_pd(a, b);
+}
+
+static inline vdouble vsqrt(vdouble a)
+{
+	return _mm512_maskz_sqrt_pd(0xFF, a);
+}
+
+static inline vdouble vmin(vdouble a, vdouble b)
+{
+	return _mm512_maskz_min_pd(0xFF, a, b);
+}
+
+static inline vdouble vmax(vdouble a, vdouble b)
+{
+	return _mm512_maskz_max_pd(0xFF, a, b);
+}
+
+static inline vdouble vround(vdouble a)
+{
+	return _mm512_maskz_roundscale_pd(0xFF, a,
+			_MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+}
+
+static inline vdouble vfloor(vdouble a)
+{
+	return _mm512_maskz_roundscale_pd(0xFF, a,
+			_MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+}
+
+static inline vmask veq(vdouble a, vdouble b)
+{
+	return _mm512_cmp_pd_mask(a, b, _CMP_EQ_OQ);
+}
+
+static inline vmask vlt(vdouble a, vdouble b)
+{
+	return _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ);
+}
+
+static inline vmask vgt(vdouble a, vdouble b)
+{
+	return _mm512_cmp_pd_mask(a, b, _CMP_GT_OQ);
+}
+
+static inline vmask visnan(vdouble a)
+{
+	return _mm512_cmp_pd_mask(a, a, _CMP_UNORD_Q);
+}
+
+static inline vmask vis_na(vdouble a)
+{
+	return is_na(a);
+}
+
+static inline vdouble vselect(vmask m, vdouble a, vdouble b)
+{
+	return _mm512_mask_blend_pd(m, b, a);
+}
+
+static inline vmask vor(vmask a, vmask b)
+{
+	return a | b;
+}
+
+static inline vmask vand(vmask a, vmask b)
+{
+	return a & b;
+}
+
+static inline vdouble vget_exp(vdouble a)
+{
+	return _mm512_maskz_getexp_pd(0xFF, a);
+}
+
+static inline vdouble vget_mant(vdouble a)
+{
+	return _mm512_maskz_getmant_pd(0xFF, a, _MM_MANT_NORM_1_2,
+			_MM_MANT_SIGN_zero);
+}
+
+static inline vdouble vpow2(vdouble k)
+{
+	return _mm512_maskz_scalef_pd(0xFF, _mm512_set1_pd(1), k);
+}
+
+#include "fmr_simd_math.h"
+#include "fmr_simd_dist.h"
+
+}
+
+template<na_uop_t op>
+struct real_ukernel<ISA_AVX512, op>
+{
+	static void run(size_t num_eles, const double *in, double *out) {
+		avx512::real_urun<op>(num_eles, in, out);
+	}
+};
+
+template<na_bop_t op, operand_t type, bool is_cmp = (op >= NA_EQ)>
+struct avx512_int_kernel
+{
+	static void run(size_t num_eles, const int *left, const int *right,
+			int *out) {
+		avx512::int_arith_run<op, type>(num_eles, left, right, out);
+	}
+};
+
+template<na_bop_t op, operand_t type>
+struct avx512_int_kernel<op, type, true>
+{
+	static void run(size_t num_eles, const int *left, const int *right,
+			int *out) {
+		avx512::int_cmp_run<op, type>(num_eles, left, right, out);
+	}
+};
+
+template<na_bop_t op, operand_t type>
+struct int_kernel<ISA_AVX512, op, type>: public avx512_int_kernel<op, type>
+{
+};
+
+template<na_bop_t op, operand_t type>
+struct int_div_kernel<ISA_AVX512, op, type>
+{
+	static void run(size_t num_eles, const int *left, const int *right,
+			double *out) {
+		avx512::int_div_run<op, type>(num_eles, left, right, out);
+	}
+};
+
+template<na_bop_t op, operand_t type>
+struct real_kernel<ISA_AVX512, op, type>
+{
+	static void run(size_t num_eles, const double *left, const double *right,
+			double *out) {
+		avx512::real_run<op, type>(num_eles, left, right, out);
+	}
+};
+
+template<na_bop_t op, operand_t type>
+struct real_cmp_kernel<ISA_AVX512, op, type>
+{
+	static void run(size_t num_eles, const double *left, const double *right,
+			int *out) {
+		avx512::real_cmp_run<op, type>(num_eles, left, right, out);
+	}
+};
+
+#pragma GCC pop_options
+
+#endif
+
+/*
+ * Pick the kernel for the operand type.
+ */
+template<template<isa_t, na_bop_t, operand_t> class Kernel, isa_t isa,
+	na_bop_t op, class KernelType>
+static KernelType select_operand(operand_t type)
+{
+	switch (type) {
+		case AA: return Kernel<isa, op, AA>::run;
+		case AE: return Kernel<isa, op, AE>::run;
+		case EA: return Kernel<isa, op, EA>::run;
+		default: return NULL;
+	}
+}
+
+template<isa_t isa>
+static bop_kernel<int, int>::type get_int_kernel(na_bop_t op, operand_t type)
+{
+	typedef bop_kernel<int, int>::type kernel_t;
+	switch (op) {
+		case NA_ADD: return select_operand<int_kernel, isa, NA_ADD, kernel_t>(type);
+		case NA_SUB: return select_operand<int_kernel, isa, NA_SUB, kernel_t>(type);
+		case NA_MUL: return select_operand<int_kernel, isa, NA_MUL, kernel_t>(type);
+		case NA_EQ: return select_operand<int_kernel, isa, NA_EQ, kernel_t>(type);
+		case NA_NEQ: return select_operand<int_kernel, isa, NA_NEQ, kernel_t>(type);
+		case NA_GT: return select_operand<int_kernel, isa, NA_GT, kernel_t>(type);
+		case NA_GE: return select_operand<int_kernel, isa, NA_GE, kernel_t>(type);
+		case NA_LT: return select_operand<int_kernel, isa, NA_LT, kernel_t>(type);
+		case NA_LE: return select_operand<int_kernel, isa, NA_LE, kernel_t>(type);
+		default: return NULL;
+	}
+}
+
+template<isa_t isa>
+static bop_kernel<int, double>::type get_int_div_kernel(na_bop_t op,
+		operand_t type)
+{
+	typedef bop_kernel<int, double>::type kernel_t;
+	if (op == NA_DIV)
+		return select_operand<int_div_kernel, isa, NA_DIV, kernel_t>(type);
+	else
+		return NULL;
+}
+
+template<isa_t isa>
+static bop_kernel<double, double>::type get_real_kernel(na_bop_t op,
+		operand_t type)
+{
+	typedef bop_kernel<double, double>::type kernel_t;
+	switch (op) {
+		case NA_ADD: return select_operand<real_kernel, isa, NA_ADD, kernel_t>(type);
+		case NA_SUB: return select_operand<real_kernel, isa, NA_SUB, kernel_t>(type);
+		case NA_MUL: return select_operand<real_kernel, isa, NA_MUL, kernel_t>(type);
+		case NA_DIV: return select_operand<real_kernel, isa, NA_DIV, kernel_t>(type);
+		default: return NULL;
+	}
+}
+
+template<isa_t isa>
+static bop_kernel<double, int>::type get_real_cmp_kernel(na_bop_t op,
+		operand_t type)
+{
+	typedef bop_kernel<double, int>::type kernel_t;
+	switch (op) {
+		case NA_EQ: return select_operand<real_cmp_kernel, isa, NA_EQ, kernel_t>(type);
+		case NA_NEQ: return select_operand<real_cmp_kernel, isa, NA_NEQ, kernel_t>(type);
+		case NA_GT: return select_operand<real_cmp_kernel, isa, NA_GT, kernel_t>(type);
+		case NA_GE: return select_operand<real_cmp_kernel, isa, NA_GE, kernel_t>(type);
+		case NA_LT: return select_operand<real_cmp_kernel, isa, NA_LT, kernel_t>(type);
+		case NA_LE: return select_operand<real_cmp_kernel, isa, NA_LE, kernel_t>(type);
+		default: return NULL;
+	}
+}
+
+template<>
+bop_kernel<int, int>::type get_na_kernel<int, int>(na_bop_t op,
+		operand_t type)
+{
+#ifdef FMR_X86_SIMD
+	switch (get_isa()) {
+		case ISA_AVX512: return get_int_kernel<ISA_AVX512>(op, type);
+		case ISA_AVX2: return get_int_kernel<ISA_AVX2>(op, type);
+		default: break;
+	}
+#endif
+	return NULL;
+}
+
+template<>
+bop_kernel<int, double>::type get_na_kernel<int, double>(na_bop_t op,
+		operand_t type)
+{
+#ifdef FMR_X86_SIMD
+	switch (get_isa()) {
+		case ISA_AVX512: return get_int_div_kernel<ISA_AVX512>(op, type);
+		case ISA_AVX2: return get_int_div_kernel<ISA_AVX2>(op, type);
+		default: break;
+	}
+#endif
+	return NULL;
+}
+
+template<>
+bop_kernel<double, double>::type get_na_kernel<double, double>(na_bop_t op,
+		operand_t type)
+{
+#ifdef FMR_X86_SIMD
+	switch (get_isa()) {
+		case ISA_AVX512: return get_real_kernel<ISA_AVX512>(op, type);
+		case ISA_AVX2: return get_real_kernel<ISA_AVX2>(op, type);
+		default: break;
+	}
+#endif
+	return NULL;
+}
+
+template<>
+bop_kernel<double, int>::type get_na_kernel<double, int>(na_bop_t op,
+		operand_t type)
+{
+#ifdef FMR_X86_SIMD
+	switch (get_isa()) {
+		case ISA_AVX512: return get_real_cmp_kernel<ISA_AVX512>(op, type);
+		case ISA_AVX2: return get_real_cmp_kernel<ISA_AVX2>(op, type);
+		default: break;
+	}
+#endif
+	return NULL;
+}
+
+template<template<isa_t, na_uop_t> class Kernel, isa_t isa, class KernelType>
+static KernelType get_ukernel(na_uop_t op)
+{
+	switch (op) {
+		case NA_SQRT: return Kernel<isa, NA_SQRT>::run;
+		case NA_LOG: return Kernel<isa, NA_LOG>::run;
+		case NA_LOG2: return Kernel<isa, NA_LOG2>::run;
+		case NA_LOG10: return Kernel<isa, NA_LOG10>::run;
+		case NA_LOG1P: return Kernel<isa, NA_LOG1P>::run;
+		case NA_EXP: return Kernel<isa, NA_EXP>::run;
+		default: return NULL;
+	}
+}
+
+template<>
+uop_kernel<int>::type get_na_ukernel<int>(na_uop_t op)
+{
+#ifdef FMR_X86_SIMD
+	typedef uop_kernel<int>::type kernel_t;
+	switch (get_isa()) {
+		case ISA_AVX512: return get_ukernel<int_ukernel, ISA_AVX512, kernel_t>(op);
+		case ISA_AVX2: return get_ukernel<int_ukernel, ISA_AVX2, kernel_t>(op);
+		default: break;
+	}
+#endif
+	return NULL;
+}
+
+template<>
+uop_kernel<double>::type get_na_ukernel<double>(na_uop_t op)
+{
+#ifdef FMR_X86_SIMD
+	typedef uop_kernel<double>::type kernel_t;
+	switch (get_isa()) {
+		case ISA_AVX512: return get_ukernel<real_ukernel, ISA_AVX512, kernel_t>(op);
+		case ISA_AVX2: return get_ukernel<real_ukernel, ISA_AVX2, kernel_t>(op);
+		default: break;
+	}
+#endif
+	return NULL;
+}
+
+bool contain_na(const int *arr, size_t num_eles)
+{
+#ifdef FMR_X86_SIMD
+	switch (get_isa()) {
+		case ISA_AVX512: return avx512::contain_na(arr, num_eles);
+		case ISA_AVX2: return avx2::contain_na(arr, num_eles);
+		default: break;
+	}
+#endif
+	for (size_t i = 0; i < num_eles; i++)
+		if (arr[i] == NA_INT)
+			return true;
+	return false;
+}
+
+bool contain_nan(const double *arr, size_t num_eles)
+{
+#ifdef FMR_X86_SIMD
+	switch (get_isa()) {
+		case ISA_AVX512: return avx512::contain_nan(arr, num_eles);
+		case ISA_AVX2: return avx2::contain_nan(arr, num_eles);
+		default: break;
+	}
+#endif
+	for (size_t i = 0; i < num_eles; i++)
+		if (std::isnan(arr[i]))
+			return true;
+	return false;
+}
+
+/*
+ * Dispatch a type cast to the kernel of the instruction set.
+ */
+#ifdef FMR_X86_SIMD
+#define DISPATCH_CAST(func, num_eles, in, out)			\
+	switch (get_isa()) {						\
+		case ISA_AVX512: avx512::func(num_eles, in, out); return;	\
+		case ISA_AVX2: avx2::func(num_eles, in, out); return;	\
+		default: break;						\
+	}
+#else
+#define DISPATCH_CAST(func, num_eles, in, out)
+#endif
+
+void cast_int2real(size_t num_eles, const int *in, double *out)
+{
+	DISPATCH_CAST(cast_int2real, num_eles, in, out);
+	scalar_cast<int, double, scalar_int2real>(num_eles, 0, in, out);
+}
+
+void cast_real2int(size_t num_eles, const double *in, int *out)
+{
+	DISPATCH_CAST(cast_real2int, num_eles, in, out);
+	scalar_cast<double, int, scalar_real2int>(num_eles, 0, in, out);
+}
+
+void cast_real2logical(size_t num_eles, const double *in, int *out)
+{
+	DISPATCH_CAST(cast_real2logical, num_eles, in, out);
+	scalar_cast<double, int, scalar_real2logical>(num_eles, 0, in, out);
+}
+
+void cast_int2logical(size_t num_eles, const int *in, int *out)
+{
+	DISPATCH_CAST(cast_int2logical, num_eles, in, out);
+	scalar_cast<int, int, scalar_int2logical>(num_eles, 0, in, out);
+}
+
+/*
+ * Find the first element that isn't NA, and then search the rest of
+ * the array with the kernel.
+ */
+template<bool is_max, class T>
+static int which(const T *arr, size_t num_eles)
+{
+	size_t i = 0;
+	for (; i < num_eles && is_missing(arr[i]); i++);
+	if (i == num_eles)
+		return NA_INT;
+
+	T best = arr[i];
+	ssize_t best_idx = i;
+#ifdef FMR_X86_SIMD
+	// The integer kernels keep the indices in 32-bit integers.
+	if (sizeof(T) == sizeof(int) && num_eles >= (size_t) INT_MAX)
+		scalar_which<is_max>(arr, i + 1, num_eles, best, best_idx);
+	else if (get_isa() == ISA_AVX512)
+		avx512::which_run<is_max>(arr, i + 1, num_eles, best, best_idx);
+	else if (get_isa() == ISA_AVX2)
+		avx2::which_run<is_max>(arr, i + 1, num_eles, best, best_idx);
+	else
+#endif
+		scalar_which<is_max>(arr, i + 1, num_eles, best, best_idx);
+	return best_idx + 1;
+}
+
+int which_min(const int *arr, size_t num_eles)
+{
+	return which<false>(arr, num_eles);
+}
+
+int which_min(const double *arr, size_t num_eles)
+{
+	return which<false>(arr, num_eles);
+}
+
+int which_max(const int *arr, size_t num_eles)
+{
+	return which<true>(arr, num_eles);
+}
+
+int which_max(const double *arr, size_t num_eles)
+{
+	return which<true>(arr, num_eles);
+}
+
+template<bool is_max, class T>
+static void row_which(const T *mat, size_t nrow, size_t ncol, bool row_major,
+		int *out)
+{
+#ifdef FMR_X86_SIMD
+	// The gather instructions take 32-bit offsets.
+	bool gather_ok = !row_major || nrow * ncol < (size_t) INT_MAX;
+	if (gather_ok && get_isa() == ISA_AVX512) {
+		if (row_major)
+			avx512::row_which_run<is_max, true>(mat, nrow, ncol, out);
+		else
+			avx512::row_which_run<is_max, false>(mat, nrow, ncol, out);
+		return;
+	}
+	if (gather_ok && get_isa() == ISA_AVX2) {
+		if (row_major)
+			avx2::row_which_run<is_max, true>(mat, nrow, ncol, out);
+		else
+			avx2::row_which_run<is_max, false>(mat, nrow, ncol, out);
+		return;
+	}
+#endif
+	scalar_row_which<is_max>(mat, 0, nrow, ncol, row_major, out);
+}
+
+void row_which_min(const int *mat, size_t nrow, size_t ncol, bool row_major,
+		int *out)
+{
+	row_which<false>(mat, nrow, ncol, row_major, out);
+}
+
+void row_which_min(const double *mat, size_t nrow, size_t ncol,
+		bool row_major, int *out)
+{
+	row_which<false>(mat, nrow, ncol, row_major, out);
+}
+
+void row_which_max(const int *mat, size_t nrow, size_t ncol, bool row_major,
+		int *out)
+{
+	row_which<true>(mat, nrow, ncol, row_major, out);
+}
+
+void row_which_max(const double *mat, size_t nrow, size_t ncol,
+		bool row_major, int *out)
+{
+	row_which<true>(mat, nrow, ncol, row_major, out);
+}
+
+void nearest_center(const double *data, size_t nrow, size_t ncol,
+		bool row_major, const double *centers, size_t num_centers, int *idx,
+		double *dist)
+{
+#ifdef FMR_X86_SIMD
+	if (get_isa() == ISA_AVX512) {
+		avx512::nearest_center_run(data, nrow, ncol, row_major, centers,
+				num_centers, idx, dist);
+		return;
+	}
+	if (get_isa() == ISA_AVX2) {
+		avx2::nearest_center_run(data, nrow, ncol, row_major, centers,
+				num_centers, idx, dist);
+		return;
+	}
+#endif
+	for (size_t i = 0; i < nrow; i++)
+		scalar_nearest_finish(data, nrow, ncol, row_major, i, centers,
+				num_centers, 0, NULL, NULL, 0, idx, dist);
+}
+
+/*
+ * AVX-512 CPUs use the AVX2 kernels, which are already bound by memory
+ * bandwidth. The tiles on the edges of the block are transposed by scalar
+ * code.
+ */
+template<class T>
+static void blocked_transpose(const T *in, size_t nrow, size_t ncol,
+		size_t in_ld, T *out, size_t out_ld)
+{
+	const size_t tile_len = transpose_tile_len<T>::value;
+	for (size_t i = 0; i < nrow; i += tile_len) {
+		size_t tile_nrow = std::min(tile_len, nrow - i);
+		for (size_t j = 0; j < ncol; j += tile_len) {
+			size_t tile_ncol = std::min(tile_len, ncol - j);
+			const T *tile_in = in + i * in_ld + j;
+			T *tile_out = out + i + j * out_ld;
+#ifdef FMR_X86_SIMD
+			if (get_isa() != ISA_SCALAR && tile_nrow == tile_len
+					&& tile_ncol == tile_len) {
+				avx2::transpose_tile(tile_in, in_ld, tile_out, out_ld);
+				continue;
+			}
+#endif
+			scalar_transpose_tile(tile_in, tile_nrow, tile_ncol, in_ld,
+					tile_out, out_ld);
+		}
+	}
+}
+
+void transpose(const double *in, size_t nrow, size_t ncol, size_t in_ld,
+		double *out, size_t out_ld)
+{
+	blocked_transpose(in, nrow, ncol, in_ld, out, out_ld);
+}
+
+void transpose(const int *in, size_t nrow, size_t ncol, size_t in_ld,
+		int *out, size_t out_ld)
+{
+	blocked_transpose(in, nrow, ncol, in_ld, out, out_ld);
+}
+
+}
+
+}
@@ -0,0 +1,225 @@
+#ifndef __FMR_SIMD_H__
+#define __FMR_SIMD_H__
+
+/*
+ * Copyright 2015 Open Connectome Project (http://openconnecto.me)
+ *
+ * This file is part of FlashR.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+
+/*
+ * This file declares the vectorized kernels that FlashR uses for its own
+ * element-wise operators. The kernels don't depend on R or FlashMatrix
+ * headers. They follow R's NA rules directly: NA_INTEGER and NA_LOGICAL
+ * are INT_MIN and NA_REAL is the NaN whose lower word is 1954.
+ *
+ * The instruction set is detected once at runtime. A kernel getter returns
+ * NULL if we don't have a kernel for the CPU, and the caller should fall
+ * back to its scalar implementation.
+ */
+
+namespace fmr
+{
+
+namespace simd
+{
+
+enum isa_t
+{
+	ISA_SCALAR,
+	ISA_AVX2,
+	ISA_AVX512,
+};
+
+/*
+ * The best instruction set supported by both the CPU and the compiler.
+ */
+isa_t get_isa();
+const char *get_isa_name(isa_t isa);
+
+/*
+ * Test if an integer or logical array contains NA.
+ */
+bool contain_na(const int *arr, size_t num_eles);
+/*
+ * Test if a double array contains NaN. NA is also a NaN.
+ */
+bool contain_nan(const double *arr, size_t num_eles);
+
+/*
+ * Cast arrays between R types with R's rules. NA is cast to NA. NaN and
+ * doubles out of the integer range are cast to NA_INTEGER. A value is TRUE
+ * if it isn't zero.
+ */
+void cast_int2real(size_t num_eles, const int *in, double *out);
+void cast_real2int(size_t num_eles, const double *in, int *out);
+void cast_real2logical(size_t num_eles, const double *in, int *out);
+void cast_int2logical(size_t num_eles, const int *in, int *out);
+
+/*
+ * which.min and which.max with R's rules. NA and NaN are ignored and
+ * the first minimum or maximum is chosen. They return a 1-based index,
+ * or NA_INTEGER if all elements are NA.
+ */
+int which_min(const int *arr, size_t num_eles);
+int which_min(const double *arr, size_t num_eles);
+int which_max(const int *arr, size_t num_eles);
+int which_max(const double *arr, size_t num_eles);
+
+/*
+ * which.min and which.max of every row of a matrix stored contiguously in
+ * row-major or column-major order. We compute many rows at once, one row
+ * in each SIMD lane. The result of row `i' is written to `out[i]'.
+ */
+void row_which_min(const int *mat, size_t nrow, size_t ncol, bool row_major,
+		int *out);
+void row_which_min(const double *mat, size_t nrow, size_t ncol,
+		bool row_major, int *out);
+void row_which_max(const int *mat, size_t nrow, size_t ncol, bool row_major,
+		int *out);
+void row_which_max(const double *mat, size_t nrow, size_t ncol,
+		bool row_major, int *out);
+
+/*
+ * Find the nearest center of every row of a data matrix stored contiguously
+ * in row-major or column-major order. The distance is the squared Euclidean
+ * distance. `centers' is a column-major matrix with a center in each row,
+ * i.e., an R matrix. The 1-based index of the nearest center of row `i' is
+ * written to `idx[i]' and its distance to `dist[i]' if `dist' isn't NULL.
+ * Distances that are NaN are ignored, so a row with NA gets NA.
+ */
+void nearest_center(const double *data, size_t nrow, size_t ncol,
+		bool row_major, const double *centers, size_t num_centers, int *idx,
+		double *dist);
+
+/*
+ * Copy a row-major block with `nrow' rows and `ncol' columns to
+ * a column-major block, e.g., a part of an R matrix. `in_ld' is the number
+ * of elements between two rows of the input and `out_ld' is the number of
+ * elements between two columns of the output. The block is copied in
+ * tiles that fit in L1 cache.
+ */
+void transpose(const double *in, size_t nrow, size_t ncol, size_t in_ld,
+		double *out, size_t out_ld);
+void transpose(const int *in, size_t nrow, size_t ncol, size_t in_ld,
+		int *out, size_t out_ld);
+
+/*
+ * Whether the left or the right operand is a single element.
+ */
+enum operand_t
+{
+	AA,
+	AE,
+	EA,
+};
+
+/*
+ * The NA-aware binary operators that have SIMD kernels.
+ */
+enum na_bop_t
+{
+	NA_ADD,
+	NA_SUB,
+	NA_MUL,
+	NA_DIV,
+	NA_EQ,
+	NA_NEQ,
+	NA_GT,
+	NA_GE,
+	NA_LT,
+	NA_LE,
+	NUM_NA_BOPS,
+};
+
+/*
+ * A kernel computes `num_eles' output elements. When an operand is
+ * a single element, it is read from the first element of the array.
+ */
+template<class InType, class OutType>
+struct bop_kernel
+{
+	typedef void (*type)(size_t num_eles, const InType *left,
+			const InType *right, OutType *out);
+};
+
+/*
+ * Get the NA-aware kernel of a binary operator. Integer kernels work for
+ * both integers and logicals because NA_INTEGER and NA_LOGICAL are the same.
+ * The output type has to match the one of the scalar operator:
+ * arithmetic on integers outputs integers except division, which outputs
+ * doubles, and comparison always outputs logicals.
+ */
+template<class InType, class OutType>
+typename bop_kernel<InType, OutType>::type get_na_kernel(na_bop_t op,
+		operand_t type);
+
+template<>
+bop_kernel<int, int>::type get_na_kernel<int, int>(na_bop_t op,
+		operand_t type);
+template<>
+bop_kernel<int, double>::type get_na_kernel<int, double>(na_bop_t op,
+		operand_t type);
+template<>
+bop_kernel<double, double>::type get_na_kernel<double, double>(na_bop_t op,
+		operand_t type);
+template<>
+bop_kernel<double, int>::type get_na_kernel<double, int>(na_bop_t op,
+		operand_t type);
+
+/*
+ * The NA-aware unary math functions that have SIMD kernels.
+ * They always output doubles.
+ */
+enum na_uop_t
+{
+	NA_SQRT,
+	NA_LOG,
+	NA_LOG2,
+	NA_LOG10,
+	NA_LOG1P,
+	NA_EXP,
+	NUM_NA_UOPS,
+};
+
+/*
+ * A unary kernel computes `num_eles' output elements. NA outputs NA and
+ * NaN outputs NaN.
+ */
+template<class InType>
+struct uop_kernel
+{
+	typedef void (*type)(size_t num_eles, const InType *in, double *out);
+};
+
+/*
+ * Get the NA-aware kernel of a unary math function. Integer kernels work
+ * for both integers and logicals.
+ */
+template<class InType>
+typename uop_kernel<InType>::type get_na_ukernel(na_uop_t op);
+
+template<>
+uop_kernel<int>::type get_na_ukernel<int>(na_uop_t op);
+template<>
+uop_kernel<double>::type get_na_ukernel<double>(na_uop_t op);
+
+}
+
+}
+
+#endif
@@ -0,0 +1,106 @@
+/*
+ * Copyright 2015 Open Connectome Project (http://openconnecto.me)
+ *
+ * This file is part of FlashR.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The vectorized nearest-center search.
+ *
+ * Like fmr_simd_math.h, this file doesn't have an include guard and is
+ * included in the namespace of each instruction set. Each SIMD lane computes
+ * the distance to a different center, so the centers have to be stored in
+ * column-major order, i.e., the same order as an R matrix with a center
+ * in each row.
+ */
+
+/*
+ * The number of rows that share the loads of centers in registers.
+ */
+static const size_t DIST_REG_ROWS = 4;
+
+/*
+ * Compute the distance between `R' rows starting from `row' and the centers
+ * in [cbase, cbase + VLEN), and keep the nearest center of each lane in
+ * `bests' and `idxs'.
+ */
+template<size_t R>
+static inline void center_block_dist(const double *data, size_t nrow,
+		size_t ncol, bool row_major, size_t row, const double *centers,
+		size_t num_centers, size_t cbase, double *bests, double *idxs)
+{
+	vdouble acc[R];
+	for (size_t r = 0; r < R; r++)
+		acc[r] = vset(0);
+	for (size_t j = 0; j < ncol; j++) {
+		vdouble c = vload(centers + cbase + j * num_centers);
+		for (size_t r = 0; r < R; r++) {
+			vdouble diff = vsub(vset(get_ele(data, nrow, ncol, row_major,
+							row + r, j)), c);
+			acc[r] = vadd(acc[r], vmul(diff, diff));
+		}
+	}
+
+	double lanes[VLEN];
+	for (size_t k = 0; k < VLEN; k++)
+		lanes[k] = cbase + k;
+	vdouble cidx = vload(lanes);
+	for (size_t r = 0; r < R; r++) {
+		vdouble best = vload(bests + r * VLEN);
+		// NaN is ignored. It also marks the lanes that haven't found
+		// a center.
+		vmask take = vor(vlt(acc[r], best),
+				vand(visnan(best), veq(acc[r], acc[r])));
+		vstore(bests + r * VLEN, vselect(take, acc[r], best));
+		vstore(idxs + r * VLEN, vselect(take, cidx,
+					vload(idxs + r * VLEN)));
+	}
+}
+
+/*
+ * We compute a block of rows against a block of centers at a time, so that
+ * the centers stay in L1 cache while we go through the rows.
+ */
+static void nearest_center_run(const double *data, size_t nrow, size_t ncol,
+		bool row_major, const double *centers, size_t num_centers, int *idx,
+		double *dist)
+{
+	static const size_t ROW_BLOCK = 64;
+	double bests[ROW_BLOCK * VLEN];
+	double idxs[ROW_BLOCK * VLEN];
+	size_t num_vec_centers = num_centers - num_centers % VLEN;
+	for (size_t start = 0; start < nrow; start += ROW_BLOCK) {
+		size_t end = std::min(start + ROW_BLOCK, nrow);
+		for (size_t k = 0; k < (end - start) * VLEN; k++) {
+			bests[k] = NAN;
+			idxs[k] = -1;
+		}
+		for (size_t c = 0; c < num_vec_centers; c += VLEN) {
+			size_t i = start;
+			for (; i + DIST_REG_ROWS <= end; i += DIST_REG_ROWS)
+				center_block_dist<DIST_REG_ROWS>(data, nrow, ncol, row_major,
+						i, centers, num_centers, c, bests + (i - start) * VLEN,
+						idxs + (i - start) * VLEN);
+			for (; i < end; i++)
+				center_block_dist<1>(data, nrow, ncol, row_major, i, centers,
+						num_centers, c, bests + (i - start) * VLEN,
+						idxs + (i - start) * VLEN);
+		}
+		for (size_t i = start; i < end; i++)
+			scalar_nearest_finish(data, nrow, ncol, row_major, i, centers,
+					num_centers, num_vec_centers, bests + (i - start) * VLEN,
+					idxs + (i - start) * VLEN, VLEN, idx, dist);
+	}
+}
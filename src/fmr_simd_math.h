@@ -0,0 +1,210 @@
+/*
+ * Copyright 2015 Open Connectome Project (http://openconnecto.me)
+ *
+ * This file is part of FlashR.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The vectorized math functions.
+ *
+ * This file doesn't have an include guard. fmr_simd.cpp includes it once
+ * in the namespace of each instruction set, which defines `vdouble',
+ * `vmask', `VLEN' and the basic operations on them. The algorithms follow
+ * fdlibm, so the results are within one or two ulps of the C library.
+ */
+
+static const double LN2_HI = 6.93147180369123816490e-01;
+static const double LN2_LO = 1.90821492927058770002e-10;
+static const double INV_LN2 = 1.44269504088896338700e+00;
+static const double INV_LN10 = 4.34294481903251816668e-01;
+static const double LOG10_2_HI = 3.01029995663611771306e-01;
+static const double LOG10_2_LO = 3.69423907715893078616e-13;
+
+/*
+ * Split a positive and finite x into 2^k * (1 + f), where 1 + f is
+ * in [sqrt(2)/2, sqrt(2)), and compute log(1 + f) without f.
+ * That is, log(1 + f) = f - hfsq + s * (hfsq + R).
+ */
+static inline void vlog_reduce(vdouble x, vdouble &k, vdouble &f,
+		vdouble &hfsq, vdouble &sR)
+{
+	static const double Lg1 = 6.666666666666735130e-01;
+	static const double Lg2 = 3.999999999940941908e-01;
+	static const double Lg3 = 2.857142874366239149e-01;
+	static const double Lg4 = 2.222219843214978396e-01;
+	static const double Lg5 = 1.818357216161805012e-01;
+	static const double Lg6 = 1.531383769920937332e-01;
+	static const double Lg7 = 1.479819860511658591e-01;
+
+	// Scale subnormal numbers, so they have an exponent.
+	vmask subnormal = vlt(x, vset(2.2250738585072014e-308));
+	x = vselect(subnormal, vmul(x, vset(18014398509481984.0)), x);
+	k = vsub(vget_exp(x), vselect(subnormal, vset(54), vset(0)));
+	vdouble m = vget_mant(x);
+	vmask large = vgt(m, vset(1.41421356237309504880));
+	m = vselect(large, vmul(m, vset(0.5)), m);
+	k = vselect(large, vadd(k, vset(1)), k);
+
+	f = vsub(m, vset(1));
+	vdouble s = vdiv(f, vadd(vset(2), f));
+	vdouble z = vmul(s, s);
+	vdouble w = vmul(z, z);
+	vdouble t1 = vmul(w, vadd(vset(Lg2), vmul(w, vadd(vset(Lg4),
+						vmul(w, vset(Lg6))))));
+	vdouble t2 = vmul(z, vadd(vset(Lg1), vmul(w, vadd(vset(Lg3),
+						vmul(w, vadd(vset(Lg5), vmul(w, vset(Lg7))))))));
+	hfsq = vmul(vset(0.5), vmul(f, f));
+	sR = vmul(s, vadd(hfsq, vadd(t1, t2)));
+}
+
+/*
+ * Set the result of log for zero, negative numbers and infinity.
+ * NaN is handled by the caller.
+ */
+static inline vdouble vlog_special(vdouble x, vdouble res)
+{
+	res = vselect(veq(x, vset(INFINITY)), vset(INFINITY), res);
+	res = vselect(vlt(x, vset(0)), vset(NAN), res);
+	return vselect(veq(x, vset(0)), vset(-INFINITY), res);
+}
+
+static inline vdouble vlog(vdouble x)
+{
+	vdouble k, f, hfsq, sR;
+	vlog_reduce(x, k, f, hfsq, sR);
+	vdouble res = vsub(vmul(k, vset(LN2_HI)), vsub(vsub(hfsq,
+					vadd(sR, vmul(k, vset(LN2_LO)))), f));
+	return vlog_special(x, res);
+}
+
+static inline vdouble vlog2(vdouble x)
+{
+	vdouble k, f, hfsq, sR;
+	vlog_reduce(x, k, f, hfsq, sR);
+	vdouble lp = vadd(vsub(f, hfsq), sR);
+	vdouble res = vadd(k, vmul(lp, vset(INV_LN2)));
+	return vlog_special(x, res);
+}
+
+static inline vdouble vlog10(vdouble x)
+{
+	vdouble k, f, hfsq, sR;
+	vlog_reduce(x, k, f, hfsq, sR);
+	vdouble lp = vadd(vsub(f, hfsq), sR);
+	vdouble res = vadd(vadd(vmul(k, vset(LOG10_2_LO)),
+				vmul(lp, vset(INV_LN10))), vmul(k, vset(LOG10_2_HI)));
+	return vlog_special(x, res);
+}
+
+/*
+ * log(1 + x). We correct the rounding error of 1 + x with the first
+ * order term, i.e., log(u) - ((u - 1) - x) / u.
+ */
+static inline vdouble vlog1p(vdouble x)
+{
+	vdouble u = vadd(vset(1), x);
+	vdouble c = vsub(vsub(u, vset(1)), x);
+	vdouble res = vsub(vlog(u), vdiv(c, u));
+	res = vselect(veq(x, vset(INFINITY)), vset(INFINITY), res);
+	res = vselect(vlt(x, vset(-1)), vset(NAN), res);
+	return vselect(veq(x, vset(-1)), vset(-INFINITY), res);
+}
+
+static inline vdouble vexp(vdouble x)
+{
+	static const double P1 = 1.66666666666666019037e-01;
+	static const double P2 = -2.77777777770155933842e-03;
+	static const double P3 = 6.61375632143793436117e-05;
+	static const double P4 = -1.65339022054652515390e-06;
+	static const double P5 = 4.13813679705723846039e-08;
+	static const double EXP_MAX = 7.09782712893383973096e+02;
+	static const double EXP_MIN = -7.45133219101941108420e+02;
+
+	vdouble clamped = vmin(vmax(x, vset(EXP_MIN - 1)), vset(EXP_MAX + 1));
+	vdouble k = vround(vmul(clamped, vset(INV_LN2)));
+	vdouble hi = vsub(clamped, vmul(k, vset(LN2_HI)));
+	vdouble lo = vmul(k, vset(LN2_LO));
+	vdouble r = vsub(hi, lo);
+	vdouble t = vmul(r, r);
+	vdouble c = vsub(r, vmul(t, vadd(vset(P1), vmul(t, vadd(vset(P2),
+							vmul(t, vadd(vset(P3), vmul(t, vadd(vset(P4),
+												vmul(t, vset(P5)))))))))));
+	vdouble y = vsub(vset(1), vsub(vsub(lo, vdiv(vmul(r, c),
+						vsub(vset(2), c))), hi));
+	// 2^k may not be a normal number, so we scale y in two steps.
+	vdouble k1 = vfloor(vmul(k, vset(0.5)));
+	vdouble k2 = vsub(k, k1);
+	vdouble res = vmul(vmul(y, vpow2(k1)), vpow2(k2));
+	res = vselect(vgt(x, vset(EXP_MAX)), vset(INFINITY), res);
+	return vselect(vlt(x, vset(EXP_MIN)), vset(0), res);
+}
+
+template<na_uop_t op>
+static inline vdouble vcompute(vdouble x);
+
+template<>
+inline vdouble vcompute<NA_SQRT>(vdouble x)
+{
+	return vsqrt(x);
+}
+
+template<>
+inline vdouble vcompute<NA_LOG>(vdouble x)
+{
+	return vlog(x);
+}
+
+template<>
+inline vdouble vcompute<NA_LOG2>(vdouble x)
+{
+	return vlog2(x);
+}
+
+template<>
+inline vdouble vcompute<NA_LOG10>(vdouble x)
+{
+	return vlog10(x);
+}
+
+template<>
+inline vdouble vcompute<NA_LOG1P>(vdouble x)
+{
+	return vlog1p(x);
+}
+
+template<>
+inline vdouble vcompute<NA_EXP>(vdouble x)
+{
+	return vexp(x);
+}
+
+/*
+ * Compute a unary math function. NA outputs NA and NaN outputs itself.
+ * The input and the output may be the same array.
+ */
+template<na_uop_t op>
+static void real_urun(size_t num_eles, const double *in, double *out)
+{
+	const vdouble na = vset(get_na_real());
+	size_t i = 0;
+	for (; i + VLEN <= num_eles; i += VLEN) {
+		vdouble x = vload(in + i);
+		vdouble res = vcompute<op>(x);
+		res = vselect(visnan(x), x, res);
+		res = vselect(vis_na(x), na, res);
+		vstore(out + i, res);
+	}
+	scalar_real_urun<op>(num_eles, i, in, out);
+}
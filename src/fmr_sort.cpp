@@ -0,0 +1,906 @@
+/*
+ * Copyright 2015 Open Connectome Project (http://openconnecto.me)
+ *
+ * This file is part of FlashR.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "local_matrix_store.h"
+
+#include "fmr_sort.h"
+#include "fmr_parallel.h"
+
+using namespace fm;
+
+namespace fmr
+{
+
+/*
+ * We sort 8 bits in a pass, so the counters of a pass fit in the L1 cache.
+ */
+static const int RADIX_BITS = 8;
+static const size_t RADIX_SIZE = 1 << RADIX_BITS;
+static const size_t RADIX_MASK = RADIX_SIZE - 1;
+/*
+ * Insertion sort is faster for short arrays.
+ */
+static const size_t MIN_RADIX_LEN = 64;
+/*
+ * We sort an array in a single thread if it's shorter than this.
+ */
+static const size_t MIN_PAR_LEN = 1 << 16;
+/*
+ * We rank short arrays by comparing all pairs of elements.
+ */
+static const size_t MAX_PAIRWISE_LEN = 12;
+/*
+ * Radix sort of a short array is dominated by the cost of the counters of
+ * the passes, so we rank arrays shorter than this with comparison sorts.
+ */
+static const size_t MIN_RANK_RADIX_LEN = 256;
+
+/*
+ * Map a value to an unsigned integer with the same order. MAX_KEY is
+ * the largest key of a value that isn't NA. All NAs have the same key,
+ * which is larger than MAX_KEY. The NA of doubles can't be recovered
+ * from its key because NA and NaN differ.
+ */
+template<class T>
+struct sort_key
+{
+};
+
+template<>
+struct sort_key<int>
+{
+	typedef uint32_t key_t;
+	static const key_t MAX_KEY = 0xFFFFFFFEU;
+
+	static key_t to_key(int v) {
+		// NA_INTEGER is INT_MIN.
+		if (v == INT_MIN)
+			return MAX_KEY + 1;
+		return (((uint32_t) v) ^ 0x80000000U) - 1;
+	}
+	static int from_key(key_t k) {
+		if (k > MAX_KEY)
+			return INT_MIN;
+		return (int) ((k + 1) ^ 0x80000000U);
+	}
+};
+
+template<>
+struct sort_key<double>
+{
+	typedef uint64_t key_t;
+	// The key of Inf.
+	static const key_t MAX_KEY = 0xFFF0000000000000ULL;
+
+	static key_t to_key(double v) {
+		// -0 and 0 are the same value.
+		if (v == 0)
+			v = 0;
+		// All NaNs have the same key, so they keep their order.
+		if (isnan(v))
+			return MAX_KEY + 1;
+		uint64_t bits;
+		memcpy(&bits, &v, sizeof(bits));
+		return (bits >> 63) ? ~bits : bits | (1ULL << 63);
+	}
+	static double from_key(key_t k) {
+		uint64_t bits = (k >> 63) ? k & ~(1ULL << 63) : ~k;
+		double v;
+		memcpy(&v, &bits, sizeof(v));
+		return v;
+	}
+};
+
+/*
+ * Reverse the order of the keys that aren't NA. It's its own inverse.
+ */
+template<class T>
+static inline typename sort_key<T>::key_t flip_key(
+		typename sort_key<T>::key_t k)
+{
+	return k <= sort_key<T>::MAX_KEY ? sort_key<T>::MAX_KEY - k : k;
+}
+
+template<class K, class I>
+static void insertion_sort(K *keys, I *idxs, size_t len)
+{
+	for (size_t i = 1; i < len; i++) {
+		K key = keys[i];
+		I idx = idxs ? idxs[i] : 0;
+		size_t j = i;
+		for (; j > 0 && keys[j - 1] > key; j--) {
+			keys[j] = keys[j - 1];
+			if (idxs)
+				idxs[j] = idxs[j - 1];
+		}
+		keys[j] = key;
+		if (idxs)
+			idxs[j] = idx;
+	}
+}
+
+/*
+ * Sort the keys on their lowest `num_bits' bits with LSD radix sort in
+ * the current thread. The keys and the indices move between the two
+ * buffers in every pass. `idxs' can be NULL. It returns true if
+ * the result ends in `tmp_keys' and `tmp_idxs'.
+ */
+template<class K, class I>
+static bool lsd_sort(K *keys, I *idxs, K *tmp_keys, I *tmp_idxs, size_t len,
+		int num_bits)
+{
+	if (len < MIN_RADIX_LEN) {
+		insertion_sort(keys, idxs, len);
+		return false;
+	}
+
+	bool in_tmp = false;
+	size_t offs[RADIX_SIZE];
+	for (int shift = 0; shift < num_bits; shift += RADIX_BITS) {
+		memset(offs, 0, sizeof(offs));
+		for (size_t i = 0; i < len; i++)
+			offs[(keys[i] >> shift) & RADIX_MASK]++;
+		// All keys have the same digit.
+		if (offs[(keys[0] >> shift) & RADIX_MASK] == len)
+			continue;
+
+		size_t off = 0;
+		for (size_t d = 0; d < RADIX_SIZE; d++) {
+			size_t cnt = offs[d];
+			offs[d] = off;
+			off += cnt;
+		}
+		for (size_t i = 0; i < len; i++) {
+			size_t pos = offs[(keys[i] >> shift) & RADIX_MASK]++;
+			tmp_keys[pos] = keys[i];
+			if (idxs)
+				tmp_idxs[pos] = idxs[i];
+		}
+		std::swap(keys, tmp_keys);
+		std::swap(idxs, tmp_idxs);
+		in_tmp = !in_tmp;
+	}
+	return in_tmp;
+}
+
+/*
+ * Move the keys and the indices to the output buffers in a pass of
+ * the parallel radix sort. `offs' has the counts of the digits in the part
+ * of each thread, which become the output locations of the digits.
+ */
+template<class K, class I>
+static void par_radix_pass(const K *keys, const I *idxs, K *out_keys,
+		I *out_idxs, size_t len, int shift,
+		std::vector<std::vector<size_t> > &offs)
+{
+	size_t num_tasks = offs.size();
+	size_t off = 0;
+	for (size_t d = 0; d < RADIX_SIZE; d++) {
+		for (size_t i = 0; i < num_tasks; i++) {
+			size_t cnt = offs[i][d];
+			offs[i][d] = off;
+			off += cnt;
+		}
+	}
+	parallel_for(num_tasks, [&](size_t i) {
+			std::vector<size_t> &pos = offs[i];
+			size_t end = len * (i + 1) / num_tasks;
+			for (size_t j = len * i / num_tasks; j < end; j++) {
+				size_t p = pos[(keys[j] >> shift) & RADIX_MASK]++;
+				out_keys[p] = keys[j];
+				if (idxs)
+					out_idxs[p] = idxs[j];
+			}
+		});
+}
+
+/*
+ * Count the digits of each range of the keys in parallel.
+ */
+template<class K>
+static void par_count_digits(const K *keys, size_t len, int shift,
+		std::vector<std::vector<size_t> > &offs)
+{
+	size_t num_tasks = offs.size();
+	parallel_for(num_tasks, [&](size_t i) {
+			std::vector<size_t> &cnts = offs[i];
+			std::fill(cnts.begin(), cnts.end(), 0);
+			size_t end = len * (i + 1) / num_tasks;
+			for (size_t j = len * i / num_tasks; j < end; j++)
+				cnts[(keys[j] >> shift) & RADIX_MASK]++;
+		});
+}
+
+/*
+ * LSD radix sort where all threads run each pass together. It has
+ * the same interface as lsd_sort.
+ */
+template<class K, class I>
+static bool par_lsd_sort(K *keys, I *idxs, K *tmp_keys, I *tmp_idxs,
+		size_t len, int num_bits)
+{
+	std::vector<std::vector<size_t> > offs(get_num_tasks(),
+			std::vector<size_t>(RADIX_SIZE));
+	bool in_tmp = false;
+	for (int shift = 0; shift < num_bits; shift += RADIX_BITS) {
+		par_count_digits(keys, len, shift, offs);
+		size_t d0 = (keys[0] >> shift) & RADIX_MASK;
+		size_t cnt = 0;
+		for (size_t i = 0; i < offs.size(); i++)
+			cnt += offs[i][d0];
+		// All keys have the same digit.
+		if (cnt == len)
+			continue;
+
+		par_radix_pass(keys, idxs, tmp_keys, tmp_idxs, len, shift, offs);
+		std::swap(keys, tmp_keys);
+		std::swap(idxs, tmp_idxs);
+		in_tmp = !in_tmp;
+	}
+	return in_tmp;
+}
+
+template<class K, class I>
+static void par_copy(const K *keys, const I *idxs, K *out_keys, I *out_idxs,
+		size_t len)
+{
+	size_t num_tasks = get_num_tasks();
+	parallel_for(num_tasks, [&](size_t i) {
+			size_t start = len * i / num_tasks;
+			size_t end = len * (i + 1) / num_tasks;
+			memcpy(out_keys + start, keys + start, (end - start) * sizeof(K));
+			if (idxs)
+				memcpy(out_idxs + start, idxs + start,
+						(end - start) * sizeof(I));
+		});
+}
+
+/*
+ * Sort the keys in parallel. `idxs' can be NULL.
+ *
+ * We first split the keys into buckets by their highest digit that
+ * differs, which is a pass of MSD radix sort. Each bucket is then sorted
+ * with LSD radix sort on the remaining bits. A small bucket is sorted by
+ * a single thread and many small buckets are sorted at the same time.
+ * A large bucket is sorted by all threads, so a skewed distribution of
+ * the keys doesn't leave the other threads idle.
+ */
+template<class K, class I>
+static void par_radix_sort(K *keys, I *idxs, size_t len)
+{
+	if (len <= 1)
+		return;
+	size_t num_tasks = get_num_tasks();
+	std::vector<K> mins(num_tasks, ~((K) 0));
+	std::vector<K> maxs(num_tasks, 0);
+	parallel_for(num_tasks, [&](size_t i) {
+			size_t end = len * (i + 1) / num_tasks;
+			for (size_t j = len * i / num_tasks; j < end; j++) {
+				mins[i] = std::min(mins[i], keys[j]);
+				maxs[i] = std::max(maxs[i], keys[j]);
+			}
+		});
+	K diff = *std::min_element(mins.begin(), mins.end())
+		^ *std::max_element(maxs.begin(), maxs.end());
+	// All keys are the same.
+	if (diff == 0)
+		return;
+	// The bits above the highest bit that differs are the same in all keys.
+	int num_bits = 0;
+	while (num_bits < (int) sizeof(K) * 8 && (diff >> num_bits) != 0)
+		num_bits++;
+
+	std::vector<K> tmp_keys(len);
+	std::vector<I> tmp_idxs(idxs ? len : 0);
+	I *tmp_idx_arr = idxs ? tmp_idxs.data() : NULL;
+	if (len < MIN_PAR_LEN) {
+		if (lsd_sort(keys, idxs, tmp_keys.data(), tmp_idx_arr, len, num_bits))
+			par_copy(tmp_keys.data(), tmp_idx_arr, keys, idxs, len);
+		return;
+	}
+
+	int msd_shift = std::max(0, num_bits - RADIX_BITS);
+	std::vector<std::vector<size_t> > offs(num_tasks,
+			std::vector<size_t>(RADIX_SIZE));
+	par_count_digits(keys, len, msd_shift, offs);
+	std::vector<size_t> bucket_starts(RADIX_SIZE + 1);
+	for (size_t d = 0; d < RADIX_SIZE; d++) {
+		bucket_starts[d + 1] = bucket_starts[d];
+		for (size_t i = 0; i < num_tasks; i++)
+			bucket_starts[d + 1] += offs[i][d];
+	}
+	par_radix_pass(keys, idxs, tmp_keys.data(), tmp_idx_arr, len, msd_shift,
+			offs);
+
+	// The buckets are in the temporary buffers now, and we move them back
+	// while sorting them.
+	std::vector<size_t> small_buckets;
+	for (size_t d = 0; d < RADIX_SIZE; d++) {
+		size_t start = bucket_starts[d];
+		size_t bucket_len = bucket_starts[d + 1] - start;
+		if (bucket_len == 0)
+			continue;
+		if (bucket_len < len / num_tasks || bucket_len < MIN_PAR_LEN) {
+			small_buckets.push_back(d);
+			continue;
+		}
+		K *bkeys = tmp_keys.data() + start;
+		I *bidxs = idxs ? tmp_idx_arr + start : NULL;
+		I *out_idxs = idxs ? idxs + start : NULL;
+		if (!par_lsd_sort(bkeys, bidxs, keys + start, out_idxs, bucket_len,
+					msd_shift))
+			par_copy(bkeys, bidxs, keys + start, out_idxs, bucket_len);
+	}
+	parallel_for(small_buckets.size(), [&](size_t i) {
+			size_t d = small_buckets[i];
+			size_t start = bucket_starts[d];
+			size_t bucket_len = bucket_starts[d + 1] - start;
+			K *bkeys = tmp_keys.data() + start;
+			I *bidxs = idxs ? tmp_idx_arr + start : NULL;
+			I *out_idxs = idxs ? idxs + start : NULL;
+			if (!lsd_sort(bkeys, bidxs, keys + start, out_idxs, bucket_len,
+						msd_shift)) {
+				memcpy(keys + start, bkeys, bucket_len * sizeof(K));
+				if (idxs)
+					memcpy(out_idxs, bidxs, bucket_len * sizeof(I));
+			}
+		});
+}
+
+template<class T, class I>
+static void radix_sort(const T *arr, size_t len, bool decreasing,
+		T *out, double *out_idxs)
+{
+	typedef typename sort_key<T>::key_t K;
+	std::vector<K> keys(len);
+	std::vector<I> idxs(out_idxs ? len : 0);
+	size_t num_tasks = get_num_tasks();
+	std::vector<size_t> na_offs(num_tasks + 1);
+	parallel_for(num_tasks, [&](size_t i) {
+			size_t end = len * (i + 1) / num_tasks;
+			size_t num_nas = 0;
+			for (size_t j = len * i / num_tasks; j < end; j++) {
+				K k = sort_key<T>::to_key(arr[j]);
+				num_nas += k > sort_key<T>::MAX_KEY;
+				keys[j] = decreasing ? flip_key<T>(k) : k;
+				if (out_idxs)
+					idxs[j] = j;
+			}
+			na_offs[i + 1] = num_nas;
+		});
+	par_radix_sort(keys.data(), out_idxs ? idxs.data() : NULL, len);
+
+	// NAs are in the end in their original order, so we copy them from
+	// the input array.
+	for (size_t i = 0; i < num_tasks; i++)
+		na_offs[i + 1] += na_offs[i];
+	size_t na_start = len - na_offs[num_tasks];
+	parallel_for(num_tasks, [&](size_t i) {
+			size_t end = len * (i + 1) / num_tasks;
+			for (size_t j = len * i / num_tasks; j < std::min(end, na_start);
+					j++) {
+				K k = decreasing ? flip_key<T>(keys[j]) : keys[j];
+				out[j] = sort_key<T>::from_key(k);
+			}
+			if (out_idxs) {
+				for (size_t j = len * i / num_tasks; j < end; j++)
+					out_idxs[j] = idxs[j];
+			}
+			size_t na_pos = na_start + na_offs[i];
+			if (na_offs[i + 1] > na_offs[i]) {
+				for (size_t j = len * i / num_tasks; j < end; j++)
+					if (sort_key<T>::to_key(arr[j]) > sort_key<T>::MAX_KEY)
+						out[na_pos++] = arr[j];
+			}
+		});
+}
+
+template<class T>
+static void radix_sort(const T *arr, size_t len, bool decreasing,
+		T *out, double *out_idxs)
+{
+	// 32-bit indices halve the memory traffic of the indices.
+	if (len <= UINT32_MAX)
+		radix_sort<T, uint32_t>(arr, len, decreasing, out, out_idxs);
+	else
+		radix_sort<T, uint64_t>(arr, len, decreasing, out, out_idxs);
+}
+
+bool radix_sort(col_vec::ptr vec, bool decreasing, dense_matrix::ptr &vals,
+		dense_matrix::ptr *idx)
+{
+	size_t len = vec->get_length();
+	bool is_int = vec->get_type() == get_scalar_type<int>();
+	bool is_double = vec->get_type() == get_scalar_type<double>();
+	if (len == 0 || !(is_int || is_double))
+		return false;
+	// The whole vector is sorted in memory. The caller falls back to
+	// the external-memory sort of FlashMatrix for a vector on disks.
+	if (!vec->is_in_mem())
+		return false;
+
+	dense_matrix::ptr mem_vec = vec->conv_store(true, -1);
+	detail::mem_matrix_store::const_ptr store
+		= std::dynamic_pointer_cast<const detail::mem_matrix_store>(
+				mem_vec->get_raw_store());
+	if (store == NULL)
+		return false;
+
+	detail::mem_matrix_store::ptr val_store = detail::mem_matrix_store::create(
+			len, 1, matrix_layout_t::L_COL, vec->get_type(), -1);
+	detail::mem_matrix_store::ptr idx_store;
+	double *idx_arr = NULL;
+	if (idx) {
+		idx_store = detail::mem_matrix_store::create(len, 1,
+				matrix_layout_t::L_COL, get_scalar_type<double>(), -1);
+		idx_arr = reinterpret_cast<double *>(idx_store->get_raw_arr());
+	}
+	if (is_int)
+		radix_sort(reinterpret_cast<const int *>(store->get_raw_arr()), len,
+				decreasing, reinterpret_cast<int *>(val_store->get_raw_arr()),
+				idx_arr);
+	else
+		radix_sort(reinterpret_cast<const double *>(store->get_raw_arr()), len,
+				decreasing, reinterpret_cast<double *>(val_store->get_raw_arr()),
+				idx_arr);
+	vals = dense_matrix::create(val_store);
+	if (idx)
+		*idx = dense_matrix::create(idx_store);
+	return true;
+}
+
+template<class T>
+static void seq_radix_sort(T *arr, size_t len)
+{
+	typedef typename sort_key<T>::key_t K;
+	std::vector<K> keys(len);
+	std::vector<K> tmp_keys(len);
+	std::vector<T> nas;
+	for (size_t i = 0; i < len; i++) {
+		keys[i] = sort_key<T>::to_key(arr[i]);
+		if (keys[i] > sort_key<T>::MAX_KEY)
+			nas.push_back(arr[i]);
+	}
+	bool in_tmp = lsd_sort<K, uint32_t>(keys.data(), NULL, tmp_keys.data(),
+			NULL, len, sizeof(K) * 8);
+	const K *sorted = in_tmp ? tmp_keys.data() : keys.data();
+	size_t na_start = len - nas.size();
+	for (size_t i = 0; i < na_start; i++)
+		arr[i] = sort_key<T>::from_key(sorted[i]);
+	std::copy(nas.begin(), nas.end(), arr + na_start);
+}
+
+void radix_sort(int *arr, size_t len)
+{
+	seq_radix_sort(arr, len);
+}
+
+void radix_sort(double *arr, size_t len)
+{
+	seq_radix_sort(arr, len);
+}
+
+template<class O>
+static inline void set_ranks(O *out, const uint32_t *idxs, size_t start,
+		size_t end, rank_ties_t ties)
+{
+	// The ranks start from 1.
+	switch (ties) {
+		case RANK_AVERAGE:
+			for (size_t k = start; k < end; k++)
+				out[idxs[k]] = (start + 1 + end) / 2.0;
+			break;
+		case RANK_MIN:
+			for (size_t k = start; k < end; k++)
+				out[idxs[k]] = start + 1;
+			break;
+		case RANK_MAX:
+			for (size_t k = start; k < end; k++)
+				out[idxs[k]] = end;
+			break;
+		case RANK_FIRST:
+			for (size_t k = start; k < end; k++)
+				out[idxs[k]] = k + 1;
+			break;
+	}
+}
+
+/*
+ * The rank of an element is determined by the number of smaller elements
+ * and the number of equal elements. It has no data-dependent branches,
+ * so it's faster than sorting on short arrays.
+ */
+template<class T, class O>
+static void pairwise_rank(const T *arr, size_t len, rank_ties_t ties, O *out)
+{
+	typedef typename sort_key<T>::key_t K;
+	K keys[MAX_PAIRWISE_LEN];
+	for (size_t i = 0; i < len; i++)
+		keys[i] = sort_key<T>::to_key(arr[i]);
+	for (size_t i = 0; i < len; i++) {
+		size_t num_less = 0;
+		size_t num_eq_before = 0;
+		size_t num_eq_after = 0;
+		for (size_t j = 0; j < i; j++) {
+			num_less += keys[j] < keys[i];
+			num_eq_before += keys[j] == keys[i];
+		}
+		for (size_t j = i + 1; j < len; j++) {
+			num_less += keys[j] < keys[i];
+			num_eq_after += keys[j] == keys[i];
+		}
+		// NAs aren't tied.
+		if (keys[i] > sort_key<T>::MAX_KEY) {
+			out[i] = num_less + num_eq_before + 1;
+			continue;
+		}
+		switch (ties) {
+			case RANK_AVERAGE:
+				out[i] = num_less + (num_eq_before + num_eq_after + 2) / 2.0;
+				break;
+			case RANK_MIN:
+				out[i] = num_less + 1;
+				break;
+			case RANK_MAX:
+				out[i] = num_less + num_eq_before + num_eq_after + 1;
+				break;
+			case RANK_FIRST:
+				out[i] = num_less + num_eq_before + 1;
+				break;
+		}
+	}
+}
+
+template<class T, class O>
+static void rank(const T *arr, size_t len, rank_ties_t ties, O *out,
+		std::vector<char> &buf)
+{
+	if (len <= MAX_PAIRWISE_LEN) {
+		pairwise_rank(arr, len, ties, out);
+		return;
+	}
+
+	typedef typename sort_key<T>::key_t K;
+	size_t num_bytes = len * 2 * (sizeof(K) + sizeof(uint32_t));
+	if (buf.size() < num_bytes)
+		buf.resize(num_bytes);
+	K *keys = reinterpret_cast<K *>(buf.data());
+	K *tmp_keys = keys + len;
+	uint32_t *idxs = reinterpret_cast<uint32_t *>(tmp_keys + len);
+	uint32_t *tmp_idxs = idxs + len;
+
+	if (len >= MIN_RADIX_LEN && len < MIN_RANK_RADIX_LEN) {
+		// An entry is twice as large as a key, so the entries fill
+		// the buffers of the keys, and the key of an entry is written over
+		// the entries that have been read.
+		typedef std::pair<K, uint32_t> entry_t;
+		entry_t *entries = reinterpret_cast<entry_t *>(keys);
+		for (size_t i = 0; i < len; i++)
+			entries[i] = entry_t(sort_key<T>::to_key(arr[i]), i);
+		// Equal keys are ordered by their indices, so NAs keep their order.
+		std::sort(entries, entries + len);
+		for (size_t i = 0; i < len; i++) {
+			idxs[i] = entries[i].second;
+			keys[i] = entries[i].first;
+		}
+	}
+	else {
+		K diff = 0;
+		for (size_t i = 0; i < len; i++) {
+			keys[i] = sort_key<T>::to_key(arr[i]);
+			idxs[i] = i;
+			diff |= keys[i] ^ keys[0];
+		}
+		int num_bits = 0;
+		while (num_bits < (int) sizeof(K) * 8 && (diff >> num_bits) != 0)
+			num_bits++;
+		// It runs insertion sort on short arrays.
+		if (lsd_sort(keys, idxs, tmp_keys, tmp_idxs, len, num_bits)) {
+			keys = tmp_keys;
+			idxs = tmp_idxs;
+		}
+	}
+
+	for (size_t i = 0; i < len;) {
+		size_t j = i + 1;
+		// NAs aren't tied.
+		if (keys[i] <= sort_key<T>::MAX_KEY)
+			while (j < len && keys[j] == keys[i])
+				j++;
+		set_ranks(out, idxs, i, j, ties);
+		i = j;
+	}
+}
+
+void rank(const int *arr, size_t len, rank_ties_t ties, int *out,
+		std::vector<char> &buf)
+{
+	rank<int, int>(arr, len, ties, out, buf);
+}
+
+void rank(const int *arr, size_t len, rank_ties_t ties, double *out,
+		std::vector<char> &buf)
+{
+	rank<int, double>(arr, len, ties, out, buf);
+}
+
+void rank(const double *arr, size_t len, rank_ties_t ties, int *out,
+		std::vector<char> &buf)
+{
+	rank<double, int>(arr, len, ties, out, buf);
+}
+
+void rank(const double *arr, size_t len, rank_ties_t ties, double *out,
+		std::vector<char> &buf)
+{
+	rank<double, double>(arr, len, ties, out, buf);
+}
+
+/*
+ * Move the k smallest entries to the front in the sorted order.
+ * nth_element runs introselect, so it's linear.
+ */
+template<class E>
+static void select_sorted(E *entries, size_t len, size_t k)
+{
+	if (k < len)
+		std::nth_element(entries, entries + k, entries + len);
+	std::sort(entries, entries + k);
+}
+
+/*
+ * An entry has the key and the location of an element. Entries with
+ * equal keys are ordered by their locations, so the selection is stable.
+ */
+template<class T, class I>
+struct topk_entry
+{
+	typedef std::pair<typename sort_key<T>::key_t, I> type;
+
+	static type create(T v, I idx, bool decreasing) {
+		typename sort_key<T>::key_t k = sort_key<T>::to_key(v);
+		return type(decreasing ? flip_key<T>(k) : k, idx);
+	}
+};
+
+/*
+ * A candidate of the k smallest elements. It keeps the value because
+ * NA and NaN have the same key.
+ */
+template<class T>
+struct topk_cand
+{
+	typename topk_entry<T, size_t>::type entry;
+	T val;
+
+	bool operator<(const topk_cand<T> &cand) const {
+		return entry < cand.entry;
+	}
+};
+
+/*
+ * Select the k smallest elements of the elements added to it. We keep at
+ * most 2k candidates in the buffer and only keep the k smallest ones when
+ * it's full. After that, an element is added only if it's smaller than
+ * the largest candidate we keep, so most elements are skipped after
+ * a while. Parts of the vector can be added in any order.
+ */
+template<class T>
+class topk_selector
+{
+	size_t k;
+	bool decreasing;
+	bool full;
+	typename topk_entry<T, size_t>::type max_entry;
+	std::vector<topk_cand<T> > buf;
+public:
+	topk_selector(size_t k, bool decreasing) {
+		this->k = k;
+		this->decreasing = decreasing;
+		this->full = false;
+	}
+
+	void add(const T *arr, size_t len, size_t start_idx) {
+		if (k == 0)
+			return;
+		for (size_t i = 0; i < len; i++) {
+			topk_cand<T> cand;
+			cand.entry = topk_entry<T, size_t>::create(arr[i], start_idx + i,
+					decreasing);
+			// The parts may not be added in order, so we compare
+			// the locations as well.
+			if (full && !(cand.entry < max_entry))
+				continue;
+			cand.val = arr[i];
+			buf.push_back(cand);
+			if (buf.size() == 2 * k) {
+				std::nth_element(buf.begin(), buf.begin() + k - 1, buf.end());
+				buf.resize(k);
+				max_entry = buf[k - 1].entry;
+				full = true;
+			}
+		}
+	}
+
+	const std::vector<topk_cand<T> > &get_cands() const {
+		return buf;
+	}
+};
+
+/*
+ * Each thread selects the k smallest elements in the portions it
+ * processes, so the vector is read once portion by portion and it doesn't
+ * need to be in memory.
+ */
+template<class T>
+class topk_portion_op: public detail::portion_mapply_op
+{
+	std::shared_ptr<std::vector<topk_selector<T> > > selectors;
+	bool transposed;
+
+	topk_portion_op(std::shared_ptr<std::vector<topk_selector<T> > > selectors,
+			bool transposed): detail::portion_mapply_op(0, 0,
+				get_scalar_type<T>()) {
+		this->selectors = selectors;
+		this->transposed = transposed;
+	}
+public:
+	topk_portion_op(size_t k, bool decreasing): detail::portion_mapply_op(0, 0,
+			get_scalar_type<T>()) {
+		selectors = std::shared_ptr<std::vector<topk_selector<T> > >(
+				new std::vector<topk_selector<T> >(
+					detail::mem_thread_pool::get_global_num_threads(),
+					topk_selector<T>(k, decreasing)));
+		transposed = false;
+	}
+
+	virtual detail::portion_mapply_op::const_ptr transpose() const {
+		return detail::portion_mapply_op::const_ptr(new topk_portion_op<T>(
+					selectors, !transposed));
+	}
+
+	virtual void run(
+			const std::vector<detail::local_matrix_store::const_ptr> &ins) const {
+		const detail::local_matrix_store &in = *ins[0];
+		size_t len = transposed ? in.get_num_cols() : in.get_num_rows();
+		size_t start = transposed
+			? in.get_global_start_col() : in.get_global_start_row();
+		int thread_id = detail::mem_thread_pool::get_curr_thread_id();
+		const T *arr = reinterpret_cast<const T *>(in.get_raw_arr());
+		if (arr) {
+			(*selectors)[thread_id].add(arr, len, start);
+			return;
+		}
+		std::vector<T> buf(len);
+		for (size_t i = 0; i < len; i++)
+			buf[i] = *reinterpret_cast<const T *>(
+					transposed ? in.get(0, i) : in.get(i, 0));
+		(*selectors)[thread_id].add(buf.data(), len, start);
+	}
+
+	/*
+	 * Merge the candidates of all threads and output the k smallest ones.
+	 */
+	void get_topk(size_t k, T *vals, double *idxs) const {
+		std::vector<topk_cand<T> > cands;
+		for (size_t i = 0; i < selectors->size(); i++)
+			cands.insert(cands.end(), (*selectors)[i].get_cands().begin(),
+					(*selectors)[i].get_cands().end());
+		select_sorted(cands.data(), cands.size(), k);
+		for (size_t i = 0; i < k; i++) {
+			vals[i] = cands[i].val;
+			if (idxs)
+				idxs[i] = cands[i].entry.second;
+		}
+	}
+
+	virtual std::string to_string(
+			const std::vector<detail::matrix_store::const_ptr> &mats) const {
+		return std::string("topk(") + mats[0]->get_name() + ")";
+	}
+
+	virtual bool is_agg() const {
+		return false;
+	}
+};
+
+template<class T>
+static void portion_topk(col_vec::ptr vec, size_t k, bool decreasing,
+		T *vals, double *idxs)
+{
+	std::shared_ptr<topk_portion_op<T> > op(new topk_portion_op<T>(k,
+				decreasing));
+	std::vector<detail::matrix_store::const_ptr> stores(1,
+			vec->get_raw_store());
+	detail::__mapply_portion(stores, op, matrix_layout_t::L_COL);
+	op->get_topk(k, vals, idxs);
+}
+
+bool topk(col_vec::ptr vec, size_t k, bool decreasing, dense_matrix::ptr &vals,
+		dense_matrix::ptr *idx)
+{
+	size_t len = vec->get_length();
+	bool is_int = vec->get_type() == get_scalar_type<int>();
+	bool is_double = vec->get_type() == get_scalar_type<double>();
+	if (!(is_int || is_double))
+		return false;
+
+	k = std::min(k, len);
+	detail::mem_matrix_store::ptr val_store = detail::mem_matrix_store::create(
+			k, 1, matrix_layout_t::L_COL, vec->get_type(), -1);
+	detail::mem_matrix_store::ptr idx_store;
+	double *idx_arr = NULL;
+	if (idx) {
+		idx_store = detail::mem_matrix_store::create(k, 1,
+				matrix_layout_t::L_COL, get_scalar_type<double>(), -1);
+		idx_arr = reinterpret_cast<double *>(idx_store->get_raw_arr());
+	}
+	if (is_int)
+		portion_topk(vec, k, decreasing,
+				reinterpret_cast<int *>(val_store->get_raw_arr()), idx_arr);
+	else
+		portion_topk(vec, k, decreasing,
+				reinterpret_cast<double *>(val_store->get_raw_arr()), idx_arr);
+	vals = dense_matrix::create(val_store);
+	if (idx)
+		*idx = dense_matrix::create(idx_store);
+	return true;
+}
+
+template<class T>
+static void seq_topk(const T *arr, size_t len, size_t k, bool decreasing,
+		T *vals, int *idxs, std::vector<char> &buf)
+{
+	typedef typename topk_entry<T, uint32_t>::type entry_t;
+	k = std::min(k, len);
+	if (buf.size() < len * sizeof(entry_t))
+		buf.resize(len * sizeof(entry_t));
+	entry_t *entries = reinterpret_cast<entry_t *>(buf.data());
+	for (size_t i = 0; i < len; i++)
+		entries[i] = topk_entry<T, uint32_t>::create(arr[i], i, decreasing);
+	select_sorted(entries, len, k);
+	for (size_t i = 0; i < k; i++) {
+		if (vals)
+			vals[i] = arr[entries[i].second];
+		if (idxs)
+			idxs[i] = entries[i].second + 1;
+	}
+}
+
+void topk(const int *arr, size_t len, size_t k, bool decreasing, int *vals,
+		int *idxs, std::vector<char> &buf)
+{
+	seq_topk(arr, len, k, decreasing, vals, idxs, buf);
+}
+
+void topk(const double *arr, size_t len, size_t k, bool decreasing,
+		double *vals, int *idxs, std::vector<char> &buf)
+{
+	seq_topk(arr, len, k, decreasing, vals, idxs, buf);
+}
+
+}
@@ -0,0 +1,105 @@
+#ifndef __FMR_SORT_H__
+#define __FMR_SORT_H__
+
+/*
+ * Copyright 2015 Open Connectome Project (http://openconnecto.me)
+ *
+ * This file is part of FlashR.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <vector>
+
+#include "dense_matrix.h"
+
+/*
+ * This file sorts integers, logicals and doubles with radix sort. It also
+ * ranks them and selects the smallest or largest ones without sorting.
+ *
+ * The values are mapped to unsigned integers with the same order first.
+ * NA and NaN are mapped to the largest integers, so they are put in the end
+ * as R does by default, even in decreasing order. The sort is stable.
+ */
+
+namespace fmr
+{
+
+/*
+ * Sort a vector in parallel. The vector is sorted as a whole, so it can
+ * have any number of portions, but it's materialized in memory first.
+ * If `idx' isn't NULL, it also outputs the 0-based location of each sorted
+ * element in the original vector as doubles. It returns false if the type
+ * of the vector isn't supported or the vector isn't in memory, so
+ * the caller can sort it with the external-memory sort.
+ */
+bool radix_sort(fm::col_vec::ptr vec, bool decreasing,
+		fm::dense_matrix::ptr &vals, fm::dense_matrix::ptr *idx);
+
+/*
+ * Sort an array in the current thread.
+ */
+void radix_sort(int *arr, size_t len);
+void radix_sort(double *arr, size_t len);
+
+/*
+ * Get the k smallest elements of a vector in parallel, or the k largest
+ * ones if `decreasing' is true. The output is the same as the first k
+ * elements of the sorted vector, but the vector isn't sorted. If `idx'
+ * isn't NULL, it also outputs the 0-based locations of the elements as
+ * doubles. The vector is read portion by portion, so it can be on disks.
+ * It returns false if the type of the vector isn't supported.
+ */
+bool topk(fm::col_vec::ptr vec, size_t k, bool decreasing,
+		fm::dense_matrix::ptr &vals, fm::dense_matrix::ptr *idx);
+
+/*
+ * Get the k smallest or largest elements of an array in the current
+ * thread. Either `vals' or `idxs' can be NULL. `idxs' gets the 1-based
+ * locations of the elements. `buf' is the scratch memory of the thread.
+ */
+void topk(const int *arr, size_t len, size_t k, bool decreasing, int *vals,
+		int *idxs, std::vector<char> &buf);
+void topk(const double *arr, size_t len, size_t k, bool decreasing,
+		double *vals, int *idxs, std::vector<char> &buf);
+
+/*
+ * How to rank equal values, as the ties.method of R's rank.
+ */
+enum rank_ties_t
+{
+	RANK_AVERAGE,
+	RANK_MIN,
+	RANK_MAX,
+	RANK_FIRST,
+};
+
+/*
+ * Rank an array in the current thread as R's rank with na.last=TRUE, so
+ * NAs get the largest ranks in their order. The ranks are integers unless
+ * ties are averaged. `buf' is the scratch memory of the thread. It only
+ * grows, so ranking many arrays doesn't allocate memory.
+ * The array can't be longer than UINT32_MAX.
+ */
+void rank(const int *arr, size_t len, rank_ties_t ties, int *out,
+		std::vector<char> &buf);
+void rank(const int *arr, size_t len, rank_ties_t ties, double *out,
+		std::vector<char> &buf);
+void rank(const double *arr, size_t len, rank_ties_t ties, int *out,
+		std::vector<char> &buf);
+void rank(const double *arr, size_t len, rank_ties_t ties, double *out,
+		std::vector<char> &buf);
+
+}
+
+#endif
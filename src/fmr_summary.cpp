@@ -0,0 +1,200 @@
+/*
+ * Copyright 2015 Open Connectome Project (http://openconnecto.me)
+ *
+ * This file is part of FlashR.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <math.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <Rcpp.h>
+
+#include "local_matrix_store.h"
+
+#include "fmr_summary.h"
+
+using namespace fm;
+
+namespace fmr
+{
+
+void col_summary::merge(const col_summary &sum)
+{
+	min = std::min(min, sum.min);
+	max = std::max(max, sum.max);
+	this->sum += sum.sum;
+	abs_sum += sum.abs_sum;
+	sq_sum += sum.sq_sum;
+	num_nonzeros += sum.num_nonzeros;
+	num_nas += sum.num_nas;
+	num_vals += sum.num_vals;
+}
+
+static inline bool is_na(int v)
+{
+	return v == NA_INTEGER;
+}
+
+static inline bool is_na(double v)
+{
+	// This is true for NA and NaN.
+	return v != v;
+}
+
+static inline void add_val(col_summary &sum, double v)
+{
+	sum.min = std::min(sum.min, v);
+	sum.max = std::max(sum.max, v);
+	sum.sum += v;
+	sum.abs_sum += fabs(v);
+	sum.sq_sum += v * v;
+	sum.num_nonzeros += v != 0;
+}
+
+/*
+ * Add a column to its summary. We check NAs in a separate loop, so
+ * the loop that computes the statistics doesn't have branches for
+ * a column without NA.
+ */
+template<class T>
+static void add_col(col_summary &sum, const T *col, size_t len)
+{
+	size_t num_nas = 0;
+	for (size_t i = 0; i < len; i++)
+		num_nas += is_na(col[i]);
+	sum.num_nas += num_nas;
+	sum.num_vals += len - num_nas;
+
+	col_summary local;
+	if (num_nas == 0) {
+		for (size_t i = 0; i < len; i++)
+			add_val(local, col[i]);
+	}
+	else {
+		for (size_t i = 0; i < len; i++)
+			if (!is_na(col[i]))
+				add_val(local, col[i]);
+	}
+	// The counts are already added.
+	local.num_nas = 0;
+	local.num_vals = 0;
+	sum.merge(local);
+}
+
+template<class T>
+static void add_portion(const detail::local_matrix_store &in,
+		col_summary *sums)
+{
+	size_t nrow = in.get_num_rows();
+	size_t ncol = in.get_num_cols();
+	if (in.store_layout() == matrix_layout_t::L_ROW) {
+		const detail::local_row_matrix_store &row_in
+			= dynamic_cast<const detail::local_row_matrix_store &>(in);
+		for (size_t i = 0; i < nrow; i++) {
+			const T *row = reinterpret_cast<const T *>(row_in.get_row(i));
+			for (size_t j = 0; j < ncol; j++) {
+				if (is_na(row[j]))
+					sums[j].num_nas++;
+				else {
+					add_val(sums[j], row[j]);
+					sums[j].num_vals++;
+				}
+			}
+		}
+	}
+	else {
+		const detail::local_col_matrix_store &col_in
+			= dynamic_cast<const detail::local_col_matrix_store &>(in);
+		for (size_t j = 0; j < ncol; j++)
+			add_col(sums[j], reinterpret_cast<const T *>(col_in.get_col(j)),
+					nrow);
+	}
+}
+
+/*
+ * This summarizes the columns of a matrix in a single scan.
+ */
+class summary_portion_op: public detail::portion_mapply_op
+{
+	size_t global_ncol;
+	// The summaries of the columns in each thread.
+	std::vector<std::vector<col_summary> > summaries;
+public:
+	summary_portion_op(size_t global_ncol): detail::portion_mapply_op(0, 0,
+				get_scalar_type<double>()) {
+		this->global_ncol = global_ncol;
+		summaries.resize(detail::mem_thread_pool::get_global_num_threads());
+	}
+
+	virtual detail::portion_mapply_op::const_ptr transpose() const {
+		fprintf(stderr, "summary doesn't support transpose\n");
+		return detail::portion_mapply_op::const_ptr();
+	}
+
+	virtual void run(
+			const std::vector<detail::local_matrix_store::const_ptr> &ins) const {
+		const detail::local_matrix_store &in = *ins[0];
+		int thread_id = detail::mem_thread_pool::get_curr_thread_id();
+		std::vector<col_summary> &local
+			= const_cast<summary_portion_op *>(this)->summaries[thread_id];
+		if (local.empty())
+			local.resize(global_ncol);
+		col_summary *sums = local.data() + in.get_global_start_col();
+		if (in.get_type() == get_scalar_type<double>())
+			add_portion<double>(in, sums);
+		else
+			add_portion<int>(in, sums);
+	}
+
+	/*
+	 * Merge the summaries of the threads.
+	 */
+	void merge(std::vector<col_summary> &res) const {
+		res.clear();
+		res.resize(global_ncol);
+		for (size_t i = 0; i < summaries.size(); i++)
+			for (size_t j = 0; j < summaries[i].size(); j++)
+				res[j].merge(summaries[i][j]);
+	}
+
+	virtual std::string to_string(
+			const std::vector<detail::matrix_store::const_ptr> &mats) const {
+		return std::string("summary(") + mats[0]->get_name() + ")";
+	}
+
+	virtual bool is_agg() const {
+		return false;
+	}
+};
+
+bool summarize_cols(dense_matrix::ptr mat, std::vector<col_summary> &res)
+{
+	if (mat->get_type() != get_scalar_type<double>()
+			&& mat->get_type() != get_scalar_type<int>())
+		return false;
+
+	std::shared_ptr<summary_portion_op> op(new summary_portion_op(
+				mat->get_num_cols()));
+	std::vector<detail::matrix_store::const_ptr> stores(1,
+			mat->get_raw_store());
+	detail::__mapply_portion(stores, op, matrix_layout_t::L_COL);
+	op->merge(res);
+	return true;
+}
+
+}
@@ -0,0 +1,70 @@
+#ifndef __FMR_SUMMARY_H__
+#define __FMR_SUMMARY_H__
+
+/*
+ * Copyright 2015 Open Connectome Project (http://openconnecto.me)
+ *
+ * This file is part of FlashR.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <math.h>
+
+#include <vector>
+
+#include "dense_matrix.h"
+
+namespace fmr
+{
+
+/*
+ * The summary statistics of a column. NAs are counted, but aren't used
+ * in the other statistics.
+ */
+struct col_summary
+{
+	double min;
+	double max;
+	double sum;
+	double abs_sum;
+	double sq_sum;
+	size_t num_nonzeros;
+	size_t num_nas;
+	size_t num_vals;
+
+	col_summary() {
+		min = INFINITY;
+		max = -INFINITY;
+		sum = 0;
+		abs_sum = 0;
+		sq_sum = 0;
+		num_nonzeros = 0;
+		num_nas = 0;
+		num_vals = 0;
+	}
+
+	void merge(const col_summary &sum);
+};
+
+/*
+ * Summarize the columns of a matrix in a single pass. Each thread keeps
+ * the statistics of the columns in the portions it processes and we merge
+ * them in the end. It returns false if the type of the matrix isn't
+ * supported.
+ */
+bool summarize_cols(fm::dense_matrix::ptr mat, std::vector<col_summary> &res);
+
+}
+
+#endif
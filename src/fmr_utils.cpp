@@ -19,6 +19,11 @@
 
 #include <stdio.h>
 
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include "data_frame.h"
 #include "mem_matrix_store.h"
 #include "sparse_matrix.h"
@@ -28,6 +33,39 @@
 
 using namespace fm;
 
+/*
+ * The library is loaded by the main thread of R.
+ */
+static const std::thread::id main_thread_id = std::this_thread::get_id();
+static std::mutex release_lock;
+static std::vector<SEXP> released_objs;
+static std::atomic<size_t> num_released(0);
+
+void release_R_obj(SEXP obj)
+{
+	if (std::this_thread::get_id() == main_thread_id)
+		R_ReleaseObject(obj);
+	else {
+		std::lock_guard<std::mutex> lock(release_lock);
+		released_objs.push_back(obj);
+		num_released++;
+	}
+}
+
+void release_queued_R_objs()
+{
+	if (num_released == 0 || std::this_thread::get_id() != main_thread_id)
+		return;
+	std::vector<SEXP> objs;
+	{
+		std::lock_guard<std::mutex> lock(release_lock);
+		objs.swap(released_objs);
+		num_released = 0;
+	}
+	for (size_t i = 0; i < objs.size(); i++)
+		R_ReleaseObject(objs[i]);
+}
+
 /*
  * Clean up a sparse matrix.
  */
@@ -36,6 +74,7 @@ static void fm_clean_SpM(SEXP p)
 	object_ref<sparse_matrix> *ref
 		= (object_ref<sparse_matrix> *) R_ExternalPtrAddr(p);
 	delete ref;
+	release_queued_R_objs();
 }
 
 /*
@@ -46,6 +85,7 @@ static void fm_clean_DM(SEXP p)
 	object_ref<dense_matrix> *ref
 		= (object_ref<dense_matrix> *) R_ExternalPtrAddr(p);
 	delete ref;
+	release_queued_R_objs();
 }
 
 static inline Rcpp::String trans_RType2Str(R_type type)
@@ -66,6 +106,7 @@ SEXP create_FMR_matrix(sparse_matrix::ptr m, R_type type, const std::string &nam
 		fprintf(stderr, "can't create an empty matrix\n");
 		return R_NilValue;
 	}
+	release_queued_R_objs();
 
 	Rcpp::List ret;
 	ret["name"] = Rcpp::String(name);
@@ -98,6 +139,7 @@ SEXP create_FMR_matrix(dense_matrix::ptr m, R_type type, const std::string &name
 		fprintf(stderr, "can't create an empty matrix\n");
 		return R_NilValue;
 	}
+	release_queued_R_objs();
 
 	Rcpp::List ret;
 	ret["name"] = Rcpp::String(name);
@@ -136,6 +178,7 @@ SEXP create_FMR_vector(dense_matrix::ptr m, R_type type, const std::string &name
 		fprintf(stderr, "can't create a vector from an empty matrix\n");
 		return R_NilValue;
 	}
+	release_queued_R_objs();
 
 	if (m->get_num_cols() > 1)
 		m = m->transpose();
@@ -169,6 +212,7 @@ SEXP create_FMR_vector(fm::factor_col_vector::ptr v, R_type type,
 		fprintf(stderr, "can't create a factor vector\n");
 		return R_NilValue;
 	}
+	release_queued_R_objs();
 
 	Rcpp::List ret;
 	ret["name"] = Rcpp::String(name);
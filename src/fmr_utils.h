@@ -24,6 +24,7 @@
 #include <memory>
 
 #include "rutils.h"
+#include "fmr_mem.h"
 
 namespace fm
 {
@@ -45,6 +46,11 @@ class object_ref
 public:
 	object_ref(typename ObjectType::ptr o) {
 		this->o = o;
+		fmr::track_obj(this, o);
+	}
+
+	~object_ref() {
+		fmr::untrack_obj(this);
 	}
 
 	typename ObjectType::ptr get_object() const {
@@ -52,13 +58,28 @@ public:
 	}
 
 	void set_object(typename ObjectType::ptr obj) {
+		fmr::untrack_obj(this);
 		this->o = obj;
+		fmr::track_obj(this, obj);
 	}
 };
 
+/*
+ * Release an R object whose memory is used by a FlashR object. R objects
+ * can only be released in the main thread, so an R object dropped in
+ * a worker thread is queued.
+ */
+void release_R_obj(SEXP obj);
+/*
+ * Release the queued R objects if it's called in the main thread.
+ * It's called whenever R gets, creates or frees a FlashR object.
+ */
+void release_queued_R_objs();
+
 template<class MatrixType>
 typename MatrixType::ptr get_matrix(const Rcpp::S4 &matrix)
 {
+	release_queued_R_objs();
 	// TODO I should test if the pointer slot does exist.
 	object_ref<MatrixType> *ref
 		= (object_ref<MatrixType> *) R_ExternalPtrAddr(matrix.slot("pointer"));
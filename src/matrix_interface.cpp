@@ -22,6 +22,11 @@
 #include <unordered_map>
 #include <Rcpp.h>
 #include <Rmath.h>
+#include <Rversion.h>
+#if R_VERSION >= R_Version(3, 6, 0)
+#define FMR_ALTREP
+#include <R_ext/Altrep.h>
+#endif
 #include <fmr_isna.h>
 
 #include "log.h"
@@ -43,11 +48,22 @@
 #include "block_matrix.h"
 #include "col_vec.h"
 #include "project_matrix_store.h"
+#include "mem_matrix_store.h"
 #include "fm_utils.h"
 
 #include "rutils.h"
 #include "fmr_utils.h"
 #include "matrix_ops.h"
+#include "fmr_fuse.h"
+#include "fmr_simd.h"
+#include "fmr_hash_agg.h"
+#include "fmr_sort.h"
+#include "fmr_quantile.h"
+#include "fmr_scan.h"
+#include "fmr_summary.h"
+#include "fmr_mem.h"
+#include "fmr_na.h"
+#include "fmr_parallel.h"
 #include "data_io.h"
 #include "Rconn.h"
 
@@ -798,8 +814,84 @@ RcppExport SEXP R_FM_multiply_dense(SEXP pmatrix, SEXP pmat)
 		return R_NilValue;
 }
 
+/*
+ * Test if a double matrix in memory may have NA with its NA flags.
+ */
+static bool may_have_NA(const dense_matrix &mat)
+{
+	detail::mem_matrix_store::const_ptr store
+		= std::dynamic_pointer_cast<const detail::mem_matrix_store>(
+				mat.get_raw_store());
+	if (store == NULL || store->get_raw_arr() == NULL)
+		return false;
+	return fmr::has_NA(reinterpret_cast<const double *>(store->get_raw_arr()),
+			store->get_num_rows() * store->get_num_cols());
+}
+
+/*
+ * The sum of squared differences between a row of `left' and a column of
+ * `right' is |x|^2 - 2 * x * y + |y|^2, so we can compute the inner product
+ * of (euclidean, add) with matrix multiplication, which uses BLAS.
+ * The result may differ from the direct computation in the last bits,
+ * especially for vectors that are very close to each other, so we clamp it
+ * at 0. The expansion is wrong for NA, NaN and Inf (Inf - Inf is NaN), so
+ * we return NULL if an input has NA or its squared norms aren't all finite
+ * and the caller computes the inner product directly.
+ * Checking the norms takes a pass over the inputs before the product, so
+ * we only use the expansion for materialized matrices in memory, where the
+ * pass is cheap compared with the product and the data isn't computed or
+ * read from disks twice.
+ */
+static dense_matrix::ptr euclidean_inner_prod(dense_matrix::ptr left,
+		dense_matrix::ptr right)
+{
+	if (left->is_virtual() || right->is_virtual() || !left->is_in_mem()
+			|| !right->is_in_mem() || may_have_NA(*left)
+			|| may_have_NA(*right))
+		return dense_matrix::ptr();
+
+	const basic_ops &ops = get_scalar_type<double>().get_basic_ops();
+	bulk_operate::const_ptr add = bulk_operate::conv2ptr(
+			*ops.get_op(basic_ops::op_idx::ADD));
+	bulk_operate::const_ptr mul = bulk_operate::conv2ptr(
+			*ops.get_op(basic_ops::op_idx::MUL));
+	agg_operate::const_ptr sum = agg_operate::create(add);
+
+	dense_matrix::ptr left2 = left->mapply2(*left, mul)->aggregate(
+			matrix_margin::MAR_ROW, sum);
+	dense_matrix::ptr right2 = right->mapply2(*right, mul)->aggregate(
+			matrix_margin::MAR_COL, sum);
+	if (left2 == NULL || right2 == NULL)
+		return dense_matrix::ptr();
+	// The squared norms are needed by the product anyway. If any of them
+	// isn't finite, an input has a NA or a non-finite value.
+	if (!left2->materialize_self() || !right2->materialize_self())
+		return dense_matrix::ptr();
+	scalar_variable::ptr left_tot = left2->aggregate(sum);
+	scalar_variable::ptr right_tot = right2->aggregate(sum);
+	if (left_tot == NULL || right_tot == NULL
+			|| !R_FINITE(*(const double *) left_tot->get_raw())
+			|| !R_FINITE(*(const double *) right_tot->get_raw()))
+		return dense_matrix::ptr();
+	// The right matrix is usually much smaller, so we scale it instead of
+	// the product.
+	dense_matrix::ptr neg2 = dense_matrix::create_const<double>(-2,
+			right->get_num_rows(), right->get_num_cols(),
+			right->store_layout());
+	dense_matrix::ptr prod = left->multiply(*right->mapply2(*neg2, mul));
+	if (prod == NULL)
+		return dense_matrix::ptr();
+	prod = prod->mapply_cols(col_vec::create(left2), add);
+	prod = prod->mapply_rows(col_vec::create(right2), add);
+	bulk_operate::const_ptr max = bulk_operate::conv2ptr(
+			*ops.get_op(basic_ops::op_idx::MAX));
+	dense_matrix::ptr zero = dense_matrix::create_const<double>(0,
+			prod->get_num_rows(), prod->get_num_cols(), prod->store_layout());
+	return prod->mapply2(*zero, max);
+}
+
 RcppExport SEXP R_FM_inner_prod_dense(SEXP pmatrix, SEXP pmat,
-		SEXP pfun1, SEXP pfun2)
+		SEXP pfun1, SEXP pfun2, SEXP pexact)
 {
 	dense_matrix::ptr matrix = get_matrix<dense_matrix>(pmatrix);
 	dense_matrix::ptr right_mat = get_matrix<dense_matrix>(pmat);
@@ -819,6 +911,20 @@ RcppExport SEXP R_FM_inner_prod_dense(SEXP pmatrix, SEXP pmat,
 	if (common_Rtype != right_type)
 		right_mat = fmr::cast_Rtype(right_mat, right_type, common_Rtype);
 
+	bool is_vec = is_vector(pmat);
+	static const fmr::op_id_t euclidean_id = fmr::get_op_id("euclidean");
+	static const fmr::op_id_t add_id = fmr::get_op_id("add");
+	if (common_Rtype == R_type::R_REAL && !LOGICAL(pexact)[0]
+			&& fmr::get_op_id(pfun1) == euclidean_id
+			&& fmr::get_op_id(pfun2) == add_id) {
+		dense_matrix::ptr res = euclidean_inner_prod(matrix, right_mat);
+		// Otherwise, we fall back to the direct computation below.
+		if (res && is_vec)
+			return create_FMR_vector(res, R_type::R_REAL, "");
+		else if (res)
+			return create_FMR_matrix(res, R_type::R_REAL, "");
+	}
+
 	auto op1_res = fmr::get_op(pfun1, common_Rtype);
 	bulk_operate::const_ptr op1 = op1_res.first;
 	if (op1 == NULL) {
@@ -845,7 +951,6 @@ RcppExport SEXP R_FM_inner_prod_dense(SEXP pmatrix, SEXP pmat,
 	if (res == NULL)
 		return R_NilValue;
 
-	bool is_vec = is_vector(pmat);
 	if (res && is_vec) {
 		return create_FMR_vector(res, op2_res.second, "");
 	}
@@ -856,6 +961,137 @@ RcppExport SEXP R_FM_inner_prod_dense(SEXP pmatrix, SEXP pmat,
 		return R_NilValue;
 }
 
+/*
+ * This finds the nearest center of every row of a tall matrix in one pass,
+ * so we don't need to materialize the distances to all centers. It outputs
+ * the 1-based index of the nearest center, and the distance to it in
+ * the second column if requested. When the operator is transposed, it
+ * computes on the columns of a wide matrix instead.
+ */
+class nearest_center_portion_op: public detail::portion_mapply_op
+{
+	std::shared_ptr<const std::vector<double> > centers;
+	size_t num_centers;
+	bool with_dist;
+	bool transposed;
+public:
+	nearest_center_portion_op(size_t nrow,
+			std::shared_ptr<const std::vector<double> > centers,
+			size_t num_centers, bool with_dist,
+			bool transposed): detail::portion_mapply_op(
+				transposed ? (with_dist ? 2 : 1) : nrow,
+				transposed ? nrow : (with_dist ? 2 : 1),
+				with_dist ? get_scalar_type<double>() : get_scalar_type<int>()) {
+		this->centers = centers;
+		this->num_centers = num_centers;
+		this->with_dist = with_dist;
+		this->transposed = transposed;
+	}
+
+	virtual detail::portion_mapply_op::const_ptr transpose() const {
+		size_t nrow = transposed ? get_out_num_cols() : get_out_num_rows();
+		return detail::portion_mapply_op::const_ptr(
+				new nearest_center_portion_op(nrow, centers, num_centers,
+					with_dist, !transposed));
+	}
+
+	virtual void run(const std::vector<detail::local_matrix_store::const_ptr> &ins,
+			detail::local_matrix_store &out) const {
+		const detail::local_matrix_store &in = *ins[0];
+		size_t nrow = transposed ? in.get_num_cols() : in.get_num_rows();
+		size_t ncol = transposed ? in.get_num_rows() : in.get_num_cols();
+		bool row_major = (in.store_layout() == matrix_layout_t::L_ROW)
+			!= transposed;
+		const double *arr = reinterpret_cast<const double *>(in.get_raw_arr());
+		std::vector<double> buf;
+		if (arr == NULL) {
+			buf.resize(nrow * ncol);
+			if (in.store_layout() == matrix_layout_t::L_ROW) {
+				const detail::local_row_matrix_store &row_in
+					= dynamic_cast<const detail::local_row_matrix_store &>(in);
+				for (size_t i = 0; i < in.get_num_rows(); i++)
+					memcpy(&buf[i * in.get_num_cols()], row_in.get_row(i),
+							in.get_num_cols() * sizeof(double));
+			}
+			else {
+				const detail::local_col_matrix_store &col_in
+					= dynamic_cast<const detail::local_col_matrix_store &>(in);
+				for (size_t j = 0; j < in.get_num_cols(); j++)
+					memcpy(&buf[j * in.get_num_rows()], col_in.get_col(j),
+							in.get_num_rows() * sizeof(double));
+			}
+			arr = buf.data();
+		}
+
+		if (!with_dist) {
+			int *res = reinterpret_cast<int *>(out.get_raw_arr());
+			fmr::simd::nearest_center(arr, nrow, ncol, row_major,
+					centers->data(), num_centers, res, NULL);
+			return;
+		}
+		// The output has the indices in the first column (or row) and
+		// the distances in the second one.
+		double *res = reinterpret_cast<double *>(out.get_raw_arr());
+		std::vector<int> idx(nrow);
+		fmr::simd::nearest_center(arr, nrow, ncol, row_major,
+				centers->data(), num_centers, idx.data(), res + nrow);
+		for (size_t i = 0; i < nrow; i++)
+			res[i] = idx[i] == NA_INTEGER ? NA_REAL : idx[i];
+	}
+
+	virtual std::string to_string(
+			const std::vector<detail::matrix_store::const_ptr> &mats) const {
+		return std::string("nearest_center(") + mats[0]->get_name() + ")";
+	}
+};
+
+RcppExport SEXP R_FM_nearest_center(SEXP pdata, SEXP pcenters, SEXP pdist)
+{
+	if (is_sparse(pdata)) {
+		fprintf(stderr, "nearest center doesn't support sparse matrix\n");
+		return R_NilValue;
+	}
+	dense_matrix::ptr data = get_matrix<dense_matrix>(pdata);
+	if (!is_supported_type(data->get_type())) {
+		fprintf(stderr, "The input matrix has unsupported type\n");
+		return R_NilValue;
+	}
+	R_type type = FM_get_Rtype(pdata);
+	if (type != R_type::R_REAL)
+		data = fmr::cast_Rtype(data, type, R_type::R_REAL);
+	if (data->is_wide()) {
+		fprintf(stderr, "nearest center only works on tall matrices\n");
+		return R_NilValue;
+	}
+
+	if (!R_is_real(pcenters)) {
+		fprintf(stderr, "centers have to be a numeric R matrix\n");
+		return R_NilValue;
+	}
+	size_t num_centers = get_nrows(pcenters);
+	if (get_ncols(pcenters) != data->get_num_cols()) {
+		fprintf(stderr, "centers and data have different numbers of cols\n");
+		return R_NilValue;
+	}
+	const double *rcenters = REAL(pcenters);
+	std::shared_ptr<std::vector<double> > centers(new std::vector<double>(
+				rcenters, rcenters + num_centers * data->get_num_cols()));
+	bool with_dist = LOGICAL(pdist)[0];
+
+	detail::portion_mapply_op::const_ptr op(new nearest_center_portion_op(
+				data->get_num_rows(), centers, num_centers, with_dist, false));
+	std::vector<detail::matrix_store::const_ptr> stores(1,
+			data->get_raw_store());
+	detail::matrix_store::ptr res = detail::__mapply_portion_virtual(stores,
+			op, matrix_layout_t::L_COL);
+	if (res == NULL)
+		return R_NilValue;
+	if (with_dist)
+		return create_FMR_matrix(dense_matrix::create(res), R_type::R_REAL, "");
+	else
+		return create_FMR_vector(dense_matrix::create(res), R_type::R_INT, "");
+}
+
 RcppExport SEXP R_FM_create_rep_matrix(SEXP pvec, SEXP pnrow, SEXP pncol,
 		SEXP pbyrow)
 {
@@ -903,6 +1139,68 @@ RcppExport SEXP R_FM_create_rep_matrix(SEXP pvec, SEXP pnrow, SEXP pncol,
 		return create_FMR_matrix(ret, type, "");
 }
 
+/*
+ * A small matrix in memory is copied to R directly.
+ */
+static bool is_small_FM(dense_matrix::ptr mat)
+{
+	size_t chunk_size = detail::mem_matrix_store::CHUNK_SIZE;
+	return mat->is_in_mem() && mat->get_num_rows() < chunk_size
+		&& mat->get_num_cols() < chunk_size;
+}
+
+/*
+ * Copy a block of a matrix to a column-major R matrix whose columns have
+ * `out_ld' elements. A row-major block is transposed in tiles with SIMD.
+ */
+template<class RType>
+static void copy_block2R(const RType *in, size_t nrow, size_t ncol,
+		bool row_major, RType *out, size_t out_ld)
+{
+	if (row_major)
+		fmr::simd::transpose(in, nrow, ncol, ncol, out, out_ld);
+	else if (nrow == out_ld)
+		memcpy(out, in, nrow * ncol * sizeof(RType));
+	else
+		for (size_t j = 0; j < ncol; j++)
+			memcpy(out + j * out_ld, in + j * nrow, nrow * sizeof(RType));
+}
+
+/*
+ * Copy a portion of a matrix to its place in an R matrix in either layout.
+ */
+template<class RType>
+static void copy_portion2R(const detail::local_matrix_store &in,
+		RType *r_vec, size_t global_nrow)
+{
+	size_t nrow = in.get_num_rows();
+	size_t ncol = in.get_num_cols();
+	bool row_major = in.store_layout() == matrix_layout_t::L_ROW;
+	RType *out = r_vec + in.get_global_start_row()
+		+ in.get_global_start_col() * global_nrow;
+	const RType *arr = reinterpret_cast<const RType *>(in.get_raw_arr());
+	if (arr) {
+		copy_block2R(arr, nrow, ncol, row_major, out, global_nrow);
+		return;
+	}
+
+	// The rows or columns of the portion aren't stored contiguously.
+	if (row_major) {
+		const detail::local_row_matrix_store &row_in
+			= dynamic_cast<const detail::local_row_matrix_store &>(in);
+		for (size_t i = 0; i < nrow; i++)
+			fmr::simd::transpose(reinterpret_cast<const RType *>(
+						row_in.get_row(i)), 1, ncol, ncol, out + i, global_nrow);
+	}
+	else {
+		const detail::local_col_matrix_store &col_in
+			= dynamic_cast<const detail::local_col_matrix_store &>(in);
+		for (size_t j = 0; j < ncol; j++)
+			memcpy(out + j * global_nrow, col_in.get_col(j),
+					nrow * sizeof(RType));
+	}
+}
+
 template<class T, class RType>
 class FM2R_portion_op: public detail::portion_mapply_op
 {
@@ -922,19 +1220,7 @@ public:
 
 	virtual void run(
 			const std::vector<detail::local_matrix_store::const_ptr> &ins) const {
-		size_t nrow = ins[0]->get_num_rows();
-		size_t ncol = ins[0]->get_num_cols();
-		const detail::local_col_matrix_store &col_in
-			= dynamic_cast<const detail::local_col_matrix_store &>(*ins[0]);
-		for (size_t j = 0; j < ncol; j++) {
-			const RType *src_col = reinterpret_cast<const RType *>(
-					col_in.get_col(j));
-			for (size_t i = 0; i < nrow; i++) {
-				off_t global_row = i + ins[0]->get_global_start_row();
-				off_t global_col = j + ins[0]->get_global_start_col();
-				r_vec[global_row + global_col * global_nrow] = src_col[i];
-			}
-		}
+		copy_portion2R(*ins[0], r_vec, global_nrow);
 	}
 
 	virtual std::string to_string(
@@ -947,37 +1233,59 @@ public:
 	}
 };
 
+/*
+ * A small matrix is stored in a single portion. We copy it in parallel by
+ * splitting it into blocks of rows, unless it's too small to be worth it.
+ */
+template<class RType>
+static void copy_small_FM2R(const detail::local_matrix_store &in,
+		RType *r_vec)
+{
+	size_t nrow = in.get_num_rows();
+	size_t ncol = in.get_num_cols();
+	const RType *arr = reinterpret_cast<const RType *>(in.get_raw_arr());
+	size_t num_tasks = fmr::get_num_tasks();
+	if (arr == NULL || num_tasks <= 1
+			|| nrow * ncol * sizeof(RType) < 1024 * 1024) {
+		copy_portion2R(in, r_vec, nrow);
+		return;
+	}
+
+	bool row_major = in.store_layout() == matrix_layout_t::L_ROW;
+	// Keep the blocks aligned to the tiles of the transpose.
+	size_t rows_per_task = (nrow + num_tasks - 1) / num_tasks;
+	rows_per_task = (rows_per_task + 63) / 64 * 64;
+	fmr::parallel_for(num_tasks, [&](size_t task_id) {
+			size_t start_row = task_id * rows_per_task;
+			if (start_row >= nrow)
+				return;
+			size_t block_nrow = std::min(rows_per_task, nrow - start_row);
+			if (row_major)
+				fmr::simd::transpose(arr + start_row * ncol, block_nrow, ncol,
+						ncol, r_vec + start_row, nrow);
+			else
+				for (size_t j = 0; j < ncol; j++)
+					memcpy(r_vec + start_row + j * nrow,
+							arr + start_row + j * nrow,
+							block_nrow * sizeof(RType));
+			});
+}
+
 template<class T, class RType>
 bool copy_FM2Rmatrix(dense_matrix::ptr mat, RType *r_vec)
 {
-	size_t chunk_size = detail::mem_matrix_store::CHUNK_SIZE;
 	// If the matrix is in memory and is small, we can copy it directly.
-	if ((mat->is_in_mem() && mat->get_num_rows() < chunk_size
-			&& mat->get_num_cols() < chunk_size)
-			|| mat->get_raw_store()->is_sink()) {
+	if (is_small_FM(mat) || mat->get_raw_store()->is_sink()) {
 		bool ret = mat->materialize_self();
 		if (!ret) {
 			fprintf(stderr, "can't materialize the matrix\n");
 			return R_NilValue;
 		}
-		if (mat->store_layout() == matrix_layout_t::L_ROW)
-			mat = mat->conv2(matrix_layout_t::L_COL);
-
-		detail::local_col_matrix_store::const_ptr col_lstore
-			= std::dynamic_pointer_cast<const detail::local_col_matrix_store>(
-					mat->get_raw_store()->get_portion(0));
-		size_t nrow = mat->get_num_rows();
-		size_t ncol = mat->get_num_cols();
-		for (size_t j = 0; j < ncol; j++) {
-			const RType *src_col = reinterpret_cast<const RType *>(
-					col_lstore->get_col(j));
-			for (size_t i = 0; i < nrow; i++)
-				r_vec[i + j * nrow] = src_col[i];
-		}
+		copy_small_FM2R(*mat->get_raw_store()->get_portion(0), r_vec);
 	}
 	else {
-		// R stores data in col-major order
-		mat = mat->conv2(matrix_layout_t::L_COL);
+		// Each portion is copied to R's col-major order in its own layout,
+		// so we don't need to convert the layout of the matrix first.
 		std::vector<detail::matrix_store::const_ptr> mats(1, mat->get_raw_store());
 		detail::portion_mapply_op::const_ptr op(
 				new FM2R_portion_op<T, RType>(r_vec, mat->get_num_rows()));
@@ -1012,6 +1320,312 @@ RcppExport SEXP R_FM_copy_FM2R(SEXP pobj, SEXP pRmat)
 	return ret;
 }
 
+#ifdef FMR_ALTREP
+
+/*
+ * An R vector whose elements are fetched from a FlashR matrix on access.
+ * The elements are fetched a portion at a time and we keep the last
+ * portion, so scanning the elements in order computes or reads each
+ * portion once. The whole matrix is copied to a regular R vector only
+ * when R needs the pointer to the data. The R vector is stored in
+ * the second data field of the ALTREP object.
+ */
+class altrep_fm
+{
+	dense_matrix::ptr mat;
+	size_t nrow;
+	size_t ncol;
+	// The portion fetched last time.
+	detail::local_col_matrix_store::const_ptr portion;
+	size_t start_row;
+	size_t start_col;
+
+	const detail::local_col_matrix_store &get_portion(size_t row, size_t col);
+public:
+	typedef std::shared_ptr<altrep_fm> ptr;
+
+	altrep_fm(dense_matrix::ptr mat) {
+		// R stores data in col-major order.
+		if (mat->store_layout() == matrix_layout_t::L_ROW)
+			mat = mat->conv2(matrix_layout_t::L_COL);
+		this->mat = mat;
+		nrow = mat->get_num_rows();
+		ncol = mat->get_num_cols();
+		start_row = 0;
+		start_col = 0;
+	}
+
+	dense_matrix::ptr get_matrix() const {
+		return mat;
+	}
+
+	size_t get_length() const {
+		return nrow * ncol;
+	}
+
+	template<class T>
+	T get(size_t idx) {
+		size_t row = idx % nrow;
+		size_t col = idx / nrow;
+		const detail::local_col_matrix_store &store = get_portion(row, col);
+		return reinterpret_cast<const T *>(store.get_col(col - start_col))[
+			row - start_row];
+	}
+
+	template<class T>
+	size_t get_region(size_t idx, size_t num, T *buf) {
+		num = std::min(num, get_length() - idx);
+		for (size_t i = 0; i < num;) {
+			size_t row = (idx + i) % nrow;
+			size_t col = (idx + i) / nrow;
+			const detail::local_col_matrix_store &store = get_portion(row, col);
+			// Copy the rest of the column in the portion.
+			size_t n = std::min(num - i,
+					start_row + store.get_num_rows() - row);
+			const T *src = reinterpret_cast<const T *>(
+					store.get_col(col - start_col)) + row - start_row;
+			memcpy(buf + i, src, n * sizeof(T));
+			i += n;
+		}
+		return num;
+	}
+};
+
+const detail::local_col_matrix_store &altrep_fm::get_portion(size_t row,
+		size_t col)
+{
+	if (portion && row >= start_row
+			&& row < start_row + portion->get_num_rows()
+			&& col >= start_col && col < start_col + portion->get_num_cols())
+		return *portion;
+
+	std::pair<size_t, size_t> size = mat->get_data().get_portion_size();
+	size_t num_rows = nrow;
+	size_t num_cols = ncol;
+	start_row = 0;
+	start_col = 0;
+	if (mat->is_wide()) {
+		start_col = col / size.second * size.second;
+		num_cols = std::min(size.second, ncol - start_col);
+	}
+	else {
+		start_row = row / size.first * size.first;
+		num_rows = std::min(size.first, nrow - start_row);
+	}
+	portion = std::dynamic_pointer_cast<const detail::local_col_matrix_store>(
+			mat->get_data().get_portion(start_row, start_col, num_rows,
+				num_cols));
+	// R can't handle a C++ exception here, so we raise an R error.
+	// Nothing on the stack needs to be destroyed.
+	if (portion == NULL)
+		Rf_error("can't get a portion of the FlashR matrix");
+	return *portion;
+}
+
+static R_altrep_class_t altrep_fm_real;
+static R_altrep_class_t altrep_fm_int;
+static R_altrep_class_t altrep_fm_logical;
+
+static altrep_fm &get_altrep_fm(SEXP x)
+{
+	return **reinterpret_cast<altrep_fm::ptr *>(
+			R_ExternalPtrAddr(R_altrep_data1(x)));
+}
+
+static void delete_altrep_fm(SEXP ptr)
+{
+	delete reinterpret_cast<altrep_fm::ptr *>(R_ExternalPtrAddr(ptr));
+	R_ClearExternalPtr(ptr);
+}
+
+static SEXP new_altrep_fm(R_altrep_class_t cls, altrep_fm::ptr fm)
+{
+	SEXP ptr = PROTECT(R_MakeExternalPtr(new altrep_fm::ptr(fm), R_NilValue,
+				R_NilValue));
+	R_RegisterCFinalizerEx(ptr, delete_altrep_fm, TRUE);
+	SEXP ret = R_new_altrep(cls, ptr, R_NilValue);
+	UNPROTECT(1);
+	return ret;
+}
+
+static void *get_Rvec_data(SEXP data)
+{
+	switch (TYPEOF(data)) {
+		case REALSXP:
+			return REAL(data);
+		case INTSXP:
+			return INTEGER(data);
+		default:
+			return LOGICAL(data);
+	}
+}
+
+static R_xlen_t altrep_fm_length(SEXP x)
+{
+	return get_altrep_fm(x).get_length();
+}
+
+static void *altrep_fm_dataptr(SEXP x, Rboolean writeable)
+{
+	SEXP data = R_altrep_data2(x);
+	if (data == R_NilValue) {
+		altrep_fm &fm = get_altrep_fm(x);
+		data = PROTECT(Rf_allocVector(TYPEOF(x), fm.get_length()));
+		bool ret;
+		if (TYPEOF(x) == REALSXP)
+			ret = copy_FM2Rmatrix<double, double>(fm.get_matrix(), REAL(data));
+		else
+			ret = copy_FM2Rmatrix<int, int>(fm.get_matrix(),
+					(int *) get_Rvec_data(data));
+		if (!ret) {
+			UNPROTECT(1);
+			Rf_error("can't copy the FlashR matrix to R");
+		}
+		R_set_altrep_data2(x, data);
+		UNPROTECT(1);
+	}
+	return get_Rvec_data(data);
+}
+
+static const void *altrep_fm_dataptr_or_null(SEXP x)
+{
+	SEXP data = R_altrep_data2(x);
+	return data == R_NilValue ? NULL : get_Rvec_data(data);
+}
+
+static SEXP altrep_fm_duplicate(SEXP x, Rboolean deep)
+{
+	// The copy shares the FlashR matrix until either of them is materialized.
+	if (R_altrep_data2(x) != R_NilValue)
+		return NULL;
+	R_altrep_class_t cls = altrep_fm_logical;
+	if (TYPEOF(x) == REALSXP)
+		cls = altrep_fm_real;
+	else if (TYPEOF(x) == INTSXP)
+		cls = altrep_fm_int;
+	return new_altrep_fm(cls, altrep_fm::ptr(new altrep_fm(
+					get_altrep_fm(x).get_matrix())));
+}
+
+static Rboolean altrep_fm_inspect(SEXP x, int pre, int deep, int pvec,
+		void (*inspect_subtree)(SEXP, int, int, int))
+{
+	Rprintf("FlashR matrix (%s)\n", R_altrep_data2(x) == R_NilValue
+			? "not materialized" : "materialized");
+	return TRUE;
+}
+
+static double altrep_fm_real_elt(SEXP x, R_xlen_t i)
+{
+	SEXP data = R_altrep_data2(x);
+	if (data != R_NilValue)
+		return REAL(data)[i];
+	return get_altrep_fm(x).get<double>(i);
+}
+
+static int altrep_fm_int_elt(SEXP x, R_xlen_t i)
+{
+	SEXP data = R_altrep_data2(x);
+	if (data != R_NilValue)
+		return ((int *) get_Rvec_data(data))[i];
+	return get_altrep_fm(x).get<int>(i);
+}
+
+template<class T>
+static R_xlen_t altrep_fm_get_region(SEXP x, R_xlen_t i, R_xlen_t n, T *buf)
+{
+	SEXP data = R_altrep_data2(x);
+	if (data != R_NilValue) {
+		n = std::min(n, XLENGTH(data) - i);
+		memcpy(buf, (const T *) get_Rvec_data(data) + i, n * sizeof(T));
+		return n;
+	}
+	return get_altrep_fm(x).get_region<T>(i, n, buf);
+}
+
+static void set_altrep_fm_methods(R_altrep_class_t cls)
+{
+	R_set_altrep_Length_method(cls, altrep_fm_length);
+	R_set_altrep_Inspect_method(cls, altrep_fm_inspect);
+	R_set_altrep_Duplicate_method(cls, altrep_fm_duplicate);
+	R_set_altvec_Dataptr_method(cls, altrep_fm_dataptr);
+	R_set_altvec_Dataptr_or_null_method(cls, altrep_fm_dataptr_or_null);
+}
+
+static void init_altrep_fm(DllInfo *dll)
+{
+	altrep_fm_real = R_make_altreal_class("altrep_fm_real", "FlashR", dll);
+	set_altrep_fm_methods(altrep_fm_real);
+	R_set_altreal_Elt_method(altrep_fm_real, altrep_fm_real_elt);
+	R_set_altreal_Get_region_method(altrep_fm_real,
+			altrep_fm_get_region<double>);
+
+	altrep_fm_int = R_make_altinteger_class("altrep_fm_int", "FlashR", dll);
+	set_altrep_fm_methods(altrep_fm_int);
+	R_set_altinteger_Elt_method(altrep_fm_int, altrep_fm_int_elt);
+	R_set_altinteger_Get_region_method(altrep_fm_int,
+			altrep_fm_get_region<int>);
+
+	altrep_fm_logical = R_make_altlogical_class("altrep_fm_logical", "FlashR",
+			dll);
+	set_altrep_fm_methods(altrep_fm_logical);
+	R_set_altlogical_Elt_method(altrep_fm_logical, altrep_fm_int_elt);
+	R_set_altlogical_Get_region_method(altrep_fm_logical,
+			altrep_fm_get_region<int>);
+}
+
+#endif
+
+extern "C" void R_init_FlashR(DllInfo *dll)
+{
+#ifdef FMR_ALTREP
+	init_altrep_fm(dll);
+#endif
+}
+
+/*
+ * Convert a FlashR object to an R object whose elements are fetched on
+ * access. It returns NULL if the object should be copied to R directly.
+ */
+RcppExport SEXP R_FM_conv_FM2R_lazy(SEXP pobj)
+{
+#ifdef FMR_ALTREP
+	if (is_sparse(pobj))
+		return R_NilValue;
+	dense_matrix::ptr mat = get_matrix<dense_matrix>(pobj);
+	if (mat == NULL || is_small_FM(mat)
+			|| (!mat->is_type<double>() && !mat->is_type<int>()))
+		return R_NilValue;
+
+	R_altrep_class_t cls;
+	switch (FM_get_Rtype(pobj)) {
+		case R_type::R_REAL:
+			cls = altrep_fm_real;
+			break;
+		case R_type::R_INT:
+			cls = altrep_fm_int;
+			break;
+		case R_type::R_LOGICAL:
+			cls = altrep_fm_logical;
+			break;
+		default:
+			return R_NilValue;
+	}
+	SEXP ret = PROTECT(new_altrep_fm(cls, altrep_fm::ptr(new altrep_fm(mat))));
+	if (!is_vector(pobj)) {
+		SEXP dims = PROTECT(Rf_allocVector(INTSXP, 2));
+		INTEGER(dims)[0] = mat->get_num_rows();
+		INTEGER(dims)[1] = mat->get_num_cols();
+		Rf_setAttrib(ret, R_DimSymbol, dims);
+		UNPROTECT(1);
+	}
+	UNPROTECT(1);
+	return ret;
+#else
+	return R_NilValue;
+#endif
+}
+
 template<class T>
 T *get_Rdata(SEXP pobj)
 {
@@ -1031,32 +1645,110 @@ double *get_Rdata<double>(SEXP pobj)
 	return REAL(pobj);
 }
 
+/*
+ * A FlashR matrix converted from an R object borrows the memory of
+ * the object. We preserve the R object while the matrix uses its memory.
+ * FlashR matrices are never modified, and R copies the R object before
+ * modifying it after this, so the memory is shared until it's written.
+ */
+template<class T>
+static detail::simple_raw_array borrow_Rdata(SEXP pobj, size_t len)
+{
+	R_PreserveObject(pobj);
+#ifdef MARK_NOT_MUTABLE
+	MARK_NOT_MUTABLE(pobj);
+#else
+	SET_NAMED(pobj, 2);
+#endif
+	fmr::track_R_data(get_Rdata<T>(pobj));
+	std::shared_ptr<char> data(reinterpret_cast<char *>(get_Rdata<T>(pobj)),
+			[pobj](char *addr) {
+				fmr::untrack_R_data(addr);
+				release_R_obj(pobj);
+			});
+	// R doesn't modify the data while we hold it, so its NA flags stay valid.
+	fmr::register_NA_arr(data, get_Rdata<T>(pobj), len, false);
+	return detail::simple_raw_array(data, len * sizeof(T), -1);
+}
+
+/*
+ * On a NUMA machine, a large R object is copied to a matrix striped on
+ * the NUMA nodes instead of being borrowed. Otherwise, all operations on
+ * the matrix read it from the node where R allocated it. A tall matrix is
+ * striped by rows and a wide matrix by columns, so the object is striped
+ * if its longer dimension fills a chunk on every node. Each portion is
+ * copied by a thread on the node that stores the portion, so the pages
+ * are first touched on their own node. It returns NULL if the R object
+ * should be borrowed.
+ */
+template<class T>
+static detail::mem_matrix_store::ptr import_Rdata_numa(SEXP pobj, size_t nrow,
+		size_t ncol)
+{
+	int num_nodes = matrix_conf.get_num_nodes();
+	if (num_nodes <= 1 || std::max(nrow, ncol)
+			< num_nodes * detail::mem_matrix_store::CHUNK_SIZE)
+		return detail::mem_matrix_store::ptr();
+
+	detail::mem_matrix_store::ptr store = detail::mem_matrix_store::create(
+			nrow, ncol, matrix_layout_t::L_COL, get_scalar_type<T>(),
+			num_nodes);
+	size_t num_portions = store->get_num_portions();
+	std::vector<std::shared_ptr<detail::local_col_matrix_store> > portions(
+			num_portions);
+	std::vector<int> node_ids(num_portions);
+	for (size_t i = 0; i < num_portions; i++) {
+		portions[i] = std::dynamic_pointer_cast<detail::local_col_matrix_store>(
+				store->get_portion(i));
+		// We can't copy the columns of R to the portion, so we borrow
+		// the R object instead.
+		if (portions[i] == NULL)
+			return detail::mem_matrix_store::ptr();
+		node_ids[i] = portions[i]->get_node_id();
+	}
+	const T *data = get_Rdata<T>(pobj);
+	fmr::parallel_for(node_ids, [&](size_t i) {
+			detail::local_col_matrix_store &portion = *portions[i];
+			size_t start_row = portion.get_global_start_row();
+			size_t start_col = portion.get_global_start_col();
+			size_t portion_nrow = portion.get_num_rows();
+			for (size_t j = 0; j < portion.get_num_cols(); j++) {
+				T *col = reinterpret_cast<T *>(portion.get_col(j));
+				memcpy(col, data + (start_col + j) * nrow + start_row,
+						portion_nrow * sizeof(T));
+				// The column is still in the cache, so we compute its NA
+				// flags now. The short columns of a wide matrix are cheaper
+				// to scan than to look up.
+				if (portion_nrow >= fmr::NA_CHUNK_LEN)
+					fmr::register_NA_arr(store, col, portion_nrow, true);
+			}
+			});
+	return store;
+}
+
 template<class T>
 dense_matrix::ptr RVec2FM(SEXP pobj)
 {
 	size_t len = get_length(pobj);
-	T *data = get_Rdata<T>(pobj);
 	// FlashR stores vectors in matrices.
-	// We can assume we only convert small R vectors. so we should store data
-	// in a SMP matrix.
-	detail::mem_matrix_store::ptr fm = detail::mem_matrix_store::create(
-			len, 1, matrix_layout_t::L_COL, get_scalar_type<T>(), -1);
-	memcpy(fm->get_raw_arr(), data, len * sizeof(data[0]));
+	detail::mem_matrix_store::ptr fm = import_Rdata_numa<T>(pobj, len, 1);
+	if (fm == NULL)
+		fm = detail::mem_col_matrix_store::create(borrow_Rdata<T>(pobj, len),
+				len, 1, get_scalar_type<T>());
 	return dense_matrix::create(fm);
 }
 
 template<class T>
 dense_matrix::ptr RMat2FM(SEXP pobj)
 {
-	T *data = get_Rdata<T>(pobj);
 	size_t nrow = get_nrows(pobj);
 	size_t ncol = get_ncols(pobj);
-	size_t len = nrow * ncol;
-	// We can assume we only convert small R matrices, so we should store data
-	// in a SMP matrix.
-	detail::mem_matrix_store::ptr fm = detail::mem_matrix_store::create(
-			nrow, ncol, matrix_layout_t::L_COL, get_scalar_type<T>(), -1);
-	memcpy(fm->get_raw_arr(), data, len * sizeof(data[0]));
+	// R stores matrices in column major.
+	detail::mem_matrix_store::ptr fm = import_Rdata_numa<T>(pobj, nrow, ncol);
+	if (fm == NULL)
+		fm = detail::mem_col_matrix_store::create(
+				borrow_Rdata<T>(pobj, nrow * ncol), nrow, ncol,
+				get_scalar_type<T>());
 	return dense_matrix::create(fm);
 }
 
@@ -1274,7 +1966,7 @@ RcppExport SEXP R_FM_mapply2(SEXP pfun, SEXP po1, SEXP po2)
 	// If the input matrices have the same size.
 	if (m1->get_num_rows() == m2->get_num_rows()
 			&& m1->get_num_cols() == m2->get_num_cols())
-		out = m1->mapply2(*m2, op);
+		out = fmr::fuse_mapply2(m1, m2, op);
 	// If the left matrix is actually a scalar.
 	else if (m1->get_num_rows() * m1->get_num_cols() == 1) {
 		if (m1->is_in_mem())
@@ -1284,9 +1976,9 @@ RcppExport SEXP R_FM_mapply2(SEXP pfun, SEXP po1, SEXP po2)
 		auto var = std::static_pointer_cast<const detail::mem_matrix_store>(
 				m1->get_raw_store());
 		if (m1->get_type() == get_scalar_type<int>())
-			out = m2->sapply(EA_operator<int>::create(op, var));
+			out = fmr::fuse_sapply(m2, EA_operator<int>::create(op, var));
 		else if (m1->get_type() == get_scalar_type<double>())
-			out = m2->sapply(EA_operator<double>::create(op, var));
+			out = fmr::fuse_sapply(m2, EA_operator<double>::create(op, var));
 	}
 	// If the right matrix is actually a scalar
 	else if (m2->get_num_rows() * m2->get_num_cols() == 1) {
@@ -1297,9 +1989,9 @@ RcppExport SEXP R_FM_mapply2(SEXP pfun, SEXP po1, SEXP po2)
 		auto var = std::static_pointer_cast<const detail::mem_matrix_store>(
 				m2->get_raw_store());
 		if (m1->get_type() == get_scalar_type<int>())
-			out = m1->sapply(AE_operator<int>::create(op, var));
+			out = fmr::fuse_sapply(m1, AE_operator<int>::create(op, var));
 		else if (m1->get_type() == get_scalar_type<double>())
-			out = m1->sapply(AE_operator<double>::create(op, var));
+			out = fmr::fuse_sapply(m1, AE_operator<double>::create(op, var));
 	}
 	// If the left matrix is actually a vector.
 	else if (m1->get_num_rows() == m2->get_num_rows()
@@ -1365,12 +2057,12 @@ RcppExport SEXP R_FM_mapply2_AE(SEXP pfun, SEXP po1, SEXP po2)
 	dense_matrix::ptr out;
 	if (m1->get_type() == get_scalar_type<double>()) {
 		double val = scalar_variable::get_val<double>(*o2);
-		out = m1->sapply(std::shared_ptr<bulk_uoperate>(
+		out = fmr::fuse_sapply(m1, std::shared_ptr<bulk_uoperate>(
 					new AE_operator<double>(op, val)));
 	}
 	else if (m1->get_type() == get_scalar_type<int>()) {
 		int val = scalar_variable::get_val<int>(*o2);
-		out = m1->sapply(std::shared_ptr<bulk_uoperate>(
+		out = fmr::fuse_sapply(m1, std::shared_ptr<bulk_uoperate>(
 					new AE_operator<int>(op, val)));
 	}
 
@@ -1418,12 +2110,12 @@ RcppExport SEXP R_FM_mapply2_EA(SEXP pfun, SEXP po1, SEXP po2)
 	dense_matrix::ptr out;
 	if (m2->get_type() == get_scalar_type<double>()) {
 		double val = scalar_variable::get_val<double>(*o1);
-		out = m2->sapply(std::shared_ptr<bulk_uoperate>(
+		out = fmr::fuse_sapply(m2, std::shared_ptr<bulk_uoperate>(
 					new EA_operator<double>(op, val)));
 	}
 	else if (m2->get_type() == get_scalar_type<int>()) {
 		int val = scalar_variable::get_val<int>(*o1);
-		out = m2->sapply(std::shared_ptr<bulk_uoperate>(
+		out = fmr::fuse_sapply(m2, std::shared_ptr<bulk_uoperate>(
 					new EA_operator<int>(op, val)));
 	}
 
@@ -1508,7 +2200,7 @@ RcppExport SEXP R_FM_sapply(SEXP pfun, SEXP pobj)
 	if (op == NULL)
 		return R_NilValue;
 
-	dense_matrix::ptr out = m->sapply(op);
+	dense_matrix::ptr out = fmr::fuse_sapply(m, op);
 	if (out == NULL)
 		return R_NilValue;
 	else if (is_vec)
@@ -1594,6 +2286,113 @@ RcppExport SEXP R_FM_agg_lazy(SEXP pobj, SEXP pfun)
 	return create_FMR_vector(res, op_res.second, "");
 }
 
+/*
+ * This computes which.min or which.max of every row of a tall matrix.
+ * Instead of invoking the aggregation operator on each row, it runs the SIMD
+ * kernel on a whole portion, which computes many rows at once.
+ * When the operator is transposed, it computes on the columns of a wide
+ * matrix instead.
+ */
+template<class T>
+class row_which_portion_op: public detail::portion_mapply_op
+{
+	bool is_max;
+	bool transposed;
+
+	void run_rows(const T *arr, size_t nrow, size_t ncol, bool row_major,
+			int *out) const {
+		if (is_max)
+			fmr::simd::row_which_max(arr, nrow, ncol, row_major, out);
+		else
+			fmr::simd::row_which_min(arr, nrow, ncol, row_major, out);
+	}
+public:
+	row_which_portion_op(size_t nrow, bool is_max,
+			bool transposed): detail::portion_mapply_op(transposed ? 1 : nrow,
+				transposed ? nrow : 1, get_scalar_type<int>()) {
+		this->is_max = is_max;
+		this->transposed = transposed;
+	}
+
+	virtual detail::portion_mapply_op::const_ptr transpose() const {
+		size_t nrow = transposed ? get_out_num_cols() : get_out_num_rows();
+		return detail::portion_mapply_op::const_ptr(
+				new row_which_portion_op<T>(nrow, is_max, !transposed));
+	}
+
+	virtual void run(const std::vector<detail::local_matrix_store::const_ptr> &ins,
+			detail::local_matrix_store &out) const {
+		const detail::local_matrix_store &in = *ins[0];
+		size_t nrow = transposed ? in.get_num_cols() : in.get_num_rows();
+		size_t ncol = transposed ? in.get_num_rows() : in.get_num_cols();
+		// A row of the original matrix is a column of the transposed one.
+		bool row_major = (in.store_layout() == matrix_layout_t::L_ROW)
+			!= transposed;
+		int *res = reinterpret_cast<int *>(out.get_raw_arr());
+		const T *arr = reinterpret_cast<const T *>(in.get_raw_arr());
+		if (arr) {
+			run_rows(arr, nrow, ncol, row_major, res);
+			return;
+		}
+
+		// The portion isn't stored contiguously, so we copy it to a buffer.
+		std::vector<T> buf(nrow * ncol);
+		if (in.store_layout() == matrix_layout_t::L_ROW) {
+			const detail::local_row_matrix_store &row_in
+				= dynamic_cast<const detail::local_row_matrix_store &>(in);
+			for (size_t i = 0; i < in.get_num_rows(); i++)
+				memcpy(&buf[i * in.get_num_cols()], row_in.get_row(i),
+						in.get_num_cols() * sizeof(T));
+		}
+		else {
+			const detail::local_col_matrix_store &col_in
+				= dynamic_cast<const detail::local_col_matrix_store &>(in);
+			for (size_t j = 0; j < in.get_num_cols(); j++)
+				memcpy(&buf[j * in.get_num_rows()], col_in.get_col(j),
+						in.get_num_rows() * sizeof(T));
+		}
+		run_rows(buf.data(), nrow, ncol, row_major, res);
+	}
+
+	virtual std::string to_string(
+			const std::vector<detail::matrix_store::const_ptr> &mats) const {
+		return std::string(is_max ? "which.max" : "which.min") + "("
+			+ mats[0]->get_name() + ")";
+	}
+};
+
+/*
+ * which.min and which.max on the rows of a tall matrix run on a portion
+ * of rows with SIMD. It returns NULL if the aggregation can't run this way.
+ */
+static dense_matrix::ptr row_which(dense_matrix::ptr m,
+		agg_operate::const_ptr op)
+{
+	std::string name = op->get_agg().get_name();
+	if (m->is_wide() || (name != "which_min" && name != "which_max"))
+		return dense_matrix::ptr();
+
+	bool is_max = name == "which_max";
+	detail::portion_mapply_op::const_ptr portion_op;
+	if (m->get_type() == get_scalar_type<double>())
+		portion_op = detail::portion_mapply_op::const_ptr(
+				new row_which_portion_op<double>(m->get_num_rows(), is_max,
+					false));
+	else if (m->get_type() == get_scalar_type<int>())
+		portion_op = detail::portion_mapply_op::const_ptr(
+				new row_which_portion_op<int>(m->get_num_rows(), is_max,
+					false));
+	else
+		return dense_matrix::ptr();
+
+	std::vector<detail::matrix_store::const_ptr> stores(1, m->get_raw_store());
+	detail::matrix_store::ptr res = detail::__mapply_portion_virtual(stores,
+			portion_op, matrix_layout_t::L_COL);
+	if (res == NULL)
+		return dense_matrix::ptr();
+	return dense_matrix::create(res);
+}
+
 RcppExport SEXP R_FM_agg_mat_lazy(SEXP pobj, SEXP pmargin, SEXP pfun)
 {
 	Rcpp::S4 obj1(pobj);
@@ -1618,7 +2417,11 @@ RcppExport SEXP R_FM_agg_mat_lazy(SEXP pobj, SEXP pmargin, SEXP pfun)
 		return R_NilValue;
 	}
 
-	dense_matrix::ptr res = m->aggregate((matrix_margin) margin, op);
+	dense_matrix::ptr res;
+	if (margin == matrix_margin::MAR_ROW)
+		res = row_which(m, op);
+	if (res == NULL)
+		res = m->aggregate((matrix_margin) margin, op);
 	return create_FMR_vector(res, op_res.second, "");
 }
 
@@ -1635,6 +2438,15 @@ RcppExport SEXP R_FM_sgroupby(SEXP pvec, SEXP pfun)
 	}
 	auto op_res = fmr::get_agg_op(pfun, FM_get_Rtype(pvec));
 	agg_operate::const_ptr op = op_res.first;
+	if (op == NULL)
+		return R_NilValue;
+	dense_matrix::ptr vals, aggs;
+	if (fmr::hash_sgroupby(vec, op, vals, aggs)) {
+		Rcpp::List ret;
+		ret["val"] = create_FMR_vector(vals, FM_get_Rtype(pvec), "val");
+		ret["agg"] = create_FMR_vector(aggs, op_res.second, "agg");
+		return ret;
+	}
 	data_frame::ptr groupby_res = vec->groupby(op, true);
 	std::vector<R_type> col_types(2);
 	col_types[0] = FM_get_Rtype(pvec);
@@ -1642,8 +2454,598 @@ RcppExport SEXP R_FM_sgroupby(SEXP pvec, SEXP pfun)
 	return create_FMR_data_frame(groupby_res, col_types, "");
 }
 
+/*
+ * This aggregates the columns of a matrix by groups. The columns of a group
+ * in a portion are copied to a row-major buffer, so that the values of
+ * a row in a group are aggregated in a single call to the aggregation
+ * operator.
+ *
+ * The portions of a tall matrix have all columns, so the operator outputs
+ * the result of the rows in a portion directly. It runs as a virtual
+ * matrix, so the result is stored in the same kind of storage as the input
+ * when it's materialized. When the operator is transposed, it computes on
+ * the rows of a wide matrix instead. The portions of a wide matrix have all
+ * rows, so each thread aggregates the portions it processes into its own
+ * partial result, and we combine the partial results in the end.
+ */
+class groupby_col_portion_op: public detail::portion_mapply_op
+{
+	agg_operate::const_ptr op;
+	// The group of each column.
+	std::shared_ptr<const std::vector<int> > col_groups;
+	size_t num_levels;
+	bool partial;
+	bool transposed;
+	detail::mem_matrix_store::ptr res;
+	// The partial results of each thread and the groups they have.
+	std::vector<detail::mem_matrix_store::ptr> partial_res;
+	std::vector<std::vector<bool> > has_groups;
+
+	void get_group_cols(const detail::local_matrix_store &in,
+			std::vector<std::vector<size_t> > &group_cols) const;
+	void agg_group(const detail::local_matrix_store &in,
+			const std::vector<size_t> &cols, char *buf, char *out) const;
+public:
+	/*
+	 * The operator for a tall matrix with `nrow' rows.
+	 */
+	groupby_col_portion_op(agg_operate::const_ptr op,
+			std::shared_ptr<const std::vector<int> > col_groups,
+			size_t num_levels, size_t nrow,
+			bool transposed): detail::portion_mapply_op(
+				transposed ? num_levels : nrow,
+				transposed ? nrow : num_levels, op->get_output_type()) {
+		this->op = op;
+		this->col_groups = col_groups;
+		this->num_levels = num_levels;
+		this->partial = false;
+		this->transposed = transposed;
+	}
+
+	/*
+	 * The operator for a wide matrix, which writes the result to `res'.
+	 */
+	groupby_col_portion_op(agg_operate::const_ptr op,
+			std::shared_ptr<const std::vector<int> > col_groups,
+			size_t num_levels,
+			detail::mem_matrix_store::ptr res): detail::portion_mapply_op(0, 0,
+				op->get_output_type()) {
+		this->op = op;
+		this->col_groups = col_groups;
+		this->num_levels = num_levels;
+		this->partial = true;
+		this->transposed = false;
+		this->res = res;
+		size_t num_threads = detail::mem_thread_pool::get_global_num_threads();
+		partial_res.resize(num_threads);
+		has_groups.resize(num_threads, std::vector<bool>(num_levels));
+	}
+
+	virtual detail::portion_mapply_op::const_ptr transpose() const {
+		if (partial) {
+			fprintf(stderr,
+					"groupby on columns of a wide matrix doesn't support transpose\n");
+			return detail::portion_mapply_op::const_ptr();
+		}
+		size_t nrow = transposed ? get_out_num_cols() : get_out_num_rows();
+		return detail::portion_mapply_op::const_ptr(
+				new groupby_col_portion_op(op, col_groups, num_levels, nrow,
+					!transposed));
+	}
+
+	virtual void run(
+			const std::vector<detail::local_matrix_store::const_ptr> &ins) const;
+	virtual void run(
+			const std::vector<detail::local_matrix_store::const_ptr> &ins,
+			detail::local_matrix_store &out) const;
+
+	/*
+	 * Combine the partial results of all threads.
+	 */
+	void combine() const;
+
+	virtual std::string to_string(
+			const std::vector<detail::matrix_store::const_ptr> &mats) const {
+		return std::string("groupby_col(") + mats[0]->get_name() + ")";
+	}
+
+	virtual bool is_agg() const {
+		return false;
+	}
+};
+
+/*
+ * Find the columns of each group in a portion. The columns are the rows of
+ * the portion if the operator is transposed.
+ */
+void groupby_col_portion_op::get_group_cols(
+		const detail::local_matrix_store &in,
+		std::vector<std::vector<size_t> > &group_cols) const
+{
+	size_t ncol = transposed ? in.get_num_rows() : in.get_num_cols();
+	size_t start_col = transposed
+		? in.get_global_start_row() : in.get_global_start_col();
+	group_cols.resize(num_levels);
+	for (size_t j = 0; j < ncol; j++)
+		group_cols[(*col_groups)[start_col + j]].push_back(j);
+}
+
+/*
+ * Aggregate the values of each row in the columns `cols' of a portion and
+ * write the results of the rows to `out'.
+ */
+void groupby_col_portion_op::agg_group(const detail::local_matrix_store &in,
+		const std::vector<size_t> &cols, char *buf, char *out) const
+{
+	size_t nrow = transposed ? in.get_num_cols() : in.get_num_rows();
+	size_t entry_size = in.get_entry_size();
+	size_t num_cols = cols.size();
+	// A row of the portion is a column of the matrix we group if
+	// the operator is transposed.
+	if ((in.store_layout() == matrix_layout_t::L_ROW) != transposed) {
+		for (size_t i = 0; i < nrow; i++) {
+			const char *row = transposed
+				? dynamic_cast<const detail::local_col_matrix_store &>(
+						in).get_col(i)
+				: dynamic_cast<const detail::local_row_matrix_store &>(
+						in).get_row(i);
+			for (size_t k = 0; k < num_cols; k++)
+				memcpy(buf + (i * num_cols + k) * entry_size,
+						row + cols[k] * entry_size, entry_size);
+		}
+	}
+	else {
+		for (size_t k = 0; k < num_cols; k++) {
+			const char *col = transposed
+				? dynamic_cast<const detail::local_row_matrix_store &>(
+						in).get_row(cols[k])
+				: dynamic_cast<const detail::local_col_matrix_store &>(
+						in).get_col(cols[k]);
+			for (size_t i = 0; i < nrow; i++)
+				memcpy(buf + (i * num_cols + k) * entry_size,
+						col + i * entry_size, entry_size);
+		}
+	}
+
+	const bulk_operate &agg = op->get_agg();
+	size_t out_size = op->get_output_type().get_size();
+	for (size_t i = 0; i < nrow; i++)
+		agg.runAgg(num_cols, buf + i * num_cols * entry_size,
+				out + i * out_size);
+}
+
+void groupby_col_portion_op::run(
+		const std::vector<detail::local_matrix_store::const_ptr> &ins,
+		detail::local_matrix_store &out) const
+{
+	const detail::local_matrix_store &in = *ins[0];
+	size_t nrow = transposed ? in.get_num_cols() : in.get_num_rows();
+	std::vector<std::vector<size_t> > group_cols;
+	get_group_cols(in, group_cols);
+
+	// The output has the result of a group in a column, or in a row if
+	// the operator is transposed, so the result of a group is contiguous
+	// in both cases.
+	size_t out_size = op->get_output_type().get_size();
+	char *res = out.get_raw_arr();
+	std::vector<char> buf(in.get_num_rows() * in.get_num_cols()
+			* in.get_entry_size());
+	for (size_t g = 0; g < num_levels; g++) {
+		char *group_res = res + g * nrow * out_size;
+		if (group_cols[g].empty())
+			memset(group_res, 0, nrow * out_size);
+		else
+			agg_group(in, group_cols[g], buf.data(), group_res);
+	}
+}
+
+void groupby_col_portion_op::run(
+		const std::vector<detail::local_matrix_store::const_ptr> &ins) const
+{
+	const detail::local_matrix_store &in = *ins[0];
+	size_t nrow = in.get_num_rows();
+	size_t start_row = in.get_global_start_row();
+	std::vector<std::vector<size_t> > group_cols;
+	get_group_cols(in, group_cols);
+
+	size_t out_size = op->get_output_type().get_size();
+	std::vector<char> buf(nrow * in.get_num_cols() * in.get_entry_size());
+	int thread_id = detail::mem_thread_pool::get_curr_thread_id();
+	groupby_col_portion_op *mutable_this
+		= const_cast<groupby_col_portion_op *>(this);
+	detail::mem_matrix_store::ptr &part = mutable_this->partial_res[thread_id];
+	std::vector<bool> &has = mutable_this->has_groups[thread_id];
+	if (part == NULL)
+		part = detail::mem_matrix_store::create(res->get_num_rows(),
+				num_levels, matrix_layout_t::L_COL, op->get_output_type(), -1);
+	std::vector<char> tmp(nrow * out_size);
+	for (size_t g = 0; g < num_levels; g++) {
+		if (group_cols[g].empty())
+			continue;
+		char *part_col = part->get(start_row, g);
+		if (!has[g]) {
+			agg_group(in, group_cols[g], buf.data(), part_col);
+			has[g] = true;
+		}
+		else {
+			agg_group(in, group_cols[g], buf.data(), tmp.data());
+			op->get_combine().runAA(nrow, part_col, tmp.data(), part_col);
+		}
+	}
+}
+
+void groupby_col_portion_op::combine() const
+{
+	size_t nrow = res->get_num_rows();
+	size_t out_size = op->get_output_type().get_size();
+	for (size_t g = 0; g < num_levels; g++) {
+		bool has_res = false;
+		char *res_col = res->get(0, g);
+		for (size_t t = 0; t < partial_res.size(); t++) {
+			if (partial_res[t] == NULL || !has_groups[t][g])
+				continue;
+			if (!has_res)
+				memcpy(res_col, partial_res[t]->get(0, g), nrow * out_size);
+			else
+				op->get_combine().runAA(nrow, res_col,
+						partial_res[t]->get(0, g), res_col);
+			has_res = true;
+		}
+	}
+}
+
+/*
+ * Aggregate the columns of a matrix by a factor. A group without any
+ * columns gets 0. The result of a tall matrix is a virtual matrix, which
+ * is stored like the input when it's materialized. The result of a wide
+ * matrix has few rows, so it's computed in memory.
+ */
+static dense_matrix::ptr groupby_col(dense_matrix::ptr mat,
+		factor_col_vector::ptr factor, agg_operate::const_ptr op)
+{
+	size_t ncol = mat->get_num_cols();
+	size_t num_levels = factor->get_num_levels();
+	std::shared_ptr<std::vector<int> > col_groups(new std::vector<int>(ncol));
+	if (!copy_FM2Rmatrix<int, int>(factor, col_groups->data()))
+		return dense_matrix::ptr();
+	for (size_t j = 0; j < ncol; j++) {
+		if ((*col_groups)[j] < 0 || (size_t) (*col_groups)[j] >= num_levels) {
+			fprintf(stderr, "the factor has a wrong level: %d\n",
+					(*col_groups)[j]);
+			return dense_matrix::ptr();
+		}
+	}
+
+	std::vector<detail::matrix_store::const_ptr> stores(1,
+			mat->get_raw_store());
+	if (!mat->is_wide()) {
+		detail::portion_mapply_op::const_ptr groupby_op(
+				new groupby_col_portion_op(op, col_groups, num_levels,
+					mat->get_num_rows(), false));
+		detail::matrix_store::ptr res = detail::__mapply_portion_virtual(
+				stores, groupby_op, matrix_layout_t::L_COL);
+		if (res == NULL)
+			return dense_matrix::ptr();
+		return dense_matrix::create(res);
+	}
+
+	if (!op->has_combine()) {
+		fprintf(stderr,
+				"groupby on columns of a wide matrix needs a combine operator\n");
+		return dense_matrix::ptr();
+	}
+	detail::mem_matrix_store::ptr res = detail::mem_matrix_store::create(
+			mat->get_num_rows(), num_levels, matrix_layout_t::L_COL,
+			op->get_output_type(), -1);
+	memset(res->get_raw_arr(), 0,
+			mat->get_num_rows() * num_levels * op->get_output_type().get_size());
+
+	std::shared_ptr<groupby_col_portion_op> groupby_op(
+			new groupby_col_portion_op(op, col_groups, num_levels, res));
+	detail::__mapply_portion(stores, groupby_op, matrix_layout_t::L_COL);
+	groupby_op->combine();
+	return dense_matrix::create(res);
+}
+
+/*
+ * This aggregates the rows of multiple matrices by the same factor with
+ * multiple aggregation operators and counts the rows in each group, all in
+ * a single scan over the input matrices. The factor is an input of
+ * the portion operation, so we don't need to keep the factor in memory.
+ * All matrices have to be tall.
+ *
+ * Each thread aggregates the portions it processes into its own partial
+ * results and we combine the partial results in the end.
+ */
+class groupby_row_multi_portion_op: public detail::portion_mapply_op
+{
+	std::vector<agg_operate::const_ptr> ops;
+	size_t num_levels;
+	size_t ncol;
+	// The partial results and counts of each thread.
+	std::vector<std::vector<detail::mem_matrix_store::ptr> > partial_res;
+	std::vector<std::vector<size_t> > partial_cnts;
+
+	void agg_group(const detail::local_matrix_store &in,
+			const std::vector<size_t> &rows, const bulk_operate &agg,
+			char *buf, char *out) const;
+public:
+	groupby_row_multi_portion_op(const std::vector<agg_operate::const_ptr> &ops,
+			size_t num_levels, size_t ncol): detail::portion_mapply_op(0, 0,
+				ops[0]->get_output_type()) {
+		this->ops = ops;
+		this->num_levels = num_levels;
+		this->ncol = ncol;
+		size_t num_threads = detail::mem_thread_pool::get_global_num_threads();
+		partial_res.resize(num_threads);
+		partial_cnts.resize(num_threads);
+	}
+
+	virtual detail::portion_mapply_op::const_ptr transpose() const {
+		fprintf(stderr, "groupby on multiple matrices doesn't support transpose\n");
+		return detail::portion_mapply_op::const_ptr();
+	}
+
+	virtual void run(
+			const std::vector<detail::local_matrix_store::const_ptr> &ins) const;
+
+	/*
+	 * Combine the partial results of all threads. A group without any rows
+	 * gets 0.
+	 */
+	void combine(std::vector<detail::mem_matrix_store::ptr> &res,
+			std::vector<size_t> &cnts) const;
+
+	virtual std::string to_string(
+			const std::vector<detail::matrix_store::const_ptr> &mats) const {
+		return std::string("groupby_row_multi(") + mats[0]->get_name() + ")";
+	}
+
+	virtual bool is_agg() const {
+		return false;
+	}
+};
+
+/*
+ * Aggregate the values of each column in the rows `rows' of a portion and
+ * write the results of the columns to `out'.
+ */
+void groupby_row_multi_portion_op::agg_group(
+		const detail::local_matrix_store &in, const std::vector<size_t> &rows,
+		const bulk_operate &agg, char *buf, char *out) const
+{
+	size_t entry_size = in.get_entry_size();
+	size_t out_size = agg.output_entry_size();
+	size_t num_rows = rows.size();
+	if (in.store_layout() == matrix_layout_t::L_ROW) {
+		const detail::local_row_matrix_store &row_in
+			= dynamic_cast<const detail::local_row_matrix_store &>(in);
+		for (size_t k = 0; k < num_rows; k++) {
+			const char *row = row_in.get_row(rows[k]);
+			for (size_t j = 0; j < ncol; j++)
+				memcpy(buf + (j * num_rows + k) * entry_size,
+						row + j * entry_size, entry_size);
+		}
+	}
+	else {
+		const detail::local_col_matrix_store &col_in
+			= dynamic_cast<const detail::local_col_matrix_store &>(in);
+		for (size_t j = 0; j < ncol; j++) {
+			const char *col = col_in.get_col(j);
+			for (size_t k = 0; k < num_rows; k++)
+				memcpy(buf + (j * num_rows + k) * entry_size,
+						col + rows[k] * entry_size, entry_size);
+		}
+	}
+	for (size_t j = 0; j < ncol; j++)
+		agg.runAgg(num_rows, buf + j * num_rows * entry_size,
+				out + j * out_size);
+}
+
+void groupby_row_multi_portion_op::run(
+		const std::vector<detail::local_matrix_store::const_ptr> &ins) const
+{
+	// The last input is the factor. Its levels have been checked.
+	const int *groups = (const int *) ins.back()->get_raw_arr();
+	size_t nrow = ins.back()->get_num_rows();
+	std::vector<std::vector<size_t> > group_rows(num_levels);
+	for (size_t i = 0; i < nrow; i++)
+		group_rows[groups[i]].push_back(i);
+
+	int thread_id = detail::mem_thread_pool::get_curr_thread_id();
+	groupby_row_multi_portion_op *mutable_this
+		= const_cast<groupby_row_multi_portion_op *>(this);
+	std::vector<detail::mem_matrix_store::ptr> &parts
+		= mutable_this->partial_res[thread_id];
+	std::vector<size_t> &cnts = mutable_this->partial_cnts[thread_id];
+	if (parts.empty()) {
+		for (size_t i = 0; i < ops.size(); i++)
+			parts.push_back(detail::mem_matrix_store::create(num_levels, ncol,
+						matrix_layout_t::L_ROW, ops[i]->get_output_type(), -1));
+		cnts.resize(num_levels);
+	}
+
+	size_t max_entry_size = 0;
+	for (size_t i = 0; i < ops.size(); i++)
+		max_entry_size = std::max(max_entry_size, std::max(
+					ins[i]->get_entry_size(),
+					ops[i]->get_output_type().get_size()));
+	std::vector<char> buf(nrow * ncol * max_entry_size);
+	std::vector<char> tmp(ncol * max_entry_size);
+	for (size_t g = 0; g < num_levels; g++) {
+		if (group_rows[g].empty())
+			continue;
+		for (size_t i = 0; i < ops.size(); i++) {
+			char *part_row = parts[i]->get(g, 0);
+			if (cnts[g] == 0)
+				agg_group(*ins[i], group_rows[g], ops[i]->get_agg(),
+						buf.data(), part_row);
+			else {
+				agg_group(*ins[i], group_rows[g], ops[i]->get_agg(),
+						buf.data(), tmp.data());
+				ops[i]->get_combine().runAA(ncol, part_row, tmp.data(),
+						part_row);
+			}
+		}
+		cnts[g] += group_rows[g].size();
+	}
+}
+
+void groupby_row_multi_portion_op::combine(
+		std::vector<detail::mem_matrix_store::ptr> &res,
+		std::vector<size_t> &cnts) const
+{
+	res.clear();
+	for (size_t i = 0; i < ops.size(); i++) {
+		size_t out_size = ops[i]->get_output_type().get_size();
+		detail::mem_matrix_store::ptr mat = detail::mem_matrix_store::create(
+				num_levels, ncol, matrix_layout_t::L_ROW,
+				ops[i]->get_output_type(), -1);
+		memset(mat->get_raw_arr(), 0, num_levels * ncol * out_size);
+		res.push_back(mat);
+	}
+	cnts.clear();
+	cnts.resize(num_levels);
+	for (size_t t = 0; t < partial_res.size(); t++) {
+		if (partial_res[t].empty())
+			continue;
+		for (size_t g = 0; g < num_levels; g++) {
+			if (partial_cnts[t][g] == 0)
+				continue;
+			for (size_t i = 0; i < ops.size(); i++) {
+				char *res_row = res[i]->get(g, 0);
+				const char *part_row = partial_res[t][i]->get(g, 0);
+				if (cnts[g] == 0)
+					memcpy(res_row, part_row,
+							ncol * ops[i]->get_output_type().get_size());
+				else
+					ops[i]->get_combine().runAA(ncol, res_row, part_row,
+							res_row);
+			}
+			cnts[g] += partial_cnts[t][g];
+		}
+	}
+}
+
+/*
+ * Test if all levels of a factor are in [0, #levels). The factor is much
+ * smaller than the matrices grouped by it, so we check it before
+ * the groupby instead of checking each row in the worker threads.
+ */
+static bool check_factor_levels(factor_col_vector::ptr factor)
+{
+	const basic_ops &ops = get_scalar_type<int>().get_basic_ops();
+	scalar_variable::ptr min = factor->aggregate(agg_operate::create(
+				bulk_operate::conv2ptr(*ops.get_op(basic_ops::op_idx::MIN))));
+	scalar_variable::ptr max = factor->aggregate(agg_operate::create(
+				bulk_operate::conv2ptr(*ops.get_op(basic_ops::op_idx::MAX))));
+	if (min == NULL || max == NULL)
+		return false;
+	int min_level = *(const int *) min->get_raw();
+	int max_level = *(const int *) max->get_raw();
+	if (min_level < 0 || (size_t) max_level >= factor->get_num_levels()) {
+		fprintf(stderr, "the factor has a wrong level: %d\n",
+				min_level < 0 ? min_level : max_level);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Aggregate the rows of the matrices with their aggregation operators and
+ * count the rows in each group with a single scan over the matrices.
+ */
+static SEXP groupby_row_multi(SEXP pmats, factor_col_vector::ptr factor,
+		SEXP pfuns)
+{
+	Rcpp::List mat_list(pmats);
+	Rcpp::List fun_list(pfuns);
+	if (mat_list.size() != fun_list.size() || mat_list.size() == 0) {
+		fprintf(stderr,
+				"groupby needs an aggregation operator for each matrix\n");
+		return R_NilValue;
+	}
+
+	std::vector<detail::matrix_store::const_ptr> stores;
+	std::vector<agg_operate::const_ptr> ops;
+	std::vector<R_type> out_types;
+	size_t nrow = factor->get_length();
+	size_t ncol = 0;
+	for (int i = 0; i < mat_list.size(); i++) {
+		SEXP pmat = mat_list[i];
+		if (is_sparse(pmat) || is_vector(pmat)) {
+			fprintf(stderr, "groupby only works on dense matrices\n");
+			return R_NilValue;
+		}
+		dense_matrix::ptr mat = get_matrix<dense_matrix>(pmat);
+		if (!is_supported_type(mat->get_type())) {
+			fprintf(stderr, "The input matrix has unsupported type\n");
+			return R_NilValue;
+		}
+		if (i == 0)
+			ncol = mat->get_num_cols();
+		if (mat->get_num_rows() != nrow || mat->get_num_cols() != ncol
+				|| mat->is_wide()) {
+			fprintf(stderr,
+					"groupby needs tall matrices with the same shape and a factor with the length as #rows\n");
+			return R_NilValue;
+		}
+		auto op_res = fmr::get_agg_op(fun_list[i], FM_get_Rtype(pmat));
+		if (op_res.first == NULL)
+			return R_NilValue;
+		if (!op_res.first->has_combine()) {
+			fprintf(stderr, "groupby on multiple matrices needs a combine operator\n");
+			return R_NilValue;
+		}
+		stores.push_back(mat->get_raw_store());
+		ops.push_back(op_res.first);
+		out_types.push_back(op_res.second);
+	}
+	if (!check_factor_levels(factor))
+		return R_NilValue;
+	stores.push_back(factor->get_raw_store());
+
+	std::shared_ptr<groupby_row_multi_portion_op> groupby_op(
+			new groupby_row_multi_portion_op(ops, factor->get_num_levels(),
+				ncol));
+	detail::__mapply_portion(stores, groupby_op, matrix_layout_t::L_ROW);
+	std::vector<detail::mem_matrix_store::ptr> res;
+	std::vector<size_t> cnts;
+	groupby_op->combine(res, cnts);
+
+	Rcpp::List aggs(res.size());
+	for (size_t i = 0; i < res.size(); i++)
+		aggs[i] = create_FMR_matrix(dense_matrix::create(res[i]),
+				out_types[i], "");
+	// A group may have more than 2^31 rows, so the counts are doubles.
+	detail::mem_matrix_store::ptr cnt_store = detail::mem_matrix_store::create(
+			cnts.size(), 1, matrix_layout_t::L_COL, get_scalar_type<double>(),
+			-1);
+	for (size_t g = 0; g < cnts.size(); g++)
+		*(double *) cnt_store->get(g, 0) = cnts[g];
+	Rcpp::List ret;
+	ret["agg"] = aggs;
+	ret["count"] = create_FMR_vector(dense_matrix::create(cnt_store),
+			R_type::R_REAL, "");
+	return ret;
+}
+
 RcppExport SEXP R_FM_groupby(SEXP pmat, SEXP pmargin, SEXP pfactor, SEXP pfun)
 {
+	if (Rf_isNewList(pmat) || Rf_isNewList(pfun)) {
+		if (INTEGER(pmargin)[0] != matrix_margin::MAR_COL) {
+			fprintf(stderr,
+					"groupby with multiple operators only works on rows\n");
+			return R_NilValue;
+		}
+		factor_col_vector::ptr factor = get_factor_vector(pfactor);
+		if (factor == NULL) {
+			fprintf(stderr, "groupby needs a factor vector\n");
+			return R_NilValue;
+		}
+		return groupby_row_multi(pmat, factor, pfun);
+	}
+
 	if (is_vector(pmat)) {
 		fprintf(stderr, "Doesn't support groupby on a vector\n");
 		return R_NilValue;
@@ -1682,13 +3084,15 @@ RcppExport SEXP R_FM_groupby(SEXP pmat, SEXP pmargin, SEXP pfactor, SEXP pfun)
 		return R_NilValue;
 	}
 
-	if (margin == matrix_margin::MAR_ROW) {
-		fprintf(stderr, "doesn't support grouping columns\n");
-		return R_NilValue;
-	}
 	auto op_res = fmr::get_agg_op(pfun, FM_get_Rtype(pmat));
 	agg_operate::const_ptr op = op_res.first;
-	dense_matrix::ptr groupby_res = mat->groupby_row(factor, op);
+	if (op == NULL)
+		return R_NilValue;
+	dense_matrix::ptr groupby_res;
+	if (margin == matrix_margin::MAR_ROW)
+		groupby_res = groupby_col(mat, factor, op);
+	else
+		groupby_res = mat->groupby_row(factor, op);
 	if (groupby_res == NULL)
 		return R_NilValue;
 	else
@@ -2146,6 +3550,30 @@ static SEXP materialize_sparse(const SEXP &pmat)
 	return create_FMR_matrix(mat, FM_get_Rtype(pmat), name);
 }
 
+/*
+ * The data of a materialized matrix doesn't change, so we register it to
+ * cache its NA flags. The flags are computed when an NA-adaptive operator
+ * reads the data for the first time.
+ */
+static void register_mater_NA(dense_matrix::ptr mat)
+{
+	detail::mem_matrix_store::const_ptr store
+		= std::dynamic_pointer_cast<const detail::mem_matrix_store>(
+				mat->get_raw_store());
+	if (store == NULL || store->get_raw_arr() == NULL)
+		return;
+
+	size_t num_eles = store->get_num_rows() * store->get_num_cols();
+	if (store->get_type() == get_scalar_type<int>())
+		fmr::register_NA_arr(store,
+				reinterpret_cast<const int *>(store->get_raw_arr()),
+				num_eles, false);
+	else if (store->get_type() == get_scalar_type<double>())
+		fmr::register_NA_arr(store,
+				reinterpret_cast<const double *>(store->get_raw_arr()),
+				num_eles, false);
+}
+
 RcppExport SEXP R_FM_materialize(SEXP pmat)
 {
 	if (is_sparse(pmat))
@@ -2154,10 +3582,12 @@ RcppExport SEXP R_FM_materialize(SEXP pmat)
 	dense_matrix::ptr mat = get_matrix<dense_matrix>(pmat);
 	// I think it's OK to materialize on the original matrix.
 	bool mater_ret = mat->materialize_self();
+	fmr::update_mem_usage();
 	if (!mater_ret) {
 		fprintf(stderr, "can't materialize the matrix\n");
 		return R_NilValue;
 	}
+	register_mater_NA(mat);
 
 	Rcpp::List ret;
 	Rcpp::S4 rcpp_mat(pmat);
@@ -2189,6 +3619,7 @@ RcppExport SEXP R_FM_materialize_list(SEXP plist)
 		}
 	}
 	bool ret = materialize(dense_mats);
+	fmr::update_mem_usage();
 	if (!ret)
 		return R_NilValue;
 
@@ -2197,6 +3628,7 @@ RcppExport SEXP R_FM_materialize_list(SEXP plist)
 		int orig_idx = dense_mat_idxs[i];
 		dense_matrix::ptr mat = dense_mats[i];
 		SEXP pmat = in_list[orig_idx];
+		register_mater_NA(mat);
 
 		Rcpp::S4 rcpp_mat(pmat);
 		Rcpp::String name = rcpp_mat.slot("name");
@@ -2623,12 +4055,68 @@ RcppExport SEXP R_FM_print_mat_info(SEXP pmat)
 					mat->get_data().get_num_nodes());
 		else
 			printf("dense matrix is stored on SMP\n");
+		if (mat->is_virtual())
+			printf("dense matrix is virtual\n");
+		else
+			printf("dense matrix has %ld bytes of data\n",
+					mat->get_num_rows() * mat->get_num_cols()
+					* mat->get_entry_size());
 		std::string name = mat->get_data().get_name();
 		printf("matrix store: %s\n", name.c_str());
 	}
 	return R_NilValue;
 }
 
+RcppExport SEXP R_FM_mem_usage()
+{
+	std::vector<fmr::obj_mem_info> infos = fmr::get_obj_mem_info();
+	Rcpp::StringVector obj_stores(infos.size());
+	Rcpp::NumericVector nrow(infos.size());
+	Rcpp::NumericVector ncol(infos.size());
+	Rcpp::NumericVector bytes(infos.size());
+	Rcpp::LogicalVector materialized(infos.size());
+	Rcpp::StringVector names(infos.size());
+	for (size_t i = 0; i < infos.size(); i++) {
+		obj_stores[i] = fmr::get_mem_store_name(infos[i].store);
+		nrow[i] = infos[i].nrow;
+		ncol[i] = infos[i].ncol;
+		bytes[i] = infos[i].bytes;
+		materialized[i] = infos[i].materialized;
+		names[i] = infos[i].name;
+	}
+	Rcpp::List objs;
+	objs["store"] = obj_stores;
+	objs["nrow"] = nrow;
+	objs["ncol"] = ncol;
+	objs["bytes"] = bytes;
+	objs["materialized"] = materialized;
+	objs["name"] = names;
+
+	fmr::mem_usage usage = fmr::get_mem_usage();
+	Rcpp::StringVector stores(fmr::NUM_MEM_STORES);
+	Rcpp::NumericVector num_objs(fmr::NUM_MEM_STORES);
+	Rcpp::NumericVector curr_bytes(fmr::NUM_MEM_STORES);
+	Rcpp::NumericVector peak_bytes(fmr::NUM_MEM_STORES);
+	for (int i = 0; i < fmr::NUM_MEM_STORES; i++) {
+		stores[i] = fmr::get_mem_store_name((fmr::mem_store_t) i);
+		num_objs[i] = usage.num_objs[i];
+		curr_bytes[i] = usage.curr_bytes[i];
+		peak_bytes[i] = usage.peak_bytes[i];
+	}
+	Rcpp::List stats;
+	stats["store"] = stores;
+	stats["num.objs"] = num_objs;
+	stats["curr.bytes"] = curr_bytes;
+	stats["peak.bytes"] = peak_bytes;
+
+	Rcpp::List ret;
+	ret["objs"] = objs;
+	ret["stores"] = stats;
+	ret["curr.bytes"] = Rcpp::NumericVector::create(usage.curr_total);
+	ret["peak.bytes"] = Rcpp::NumericVector::create(usage.peak_total);
+	return ret;
+}
+
 RcppExport SEXP R_FM_conv_store(SEXP pmat, SEXP pin_mem, SEXP pname)
 {
 	if (is_sparse(pmat)) {
@@ -2738,12 +4226,196 @@ RcppExport SEXP R_FM_set_test_NA(SEXP pval)
 	return R_NilValue;
 }
 
+RcppExport SEXP R_FM_set_fuse_ops(SEXP pval)
+{
+	fmr::set_fuse_ops(LOGICAL(pval)[0]);
+	return R_NilValue;
+}
+
+RcppExport SEXP R_FM_table(SEXP pvec)
+{
+	dense_matrix::ptr vals, cnts;
+	// fm.table counts with sgroupby if the type isn't supported here.
+	if (!fmr::hash_count(get_vector(pvec), vals, cnts))
+		return R_NilValue;
+	Rcpp::List ret;
+	ret["val"] = create_FMR_vector(vals, FM_get_Rtype(pvec), "val");
+	ret["Freq"] = create_FMR_vector(cnts, R_type::R_REAL, "Freq");
+	return ret;
+}
+
+RcppExport SEXP R_FM_quantile(SEXP pobj, SEXP pprobs, SEXP pmargin,
+		SEXP pna_rm, SEXP peps)
+{
+	Rcpp::S4 obj(pobj);
+	if (is_sparse(obj)) {
+		fprintf(stderr, "quantile doesn't support sparse matrix\n");
+		return R_NilValue;
+	}
+
+	dense_matrix::ptr mat = get_matrix<dense_matrix>(obj);
+	int margin = INTEGER(pmargin)[0];
+	if (margin != matrix_margin::MAR_ROW && margin != matrix_margin::MAR_COL) {
+		fprintf(stderr, "unknown margin\n");
+		return R_NilValue;
+	}
+	// The quantiles of the rows are the quantiles of the columns of
+	// the transpose.
+	if (margin == matrix_margin::MAR_ROW)
+		mat = mat->transpose();
+
+	Rcpp::NumericVector rprobs(pprobs);
+	std::vector<double> probs(rprobs.begin(), rprobs.end());
+	dense_matrix::ptr res = fmr::sketch_col_quantiles(mat, probs,
+			REAL(peps)[0], LOGICAL(pna_rm)[0]);
+	if (res == NULL) {
+		fprintf(stderr, "quantile doesn't support the type of the matrix\n");
+		return R_NilValue;
+	}
+	return create_FMR_matrix(res, R_type::R_REAL, "");
+}
+
+RcppExport SEXP R_FM_summary(SEXP pobj, SEXP pall)
+{
+	Rcpp::S4 obj(pobj);
+	if (is_sparse(obj)) {
+		fprintf(stderr, "summary doesn't support sparse matrix\n");
+		return R_NilValue;
+	}
+
+	dense_matrix::ptr mat = get_matrix<dense_matrix>(obj);
+	std::vector<fmr::col_summary> sums;
+	if (!fmr::summarize_cols(mat, sums)) {
+		fprintf(stderr, "summary doesn't support the type of the matrix\n");
+		return R_NilValue;
+	}
+	// Summarize all elements of the matrix.
+	if (LOGICAL(pall)[0] && sums.size() > 1) {
+		for (size_t j = 1; j < sums.size(); j++)
+			sums[0].merge(sums[j]);
+		sums.resize(1);
+	}
+
+	size_t n = sums.size();
+	Rcpp::NumericVector min(n), max(n), sum(n), abs_sum(n), sq_sum(n);
+	Rcpp::NumericVector num_nonzeros(n), num_nas(n), num_vals(n);
+	for (size_t j = 0; j < n; j++) {
+		min[j] = sums[j].min;
+		max[j] = sums[j].max;
+		sum[j] = sums[j].sum;
+		abs_sum[j] = sums[j].abs_sum;
+		sq_sum[j] = sums[j].sq_sum;
+		num_nonzeros[j] = sums[j].num_nonzeros;
+		num_nas[j] = sums[j].num_nas;
+		num_vals[j] = sums[j].num_vals;
+	}
+	Rcpp::List ret;
+	ret["min"] = min;
+	ret["max"] = max;
+	ret["sum"] = sum;
+	ret["normL1"] = abs_sum;
+	ret["sqSum"] = sq_sum;
+	ret["numNonzeros"] = num_nonzeros;
+	ret["numNAs"] = num_nas;
+	ret["numVals"] = num_vals;
+	return ret;
+}
+
+RcppExport SEXP R_FM_cum(SEXP pobj, SEXP pmargin, SEXP pop)
+{
+	Rcpp::S4 obj(pobj);
+	if (is_sparse(obj)) {
+		fprintf(stderr, "cum doesn't support sparse matrix\n");
+		return R_NilValue;
+	}
+
+	dense_matrix::ptr mat = get_matrix<dense_matrix>(obj);
+	int margin = INTEGER(pmargin)[0];
+	if (margin != matrix_margin::MAR_ROW && margin != matrix_margin::MAR_COL) {
+		fprintf(stderr, "unknown margin\n");
+		return R_NilValue;
+	}
+	fmr::scan_op_t op;
+	switch (INTEGER(pop)[0]) {
+		case basic_ops::op_idx::ADD:
+			op = fmr::SCAN_SUM;
+			break;
+		case basic_ops::op_idx::MUL:
+			op = fmr::SCAN_PROD;
+			break;
+		case basic_ops::op_idx::MAX:
+			op = fmr::SCAN_MAX;
+			break;
+		case basic_ops::op_idx::MIN:
+			op = fmr::SCAN_MIN;
+			break;
+		default:
+			fprintf(stderr, "cum only supports +, *, max and min\n");
+			return R_NilValue;
+	}
+
+	// R computes the cumulative products of integers on doubles and
+	// the other cumulative operations of logicals on integers.
+	R_type type = FM_get_Rtype(obj);
+	if (op == fmr::SCAN_PROD && type != R_type::R_REAL) {
+		mat = fmr::cast_Rtype(mat, type, R_type::R_REAL);
+		type = R_type::R_REAL;
+	}
+	else if (type == R_type::R_LOGICAL)
+		type = R_type::R_INT;
+
+	// The scans of the rows are the scans of the columns of the transpose.
+	if (margin == matrix_margin::MAR_ROW)
+		mat = mat->transpose();
+	dense_matrix::ptr res = fmr::scan_cols(mat, op);
+	if (res == NULL) {
+		fprintf(stderr, "cum doesn't support the type of the matrix\n");
+		return R_NilValue;
+	}
+	if (margin == matrix_margin::MAR_ROW)
+		res = res->transpose();
+	if (is_vector(obj))
+		return create_FMR_vector(res, type, "");
+	else
+		return create_FMR_matrix(res, type, "");
+}
+
+RcppExport SEXP R_FM_topk(SEXP pvec, SEXP pk, SEXP pdecrease, SEXP pret_idx)
+{
+	size_t k = REAL(pk)[0];
+	bool ret_idx = LOGICAL(pret_idx)[0];
+	bool decrease = LOGICAL(pdecrease)[0];
+	dense_matrix::ptr vals, idx;
+	if (!fmr::topk(get_vector(pvec), k, decrease, vals,
+				ret_idx ? &idx : NULL)) {
+		fprintf(stderr, "topk doesn't support the type of the vector\n");
+		return R_NilValue;
+	}
+	if (!ret_idx)
+		return create_FMR_vector(vals, FM_get_Rtype(pvec), "");
+	Rcpp::List ret;
+	ret["x"] = create_FMR_vector(vals, FM_get_Rtype(pvec), "");
+	ret["ix"] = create_FMR_vector(idx, R_type::R_REAL, "");
+	return ret;
+}
+
 RcppExport SEXP R_FM_sort(SEXP pvec, SEXP pdecrease, SEXP pret_idx)
 {
 	dense_matrix::ptr mat = get_matrix<dense_matrix>(pvec);
-	vector::ptr vec = mat->conv2vec();
 	bool ret_idx = LOGICAL(pret_idx)[0];
 	bool decrease = LOGICAL(pdecrease)[0];
+	dense_matrix::ptr vals, idx;
+	if (fmr::radix_sort(get_vector(pvec), decrease, vals,
+				ret_idx ? &idx : NULL)) {
+		if (!ret_idx)
+			return create_FMR_vector(vals, FM_get_Rtype(pvec), "");
+		Rcpp::List ret;
+		ret["x"] = create_FMR_vector(vals, FM_get_Rtype(pvec), "");
+		ret["ix"] = create_FMR_vector(idx, R_type::R_REAL, "");
+		return ret;
+	}
+
+	vector::ptr vec = mat->conv2vec();
 	if (ret_idx) {
 		auto sorted = vec->sort_with_index();
 		Rcpp::List ret;
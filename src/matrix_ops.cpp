@@ -17,9 +17,15 @@
  * limitations under the License.
  */
 
+#include <limits.h>
+#include <stdint.h>
+
 #include <unordered_map>
 
 #include "matrix_ops.h"
+#include "fmr_simd.h"
+#include "fmr_na.h"
+#include "fmr_sort.h"
 #include "mem_worker_thread.h"
 #include "local_vec_store.h"
 #include "bulk_operate_impl.h"
@@ -115,6 +121,50 @@ double R_get_na<double, false>()
 	return NA_REAL;
 }
 
+/*
+ * R outputs NA when integer arithmetic overflows. We compute integers in
+ * 64 bits and check the range. NA itself isn't in the range.
+ * The element-wise operators run the SIMD kernels in fmr_simd.cpp, which
+ * check overflow in vectors, so this scalar check only runs in
+ * aggregations, where a sum may create NA in the middle and must keep it,
+ * and on CPUs without the SIMD kernels.
+ */
+static inline int R_int_res(int e1, int e2, int64_t res)
+{
+	return e1 == NA_INTEGER || e2 == NA_INTEGER || res > INT_MAX
+		|| res < -INT_MAX ? NA_INTEGER : (int) res;
+}
+
+static inline int R_add(int e1, int e2)
+{
+	return R_int_res(e1, e2, (int64_t) e1 + e2);
+}
+
+static inline double R_add(double e1, double e2)
+{
+	return e1 + e2;
+}
+
+static inline int R_sub(int e1, int e2)
+{
+	return R_int_res(e1, e2, (int64_t) e1 - e2);
+}
+
+static inline double R_sub(double e1, double e2)
+{
+	return e1 - e2;
+}
+
+static inline int R_mul(int e1, int e2)
+{
+	return R_int_res(e1, e2, (int64_t) e1 * e2);
+}
+
+static inline double R_mul(double e1, double e2)
+{
+	return e1 * e2;
+}
+
 template<class T, bool is_logical>
 R_type get_Rtype()
 {
@@ -278,7 +328,7 @@ struct add {
 		return get_Rtype<Type, false>();
 	}
 	Type operator()(const Type &e1, const Type &e2) const {
-		return e1 + e2;
+		return R_add(e1, e2);
 	}
 };
 
@@ -296,7 +346,7 @@ struct sub {
 		return get_Rtype<Type, false>();
 	}
 	Type operator()(const Type &e1, const Type &e2) const {
-		return e1 - e2;
+		return R_sub(e1, e2);
 	}
 };
 
@@ -312,7 +362,7 @@ struct multiply {
 		return get_Rtype<Type, false>();
 	}
 	Type operator()(const Type &e1, const Type &e2) const {
-		return e1 * e2;
+		return R_mul(e1, e2);
 	}
 };
 
@@ -819,6 +869,32 @@ struct log10 {
 	}
 };
 
+template<class Type, bool is_logical>
+struct log1p {
+	static std::string get_name() {
+		return "log1p";
+	}
+	static R_type get_output_type() {
+		return get_Rtype<double, false>();
+	}
+	double operator()(const Type &e) const {
+		return std::log1p((double) e);
+	}
+};
+
+template<class Type, bool is_logical>
+struct uop_exp {
+	static std::string get_name() {
+		return "exp";
+	}
+	static R_type get_output_type() {
+		return get_Rtype<double, false>();
+	}
+	double operator()(const Type &e) const {
+		return std::exp((double) e);
+	}
+};
+
 ////////////////////// Define basic Ops //////////////////////
 
 class basic_Ruops: public basic_uops
@@ -826,6 +902,12 @@ class basic_Ruops: public basic_uops
 public:
 	typedef std::shared_ptr<basic_Ruops> ptr;
 	virtual R_type get_output_type(op_idx idx) const = 0;
+	/*
+	 * Whether the operator runs with SIMD kernels.
+	 */
+	virtual bool is_vectorized(op_idx idx) const {
+		return false;
+	}
 };
 
 class basic_Rops: public basic_ops
@@ -833,6 +915,12 @@ class basic_Rops: public basic_ops
 public:
 	typedef std::shared_ptr<basic_Rops> ptr;
 	virtual R_type get_output_type(op_idx idx) const = 0;
+	/*
+	 * Whether the operator runs with SIMD kernels.
+	 */
+	virtual bool is_vectorized(op_idx idx) const {
+		return false;
+	}
 };
 
 /*
@@ -897,15 +985,85 @@ public:
 	}
 };
 
+/*
+ * This runs a NA-aware binary operator with the SIMD kernel for the CPU.
+ * The scalar implementation is used if we don't have a kernel for the CPU.
+ */
+template<class OpType, class LeftType, class RightType, class ResType,
+	simd::na_bop_t op>
+class simd_NA_operate: public bulk_operate_impl<OpType, LeftType, RightType,
+	ResType>
+{
+	typedef bulk_operate_impl<OpType, LeftType, RightType, ResType> base_op;
+	typedef typename simd::bop_kernel<LeftType, ResType>::type kernel_t;
+
+	kernel_t AA_kernel;
+	kernel_t AE_kernel;
+	kernel_t EA_kernel;
+public:
+	simd_NA_operate() {
+		AA_kernel = simd::get_na_kernel<LeftType, ResType>(op, simd::AA);
+		AE_kernel = simd::get_na_kernel<LeftType, ResType>(op, simd::AE);
+		EA_kernel = simd::get_na_kernel<LeftType, ResType>(op, simd::EA);
+	}
+
+	bool is_vectorized() const {
+		return AA_kernel && AE_kernel && EA_kernel;
+	}
+
+	virtual void runAA(size_t num_eles, const void *left_arr,
+			const void *right_arr, void *output_arr) const {
+		if (AA_kernel)
+			AA_kernel(num_eles, (const LeftType *) left_arr,
+					(const RightType *) right_arr, (ResType *) output_arr);
+		else
+			base_op::runAA(num_eles, left_arr, right_arr, output_arr);
+	}
+	virtual void runAE(size_t num_eles, const void *left_arr,
+			const void *right, void *output_arr) const {
+		if (AE_kernel)
+			AE_kernel(num_eles, (const LeftType *) left_arr,
+					(const RightType *) right, (ResType *) output_arr);
+		else
+			base_op::runAE(num_eles, left_arr, right, output_arr);
+	}
+	virtual void runEA(size_t num_eles, const void *left,
+			const void *right_arr, void *output_arr) const {
+		if (EA_kernel)
+			EA_kernel(num_eles, (const LeftType *) left,
+					(const RightType *) right_arr, (ResType *) output_arr);
+		else
+			base_op::runEA(num_eles, left, right_arr, output_arr);
+	}
+};
+
+/*
+ * R outputs NA when integer arithmetic overflows, so integer +, - and *
+ * without NA checks still run the SIMD kernels, which check overflow in
+ * vectors. Doubles don't overflow.
+ */
+template<class OpType, class Type, simd::na_bop_t op>
+struct plain_arith
+{
+	typedef simd_NA_operate<OpType, Type, Type, Type, op> type;
+};
+
+template<class OpType, simd::na_bop_t op>
+struct plain_arith<OpType, double, op>
+{
+	typedef bulk_operate_impl<OpType, double, double, double> type;
+};
+
 /*
  * This template implements all basic binary operators for different types.
  */
 template<class Type, bool is_logical>
 class basic_Rops_impl: public basic_Rops
 {
-	bulk_operate_impl<add<Type, is_logical>, Type, Type, Type> add_op;
-	bulk_operate_impl<sub<Type, is_logical>, Type, Type, Type> sub_op;
-	bulk_operate_impl<multiply<Type, is_logical>, Type, Type, Type> mul_op;
+	typename plain_arith<add<Type, is_logical>, Type, simd::NA_ADD>::type add_op;
+	typename plain_arith<sub<Type, is_logical>, Type, simd::NA_SUB>::type sub_op;
+	typename plain_arith<multiply<Type, is_logical>, Type,
+		simd::NA_MUL>::type mul_op;
 	bulk_operate_impl<divide<Type, is_logical>, Type, Type, double> div_op;
 	bulk_operate_impl<mod<Type, is_logical>, Type, Type, Type> mod_op;
 	bulk_operate_impl<idiv<Type, is_logical>, Type, Type, Type> idiv_op;
@@ -977,6 +1135,34 @@ public:
 	}
 };
 
+/*
+ * This runs a NA-aware math function with the SIMD kernel for the CPU.
+ * The scalar implementation is used if we don't have a kernel for the CPU.
+ */
+template<class OpType, class InType, simd::na_uop_t op>
+class simd_NA_uoperate: public bulk_uoperate_impl<OpType, InType, double>
+{
+	typedef bulk_uoperate_impl<OpType, InType, double> base_op;
+
+	typename simd::uop_kernel<InType>::type kernel;
+public:
+	simd_NA_uoperate() {
+		kernel = simd::get_na_ukernel<InType>(op);
+	}
+
+	bool is_vectorized() const {
+		return kernel != NULL;
+	}
+
+	virtual void runA(size_t num_eles, const void *in_arr,
+			void *out_arr) const {
+		if (kernel)
+			kernel(num_eles, (const InType *) in_arr, (double *) out_arr);
+		else
+			base_op::runA(num_eles, in_arr, out_arr);
+	}
+};
+
 /*
  * This template implements all basic binary operators for different types.
  */
@@ -1061,19 +1247,20 @@ class basic_Ruops_NA_impl: public basic_Ruops
 	};
 
 	bulk_uoperate_impl<uop_neg_na, Type, Type> neg_op;
-	bulk_uoperate_impl<uop_sqrt_na, Type, double> sqrt_op;
+	simd_NA_uoperate<uop_sqrt_na, Type, simd::NA_SQRT> sqrt_op;
 	bulk_uoperate_impl<uop_abs_na, Type, Type> abs_op;
 	bulk_uoperate_impl<uop_not_na, Type, int> not_op;
 	bulk_uoperate_impl<sq_na, Type, Type> sq_op;
 	bulk_uoperate_impl<ceil_na, Type, Type> ceil_op;
 	bulk_uoperate_impl<floor_na, Type, Type> floor_op;
 	bulk_uoperate_impl<round_na, Type, Type> round_op;
-	bulk_uoperate_impl<log_na, Type, double> log_op;
-	bulk_uoperate_impl<log2_na, Type, double> log2_op;
-	bulk_uoperate_impl<log10_na, Type, double> log10_op;
+	simd_NA_uoperate<log_na, Type, simd::NA_LOG> log_op;
+	simd_NA_uoperate<log2_na, Type, simd::NA_LOG2> log2_op;
+	simd_NA_uoperate<log10_na, Type, simd::NA_LOG10> log10_op;
 
 	std::vector<bulk_uoperate *> ops;
 	std::vector<R_type> R_output_types;
+	std::vector<bool> vectorized;
 public:
 	basic_Ruops_NA_impl() {
 		ops.resize(NUM_OPS);
@@ -1101,6 +1288,12 @@ public:
 		R_output_types[LOG] = log<Type, is_logical>::get_output_type();
 		R_output_types[LOG2] = log2<Type, is_logical>::get_output_type();
 		R_output_types[LOG10] = log10<Type, is_logical>::get_output_type();
+
+		vectorized.resize(NUM_OPS, false);
+		vectorized[SQRT] = sqrt_op.is_vectorized();
+		vectorized[LOG] = log_op.is_vectorized();
+		vectorized[LOG2] = log2_op.is_vectorized();
+		vectorized[LOG10] = log10_op.is_vectorized();
 	}
 
 	virtual const bulk_uoperate *get_op(op_idx idx) const {
@@ -1114,6 +1307,12 @@ public:
 			return R_type::R_NTYPES;
 		return R_output_types[idx];
 	}
+
+	virtual bool is_vectorized(op_idx idx) const {
+		if (idx >= op_idx::NUM_OPS)
+			return false;
+		return vectorized[idx];
+	}
 };
 
 template<class Type, bool is_logical>
@@ -1192,21 +1391,21 @@ class basic_Rops_NA_impl: public basic_Rops
 		Type operator()(const Type &e1, const Type &e2) const {
 			return R_is_na<Type, is_logical>(e1) || R_is_na<Type, is_logical>(e2)
 				// This operation on a logical outputs an integer
-				? R_get_na<Type, false>() : e1 + e2;
+				? R_get_na<Type, false>() : R_add(e1, e2);
 		}
 	};
 
 	struct sub_na: public sub<Type, is_logical> {
 		Type operator()(const Type &e1, const Type &e2) const {
 			return R_is_na<Type, is_logical>(e1) || R_is_na<Type, is_logical>(e2)
-				? R_get_na<Type, false>() : e1 - e2;
+				? R_get_na<Type, false>() : R_sub(e1, e2);
 		}
 	};
 
 	struct multiply_na: public multiply<Type, is_logical> {
 		Type operator()(const Type &e1, const Type &e2) const {
 			return R_is_na<Type, is_logical>(e1) || R_is_na<Type, is_logical>(e2)
-				? R_get_na<Type, false>() : e1 * e2;
+				? R_get_na<Type, false>() : R_mul(e1, e2);
 		}
 	};
 
@@ -1311,26 +1510,27 @@ class basic_Rops_NA_impl: public basic_Rops
 		}
 	};
 
-	bulk_operate_impl<add_na, Type, Type, Type> add_op;
-	bulk_operate_impl<sub_na, Type, Type, Type> sub_op;
-	bulk_operate_impl<multiply_na, Type, Type, Type> mul_op;
-	bulk_operate_impl<divide_na, Type, Type, double> div_op;
+	simd_NA_operate<add_na, Type, Type, Type, simd::NA_ADD> add_op;
+	simd_NA_operate<sub_na, Type, Type, Type, simd::NA_SUB> sub_op;
+	simd_NA_operate<multiply_na, Type, Type, Type, simd::NA_MUL> mul_op;
+	simd_NA_operate<divide_na, Type, Type, double, simd::NA_DIV> div_op;
 	bulk_operate_impl<mod_na<Type, is_logical>, Type, Type, Type> mod_op;
 	bulk_operate_impl<idiv_na, Type, Type, Type> idiv_op;
 	bulk_operate_impl<min_na<Type, is_logical>, Type, Type, Type> min_op;
 	bulk_operate_impl<max_na<Type, is_logical>, Type, Type, Type> max_op;
 	bulk_operate_impl<pow_na, Type, Type, Type> pow_op;
-	bulk_operate_impl<eq_na, Type, Type, int> eq_op;
-	bulk_operate_impl<neq_na, Type, Type, int> neq_op;
-	bulk_operate_impl<gt_na, Type, Type, int> gt_op;
-	bulk_operate_impl<ge_na, Type, Type, int> ge_op;
-	bulk_operate_impl<lt_na, Type, Type, int> lt_op;
-	bulk_operate_impl<le_na, Type, Type, int> le_op;
+	simd_NA_operate<eq_na, Type, Type, int, simd::NA_EQ> eq_op;
+	simd_NA_operate<neq_na, Type, Type, int, simd::NA_NEQ> neq_op;
+	simd_NA_operate<gt_na, Type, Type, int, simd::NA_GT> gt_op;
+	simd_NA_operate<ge_na, Type, Type, int, simd::NA_GE> ge_op;
+	simd_NA_operate<lt_na, Type, Type, int, simd::NA_LT> lt_op;
+	simd_NA_operate<le_na, Type, Type, int, simd::NA_LE> le_op;
 	bulk_operate_impl<logic_or_na, Type, Type, int> or_op;
 	bulk_operate_impl<logic_and_na, Type, Type, int> and_op;
 
 	std::vector<bulk_operate *> ops;
 	std::vector<R_type> R_output_types;
+	std::vector<bool> vectorized;
 public:
 	basic_Rops_NA_impl() {
 		ops.resize(NUM_OPS);
@@ -1370,6 +1570,18 @@ public:
 		R_output_types[AND] = logic_and<Type, is_logical>::get_output_type();
 		R_output_types[MOD] = mod<Type, is_logical>::get_output_type();
 		R_output_types[IDIV] = idiv<Type, is_logical>::get_output_type();
+
+		vectorized.resize(NUM_OPS, false);
+		vectorized[ADD] = add_op.is_vectorized();
+		vectorized[SUB] = sub_op.is_vectorized();
+		vectorized[MUL] = mul_op.is_vectorized();
+		vectorized[DIV] = div_op.is_vectorized();
+		vectorized[EQ] = eq_op.is_vectorized();
+		vectorized[NEQ] = neq_op.is_vectorized();
+		vectorized[GT] = gt_op.is_vectorized();
+		vectorized[GE] = ge_op.is_vectorized();
+		vectorized[LT] = lt_op.is_vectorized();
+		vectorized[LE] = le_op.is_vectorized();
 	}
 
 	virtual const bulk_operate *get_op(op_idx idx) const {
@@ -1383,6 +1595,12 @@ public:
 			return R_type::R_NTYPES;
 		return R_output_types[idx];
 	}
+
+	virtual bool is_vectorized(op_idx idx) const {
+		if (idx >= op_idx::NUM_OPS)
+			return false;
+		return vectorized[idx];
+	}
 };
 
 class generic_bulk_operate
@@ -1438,6 +1656,67 @@ public:
 static std::vector<generic_bulk_operate> bulk_ops;
 static std::vector<generic_bulk_uoperate> bulk_uops;
 
+typedef std::unordered_map<std::string, op_id_t> op_name_map;
+
+/*
+ * The ids of binary operators indexed by their names. The basic operators
+ * are added first, so a UDF can't hide a basic operator with the same name.
+ */
+static op_name_map &get_op_names()
+{
+	static op_name_map names {
+		{"add", basic_ops::op_idx::ADD},
+		{"+", basic_ops::op_idx::ADD},
+		{"sub", basic_ops::op_idx::SUB},
+		{"-", basic_ops::op_idx::SUB},
+		{"mul", basic_ops::op_idx::MUL},
+		{"*", basic_ops::op_idx::MUL},
+		{"div", basic_ops::op_idx::DIV},
+		{"/", basic_ops::op_idx::DIV},
+		{"mod", basic_ops::op_idx::MOD},
+		{"%%", basic_ops::op_idx::MOD},
+		{"%/%", basic_ops::op_idx::IDIV},
+		{"min", basic_ops::op_idx::MIN},
+		{"max", basic_ops::op_idx::MAX},
+		{"pow", basic_ops::op_idx::POW},
+		{"eq", basic_ops::op_idx::EQ},
+		{"==", basic_ops::op_idx::EQ},
+		{"neq", basic_ops::op_idx::NEQ},
+		{"!=", basic_ops::op_idx::NEQ},
+		{"gt", basic_ops::op_idx::GT},
+		{">", basic_ops::op_idx::GT},
+		{"ge", basic_ops::op_idx::GE},
+		{">=", basic_ops::op_idx::GE},
+		{"lt", basic_ops::op_idx::LT},
+		{"<", basic_ops::op_idx::LT},
+		{"le", basic_ops::op_idx::LE},
+		{"<=", basic_ops::op_idx::LE},
+		{"|", basic_ops::op_idx::OR},
+		{"&", basic_ops::op_idx::AND},
+	};
+	return names;
+}
+
+/*
+ * The ids of unary operators indexed by their names.
+ */
+static op_name_map &get_uop_names()
+{
+	static op_name_map names {
+		{"neg", basic_uops::op_idx::NEG},
+		{"sqrt", basic_uops::op_idx::SQRT},
+		{"abs", basic_uops::op_idx::ABS},
+		{"not", basic_uops::op_idx::NOT},
+		{"ceil", basic_uops::op_idx::CEIL},
+		{"floor", basic_uops::op_idx::FLOOR},
+		{"round", basic_uops::op_idx::ROUND},
+		{"log", basic_uops::op_idx::LOG},
+		{"log2", basic_uops::op_idx::LOG2},
+		{"log10", basic_uops::op_idx::LOG10},
+	};
+	return names;
+}
+
 /*
  * Register a binary UDF.
  * A user has to provide UDFs for all different types.
@@ -1446,6 +1725,9 @@ void register_udf(const std::vector<bulk_operate::const_ptr> &ops,
 		const std::string &name)
 {
 	bulk_ops.emplace_back(name, ops);
+	// If the name exists, the UDF registered first is used.
+	get_op_names().emplace(name,
+			bulk_ops.size() - 1 + basic_ops::op_idx::NUM_OPS);
 }
 
 /*
@@ -1456,6 +1738,8 @@ void register_udf(const std::vector<bulk_uoperate::const_ptr> &ops,
 		const std::string &name)
 {
 	bulk_uops.emplace_back(name, ops);
+	get_uop_names().emplace(name,
+			bulk_uops.size() - 1 + basic_uops::op_idx::NUM_OPS);
 }
 
 static bool use_na_op = true;
@@ -1470,6 +1754,179 @@ std::vector<basic_Rops::ptr> bops_na((int) R_type::R_NTYPES);
 std::vector<basic_Ruops::ptr> buops((int) R_type::R_NTYPES);
 std::vector<basic_Ruops::ptr> buops_na((int) R_type::R_NTYPES);
 
+/*
+ * Test if a portion of data may contain NA. For doubles, we treat NaN as
+ * NA because some NA-aware operators output NA for NaN. If the portion
+ * belongs to data imported from R or materialized by FlashR, the answer
+ * comes from its cached NA flags instead of a scan.
+ */
+template<class Type>
+static inline bool portion_has_NA(const void *arr, size_t num_eles)
+{
+	return true;
+}
+
+template<>
+inline bool portion_has_NA<int>(const void *arr, size_t num_eles)
+{
+	return has_NA((const int *) arr, num_eles);
+}
+
+template<>
+inline bool portion_has_NA<double>(const void *arr, size_t num_eles)
+{
+	return has_NA((const double *) arr, num_eles);
+}
+
+/*
+ * This chooses between the NA-aware operator and the plain operator for
+ * each portion of data it runs on. The plain operator outputs the same
+ * result when the portion doesn't have NA and it's much cheaper.
+ */
+template<class Type>
+class NA_adaptive_operate: public bulk_operate
+{
+	// We keep the operator tables so that the operators are alive.
+	basic_Rops::ptr ops;
+	basic_Rops::ptr na_ops;
+	const bulk_operate &op;
+	const bulk_operate &na_op;
+public:
+	NA_adaptive_operate(basic_Rops::ptr ops, basic_Rops::ptr na_ops,
+			basic_ops::op_idx idx): op(*ops->get_op(idx)),
+			na_op(*na_ops->get_op(idx)) {
+		this->ops = ops;
+		this->na_ops = na_ops;
+	}
+
+	virtual void runAA(size_t num_eles, const void *left_arr,
+			const void *right_arr, void *output_arr) const {
+		if (portion_has_NA<Type>(left_arr, num_eles)
+				|| portion_has_NA<Type>(right_arr, num_eles))
+			na_op.runAA(num_eles, left_arr, right_arr, output_arr);
+		else
+			op.runAA(num_eles, left_arr, right_arr, output_arr);
+	}
+	virtual void runAE(size_t num_eles, const void *left_arr,
+			const void *right, void *output_arr) const {
+		if (portion_has_NA<Type>(left_arr, num_eles)
+				|| portion_has_NA<Type>(right, 1))
+			na_op.runAE(num_eles, left_arr, right, output_arr);
+		else
+			op.runAE(num_eles, left_arr, right, output_arr);
+	}
+	virtual void runEA(size_t num_eles, const void *left,
+			const void *right_arr, void *output_arr) const {
+		if (portion_has_NA<Type>(left, 1)
+				|| portion_has_NA<Type>(right_arr, num_eles))
+			na_op.runEA(num_eles, left, right_arr, output_arr);
+		else
+			op.runEA(num_eles, left, right_arr, output_arr);
+	}
+	virtual void runAgg(size_t num_eles, const void *in, void *output) const {
+		if (portion_has_NA<Type>(in, num_eles))
+			na_op.runAgg(num_eles, in, output);
+		else
+			op.runAgg(num_eles, in, output);
+	}
+	virtual void runCum(size_t num_eles, const void *left_arr,
+			const void *prev, void *output) const {
+		// The value accumulated from the previous portion may be NA.
+		na_op.runCum(num_eles, left_arr, prev, output);
+	}
+
+	virtual const scalar_type &get_left_type() const {
+		return na_op.get_left_type();
+	}
+	virtual const scalar_type &get_right_type() const {
+		return na_op.get_right_type();
+	}
+	virtual const scalar_type &get_output_type() const {
+		return na_op.get_output_type();
+	}
+	virtual std::string get_name() const {
+		return na_op.get_name();
+	}
+};
+
+template<class Type>
+class NA_adaptive_uoperate: public bulk_uoperate
+{
+	basic_Ruops::ptr ops;
+	basic_Ruops::ptr na_ops;
+	const bulk_uoperate &op;
+	const bulk_uoperate &na_op;
+public:
+	NA_adaptive_uoperate(basic_Ruops::ptr ops, basic_Ruops::ptr na_ops,
+			basic_uops::op_idx idx): op(*ops->get_op(idx)),
+			na_op(*na_ops->get_op(idx)) {
+		this->ops = ops;
+		this->na_ops = na_ops;
+	}
+
+	virtual void runA(size_t num_eles, const void *in_arr,
+			void *out_arr) const {
+		if (portion_has_NA<Type>(in_arr, num_eles))
+			na_op.runA(num_eles, in_arr, out_arr);
+		else
+			op.runA(num_eles, in_arr, out_arr);
+	}
+	virtual const scalar_type &get_input_type() const {
+		return na_op.get_input_type();
+	}
+	virtual const scalar_type &get_output_type() const {
+		return na_op.get_output_type();
+	}
+	virtual std::string get_name() const {
+		return na_op.get_name();
+	}
+};
+
+/*
+ * The operators used when we test NA. We only choose operators per portion
+ * if the NA-aware operator isn't vectorized, in which case checking NA
+ * first is cheaper than running the NA-aware operator. We can't choose
+ * if the two operators output different types.
+ */
+static std::vector<std::vector<bulk_operate::const_ptr> > na_bops(
+		(int) R_type::R_NTYPES);
+static std::vector<std::vector<bulk_uoperate::const_ptr> > na_buops(
+		(int) R_type::R_NTYPES);
+
+template<class Type>
+static void init_na_ops(R_type type)
+{
+	basic_Rops::ptr ops = bops[(int) type];
+	basic_Rops::ptr na_ops = bops_na[(int) type];
+	na_bops[(int) type].resize(basic_ops::op_idx::NUM_OPS);
+	for (int i = 0; i < basic_ops::op_idx::NUM_OPS; i++) {
+		basic_ops::op_idx idx = (basic_ops::op_idx) i;
+		const bulk_operate *op = ops->get_op(idx);
+		const bulk_operate *na_op = na_ops->get_op(idx);
+		bool same_type = op->get_output_type() == na_op->get_output_type();
+		if (na_ops->is_vectorized(idx) || !same_type)
+			na_bops[(int) type][i] = bulk_operate::conv2ptr(*na_op);
+		else
+			na_bops[(int) type][i] = bulk_operate::const_ptr(
+					new NA_adaptive_operate<Type>(ops, na_ops, idx));
+	}
+
+	basic_Ruops::ptr uops = buops[(int) type];
+	basic_Ruops::ptr na_uops = buops_na[(int) type];
+	na_buops[(int) type].resize(basic_uops::op_idx::NUM_OPS);
+	for (int i = 0; i < basic_uops::op_idx::NUM_OPS; i++) {
+		basic_uops::op_idx idx = (basic_uops::op_idx) i;
+		const bulk_uoperate *op = uops->get_op(idx);
+		const bulk_uoperate *na_op = na_uops->get_op(idx);
+		bool same_type = op->get_output_type() == na_op->get_output_type();
+		if (na_uops->is_vectorized(idx) || !same_type)
+			na_buops[(int) type][i] = bulk_uoperate::conv2ptr(*na_op);
+		else
+			na_buops[(int) type][i] = bulk_uoperate::const_ptr(
+					new NA_adaptive_uoperate<Type>(uops, na_uops, idx));
+	}
+}
+
 static R_type get_op_output_type(basic_ops::op_idx bo_idx, R_type in_type)
 {
 	if (bo_idx < basic_ops::op_idx::NUM_OPS) {
@@ -1516,12 +1973,10 @@ static bulk_operate::const_ptr _get_op(basic_ops::op_idx bo_idx, int noperands,
 			return bulk_operate::const_ptr();
 		}
 
-		basic_Rops::ptr ops;
 		if (use_na_op)
-			ops = bops_na[(int) type];
+			op = na_bops[(int) type][bo_idx];
 		else
-			ops = bops[(int) type];
-		op = bulk_operate::conv2ptr(*ops->get_op(bo_idx));
+			op = bulk_operate::conv2ptr(*bops[(int) type]->get_op(bo_idx));
 		if (op == NULL) {
 			fprintf(stderr, "invalid basic binary operator\n");
 			return bulk_operate::const_ptr();
@@ -1543,20 +1998,88 @@ static bulk_operate::const_ptr _get_op(basic_ops::op_idx bo_idx, int noperands,
 	return op;
 }
 
+/*
+ * An operator resolved for an input type and its output type.
+ */
+template<class OpType>
+struct resolved_op
+{
+	typename OpType::const_ptr op;
+	R_type out_type;
+
+	resolved_op() {
+		out_type = R_type::R_NTYPES;
+	}
+};
+
+/*
+ * The resolved operators indexed by the operator id, the input type and
+ * whether we use NA-aware operators. R code may run a large number of
+ * small operations, so we don't want to resolve an operator every time.
+ * Operators are only resolved in the R thread.
+ */
+static std::vector<resolved_op<bulk_operate> > bop_cache;
+static std::vector<resolved_op<bulk_uoperate> > buop_cache;
+
+static inline bool cacheable(int op_idx, R_type type)
+{
+	return op_idx >= 0 && type >= 0 && type < R_type::R_NTYPES;
+}
+
+static inline size_t get_cache_idx(int op_idx, R_type type)
+{
+	return ((size_t) op_idx * R_type::R_NTYPES + type) * 2 + use_na_op;
+}
+
+/*
+ * Read the operator info from a slot of an operator object.
+ * This is much cheaper than going through Rcpp::S4.
+ */
+static inline const int *get_op_info(SEXP pfun, SEXP slot)
+{
+	return INTEGER(R_do_slot(pfun, slot));
+}
+
+static resolved_op<bulk_operate> resolve_op(basic_ops::op_idx bo_idx,
+		int noperands, R_type type)
+{
+	if (noperands != 2) {
+		fprintf(stderr, "This isn't a binary operator\n");
+		return resolved_op<bulk_operate>();
+	}
+
+	bool use_cache = cacheable(bo_idx, type);
+	size_t idx = get_cache_idx(bo_idx, type);
+	if (use_cache && idx < bop_cache.size() && bop_cache[idx].op)
+		return bop_cache[idx];
+
+	resolved_op<bulk_operate> ret;
+	ret.op = _get_op(bo_idx, noperands, type);
+	if (ret.op == NULL)
+		return ret;
+	ret.out_type = get_op_output_type(bo_idx, type);
+	if (use_cache) {
+		if (idx >= bop_cache.size())
+			bop_cache.resize(idx + 1);
+		bop_cache[idx] = ret;
+	}
+	return ret;
+}
+
 /*
  * Get a binary operator.
  */
 std::pair<bulk_operate::const_ptr, R_type> get_op(SEXP pfun, R_type type)
 {
-	Rcpp::S4 fun_obj(pfun);
-	Rcpp::IntegerVector info = fun_obj.slot("info");
-	auto op = _get_op((basic_ops::op_idx) info[0], info[1], type);
-	if (op == NULL)
+	static SEXP info_sym = Rf_install("info");
+	const int *info = get_op_info(pfun, info_sym);
+	auto res = resolve_op((basic_ops::op_idx) info[0], info[1], type);
+	if (res.op == NULL)
 		return std::pair<bulk_operate::const_ptr, R_type>(NULL,
 				R_type::R_NTYPES);
 	else
-		return std::pair<bulk_operate::const_ptr, R_type>(op,
-				get_op_output_type((basic_ops::op_idx) info[0], type));
+		return std::pair<bulk_operate::const_ptr, R_type>(res.op,
+				res.out_type);
 }
 
 /*
@@ -1564,188 +2087,126 @@ std::pair<bulk_operate::const_ptr, R_type> get_op(SEXP pfun, R_type type)
  */
 std::pair<agg_operate::const_ptr, R_type> get_agg_op(SEXP pfun, R_type type)
 {
-	Rcpp::S4 sym_op(pfun);
-	Rcpp::IntegerVector agg_info = sym_op.slot("agg");
-	basic_ops::op_idx agg_op_idx = (basic_ops::op_idx) agg_info[0];
-	bulk_operate::const_ptr agg_op = _get_op(agg_op_idx, agg_info[1], type);
-	if (agg_op == NULL)
+	static SEXP agg_sym = Rf_install("agg");
+	static SEXP combine_sym = Rf_install("combine");
+	const int *agg_info = get_op_info(pfun, agg_sym);
+	auto agg_res = resolve_op((basic_ops::op_idx) agg_info[0], agg_info[1],
+			type);
+	if (agg_res.op == NULL)
 		return std::pair<agg_operate::const_ptr, R_type>(NULL, R_type::R_NTYPES);
-	R_type out_type = get_op_output_type(agg_op_idx, type);
+	R_type out_type = agg_res.out_type;
 
-	Rcpp::IntegerVector combine_info = sym_op.slot("combine");
+	const int *combine_info = get_op_info(pfun, combine_sym);
 	bulk_operate::const_ptr combine_op;
 	if (combine_info[0] >= 0) {
-		basic_ops::op_idx comb_op_idx = (basic_ops::op_idx) combine_info[0];
-		combine_op = _get_op(comb_op_idx, combine_info[1], out_type);
-		if (combine_op == NULL)
+		auto combine_res = resolve_op((basic_ops::op_idx) combine_info[0],
+				combine_info[1], out_type);
+		if (combine_res.op == NULL)
 			return std::pair<agg_operate::const_ptr, R_type>(NULL,
 					R_type::R_NTYPES);
-		out_type = get_op_output_type(comb_op_idx, out_type);
+		combine_op = combine_res.op;
+		out_type = combine_res.out_type;
 	}
-	auto ret = agg_operate::create(agg_op, combine_op);
+	auto ret = agg_operate::create(agg_res.op, combine_op);
 	return std::pair<agg_operate::const_ptr, R_type>(ret, out_type);
 }
 
-/*
- * Get a unary operator.
- */
-std::pair<bulk_uoperate::const_ptr, R_type> get_uop(SEXP pfun, R_type type)
+static resolved_op<bulk_uoperate> _get_uop(basic_uops::op_idx bo_idx,
+		R_type type)
 {
-	Rcpp::S4 fun_obj(pfun);
-	Rcpp::IntegerVector info = fun_obj.slot("info");
-	basic_uops::op_idx bo_idx = (basic_uops::op_idx) info[0];
-	int noperands = info[1];
-	if (noperands != 1) {
-		fprintf(stderr, "This isn't a unary operator\n");
-		return std::pair<bulk_uoperate::const_ptr, R_type>(NULL,
-				R_type::R_NTYPES);
+	resolved_op<bulk_uoperate> ret;
+	if (bo_idx < 0) {
+		fprintf(stderr, "invalid operator index\n");
+		return ret;
 	}
-
-	R_type output_type = R_type::R_NTYPES;
-	bulk_uoperate::const_ptr op;
 	if (bo_idx < basic_uops::op_idx::NUM_OPS) {
 		if (bops.size() <= (size_t) type) {
 			fprintf(stderr, "wrong unary operation type\n");
-			return std::pair<bulk_uoperate::const_ptr, R_type>(NULL,
-					R_type::R_NTYPES);
+			return ret;
 		}
 
 		basic_Ruops::ptr ops;
-		if (use_na_op)
+		if (use_na_op) {
 			ops = buops_na[(int) type];
-		else
+			ret.op = na_buops[(int) type][bo_idx];
+		}
+		else {
 			ops = buops[(int) type];
-
-		output_type = ops->get_output_type(bo_idx);
-		op = bulk_uoperate::conv2ptr(*ops->get_op(bo_idx));
-		if (op == NULL) {
+			ret.op = bulk_uoperate::conv2ptr(*ops->get_op(bo_idx));
+		}
+		if (ret.op == NULL) {
 			fprintf(stderr, "invalid basic unary operator\n");
-			return std::pair<bulk_uoperate::const_ptr, R_type>(NULL,
-					R_type::R_NTYPES);
+			return ret;
 		}
+		ret.out_type = ops->get_output_type(bo_idx);
 	}
 	else if ((size_t) (bo_idx - basic_uops::op_idx::NUM_OPS) < bulk_uops.size()) {
 		size_t off = bo_idx - basic_uops::op_idx::NUM_OPS;
-		op = bulk_uops[off].get_op(type);
-		if (op == NULL) {
+		ret.op = bulk_uops[off].get_op(type);
+		if (ret.op == NULL) {
 			fprintf(stderr,
 					"can't find the specified unary operation with right type\n");
-			return std::pair<bulk_uoperate::const_ptr, R_type>(NULL,
-					R_type::R_NTYPES);
+			return ret;
 		}
-		output_type = trans_FM2R(op->get_output_type());
+		ret.out_type = trans_FM2R(ret.op->get_output_type());
 	}
-	else {
+	else
 		fprintf(stderr, "can't find the specified unary operation\n");
+	return ret;
+}
+
+/*
+ * Get a unary operator.
+ */
+std::pair<bulk_uoperate::const_ptr, R_type> get_uop(SEXP pfun, R_type type)
+{
+	static SEXP info_sym = Rf_install("info");
+	const int *info = get_op_info(pfun, info_sym);
+	basic_uops::op_idx bo_idx = (basic_uops::op_idx) info[0];
+	int noperands = info[1];
+	if (noperands != 1) {
+		fprintf(stderr, "This isn't a unary operator\n");
 		return std::pair<bulk_uoperate::const_ptr, R_type>(NULL,
 				R_type::R_NTYPES);
 	}
-	return std::pair<bulk_uoperate::const_ptr, R_type>(op, output_type);
-}
 
-static int _get_op_id(const std::string &name)
-{
-	for (size_t i = 0; i < bulk_ops.size(); i++)
-		if (bulk_ops[i].get_name() == name)
-			return i + basic_ops::op_idx::NUM_OPS;
-	return -1;
+	bool use_cache = cacheable(bo_idx, type);
+	size_t idx = get_cache_idx(bo_idx, type);
+	resolved_op<bulk_uoperate> res;
+	if (use_cache && idx < buop_cache.size() && buop_cache[idx].op)
+		res = buop_cache[idx];
+	else {
+		res = _get_uop(bo_idx, type);
+		if (res.op && use_cache) {
+			if (idx >= buop_cache.size())
+				buop_cache.resize(idx + 1);
+			buop_cache[idx] = res;
+		}
+	}
+	if (res.op == NULL)
+		return std::pair<bulk_uoperate::const_ptr, R_type>(NULL,
+				R_type::R_NTYPES);
+	return std::pair<bulk_uoperate::const_ptr, R_type>(res.op, res.out_type);
 }
 
-static int _get_uop_id(const std::string &name)
+op_id_t get_op_id(const std::string &name)
 {
-	for (size_t i = 0; i < bulk_uops.size(); i++)
-		if (bulk_uops[i].get_name() == name)
-			return i + basic_uops::op_idx::NUM_OPS;
-	return -1;
+	const op_name_map &names = get_op_names();
+	auto it = names.find(name);
+	return it == names.end() ? -1 : it->second;
 }
 
-op_id_t get_op_id(const std::string &name)
+op_id_t get_uop_id(const std::string &name)
 {
-	// TODO I should use a hashtable.
-	if (name == "add")
-		return basic_ops::op_idx::ADD;
-	else if (name == "+")
-		return basic_ops::op_idx::ADD;
-	else if (name == "sub")
-		return basic_ops::op_idx::SUB;
-	else if (name == "-")
-		return basic_ops::op_idx::SUB;
-	else if (name == "mul")
-		return basic_ops::op_idx::MUL;
-	else if (name == "*")
-		return basic_ops::op_idx::MUL;
-	else if (name == "div")
-		return basic_ops::op_idx::DIV;
-	else if (name == "/")
-		return basic_ops::op_idx::DIV;
-	else if (name == "mod")
-		return basic_ops::op_idx::MOD;
-	else if (name == "%%")
-		return basic_ops::op_idx::MOD;
-	else if (name == "%/%")
-		return basic_ops::op_idx::IDIV;
-	else if (name == "min")
-		return basic_ops::op_idx::MIN;
-	else if (name == "max")
-		return basic_ops::op_idx::MAX;
-	else if (name == "pow")
-		return basic_ops::op_idx::POW;
-	else if (name == "eq")
-		return basic_ops::op_idx::EQ;
-	else if (name == "==")
-		return basic_ops::op_idx::EQ;
-	else if (name == "neq")
-		return basic_ops::op_idx::NEQ;
-	else if (name == "!=")
-		return basic_ops::op_idx::NEQ;
-	else if (name == "gt")
-		return basic_ops::op_idx::GT;
-	else if (name == ">")
-		return basic_ops::op_idx::GT;
-	else if (name == "ge")
-		return basic_ops::op_idx::GE;
-	else if (name == ">=")
-		return basic_ops::op_idx::GE;
-	else if (name == "lt")
-		return basic_ops::op_idx::LT;
-	else if (name == "<")
-		return basic_ops::op_idx::LT;
-	else if (name == "le")
-		return basic_ops::op_idx::LE;
-	else if (name == "<=")
-		return basic_ops::op_idx::LE;
-	else if (name == "|")
-		return basic_ops::op_idx::OR;
-	else if (name == "&")
-		return basic_ops::op_idx::AND;
-	else
-		return _get_op_id(name);
+	const op_name_map &names = get_uop_names();
+	auto it = names.find(name);
+	return it == names.end() ? -1 : it->second;
 }
 
-op_id_t get_uop_id(const std::string &name)
+op_id_t get_op_id(SEXP pfun)
 {
-	if (name == "neg")
-		return basic_uops::op_idx::NEG;
-	else if (name == "sqrt")
-		return basic_uops::op_idx::SQRT;
-	else if (name == "abs")
-		return basic_uops::op_idx::ABS;
-	else if (name == "not")
-		return basic_uops::op_idx::NOT;
-	else if (name == "ceil")
-		return basic_uops::op_idx::CEIL;
-	else if (name == "floor")
-		return basic_uops::op_idx::FLOOR;
-	else if (name == "round")
-		return basic_uops::op_idx::ROUND;
-	else if (name == "log")
-		return basic_uops::op_idx::LOG;
-	else if (name == "log2")
-		return basic_uops::op_idx::LOG2;
-	else if (name == "log10")
-		return basic_uops::op_idx::LOG10;
-	else
-		return _get_uop_id(name);
+	static SEXP info_sym = Rf_install("info");
+	return get_op_info(pfun, info_sym)[0];
 }
 
 template<class T>
@@ -1811,15 +2272,8 @@ public:
 		const T *t_in = (const T *) in;
 		if (num_eles == 0)
 			return;
-		T max = t_in[0];
-		int idx = 0;
-		for (size_t i = 1; i < num_eles; i++) {
-			if (max < t_in[i]) {
-				max = t_in[i];
-				idx = i;
-			}
-		}
-		t_out[0] = idx + 1;
+		// NA and NaN are ignored as R does.
+		t_out[0] = simd::which_max(t_in, num_eles);
 	}
 	virtual void runCum(size_t num_eles, const void *left_arr,
 			const void *prev, void *output) const {
@@ -1862,15 +2316,8 @@ public:
 		const T *t_in = (const T *) in;
 		if (num_eles == 0)
 			return;
-		T min = t_in[0];
-		int idx = 0;
-		for (size_t i = 1; i < num_eles; i++) {
-			if (min > t_in[i]) {
-				min = t_in[i];
-				idx = i;
-			}
-		}
-		t_out[0] = idx + 1;
+		// NA and NaN are ignored as R does.
+		t_out[0] = simd::which_min(t_in, num_eles);
 	}
 	virtual void runCum(size_t num_eles, const void *left_arr,
 			const void *prev, void *output) const {
@@ -1942,22 +2389,36 @@ public:
 	}
 };
 
+/*
+ * Cast an element with R's rules. This is the same as a C cast for
+ * the casts that aren't specialized below.
+ */
 template<class InT, class OutT, bool in_logical, bool out_logical>
 class cast_ele
 {
 public:
 	OutT operator()(InT v) const {
-		// TODO we need to handle NA.
 		return v;
 	}
 };
 
+template<bool in_logical>
+class cast_ele<int, double, in_logical, false>
+{
+public:
+	double operator()(int v) const {
+		return R_is_na<int, in_logical>(v) ? R_get_na<double, false>() : v;
+	}
+};
+
 template<>
 class cast_ele<double, int, false, false>
 {
 public:
 	int operator()(double v) const {
-		// TODO we need to handle NA.
+		// R casts a double out of the integer range to NA.
+		if (std::isnan(v) || v >= 2147483648.0 || v <= -2147483648.0)
+			return R_get_na<int, false>();
 		return v;
 	}
 };
@@ -1967,22 +2428,74 @@ class cast_ele<double, int, false, true>
 {
 public:
 	int operator()(double v) const {
-		// TODO we need to handle NA.
-		return v != 0;
+		return std::isnan(v) ? R_get_na<int, true>() : v != 0;
+	}
+};
+
+template<>
+class cast_ele<int, int, false, true>
+{
+public:
+	int operator()(int v) const {
+		return R_is_na<int, false>(v) ? R_get_na<int, true>() : v != 0;
+	}
+};
+
+/*
+ * Cast an array. We use the SIMD kernels for the casts that need to
+ * handle NA.
+ */
+template<class InT, class OutT, bool in_logical, bool out_logical>
+struct cast_arr
+{
+	static void run(size_t num_eles, const InT *in, OutT *out) {
+		cast_ele<InT, OutT, in_logical, out_logical> cast;
+		for (size_t i = 0; i < num_eles; i++)
+			out[i] = cast(in[i]);
+	}
+};
+
+template<bool in_logical>
+struct cast_arr<int, double, in_logical, false>
+{
+	static void run(size_t num_eles, const int *in, double *out) {
+		simd::cast_int2real(num_eles, in, out);
+	}
+};
+
+template<>
+struct cast_arr<double, int, false, false>
+{
+	static void run(size_t num_eles, const double *in, int *out) {
+		simd::cast_real2int(num_eles, in, out);
+	}
+};
+
+template<>
+struct cast_arr<double, int, false, true>
+{
+	static void run(size_t num_eles, const double *in, int *out) {
+		simd::cast_real2logical(num_eles, in, out);
+	}
+};
+
+template<>
+struct cast_arr<int, int, false, true>
+{
+	static void run(size_t num_eles, const int *in, int *out) {
+		simd::cast_int2logical(num_eles, in, out);
 	}
 };
 
 template<class InT, class OutT, bool in_logical, bool out_logical>
 class ele_type_cast: public bulk_uoperate
 {
-	cast_ele<InT, OutT, in_logical, out_logical> cast;
 public:
 	virtual void runA(size_t num_eles, const void *in_arr,
 			void *out_arr) const {
-		OutT *t_out = reinterpret_cast<OutT *>(out_arr);
-		const InT *t_in = reinterpret_cast<const InT *>(in_arr);
-		for (size_t i = 0; i < num_eles; i++)
-			t_out[i] = cast(t_in[i]);
+		cast_arr<InT, OutT, in_logical, out_logical>::run(num_eles,
+				reinterpret_cast<const InT *>(in_arr),
+				reinterpret_cast<OutT *>(out_arr));
 	}
 	virtual const scalar_type &get_input_type() const {
 		return get_scalar_type<InT>();
@@ -1996,6 +2509,27 @@ public:
 	}
 };
 
+/*
+ * The NA-aware math functions that aren't basic unary operators.
+ */
+template<class Type, bool is_logical>
+struct log1p_na: public log1p<Type, is_logical>
+{
+	double operator()(const Type &e) const {
+		return R_is_na<Type, is_logical>(e)
+			? R_get_na<double, false>() : std::log1p((double) e);
+	}
+};
+
+template<class Type, bool is_logical>
+struct exp_na: public uop_exp<Type, is_logical>
+{
+	double operator()(const Type &e) const {
+		return R_is_na<Type, is_logical>(e)
+			? R_get_na<double, false>() : std::exp((double) e);
+	}
+};
+
 void init_udf_ext()
 {
 	bops[(int) R_type::R_LOGICAL]
@@ -2026,6 +2560,10 @@ void init_udf_ext()
 	buops_na[(int) R_type::R_REAL]
 		= basic_Ruops::ptr(new basic_Ruops_NA_impl<double, false>());
 
+	init_na_ops<int>(R_type::R_LOGICAL);
+	init_na_ops<int>(R_type::R_INT);
+	init_na_ops<double>(R_type::R_REAL);
+
 	std::vector<bulk_operate::const_ptr> ops(R_type::R_NTYPES);
 	// Add count.
 	ops[R_type::R_LOGICAL]
@@ -2085,24 +2623,48 @@ void init_udf_ext()
 	uops[R_type::R_REAL] = bulk_uoperate::const_ptr(
 			new ele_type_cast<double, int, false, true>());
 	register_udf(uops, "as.logical");
+
+	uops[R_type::R_LOGICAL] = bulk_uoperate::const_ptr(
+			new simd_NA_uoperate<exp_na<int, true>, int, simd::NA_EXP>());
+	uops[R_type::R_INT] = bulk_uoperate::const_ptr(
+			new simd_NA_uoperate<exp_na<int, false>, int, simd::NA_EXP>());
+	uops[R_type::R_REAL] = bulk_uoperate::const_ptr(
+			new simd_NA_uoperate<exp_na<double, false>, double, simd::NA_EXP>());
+	register_udf(uops, "exp");
+
+	uops[R_type::R_LOGICAL] = bulk_uoperate::const_ptr(
+			new simd_NA_uoperate<log1p_na<int, true>, int, simd::NA_LOG1P>());
+	uops[R_type::R_INT] = bulk_uoperate::const_ptr(
+			new simd_NA_uoperate<log1p_na<int, false>, int, simd::NA_LOG1P>());
+	uops[R_type::R_REAL] = bulk_uoperate::const_ptr(
+			new simd_NA_uoperate<log1p_na<double, false>, double,
+			simd::NA_LOG1P>());
+	register_udf(uops, "log1p");
 }
 
 typedef std::vector<arr_apply_operate::const_ptr> app_op_vec;
 
 static std::unordered_map<std::string, app_op_vec> apply_ops;
 
-template<class T>
+bool register_apply_op(const std::string &name, const app_op_vec &ops)
+{
+	auto ret = apply_ops.insert(std::pair<std::string, app_op_vec>(name, ops));
+	return ret.second;
+}
+
+/*
+ * Rank the elements in each row/column. Ranks are integers unless
+ * ties are averaged.
+ */
+template<class T, class O>
 class rank_apply_operate: public arr_apply_operate
 {
-	typedef std::pair<T, int> indexed_entry;
-	std::vector<std::vector<indexed_entry> > bufs;
-	struct {
-		bool operator()(const indexed_entry &e1, const indexed_entry &e2) const {
-			return e1.first < e2.first;
-		}
-	} entry_less;
+	fmr::rank_ties_t ties;
+	// The scratch memory of each thread.
+	std::vector<std::vector<char> > bufs;
 public:
-	rank_apply_operate() {
+	rank_apply_operate(fmr::rank_ties_t ties) {
+		this->ties = ties;
 		bufs.resize(detail::mem_thread_pool::get_global_num_threads());
 	}
 
@@ -2110,18 +2672,11 @@ public:
 			local_vec_store &out) const {
 		assert(out.get_length() == in.get_length());
 		const T *in_arr = reinterpret_cast<const T *>(in.get_raw_arr());
-		int *out_arr = reinterpret_cast<int *>(out.get_raw_arr());
+		O *out_arr = reinterpret_cast<O *>(out.get_raw_arr());
 		int thread_id = detail::mem_thread_pool::get_curr_thread_id();
-		std::vector<std::pair<T, int> > &buf
+		std::vector<char> &buf
 			= const_cast<rank_apply_operate *>(this)->bufs[thread_id];
-		buf.resize(in.get_length());
-		for (size_t i = 0; i < in.get_length(); i++) {
-			buf[i].first = in_arr[i];
-			buf[i].second = i;
-		}
-		std::sort(buf.begin(), buf.end(), entry_less);
-		for (size_t i = 0; i < out.get_length(); i++)
-			out_arr[i] = buf[i].second;
+		fmr::rank(in_arr, in.get_length(), ties, out_arr, buf);
 	}
 	virtual size_t get_num_out_eles(size_t num_input) const {
 		return num_input;
@@ -2131,10 +2686,107 @@ public:
 		return get_scalar_type<T>();
 	}
 	virtual const scalar_type &get_output_type() const {
-		return get_scalar_type<int>();
+		return get_scalar_type<O>();
 	}
 };
 
+template<class O>
+static void register_rank_op(const std::string &name, fmr::rank_ties_t ties)
+{
+	app_op_vec ops(R_type::R_NTYPES);
+	// For logicals
+	ops[R_type::R_LOGICAL]
+		= arr_apply_operate::const_ptr(new rank_apply_operate<int, O>(ties));
+	// For integers
+	ops[R_type::R_INT]
+		= arr_apply_operate::const_ptr(new rank_apply_operate<int, O>(ties));
+	// For floating-points
+	ops[R_type::R_REAL]
+		= arr_apply_operate::const_ptr(new rank_apply_operate<double, O>(ties));
+	register_apply_op(name, ops);
+}
+
+/*
+ * An apply operator that takes an integer parameter from the `info' slot
+ * of fm.apply.op. The registered operator is a prototype that creates
+ * the operator with the parameter.
+ */
+class param_apply_operate: public arr_apply_operate
+{
+public:
+	virtual arr_apply_operate::const_ptr create(int param) const = 0;
+};
+
+/*
+ * Get the k smallest or largest elements in each row/column in the sorted
+ * order, or their 1-based locations.
+ */
+template<class T>
+class topk_apply_operate: public param_apply_operate
+{
+	size_t k;
+	bool decreasing;
+	bool ret_idx;
+	// The scratch memory of each thread.
+	std::vector<std::vector<char> > bufs;
+public:
+	topk_apply_operate(size_t k, bool decreasing, bool ret_idx) {
+		this->k = k;
+		this->decreasing = decreasing;
+		this->ret_idx = ret_idx;
+		bufs.resize(detail::mem_thread_pool::get_global_num_threads());
+	}
+
+	virtual arr_apply_operate::const_ptr create(int param) const {
+		return arr_apply_operate::const_ptr(new topk_apply_operate<T>(param,
+					decreasing, ret_idx));
+	}
+
+	virtual void run(const local_vec_store &in,
+			local_vec_store &out) const {
+		assert(out.get_length() == get_num_out_eles(in.get_length()));
+		const T *in_arr = reinterpret_cast<const T *>(in.get_raw_arr());
+		int thread_id = detail::mem_thread_pool::get_curr_thread_id();
+		std::vector<char> &buf
+			= const_cast<topk_apply_operate *>(this)->bufs[thread_id];
+		if (ret_idx)
+			fmr::topk(in_arr, in.get_length(), k, decreasing, NULL,
+					reinterpret_cast<int *>(out.get_raw_arr()), buf);
+		else
+			fmr::topk(in_arr, in.get_length(), k, decreasing,
+					reinterpret_cast<T *>(out.get_raw_arr()), NULL, buf);
+	}
+	virtual size_t get_num_out_eles(size_t num_input) const {
+		return std::min(k, num_input);
+	}
+
+	virtual const scalar_type &get_input_type() const {
+		return get_scalar_type<T>();
+	}
+	virtual const scalar_type &get_output_type() const {
+		if (ret_idx)
+			return get_scalar_type<int>();
+		else
+			return get_scalar_type<T>();
+	}
+};
+
+static void register_topk_op(const std::string &name, bool decreasing,
+		bool ret_idx)
+{
+	app_op_vec ops(R_type::R_NTYPES);
+	// For logicals
+	ops[R_type::R_LOGICAL] = arr_apply_operate::const_ptr(
+			new topk_apply_operate<int>(0, decreasing, ret_idx));
+	// For integers
+	ops[R_type::R_INT] = arr_apply_operate::const_ptr(
+			new topk_apply_operate<int>(0, decreasing, ret_idx));
+	// For floating-points
+	ops[R_type::R_REAL] = arr_apply_operate::const_ptr(
+			new topk_apply_operate<double>(0, decreasing, ret_idx));
+	register_apply_op(name, ops);
+}
+
 template<class T>
 class sort_apply_operate: public arr_apply_operate
 {
@@ -2145,7 +2797,7 @@ public:
 		memcpy(out.get_raw_arr(), in.get_raw_arr(),
 				in.get_entry_size() * in.get_length());
 		T *out_arr = reinterpret_cast<T *>(out.get_raw_arr());
-		std::sort(out_arr, out_arr + out.get_length());
+		radix_sort(out_arr, out.get_length());
 	}
 	virtual size_t get_num_out_eles(size_t num_input) const {
 		return num_input;
@@ -2159,26 +2811,16 @@ public:
 	}
 };
 
-bool register_apply_op(const std::string &name, const app_op_vec &ops)
-{
-	auto ret = apply_ops.insert(std::pair<std::string, app_op_vec>(name, ops));
-	return ret.second;
-}
-
 void init_apply_ops()
 {
 	app_op_vec ops(R_type::R_NTYPES);
 
-	// For logicals
-	ops[R_type::R_LOGICAL]
-		= arr_apply_operate::const_ptr(new rank_apply_operate<int>());
-	// For integers
-	ops[R_type::R_INT]
-		= arr_apply_operate::const_ptr(new rank_apply_operate<int>());
-	// For floating-points
-	ops[R_type::R_REAL]
-		= arr_apply_operate::const_ptr(new rank_apply_operate<double>());
-	register_apply_op("rank", ops);
+	// "rank" averages ties as R does by default.
+	register_rank_op<double>("rank", fmr::RANK_AVERAGE);
+	register_rank_op<double>("rank.average", fmr::RANK_AVERAGE);
+	register_rank_op<int>("rank.min", fmr::RANK_MIN);
+	register_rank_op<int>("rank.max", fmr::RANK_MAX);
+	register_rank_op<int>("rank.first", fmr::RANK_FIRST);
 
 	// For logicals
 	ops[R_type::R_LOGICAL]
@@ -2190,6 +2832,11 @@ void init_apply_ops()
 	ops[R_type::R_REAL]
 		= arr_apply_operate::const_ptr(new sort_apply_operate<double>());
 	register_apply_op("sort", ops);
+
+	register_topk_op("topk", true, false);
+	register_topk_op("topk.index", true, true);
+	register_topk_op("bottomk", false, false);
+	register_topk_op("bottomk.index", false, true);
 }
 
 std::pair<arr_apply_operate::const_ptr, R_type> get_apply_op(SEXP pfun, R_type type)
@@ -2212,6 +2859,12 @@ std::pair<arr_apply_operate::const_ptr, R_type> get_apply_op(SEXP pfun, R_type t
 	}
 	else {
 		auto op = vec[(int) type];
+		auto param_op
+			= std::dynamic_pointer_cast<const param_apply_operate>(op);
+		if (param_op) {
+			int info = sym_op.slot("info");
+			op = param_op->create(info);
+		}
 		return std::pair<arr_apply_operate::const_ptr, R_type>(op,
 				trans_FM2R(op->get_output_type()));
 	}
@@ -2223,7 +2876,7 @@ dense_matrix::ptr cast_Rtype(dense_matrix::ptr mat, R_type in_type,
 	if (in_type == out_type)
 		return mat;
 	else if (out_type == R_type::R_INT) {
-		int op_idx = _get_uop_id("as.int");
+		int op_idx = get_uop_id("as.int");
 		size_t off = op_idx - basic_uops::op_idx::NUM_OPS;
 		if (off >= bulk_uops.size()) {
 			fprintf(stderr, "Can't cast to int\n");
@@ -2233,7 +2886,7 @@ dense_matrix::ptr cast_Rtype(dense_matrix::ptr mat, R_type in_type,
 		return mat->sapply(op);
 	}
 	else if (out_type == R_type::R_REAL) {
-		int op_idx = _get_uop_id("as.numeric");
+		int op_idx = get_uop_id("as.numeric");
 		size_t off = op_idx - basic_uops::op_idx::NUM_OPS;
 		if (off >= bulk_uops.size()) {
 			fprintf(stderr, "Can't cast to floating-points\n");
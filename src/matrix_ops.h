@@ -87,6 +87,8 @@ typedef int op_id_t;
 op_id_t get_op_id(const std::string &name);
 /* Get the unary operator Id given a name. */
 op_id_t get_uop_id(const std::string &name);
+/* Get the Id of a binary operator object created in R. */
+op_id_t get_op_id(SEXP pfun);
 
 void init_apply_ops();
 